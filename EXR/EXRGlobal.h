@@ -0,0 +1,55 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+#ifndef IO_GLOBAL_EXR_H
+#define IO_GLOBAL_EXR_H
+
+#include <cstdlib> // getenv, strtol
+
+#include <ImfThreading.h>
+
+#include "ofxsMultiThread.h"
+
+// number of threads used by OpenEXR to compress and decompress line blocks and tiles (0 means the number of CPUs).
+// The default value can be overriden using the environment variable OFX_IO_EXR_THREADS
+#define kEXRThreadsEnv "OFX_IO_EXR_THREADS"
+
+#ifndef OPENEXR_IMF_NAMESPACE
+#define OPENEXR_IMF_NAMESPACE Imf
+#endif
+
+inline void
+initEXRThreads()
+{
+    // This must be set before the files are opened, since each InputFile or OutputFile
+    // gets the global thread count when it is created.
+    if (OPENEXR_IMF_NAMESPACE::globalThreadCount() != 0) {
+        return;
+    }
+    int nThreads = 0;
+    const char* nThreadsEnv = std::getenv(kEXRThreadsEnv);
+    if (nThreadsEnv) {
+        nThreads = (int)std::strtol(nThreadsEnv, NULL, 10);
+    }
+    if (nThreads <= 0) {
+        nThreads = (int)OFX::MultiThread::getNumCPUs();
+    }
+    OPENEXR_IMF_NAMESPACE::setGlobalThreadCount(nThreads);
+}
+
+#endif /* IO_GLOBAL_EXR_H */
@@ -22,6 +22,8 @@
  */
 
 #include <algorithm>
+#include <cstddef> // ptrdiff_t
+#include <cstring> // memcpy
 #ifdef DEBUG
 #include <iostream>
 #endif
@@ -35,17 +37,22 @@
 #endif
 #endif
 
+#include <Iex.h>
+#include <ImfIO.h>
+#include <ImfInt64.h>
 #include <ImfPixelType.h>
 #include <ImfChannelList.h>
 #include <ImfInputFile.h>
+#include <ImfThreading.h>
 #include <IlmThreadPool.h>
 
-#ifdef OFX_IO_MT_EXR
 #include <ofxsMultiThread.h>
-#endif
 
 #include "GenericOCIO.h"
 #include "GenericReader.h"
+#include "FileHandleCache.h"
+#include "MappedFile.h"
+#include "EXRGlobal.h"
 
 
 using namespace OFX;
@@ -74,6 +81,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #ifndef OPENEXR_IMF_NAMESPACE
 #define OPENEXR_IMF_NAMESPACE Imf
 #endif
+#ifndef IEX_NAMESPACE
+#define IEX_NAMESPACE Iex
+#endif
 namespace Imf_ = OPENEXR_IMF_NAMESPACE;
 
 #define kSupportsRGBA true
@@ -96,10 +106,14 @@ public:
 private:
 
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
+    virtual bool isDecodeParamFree() const OVERRIDE FINAL { return true; }
 
     virtual void decode(const string& filename, OfxTime time, int /*view*/, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& /*filename*/, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, string *error, int* tile_width, int* tile_height) OVERRIDE FINAL;
 
+    // guessParamsFromFilename() only reads the channels of the file
+    virtual bool isGuessParamsCacheable() const OVERRIDE FINAL { return true; }
+
     /**
      * @brief Called when the input image/video file changed.
      *
@@ -120,6 +134,8 @@ private:
      * When reading an image sequence, this is called only for the first image when the user actually selects the new sequence.
      **/
     virtual bool guessParamsFromFilename(const string& newFile, string *colorspace, PreMultiplicationEnum *filePremult, PixelComponentEnum *components, int *componentCount) OVERRIDE FINAL;
+
+    virtual void clearAnyCache() OVERRIDE FINAL;
 };
 
 namespace Exr {
@@ -313,14 +329,81 @@ private:
     }
 };
 
+// An input stream on a memory-mapped file. OpenEXR reads the chunks of memory-mapped streams in place,
+// rather than copying them through a stream buffer with a seek and a read per chunk: uncompressed and
+// B44 data is even decoded straight from the mapping.
+class MappedIStream
+    : public Imf_::IStream
+{
+public:
+    MappedIStream(const MappedFile& file,
+                  const string& filename)
+        : Imf_::IStream( filename.c_str() )
+        , _data( file.data() )
+        , _size( file.size() )
+        , _pos(0)
+    {
+    }
+
+    virtual bool isMemoryMapped() const OVERRIDE FINAL
+    {
+        return true;
+    }
+
+    virtual bool read(char c[/*n*/],
+                      int n) OVERRIDE FINAL
+    {
+        std::memcpy(c, advance(n), n);
+
+        return _pos < _size;
+    }
+
+    virtual char* readMemoryMapped(int n) OVERRIDE FINAL
+    {
+        return const_cast<char*>( advance(n) );
+    }
+
+    virtual Imf_::Int64 tellg() OVERRIDE FINAL
+    {
+        return _pos;
+    }
+
+    virtual void seekg(Imf_::Int64 pos) OVERRIDE FINAL
+    {
+        _pos = pos;
+    }
+
+private:
+    // the next n bytes, throws at the end of the file like Imf::StdIFStream
+    const char* advance(int n)
+    {
+        if ( (n < 0) || (_pos > _size) || ( (Imf_::Int64)n > _size - _pos ) ) {
+            throw IEX_NAMESPACE::InputExc("Unexpected end of file.");
+        }
+        const char* data = _data + _pos;
+        _pos += n;
+
+        return data;
+    }
+
+    const char* _data;
+    Imf_::Int64 _size;
+    Imf_::Int64 _pos;
+};
+
 struct File
+    : public FileHandleCache::Handle
 {
     File(const string& filename);
 
 
-    ~File();
+    virtual ~File();
+
+    virtual std::size_t getMemorySize() const OVERRIDE FINAL;
 
     Imf::InputFile* inputfile;
+    MappedFile mappedFile; // if mappings are enabled, local files are read through a memory mapping
+    MappedIStream* mappedStream;
 
     typedef map<Channel, string> ChannelsMap;
     ChannelsMap channel_map;
@@ -333,9 +416,6 @@ struct File
     std::ifstream* inputStr;
     Imf::StdIFStream* inputStdStream;
 #endif
-#ifdef OFX_IO_MT_EXR
-    MultiThread::Mutex lock;
-#endif
 #ifdef _WIN32
     inline wstring s2ws(const string& s)
     {
@@ -356,6 +436,8 @@ struct File
 
 File::File(const string& filename)
     : inputfile(NULL)
+    , mappedFile()
+    , mappedStream(NULL)
     , channel_map()
     , dataOffset(0)
     , views()
@@ -366,19 +448,20 @@ File::File(const string& filename)
     , inputStr(NULL)
     , inputStdStream(NULL)
 #endif
-#ifdef OFX_IO_MT_EXR
-    , lock()
-#endif
 {
     try{
+        if ( mappedFile.open(filename) ) {
+            mappedStream = new MappedIStream(mappedFile, filename);
+            inputfile = new Imf_::InputFile(*mappedStream);
+        } else {
 #if defined(_WIN32) && !defined(__MINGW32__)
-        inputStr = new std::ifstream(s2ws(filename), std::ios_base::binary);
-        inputStdStream = new Imf_::StdIFStream( *inputStr, filename.c_str() );
-        inputfile = new Imf_::InputFile(*inputStdStream);
+            inputStr = new std::ifstream(s2ws(filename), std::ios_base::binary);
+            inputStdStream = new Imf_::StdIFStream( *inputStr, filename.c_str() );
+            inputfile = new Imf_::InputFile(*inputStdStream);
 #else
-
-        inputfile = new Imf_::InputFile( filename.c_str() );
+            inputfile = new Imf_::InputFile( filename.c_str() );
 #endif
+        }
 
 
         // convert exr channels to our channels
@@ -449,6 +532,8 @@ File::File(const string& filename)
 #endif
         delete inputfile;
         inputfile = 0;
+        delete mappedStream;
+        mappedStream = 0;
         throw e;
     }
 }
@@ -460,89 +545,46 @@ File::~File()
     delete inputStdStream;
 #endif
     delete inputfile;
+    // the InputFile reads from the stream until it is deleted
+    delete mappedStream;
 }
 
-// Keeps track of all Exr::File mapped against file name.
-class FileManager
+// OpenEXR keeps the line buffers of the InputFile: count up to 32 lines (the PIZ and PXR24 line blocks)
+// of all the channels per decoding thread.
+std::size_t
+File::getMemorySize() const
 {
-    typedef map<string, File*> FilesMap;
-
-    FilesMap _files;
-    bool _isLoaded;    ///< register all "global" flags to ffmpeg outside of the constructor to allow
-    /// all OpenFX related stuff (which depend on another singleton) to be allocated.
-
-#ifdef OFX_IO_MT_EXR
-    // internal lock
-    MultiThread::Mutex *_lock;
-#endif
-
-public:
-
-    // singleton
-    static FileManager s_readerManager;
-
-    // constructor
-    FileManager();
-
-    ~FileManager();
+    const Imath::Box2i& datawin = inputfile->header().dataWindow();
+    const Imf_::ChannelList& imfchannels = inputfile->header().channels();
+    std::size_t lineSize = 0;
 
-    void initialize();
-
-    // get a specific reader
-    File* get(const string& filename);
-};
-
-FileManager FileManager::s_readerManager;
-
-// constructor
-FileManager::FileManager()
-    : _files()
-    , _isLoaded(false)
-#ifdef OFX_IO_MT_EXR
-    , _lock(NULL)
-#endif
-{
-}
-
-FileManager::~FileManager()
-{
-    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
-        delete it->second;
+    for (Imf_::ChannelList::ConstIterator chan = imfchannels.begin(); chan != imfchannels.end(); ++chan) {
+        lineSize += (std::size_t)(datawin.max.x - datawin.min.x + 1) * (chan.channel().type == Imf_::HALF ? 2 : 4);
     }
-#ifdef OFX_IO_MT_EXR
-    delete _lock;
-#endif
+
+    return sizeof(File) + lineSize * 32 * std::max(1, Imf_::globalThreadCount() );
 }
 
-void
-FileManager::initialize()
+static FileHandleCache::Handle*
+createFile(const string& filename,
+           void* /*arg*/)
 {
-    if (!_isLoaded) {
-#ifdef OFX_IO_MT_EXR
-        _lock = new MultiThread::Mutex();
-#endif
-        _isLoaded = true;
-    }
+    return new File(filename);
 }
 
-// get a specific reader
-File*
-FileManager::get(const string& filename)
+// Check out the file from the FileHandleCache. An InputFile cannot read from several threads at once,
+// so each thread gets its own File. The files are kept under the instance that opened them, so that
+// they are closed when that instance clears its caches or is destroyed.
+class FileCheckout
+    : public FileHandleCache::Checkout<File>
 {
-    assert(_isLoaded);
-#ifdef OFX_IO_MT_EXR
-    MultiThread::AutoMutex g(*_lock);
-#endif
-    FilesMap::iterator it = _files.find(filename);
-    if ( it == _files.end() ) {
-        pair<FilesMap::iterator, bool> ret = _files.insert( make_pair( string(filename), new File(filename) ) );
-        assert(ret.second);
-
-        return ret.first->second;
-    } else {
-        return it->second;
+public:
+    FileCheckout(const void* owner,
+                 const string& filename)
+        : FileHandleCache::Checkout<File>(owner, filename, createFile, NULL)
+    {
     }
-}
+};
 } // namespace Exr
 
 
@@ -550,11 +592,19 @@ ReadEXRPlugin::ReadEXRPlugin(OfxImageEffectHandle handle,
                              const vector<string>& extensions)
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
 {
-    Exr::FileManager::s_readerManager.initialize();
+    // let OpenEXR decompress line blocks in parallel
+    initEXRThreads();
 }
 
 ReadEXRPlugin::~ReadEXRPlugin()
 {
+    FileHandleCache::instance().purge(this);
+}
+
+void
+ReadEXRPlugin::clearAnyCache()
+{
+    FileHandleCache::instance().purge(this);
 }
 
 void
@@ -564,13 +614,6 @@ ReadEXRPlugin::changedParam(const InstanceChangedArgs &args,
     GenericReaderPlugin::changedParam(args, paramName);
 }
 
-struct DecodingChannelsMap
-{
-    float* buf;
-    bool subsampled;
-    string channelName;
-};
-
 void
 ReadEXRPlugin::decode(const string& filename,
                       OfxTime /*time*/,
@@ -590,60 +633,57 @@ ReadEXRPlugin::decode(const string& filename,
         return;
     }
 
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
+    Exr::FileCheckout file(this, filename);
     OfxRectI roi = bounds; // used to be dstImg->getRegionOfDefinition(); why?
     assert( kSupportsTiles || (renderWindow.x1 == file->dataWindow.x1 && renderWindow.x2 == file->dataWindow.x2 && renderWindow.y1 == file->dataWindow.y1 && renderWindow.y2 == file->dataWindow.y2) );
 
-    for (int y = roi.y1; y < roi.y2; ++y) {
-        map<Exr::Channel, DecodingChannelsMap > channels;
-        for (Exr::File::ChannelsMap::const_iterator it = file->channel_map.begin(); it != file->channel_map.end(); ++it) {
-            DecodingChannelsMap d;
-
-            ///This line means we only support FLOAT dst images with the RGBA format.
-            d.buf = (float*)( (char*)pixelData + (y - roi.y1) * rowBytes ) + (int)it->first;
+    const Imath::Box2i& dispwin = file->inputfile->header().displayWindow();
+    const Imath::Box2i& datawin = file->inputfile->header().dataWindow();
 
-            d.subsampled = it->second == "BY" || it->second == "RY";
-            d.channelName = it->second;
-            channels.insert( make_pair(it->first, d) );
-        }
-
-        const Imath::Box2i& dispwin = file->inputfile->header().displayWindow();
-        const Imath::Box2i& datawin = file->inputfile->header().dataWindow();
-        int exrY = dispwin.max.y - y;
-        //int r = roi.x2;
-        //int x = roi.x1;
-
-        //const int X = std::max(x, datawin.min.x + file->dataOffset);
-        //const int R = std::min(r, datawin.max.x + file->dataOffset + 1);
+    // the EXR lines covered by the roi (EXR lines go top to bottom), clipped to the data window
+    const int exrYMin = std::max(dispwin.max.y - (roi.y2 - 1), datawin.min.y);
+    const int exrYMax = std::min(dispwin.max.y - roi.y1, datawin.max.y);
+    if (exrYMin > exrYMax) {
+        // we're below or above the data window
+        return;
+    }
 
-        // if we're below or above the data window
-        if ( (exrY < datawin.min.y) || (exrY > datawin.max.y) /* || R <= X*/ ) {
+    // One frame buffer for the whole roi, so that OpenEXR reads all line blocks with a single
+    // readPixels() call, and decompresses them in parallel using its global thread pool.
+    // EXR line exrY goes to the output line dispwin.max.y - exrY, hence the negative y stride.
+    // Slice strides are unsigned: a negative stride wraps around, which OpenEXR supports.
+    char* base = (char*)pixelData + (dispwin.max.y - roi.y1) * (ptrdiff_t)rowBytes;
+    const size_t yStride = (size_t)( -(ptrdiff_t)rowBytes );
+    Imf_::FrameBuffer fbuf;
+    for (Exr::File::ChannelsMap::const_iterator it = file->channel_map.begin(); it != file->channel_map.end(); ++it) {
+        ///Only read the channels that have a component in the output image:
+        ///this line means we only support FLOAT dst images with the RGBA format.
+        if ( (int)it->first >= pixelComponentCount ) {
             continue;
         }
-
-        Imf_::FrameBuffer fbuf;
-        for (map<Exr::Channel, DecodingChannelsMap >::const_iterator z = channels.begin(); z != channels.end(); ++z) {
-            if (!z->second.subsampled) {
-                fbuf.insert( z->second.channelName.c_str(),
-                             Imf_::Slice(Imf_::FLOAT, (char*)(z->second.buf /*+ file->dataOffset*/), sizeof(float) * 4, 0) );
-            } else {
-                fbuf.insert( z->second.channelName.c_str(),
-                             Imf_::Slice(Imf_::FLOAT, (char*)(z->second.buf /*+ file->dataOffset*/), sizeof(float) * 4, 0, 2, 2) );
-            }
+        char* buf = base + (int)it->first * sizeof(float);
+        const bool subsampled = it->second == "BY" || it->second == "RY";
+        if (!subsampled) {
+            fbuf.insert( it->second.c_str(),
+                         Imf_::Slice(Imf_::FLOAT, buf /*+ file->dataOffset*/, sizeof(float) * 4, yStride) );
+        } else {
+            // a subsampled line y goes to the same output line as a full resolution line, hence the doubled y stride
+            fbuf.insert( it->second.c_str(),
+                         Imf_::Slice(Imf_::FLOAT, buf /*+ file->dataOffset*/, sizeof(float) * 4, 2 * yStride, 2, 2) );
         }
-        {
-#ifdef OFX_IO_MT_EXR
-            MultiThread::AutoMutex locker(file->lock);
-#endif
-            try {
-                file->inputfile->setFrameBuffer(fbuf);
-                file->inputfile->readPixels(exrY);
-            } catch (const std::exception& e) {
-                setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
-
-                return;
-            }
+    }
+    // the file is checked out by this thread only: no need to lock it
+    try {
+        file->inputfile->setFrameBuffer(fbuf);
+        file->inputfile->readPixels(exrYMin, exrYMax);
+    } catch (const std::exception& e) {
+        if ( isPrefetching() ) {
+            // the frame is not cached, and the error is reported when render() reads it
+            throw;
         }
+        setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+
+        return;
     }
 } // ReadEXRPlugin::decode
 
@@ -675,8 +715,11 @@ ReadEXRPlugin::guessParamsFromFilename(const string& newFile,
 {
     assert(colorspace && filePremult && components && componentCount);
 
-    Exr::File* file = newFile.empty() ? NULL : Exr::FileManager::s_readerManager.get(newFile);
-    if (!file) {
+    if ( newFile.empty() ) {
+        return false;
+    }
+    Exr::FileCheckout file(this, newFile);
+    if ( !file.get() ) {
         return false;
     }
 
@@ -738,8 +781,8 @@ ReadEXRPlugin::getFrameBounds(const string& filename,
                               int* tile_height)
 {
     assert(bounds && par);
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    if (!file) {
+    Exr::FileCheckout file(this, filename);
+    if ( !file.get() ) {
         if (error) {
             *error = "No such file";
         }
@@ -764,6 +807,7 @@ mDeclareReaderPluginFactory(ReadEXRPluginFactory,; , false);
 void
 ReadEXRPluginFactory::unload()
 {
+    GenericReaderUnload();
     //Kill all threads
     IlmThread::ThreadPool::globalThreadPool().setNumThreads(0);
 }
@@ -28,14 +28,48 @@
 #include <half.h>
 
 
+#include <algorithm>
+#include <cfloat> // DBL_MAX
+#include <cstddef> // ptrdiff_t
+#include <list>
+#include <map>
 #include <ImfChannelList.h>
 #include <IlmThreadPool.h>
 #include <ImfArray.h>
 #include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfStandardAttributes.h>
+#include <OpenEXRConfig.h>
+// the multi-part files written by beginEncodeParts() need OpenEXR 2.0, which introduced the namespace macros
+#if defined(OPENEXR_IMF_NAMESPACE) || ( defined(OPENEXR_VERSION_MAJOR) && OPENEXR_VERSION_MAJOR >= 2 )
+#define WRITEEXR_OPENEXR_2_0 1
+#include <ImfMultiPartOutputFile.h>
+#include <ImfOutputPart.h>
+#include <ImfTiledOutputPart.h>
+#include <ImfPartType.h>
+#else
+#define WRITEEXR_OPENEXR_2_0 0
+#endif
+// DWA compression needs OpenEXR 2.2
+#if defined(OPENEXR_VERSION_HEX) && OPENEXR_VERSION_HEX >= 0x02020000
+#define WRITEEXR_OPENEXR_2_2 1
+#else
+#define WRITEEXR_OPENEXR_2_2 0
+#endif
 #include <half.h>
 
+#if ( defined(__GNUC__) || defined(__clang__) ) && ( defined(__x86_64__) || defined(__i386__) )
+#include <immintrin.h>
+#define WRITEEXR_F16C_DISPATCH
+#endif
+
+#include "ofxsMultiThread.h"
+#include "ofxsMultiPlane.h"
+
 #include "GenericOCIO.h"
 #include "GenericWriter.h"
+#include "CPUFeatures.h"
+#include "EXRGlobal.h"
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -45,6 +79,7 @@ namespace OCIO = OCIO_NAMESPACE;
 
 using std::string;
 using std::vector;
+using std::map;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
 
@@ -59,6 +94,40 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamWriteEXRCompression "compression"
 #define kParamWriteEXRDataType "dataType"
 
+#define kParamWriteEXRDWACompressionLevel "dwaCompressionLevel"
+#define kParamWriteEXRDWACompressionLevelLabel "DWA Compression Level"
+#define kParamWriteEXRDWACompressionLevelHint \
+    "Amount of compression when using DWAA or DWAB compression. These lossy formats are variable in quality. " \
+    "Higher values give smaller files, but increase the chance for artifacts. Values from 45 to 150 are usually correct for production shots."
+#define kParamWriteEXRDWACompressionLevelDefault 45
+
+#define kParamWriteEXROutputLayers kNatronOfxParamOutputChannels
+#define kParamWriteEXROutputLayersLabel "Layer(s)"
+#define kParamWriteEXROutputLayersHint "Select which layer to write to the file. This is either All or a single layer. " \
+    "When writing all layers, each layer is written to its own part of a multi-part file (OpenEXR 2)."
+
+#define kParamWriteEXRTileSize "tileSize"
+#define kParamWriteEXRTileSizeLabel "Tile Size"
+#define kParamWriteEXRTileSizeHint "Size of the tiles in the output file. If scan-line based, the file is written as scan lines."
+#define kParamWriteEXRTileSizeOptionScanLineBased "Scan-Line Based", "", "0"
+#define kParamWriteEXRTileSizeOption64 "64", "", "64"
+#define kParamWriteEXRTileSizeOption128 "128", "", "128"
+#define kParamWriteEXRTileSizeOption256 "256", "", "256"
+#define kParamWriteEXRTileSizeOption512 "512", "", "512"
+
+enum EParamTileSize
+{
+    eParamTileSizeScanLineBased = 0,
+    eParamTileSize64,
+    eParamTileSize128,
+    eParamTileSize256,
+    eParamTileSize512
+};
+
+#define kParamWriteEXRMipmap "mipmap"
+#define kParamWriteEXRMipmapLabel "Mipmaps"
+#define kParamWriteEXRMipmapHint "Also write the mipmap levels of the image, each level being half the size of the previous one (rounded down). Only available for tiled files."
+
 #ifndef OPENEXR_IMF_NAMESPACE
 #define OPENEXR_IMF_NAMESPACE Imf
 #endif
@@ -71,22 +140,38 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 namespace Imf_ = OPENEXR_IMF_NAMESPACE;
 
 
+static bool gIsMultiplanarV2 = false;
+
 namespace Exr {
-static const char* compressionNames[6] = {
+// new compressions are appended, so that the indices of existing projects do not change
+#if WRITEEXR_OPENEXR_2_2
+#define kWriteEXRCompressionCount 8
+#else
+#define kWriteEXRCompressionCount 6
+#endif
+static const char* compressionNames[kWriteEXRCompressionCount] = {
     "No compression",
     "Zip (1 scanline)",
     "Zip (16 scanlines)",
     "PIZ Wavelet (32 scanlines)",
     "RLE",
-    "B44"
+    "B44",
+#if WRITEEXR_OPENEXR_2_2
+    "DWAA (32 scanlines)",
+    "DWAB (256 scanlines)"
+#endif
 };
-static const char* compressionEnums[6] = {
+static const char* compressionEnums[kWriteEXRCompressionCount] = {
     "no",
     "zips",
     "zip",
     "piz",
     "rle",
-    "b44"
+    "b44",
+#if WRITEEXR_OPENEXR_2_2
+    "dwaa",
+    "dwab"
+#endif
 };
 static Imf_::Compression
 stringToCompression(const string& str)
@@ -101,6 +186,12 @@ stringToCompression(const string& str)
         return Imf_::PIZ_COMPRESSION;
     } else if (str == compressionNames[4]) {
         return Imf_::RLE_COMPRESSION;
+#if WRITEEXR_OPENEXR_2_2
+    } else if (str == compressionNames[6]) {
+        return Imf_::DWAA_COMPRESSION;
+    } else if (str == compressionNames[7]) {
+        return Imf_::DWAB_COMPRESSION;
+#endif
     } else {
         return Imf_::B44_COMPRESSION;
     }
@@ -121,7 +212,226 @@ depthNameToInt(const string& name)
         return 32;
     }
 }
+
+static int
+tileSizeToInt(EParamTileSize tileSize)
+{
+    switch (tileSize) {
+    case eParamTileSize64:
+        return 64;
+    case eParamTileSize128:
+        return 128;
+    case eParamTileSize256:
+        return 256;
+    case eParamTileSize512:
+        return 512;
+    case eParamTileSizeScanLineBased:
+    default:
+        return 0;
+    }
+}
+
+#ifdef WRITEEXR_F16C_DISPATCH
+// convert 8 floats at a time with the F16C instructions, returns the number of converted values
+__attribute__( ( target("avx,f16c") ) )
+static int
+floatToHalfF16C(const float* from,
+                half* to,
+                int n)
+{
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(from + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128( (__m128i*)(to + i), h );
+    }
+
+    return i;
+}
+#endif
+
+// convert n floats to half. This rounds to the nearest value, like half(float).
+static void
+floatToHalf(const float* from,
+            half* to,
+            int n)
+{
+    int i = 0;
+
+#ifdef WRITEEXR_F16C_DISPATCH
+    static const bool f16c = getCPUFeatures().f16c;
+    if (f16c) {
+        i = floatToHalfF16C(from, to, n);
+    }
+#endif
+    for (; i < n; ++i) {
+        to[i] = from[i];
+    }
+}
+
+// An image in EXR line order (top to bottom): the first line starts at data, and each next line is
+// rowBytes further (rowBytes is negative for OFX images, which are bottom to top).
+struct Image
+{
+    const char* data;
+    ptrdiff_t rowBytes;
+    int width;
+    int height;
+};
+
+// Converts the lines of a float image to half, in parallel
+class FloatToHalfProcessor
+    : public MultiThread::Processor
+{
+public:
+    FloatToHalfProcessor(const Image& src,
+                         int nComps,
+                         half* dst)
+        : _src(src)
+        , _nComps(nComps)
+        , _dst(dst)
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int lineSize = _src.width * _nComps;
+        const int y1 = (int)( (long long)_src.height * threadID / nThreads );
+        const int y2 = (int)( (long long)_src.height * (threadID + 1) / nThreads );
+
+        for (int y = y1; y < y2; ++y) {
+            floatToHalf( (const float*)(_src.data + y * _src.rowBytes), _dst + (std::size_t)y * lineSize, lineSize );
+        }
+    }
+
+private:
+    Image _src;
+    int _nComps;
+    half* _dst;
+};
+
+// convert a float image to half, stored in buffer
+static Image
+toHalf(const Image& src,
+       int nComps,
+       vector<half>* buffer)
+{
+    buffer->resize( (std::size_t)src.width * src.height * nComps );
+    FloatToHalfProcessor processor(src, nComps, &buffer->front());
+    processor.multiThread();
+    Image dst = { (const char*)&buffer->front(), (ptrdiff_t)( src.width * nComps * sizeof(half) ), src.width, src.height };
+
+    return dst;
+}
+
+// halve the size of a float image, rounding down like Imf::ROUND_DOWN, with a box filter
+static Image
+downsample(const Image& src,
+           int nComps,
+           vector<float>* buffer)
+{
+    const int width = std::max(1, src.width / 2);
+    const int height = std::max(1, src.height / 2);
+
+    buffer->resize( (std::size_t)width * height * nComps );
+    float* to = &buffer->front();
+    for (int y = 0; y < height; ++y) {
+        const float* line0 = (const float*)(src.data + std::min(2 * y, src.height - 1) * src.rowBytes);
+        const float* line1 = (const float*)(src.data + std::min(2 * y + 1, src.height - 1) * src.rowBytes);
+        for (int x = 0; x < width; ++x, to += nComps) {
+            const int x0 = std::min(2 * x, src.width - 1) * nComps;
+            const int x1 = std::min(2 * x + 1, src.width - 1) * nComps;
+            for (int c = 0; c < nComps; ++c) {
+                to[c] = 0.25f * (line0[x0 + c] + line0[x1 + c] + line1[x0 + c] + line1[x1 + c]);
+            }
+        }
+    }
+    Image dst = { (const char*)&buffer->front(), (ptrdiff_t)(width * nComps * sizeof(float) ), width, height };
+
+    return dst;
+}
+
+// insert the slices of the interleaved channels of img, whose top left pixel is at (xMin, yMin) in the data window.
+// Slice strides are unsigned: a negative stride wraps around, which OpenEXR supports.
+static void
+insertSlices(const Image& img,
+             int nComps,
+             const char* chanNames[],
+             Imf_::PixelType pixelType,
+             int xMin,
+             int yMin,
+             Imf_::FrameBuffer* fbuf)
+{
+    const std::size_t pixelBytes = (pixelType == Imf_::HALF) ? sizeof(half) : sizeof(float);
+    const std::size_t xStride = pixelBytes * nComps;
+
+    for (int chan = 0; chan < nComps; ++chan) {
+        const char* base = img.data + chan * pixelBytes - yMin * img.rowBytes - xMin * (ptrdiff_t)xStride;
+        fbuf->insert( chanNames[chan], Imf_::Slice(pixelType, (char*)base, xStride, (std::size_t)img.rowBytes) );
+    }
+}
+
+// write a whole scan-line image to an OutputFile or an OutputPart
+template <class OutputT>
+static void
+writeScanLines(OutputT& output,
+               const Image& image,
+               int nComps,
+               const char* chanNames[],
+               Imf_::PixelType pixelType)
+{
+    const Imath::Box2i& dataW = output.header().dataWindow();
+    vector<half> halfBuffer;
+    Imf_::FrameBuffer fbuf;
+
+    insertSlices( (pixelType == Imf_::HALF) ? toHalf(image, nComps, &halfBuffer) : image,
+                  nComps, chanNames, pixelType, dataW.min.x, dataW.min.y, &fbuf );
+    output.setFrameBuffer(fbuf);
+    // write all the lines at once, so that OpenEXR compresses the line blocks in parallel
+    output.writePixels(image.height);
+}
+
+// write all the levels of a tiled image to a TiledOutputFile or a TiledOutputPart
+template <class TiledOutputT>
+static void
+writeTiledLevels(TiledOutputT& output,
+                 Image image,
+                 int nComps,
+                 const char* chanNames[],
+                 Imf_::PixelType pixelType)
+{
+    vector<half> halfBuffer;
+    vector<float> levelBuffer;
+    vector<float> nextLevelBuffer;
+
+    for (int level = 0; level < output.numLevels(); ++level) {
+        if (level > 0) {
+            image = downsample(image, nComps, &nextLevelBuffer);
+            levelBuffer.swap(nextLevelBuffer);
+        }
+        const Imath::Box2i levelDataW = output.dataWindowForLevel(level);
+        assert(image.width == levelDataW.max.x - levelDataW.min.x + 1 && image.height == levelDataW.max.y - levelDataW.min.y + 1);
+        Imf_::FrameBuffer fbuf;
+        insertSlices( (pixelType == Imf_::HALF) ? toHalf(image, nComps, &halfBuffer) : image,
+                      nComps, chanNames, pixelType, levelDataW.min.x, levelDataW.min.y, &fbuf );
+        output.setFrameBuffer(fbuf);
+        // write all the tiles of the level at once, so that OpenEXR compresses them in parallel
+        output.writeTiles(0, output.numXTiles(level) - 1, 0, output.numYTiles(level) - 1, level);
+    }
 }
+}
+
+#if WRITEEXR_OPENEXR_2_0
+// The multi-part file being written by beginEncodeParts()/encodePart()/endEncodeParts()
+struct WriteEXREncodePartsData
+{
+    auto_ptr<Imf_::MultiPartOutputFile> file;
+    vector<vector<string> > chanNames; // for each part
+    Imf_::PixelType pixelType;
+    bool tiled;
+};
+#endif
 
 class WriteEXRPlugin
     : public GenericWriterPlugin
@@ -133,10 +443,43 @@ public:
 
     virtual ~WriteEXRPlugin();
 
-    //virtual void changedParam(const InstanceChangedArgs &args, const string &paramName);
+    virtual void changedParam(const InstanceChangedArgs &args, const string &paramName) OVERRIDE FINAL;
+
+    /**
+     * @brief Restore any state from the parameters set
+     * Called from createInstance() and changedParam() (via changedFilename()), must restore the
+     * state of the Reader, such as Choice param options, data members and non-persistent param values.
+     * We don't do this in the ctor of the plug-in since we can't call virtuals yet.
+     * Any derived implementation must call GenericWriterPlugin::restoreStateFromParams() first
+     **/
+    virtual void restoreStateFromParams() OVERRIDE FINAL;
+
+    virtual OfxStatus getClipComponents(const ClipComponentsArguments& args, ClipComponentsSetter& clipComponents) OVERRIDE FINAL;
 
 private:
 
+#if WRITEEXR_OPENEXR_2_0
+    virtual LayerViewsPartsEnum getPartsSplittingPreference() const OVERRIDE FINAL { return eLayerViewsSplitViewsLayers; }
+
+    virtual void* allocateEncodePlanesUserData() OVERRIDE FINAL;
+    virtual void destroyEncodePlanesUserData(void* data) OVERRIDE FINAL;
+    virtual void beginEncodeParts(void* user_data,
+                                  const string& filename,
+                                  OfxTime time,
+                                  float pixelAspectRatio,
+                                  LayerViewsPartsEnum partsSplitting,
+                                  const map<int, string>& viewsToRender,
+                                  const std::list<string>& planes,
+                                  const bool packingRequired,
+                                  const vector<int>& packingMapping,
+                                  const OfxRectI& bounds) OVERRIDE FINAL;
+    virtual void encodePart(void* user_data, const string& filename, const float *pixelData, int pixelDataNComps, int planeIndex, int rowBytes) OVERRIDE FINAL;
+    virtual void endEncodeParts(void* user_data) OVERRIDE FINAL;
+#endif
+
+    // the header shared by all parts, without the channels
+    Imf_::Header makeHeader(const OfxRectI& bounds, float pixelAspectRatio, Imf_::PixelType* pixelType, bool* tiled) const;
+
     virtual void encode(const string& filename,
                         const OfxTime time,
                         const string& viewName,
@@ -151,27 +494,172 @@ private:
     virtual PreMultiplicationEnum getExpectedInputPremultiplication() const OVERRIDE FINAL { return eImagePreMultiplied; }
 
     virtual void onOutputFileChanged(const string& newFile, bool setColorSpace) OVERRIDE FINAL;
+
+    void refreshDWACompressionLevel();
+
     ChoiceParam* _compression;
+    DoubleParam* _dwaCompressionLevel;
     ChoiceParam* _bitDepth;
+    ChoiceParam* _tileSize;
+    BooleanParam* _mipmap;
+    ChoiceParam* _outputLayers;
 };
 
 WriteEXRPlugin::WriteEXRPlugin(OfxImageEffectHandle handle,
                                const vector<string>& extensions)
     : GenericWriterPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha)
     , _compression(NULL)
+    , _dwaCompressionLevel(NULL)
     , _bitDepth(NULL)
+    , _tileSize(NULL)
+    , _mipmap(NULL)
+    , _outputLayers(NULL)
 {
     _compression = fetchChoiceParam(kParamWriteEXRCompression);
+    _dwaCompressionLevel = fetchDoubleParam(kParamWriteEXRDWACompressionLevel);
     _bitDepth = fetchChoiceParam(kParamWriteEXRDataType);
+    _tileSize = fetchChoiceParam(kParamWriteEXRTileSize);
+    _mipmap = fetchBooleanParam(kParamWriteEXRMipmap);
+    assert(_dwaCompressionLevel && _tileSize && _mipmap);
+    if (gIsMultiplanarV2) {
+        _outputLayers = fetchChoiceParam(kParamWriteEXROutputLayers);
+        {
+            FetchChoiceParamOptions args = FetchChoiceParamOptions::createFetchChoiceParamOptionsForOutputPlane();
+            args.dependsClips.push_back(_inputClip);
+            fetchDynamicMultiplaneChoiceParameter(kParamWriteEXROutputLayers, args);
+        }
+        onAllParametersFetched();
+    }
+
+    // let OpenEXR compress line blocks and tiles in parallel
+    initEXRThreads();
 }
 
 WriteEXRPlugin::~WriteEXRPlugin()
 {
 }
 
-//void WriteEXRPlugin::changedParam(const InstanceChangedArgs &/*args*/, const string &paramName)
-//{
-//}
+void
+WriteEXRPlugin::changedParam(const InstanceChangedArgs &args,
+                             const string &paramName)
+{
+    if (paramName == kParamWriteEXRTileSize) {
+        _mipmap->setEnabled(_tileSize->getValue() != eParamTileSizeScanLineBased);
+    } else if (paramName == kParamWriteEXRCompression) {
+        refreshDWACompressionLevel();
+    }
+
+    GenericWriterPlugin::changedParam(args, paramName);
+}
+
+void
+WriteEXRPlugin::restoreStateFromParams()
+{
+    GenericWriterPlugin::restoreStateFromParams();
+    _mipmap->setEnabled(_tileSize->getValue() != eParamTileSizeScanLineBased);
+    refreshDWACompressionLevel();
+}
+
+void
+WriteEXRPlugin::refreshDWACompressionLevel()
+{
+#if WRITEEXR_OPENEXR_2_2
+    const Imf_::Compression compression = Exr::stringToCompression(Exr::compressionNames[_compression->getValue()]);
+
+    _dwaCompressionLevel->setEnabled(compression == Imf_::DWAA_COMPRESSION || compression == Imf_::DWAB_COMPRESSION);
+#endif
+}
+
+OfxStatus
+WriteEXRPlugin::getClipComponents(const ClipComponentsArguments& /*args*/,
+                                  ClipComponentsSetter& clipComponents)
+{
+    if (!_outputLayers) {
+        return kOfxStatReplyDefault;
+    }
+
+    MultiPlane::ImagePlaneDesc dstPlane;
+    OFX::Clip* clip = 0;
+    int channelIndex = -1;
+    MultiPlane::MultiPlaneEffect::GetPlaneNeededRetCodeEnum stat = getPlaneNeeded(_outputLayers->getName(), &clip, &dstPlane, &channelIndex);
+    if (stat == MultiPlane::MultiPlaneEffect::eGetPlaneNeededRetCodeFailed) {
+        return kOfxStatFailed;
+    }
+
+    if (stat == MultiPlane::MultiPlaneEffect::eGetPlaneNeededRetCodeReturnedAllPlanes) {
+        vector<string> components;
+        _inputClip->getPlanesPresent(&components);
+        for (vector<string>::const_iterator it = components.begin(); it != components.end(); ++it) {
+            clipComponents.addClipPlane(*_inputClip, *it);
+            clipComponents.addClipPlane(*_outputClip, *it);
+        }
+    } else {
+        assert(stat == MultiPlane::MultiPlaneEffect::eGetPlaneNeededRetCodeReturnedPlane);
+        string ofxComponentsStr = MultiPlane::ImagePlaneDesc::mapPlaneToOFXPlaneString(dstPlane);
+        clipComponents.addClipPlane(*_inputClip, ofxComponentsStr);
+        clipComponents.addClipPlane(*_outputClip, ofxComponentsStr);
+    }
+
+    return kOfxStatOK;
+}
+
+Imf_::Header
+WriteEXRPlugin::makeHeader(const OfxRectI& bounds,
+                           float pixelAspectRatio,
+                           Imf_::PixelType* pixelType,
+                           bool* tiled) const
+{
+    int compressionIndex;
+    _compression->getValue(compressionIndex);
+    if ( (compressionIndex < 0) || (compressionIndex >= kWriteEXRCompressionCount) ) {
+        // saved with DWA compression, which this OpenEXR does not have: use the default (PIZ)
+        compressionIndex = 3;
+    }
+
+    Imf_::Compression compression( Exr::stringToCompression(Exr::compressionNames[compressionIndex]) );
+
+    int depthIndex;
+    _bitDepth->getValue(depthIndex);
+
+    int depth = Exr::depthNameToInt(Exr::depthNames[depthIndex]);
+    Imath::Box2i exrDataW;
+
+    exrDataW.min.x = bounds.x1;
+    exrDataW.min.y = bounds.y1;
+    exrDataW.max.x = bounds.x2 - 1;
+    exrDataW.max.y = bounds.y2 - 1;
+
+    Imath::Box2i exrDispW;
+    exrDispW.min.x = 0;
+    exrDispW.min.y = 0;
+    exrDispW.max.x = (bounds.x2 - bounds.x1);
+    exrDispW.max.y = (bounds.y2 - bounds.y1);
+
+    Imf_::Header exrheader(exrDispW, exrDataW, pixelAspectRatio,
+                           Imath::V2f(0, 0), 1, Imf_::INCREASING_Y, compression);
+
+#if WRITEEXR_OPENEXR_2_2
+    if ( (compression == Imf_::DWAA_COMPRESSION) || (compression == Imf_::DWAB_COMPRESSION) ) {
+        Imf_::addDwaCompressionLevel( exrheader, (float)_dwaCompressionLevel->getValue() );
+    }
+#endif
+
+    if (depth == 32) {
+        *pixelType = Imf_::FLOAT;
+    } else {
+        assert(depth == 16);
+        *pixelType = Imf_::HALF;
+    }
+
+    const int tileSize = Exr::tileSizeToInt( (EParamTileSize)_tileSize->getValue() );
+    *tiled = (tileSize != 0);
+    if (*tiled) {
+        const bool mipmap = _mipmap->getValue();
+        exrheader.setTileDescription( Imf_::TileDescription(tileSize, tileSize, mipmap ? Imf_::MIPMAP_LEVELS : Imf_::ONE_LEVEL, Imf_::ROUND_DOWN) );
+    }
+
+    return exrheader;
+} // WriteEXRPlugin::makeHeader
 
 
 void
@@ -197,38 +685,9 @@ WriteEXRPlugin::encode(const string& filename,
 
     assert(pixelDataNComps);
     try {
-        int compressionIndex;
-        _compression->getValue(compressionIndex);
-
-        Imf_::Compression compression( Exr::stringToCompression(Exr::compressionNames[compressionIndex]) );
-
-        int depthIndex;
-        _bitDepth->getValue(depthIndex);
-
-        int depth = Exr::depthNameToInt(Exr::depthNames[depthIndex]);
-        Imath::Box2i exrDataW;
-
-        exrDataW.min.x = bounds.x1;
-        exrDataW.min.y = bounds.y1;
-        exrDataW.max.x = bounds.x2 - 1;
-        exrDataW.max.y = bounds.y2 - 1;
-
-        Imath::Box2i exrDispW;
-        exrDispW.min.x = 0;
-        exrDispW.min.y = 0;
-        exrDispW.max.x = (bounds.x2 - bounds.x1);
-        exrDispW.max.y = (bounds.y2 - bounds.y1);
-
-        Imf_::Header exrheader(exrDispW, exrDataW, pixelAspectRatio,
-                               Imath::V2f(0, 0), 1, Imf_::INCREASING_Y, compression);
-
         Imf_::PixelType pixelType;
-        if (depth == 32) {
-            pixelType = Imf_::FLOAT;
-        } else {
-            assert(depth == 16);
-            pixelType = Imf_::HALF;
-        }
+        bool tiled;
+        Imf_::Header exrheader = makeHeader(bounds, pixelAspectRatio, &pixelType, &tiled);
 
         const char* chanNames[4] = { "R", "G", "B", "A" };
         if (pixelDataNComps == 1) {
@@ -238,44 +697,172 @@ WriteEXRPlugin::encode(const string& filename,
             exrheader.channels().insert( chanNames[chan], Imf_::Channel(pixelType) );
         }
 
-        Imf_::OutputFile outputFile(filename.c_str(), exrheader);
+        // OFX images are bottom to top: start from the last line
+        Exr::Image image = { (const char*)pixelData + (ptrdiff_t)(bounds.y2 - bounds.y1 - 1) * rowBytes, -(ptrdiff_t)rowBytes,
+                             bounds.x2 - bounds.x1, bounds.y2 - bounds.y1 };
+
+        if (!tiled) {
+            Imf_::OutputFile outputFile(filename.c_str(), exrheader);
+            Exr::writeScanLines(outputFile, image, pixelDataNComps, chanNames, pixelType);
+        } else {
+            Imf_::TiledOutputFile outputFile(filename.c_str(), exrheader);
+            Exr::writeTiledLevels(outputFile, image, pixelDataNComps, chanNames, pixelType);
+        }
+    } catch (const std::exception& e) {
+        setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+} // WriteEXRPlugin::encode
+
+#if WRITEEXR_OPENEXR_2_0
+void*
+WriteEXRPlugin::allocateEncodePlanesUserData()
+{
+    WriteEXREncodePartsData* data = new WriteEXREncodePartsData;
+
+    return data;
+}
+
+void
+WriteEXRPlugin::destroyEncodePlanesUserData(void* data)
+{
+    assert(data);
+    WriteEXREncodePartsData* d = (WriteEXREncodePartsData*)data;
+    delete d;
+}
+
+void
+WriteEXRPlugin::beginEncodeParts(void* user_data,
+                                 const string& filename,
+                                 OfxTime /*time*/,
+                                 float pixelAspectRatio,
+                                 LayerViewsPartsEnum partsSplitting,
+                                 const map<int, string>& viewsToRender,
+                                 const std::list<string>& planes,
+                                 const bool packingRequired,
+                                 const vector<int>& packingMapping,
+                                 const OfxRectI& bounds)
+{
+    // each layer of each view is written to its own part
+    assert(partsSplitting == eLayerViewsSplitViewsLayers);
+    (void)partsSplitting;
+    assert( (packingRequired && planes.size() == 1) || !packingRequired );
+    assert( !viewsToRender.empty() && !planes.empty() );
+    assert(user_data);
+    WriteEXREncodePartsData* data = (WriteEXREncodePartsData*)user_data;
+
+    try {
+        const Imf_::Header baseHeader = makeHeader(bounds, pixelAspectRatio, &data->pixelType, &data->tiled);
+        vector<Imf_::Header> headers;
+        data->chanNames.clear();
 
-        for (int y = bounds.y1; y < bounds.y2; ++y) {
-            /*First we create a row that will serve as the output buffer.
-               We copy the scan-line (with y inverted) in the inputImage to the row.*/
-            int exrY = bounds.y2 - y - 1;
-            float* src_pixels = (float*)( (char*)pixelData + (exrY - bounds.y1) * rowBytes );
+        for (map<int, string>::const_iterator view = viewsToRender.begin(); view != viewsToRender.end(); ++view) {
+            for (std::list<string>::const_iterator it = planes.begin(); it != planes.end(); ++it) {
+                const bool isColor = (*it == kFnOfxImagePlaneColour);
+                const string rawComponents = isColor ? _inputClip->getPixelComponentsProperty() : *it;
+                MultiPlane::ImagePlaneDesc plane, pairedPlane;
+                MultiPlane::ImagePlaneDesc::mapOFXComponentsTypeStringToPlanes(rawComponents, &plane, &pairedPlane);
 
-            /*we create the frame buffer*/
-            Imf_::FrameBuffer fbuf;
-            if (depth == 32) {
-                for (int chan = 0; chan < pixelDataNComps; ++chan) {
-                    fbuf.insert( chanNames[chan], Imf_::Slice(Imf_::FLOAT, (char*)src_pixels + chan, sizeof(float) * pixelDataNComps, 0) );
+                // the color plane keeps the usual R, G, B, A channel names, other layers are prefixed by their name
+                vector<string> planeChannels = plane.getChannels();
+                if (!isColor) {
+                    for (std::size_t i = 0; i < planeChannels.size(); ++i) {
+                        planeChannels[i] = plane.getPlaneLabel() + "." + planeChannels[i];
+                    }
                 }
-            } else {
-                Imf_::Array2D<half> halfwriterow(pixelDataNComps, bounds.x2 - bounds.x1);
-
-                for (int chan = 0; chan < pixelDataNComps; ++chan) {
-                    fbuf.insert( chanNames[chan],
-                                 Imf_::Slice(Imf_::HALF,
-                                             (char*)(&halfwriterow[chan][0] - exrDataW.min.x),
-                                             sizeof(halfwriterow[chan][0]), 0) );
-                    const float* from = src_pixels + chan;
-                    for (int i = exrDataW.min.x, f = exrDataW.min.x; i < exrDataW.max.x; ++i, f += pixelDataNComps) {
-                        halfwriterow[chan][i - exrDataW.min.x] = from[f];
+                vector<string> channels;
+                if (!packingRequired) {
+                    channels = planeChannels;
+                } else {
+                    assert( planeChannels.size() >= packingMapping.size() );
+                    for (std::size_t i = 0; i < packingMapping.size(); ++i) {
+                        channels.push_back(planeChannels[packingMapping[i]]);
                     }
                 }
+
+                Imf_::Header header = baseHeader;
+                for (std::size_t i = 0; i < channels.size(); ++i) {
+                    header.channels().insert( channels[i], Imf_::Channel(data->pixelType) );
+                }
+                // part names must be unique in the file
+                string partName = isColor ? string("rgba") : plane.getPlaneLabel();
+                if (viewsToRender.size() > 1) {
+                    partName = view->second + "." + partName;
+                }
+                header.setName(partName);
+                header.setView(view->second);
+                header.setType(data->tiled ? Imf_::TILEDIMAGE : Imf_::SCANLINEIMAGE);
+                headers.push_back(header);
+                data->chanNames.push_back(channels);
             }
-            outputFile.setFrameBuffer(fbuf);
-            outputFile.writePixels(1);
         }
+
+        data->file.reset( new Imf_::MultiPartOutputFile( filename.c_str(), &headers.front(), (int)headers.size() ) );
     } catch (const std::exception& e) {
         setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
     }
-} // WriteEXRPlugin::encode
+} // WriteEXRPlugin::beginEncodeParts
+
+void
+WriteEXRPlugin::encodePart(void* user_data,
+                           const string& /*filename*/,
+                           const float *pixelData,
+                           int pixelDataNComps,
+                           int planeIndex,
+                           int rowBytes)
+{
+    assert(user_data);
+    WriteEXREncodePartsData* data = (WriteEXREncodePartsData*)user_data;
+    assert( data->file.get() && planeIndex >= 0 && planeIndex < (int)data->chanNames.size() );
+
+    const vector<string>& names = data->chanNames[planeIndex];
+    if ( (int)names.size() != pixelDataNComps ) {
+        setPersistentMessage(Message::eMessageError, "", "EXR: the number of channels of the layer does not match the part");
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    vector<const char*> chanNames( names.size() );
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        chanNames[i] = names[i].c_str();
+    }
+
+    try {
+        const Imath::Box2i& dataW = data->file->header(planeIndex).dataWindow();
+        const int width = dataW.max.x - dataW.min.x + 1;
+        const int height = dataW.max.y - dataW.min.y + 1;
+        // OFX images are bottom to top: start from the last line
+        Exr::Image image = { (const char*)pixelData + (ptrdiff_t)(height - 1) * rowBytes, -(ptrdiff_t)rowBytes, width, height };
+
+        if (!data->tiled) {
+            Imf_::OutputPart part(*data->file, planeIndex);
+            Exr::writeScanLines(part, image, pixelDataNComps, &chanNames.front(), data->pixelType);
+        } else {
+            Imf_::TiledOutputPart part(*data->file, planeIndex);
+            Exr::writeTiledLevels(part, image, pixelDataNComps, &chanNames.front(), data->pixelType);
+        }
+    } catch (const std::exception& e) {
+        setPersistentMessage( Message::eMessageError, "", string("OpenEXR error") + ": " + e.what() );
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+} // WriteEXRPlugin::encodePart
+
+void
+WriteEXRPlugin::endEncodeParts(void* user_data)
+{
+    assert(user_data);
+    WriteEXREncodePartsData* data = (WriteEXREncodePartsData*)user_data;
+    // closing the file writes the line offset tables of all parts
+    data->file.reset();
+}
+#endif // WRITEEXR_OPENEXR_2_0
 
 bool
 WriteEXRPlugin::isImageFile(const string& /*fileExtension*/) const
@@ -314,12 +901,21 @@ WriteEXRPluginFactory::unload()
 void
 WriteEXRPluginFactory::describe(ImageEffectDescriptor &desc)
 {
-    GenericWriterDescribe(desc, eRenderFullySafe, _extensions, kPluginEvaluation, false, false);
+    // the layers are written to the parts of a multi-part file
+    GenericWriterDescribe(desc, eRenderFullySafe, _extensions, kPluginEvaluation, WRITEEXR_OPENEXR_2_0, false);
     // basic labels
     desc.setLabel(kPluginName);
     desc.setPluginDescription(kPluginDescription);
 
     desc.setIsDeprecated(true); // This plugin was superseeded by WriteOIIO
+
+# if defined(OFX_EXTENSIONS_NATRON) && defined(OFX_EXTENSIONS_NUKE) && WRITEEXR_OPENEXR_2_0
+    gIsMultiplanarV2 = ( getImageEffectHostDescription()->supportsDynamicChoices &&
+                         getImageEffectHostDescription()->isMultiPlanar &&
+                         fetchSuite(kFnOfxImageEffectPlaneSuite, 2, true) );
+# else
+    gIsMultiplanarV2 = false;
+# endif
 }
 
 /** @brief The describe in context function, passed a plugin descriptor and a context */
@@ -336,7 +932,7 @@ WriteEXRPluginFactory::describeInContext(ImageEffectDescriptor &desc,
     {
         ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamWriteEXRCompression);
         param->setAnimates(true);
-        for (int i = 0; i < 6; ++i) {
+        for (int i = 0; i < kWriteEXRCompressionCount; ++i) {
             param->appendOption(Exr::compressionNames[i], "", Exr::compressionEnums[i]);
         }
         param->setDefault(3);
@@ -345,6 +941,23 @@ WriteEXRPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         }
     }
 
+    ////////DWA compression level
+    {
+        DoubleParamDescriptor* param = desc.defineDoubleParam(kParamWriteEXRDWACompressionLevel);
+        param->setLabel(kParamWriteEXRDWACompressionLevelLabel);
+        param->setHint(kParamWriteEXRDWACompressionLevelHint);
+        param->setRange(0, DBL_MAX);
+        param->setDisplayRange(45, 200);
+        param->setDefault(kParamWriteEXRDWACompressionLevelDefault);
+        param->setAnimates(true);
+#if !WRITEEXR_OPENEXR_2_2
+        param->setIsSecretAndDisabled(true); // DWA compression is not available
+#endif
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     ////////Data type
     {
         ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamWriteEXRDataType);
@@ -358,6 +971,44 @@ WriteEXRPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         }
     }
 
+    ////////Tile size
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamWriteEXRTileSize);
+        param->setLabel(kParamWriteEXRTileSizeLabel);
+        param->setHint(kParamWriteEXRTileSizeHint);
+        assert(param->getNOptions() == eParamTileSizeScanLineBased);
+        param->appendOption(kParamWriteEXRTileSizeOptionScanLineBased);
+        assert(param->getNOptions() == eParamTileSize64);
+        param->appendOption(kParamWriteEXRTileSizeOption64);
+        assert(param->getNOptions() == eParamTileSize128);
+        param->appendOption(kParamWriteEXRTileSizeOption128);
+        assert(param->getNOptions() == eParamTileSize256);
+        param->appendOption(kParamWriteEXRTileSizeOption256);
+        assert(param->getNOptions() == eParamTileSize512);
+        param->appendOption(kParamWriteEXRTileSizeOption512);
+        param->setDefault(eParamTileSizeScanLineBased);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    ////////Mipmaps
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamWriteEXRMipmap);
+        param->setLabel(kParamWriteEXRMipmapLabel);
+        param->setHint(kParamWriteEXRMipmapHint);
+        param->setDefault(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    ////////Layers
+    if (gIsMultiplanarV2) {
+        MultiPlane::Factory::describeInContextAddPlaneChoice(desc, page, kParamWriteEXROutputLayers, kParamWriteEXROutputLayersLabel, kParamWriteEXROutputLayersHint);
+        MultiPlane::Factory::describeInContextAddAllPlanesOutputCheckbox(desc, page);
+    }
+
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
 
@@ -29,9 +29,18 @@
 #endif
 #include "FFmpegFile.h"
 
+#include <climits>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib> // getenv
+#include <cstring> // memcmp
 #include <iostream>
+#include <iomanip>
+#include <new> // bad_alloc
+#include <sstream>
 #include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <ofxsImageEffect.h>
 
@@ -42,6 +51,8 @@
 #  include <unistd.h> // for sysconf()
 #endif
 
+#include "tinythread.h"
+
 using namespace OFX;
 
 using std::string;
@@ -90,6 +101,214 @@ video_decoding_threads()
 
 #endif
 
+/**
+ * @brief The memory budget shared by the decoded frames kept by all the video streams of the process
+ * (see kFFmpegFrameRingSizeEnv), so that opening many videos does not multiply the memory used.
+ **/
+class FrameRingBudget
+{
+public:
+    FrameRingBudget()
+        : _lock()
+        , _size( (std::size_t)kFFmpegFrameRingSizeDefault << 20 )
+        , _used(0)
+    {
+        const char* ringSizeEnv = std::getenv(kFFmpegFrameRingSizeEnv);
+
+        if (ringSizeEnv) {
+            _size = (std::size_t)std::max( 0L, std::strtol(ringSizeEnv, NULL, 10) ) << 20;
+        }
+    }
+
+    // the budget, in bytes
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+    // reserve bytes for a decoded frame, return false if the budget is exhausted
+    bool reserve(std::size_t bytes)
+    {
+        tthread::lock_guard<tthread::fast_mutex> l(_lock);
+
+        if (_used + bytes > _size) {
+            return false;
+        }
+        _used += bytes;
+
+        return true;
+    }
+
+    void release(std::size_t bytes)
+    {
+        tthread::lock_guard<tthread::fast_mutex> l(_lock);
+
+        assert(bytes <= _used);
+        _used -= std::min(bytes, _used);
+    }
+
+private:
+    tthread::fast_mutex _lock;
+    std::size_t _size;
+    std::size_t _used;
+};
+
+static FrameRingBudget gFrameRingBudget;
+
+#define kFrameIndexMagic "OFXFFIX1"
+
+// the on-disk keyframe index of a file is named after a hash of its path, size and modification time,
+// so that an index is never used for a file that was modified since it was built
+static string
+getFrameIndexCacheFile(const string& filename,
+                       long long* fileSize,
+                       long long* mtime)
+{
+    const char* dirEnv = std::getenv(kFFmpegIndexDirEnv);
+    string dir;
+
+    if (dirEnv) {
+        dir = dirEnv;
+        if ( dir.empty() ) {
+            // on-disk cache disabled
+            return string();
+        }
+    } else {
+        const char* tmpEnv = std::getenv("TMPDIR");
+        if (!tmpEnv) {
+            tmpEnv = std::getenv("TEMP");
+        }
+        if (!tmpEnv) {
+            tmpEnv = std::getenv("TMP");
+        }
+#if defined(_WIN32) || defined(WIN64)
+        dir = tmpEnv ? tmpEnv : ".";
+#else
+        dir = tmpEnv ? tmpEnv : "/tmp";
+#endif
+    }
+
+#if defined(_WIN32) || defined(WIN64)
+    // filename is UTF-8, convert it to wide chars
+    std::wstring wfilename;
+    wfilename.resize( MultiByteToWideChar (CP_UTF8, 0, filename.c_str(), -1, NULL, 0) );
+    MultiByteToWideChar ( CP_UTF8, 0, filename.c_str(), -1, &wfilename[0], (int)wfilename.size() );
+    struct _stat64 st;
+    if (_wstat64(wfilename.c_str(), &st) != 0) {
+        return string();
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return string();
+    }
+#endif
+    *fileSize = (long long)st.st_size;
+    *mtime = (long long)st.st_mtime;
+
+    // 64-bit FNV-1a
+    unsigned long long hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < filename.size(); ++i) {
+        hash = (hash ^ (unsigned char)filename[i]) * 1099511628211ULL;
+    }
+    for (int i = 0; i < 8; ++i) {
+        hash = ( hash ^ ( ( (unsigned long long)*fileSize >> (8 * i) ) & 0xff ) ) * 1099511628211ULL;
+        hash = ( hash ^ ( ( (unsigned long long)*mtime >> (8 * i) ) & 0xff ) ) * 1099511628211ULL;
+    }
+
+    std::stringstream ss;
+    ss << dir;
+    const char last = dir[dir.size() - 1];
+    if ( (last != '/') && (last != '\\') ) {
+        ss << '/';
+    }
+    ss << "openfx-io-ffmpeg-" << std::hex << std::setw(16) << std::setfill('0') << hash << ".idx";
+
+    return ss.str();
+}
+
+// The index file contains the magic string, the file path, size and modification time
+// (to detect hash collisions), the stream index, the number of keyframes and their PTS/DTS.
+static bool
+readFrameIndexCache(const string& cacheFile,
+                    const string& filename,
+                    long long fileSize,
+                    long long mtime,
+                    int streamIdx,
+                    std::vector<int64_t>* timestamps)
+{
+    std::FILE* f = std::fopen(cacheFile.c_str(), "rb");
+
+    if (!f) {
+        return false;
+    }
+    bool ok = true;
+    char magic[8];
+    ok = ok && std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) && std::memcmp(magic, kFrameIndexMagic, sizeof(magic)) == 0;
+    unsigned int nameSize = 0;
+    ok = ok && std::fread(&nameSize, sizeof(nameSize), 1, f) == 1 && nameSize == filename.size();
+    if (ok) {
+        std::vector<char> name(nameSize + 1);
+        ok = std::fread(&name[0], 1, nameSize, f) == nameSize && filename.compare(0, string::npos, &name[0], nameSize) == 0;
+    }
+    long long fileSizeRead = 0, mtimeRead = 0;
+    int streamIdxRead = -1;
+    unsigned int count = 0;
+    ok = ok && std::fread(&fileSizeRead, sizeof(fileSizeRead), 1, f) == 1 && fileSizeRead == fileSize;
+    ok = ok && std::fread(&mtimeRead, sizeof(mtimeRead), 1, f) == 1 && mtimeRead == mtime;
+    ok = ok && std::fread(&streamIdxRead, sizeof(streamIdxRead), 1, f) == 1 && streamIdxRead == streamIdx;
+    ok = ok && std::fread(&count, sizeof(count), 1, f) == 1;
+    if (ok) {
+        timestamps->resize(2 * (std::size_t)count);
+        ok = (count == 0) || std::fread(&(*timestamps)[0], sizeof(int64_t), timestamps->size(), f) == timestamps->size();
+    }
+    std::fclose(f);
+
+    return ok;
+}
+
+static void
+writeFrameIndexCache(const string& cacheFile,
+                     const string& filename,
+                     long long fileSize,
+                     long long mtime,
+                     int streamIdx,
+                     const std::vector<int64_t>& timestamps)
+{
+    // write to a temporary file, so that other processes never read an incomplete index
+    std::stringstream ss;
+    // the process and thread ids make the name unique, even if several processes or readers index the same file
+#if defined(_WIN32) || defined(WIN64)
+    ss << cacheFile << '.' << GetCurrentProcessId() << '.' << tthread::this_thread::get_id() << ".tmp";
+#else
+    ss << cacheFile << '.' << getpid() << '.' << tthread::this_thread::get_id() << ".tmp";
+#endif
+    const string tmpFile = ss.str();
+    std::FILE* f = std::fopen(tmpFile.c_str(), "wb");
+
+    if (!f) {
+        return;
+    }
+    const unsigned int nameSize = (unsigned int)filename.size();
+    const unsigned int count = (unsigned int)(timestamps.size() / 2);
+    bool ok = std::fwrite(kFrameIndexMagic, 1, 8, f) == 8;
+    ok = ok && std::fwrite(&nameSize, sizeof(nameSize), 1, f) == 1;
+    ok = ok && std::fwrite(filename.data(), 1, nameSize, f) == nameSize;
+    ok = ok && std::fwrite(&fileSize, sizeof(fileSize), 1, f) == 1;
+    ok = ok && std::fwrite(&mtime, sizeof(mtime), 1, f) == 1;
+    ok = ok && std::fwrite(&streamIdx, sizeof(streamIdx), 1, f) == 1;
+    ok = ok && std::fwrite(&count, sizeof(count), 1, f) == 1;
+    ok = ok && ( timestamps.empty() || std::fwrite(&timestamps[0], sizeof(int64_t), timestamps.size(), f) == timestamps.size() );
+    ok = (std::fclose(f) == 0) && ok;
+    if (ok) {
+        std::remove( cacheFile.c_str() ); // rename() fails on Windows if the destination exists
+        ok = std::rename( tmpFile.c_str(), cacheFile.c_str() ) == 0;
+    }
+    if (!ok) {
+        std::remove( tmpFile.c_str() );
+    }
+}
+
 static bool
 extensionCorrespondToImageFile(const string & ext)
 {
@@ -459,6 +678,84 @@ FFmpegFile::Stream::GetStreamAspectRatio(Stream* stream)
     return stream->_aspect;
 }
 
+bool
+FFmpegFile::Stream::getDecodedFrame(int frame,
+                                    unsigned char* buffer,
+                                    std::size_t size)
+{
+    for (std::list<DecodedFrame>::iterator it = _decodedFrames.begin(); it != _decodedFrames.end(); ++it) {
+        if ( (it->frame == frame) && (it->data.size() == size) ) {
+            std::copy(it->data.begin(), it->data.end(), buffer);
+            _decodedFrames.splice(_decodedFrames.begin(), _decodedFrames, it);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+unsigned char*
+FFmpegFile::Stream::newDecodedFrame(int frame,
+                                    std::size_t size)
+{
+    if ( (_decodedFramesMax == 0) || (size == 0) ) {
+        return NULL;
+    }
+    std::list<DecodedFrame>::iterator it = _decodedFrames.begin();
+    while ( it != _decodedFrames.end() && it->frame != frame ) {
+        ++it;
+    }
+    if ( it == _decodedFrames.end() ) {
+        if ( (_decodedFrames.size() < _decodedFramesMax) && gFrameRingBudget.reserve(size) ) {
+            _decodedFrames.push_front( DecodedFrame() );
+        } else if ( !_decodedFrames.empty() ) {
+            // reuse the buffer of the least recently used frame
+            _decodedFrames.splice( _decodedFrames.begin(), _decodedFrames, --_decodedFrames.end() );
+        } else {
+            // the frames of the other streams use the whole budget
+            return NULL;
+        }
+    } else {
+        _decodedFrames.splice(_decodedFrames.begin(), _decodedFrames, it);
+    }
+    DecodedFrame& decodedFrame = _decodedFrames.front();
+    decodedFrame.frame = frame;
+    // a new frame has its size reserved, and a reused frame has the size of its data
+    const std::size_t reservedSize = decodedFrame.data.empty() ? size : decodedFrame.data.size();
+    if ( (size > reservedSize) && !gFrameRingBudget.reserve(size - reservedSize) ) {
+        gFrameRingBudget.release(reservedSize);
+        _decodedFrames.pop_front();
+
+        return NULL;
+    }
+    try {
+        decodedFrame.data.resize(size);
+    } catch (const std::bad_alloc&) {
+        gFrameRingBudget.release( std::max(size, reservedSize) );
+        _decodedFrames.pop_front();
+
+        return NULL;
+    }
+    if (size < reservedSize) {
+        gFrameRingBudget.release(reservedSize - size);
+    }
+
+    return &decodedFrame.data[0];
+}
+
+void
+FFmpegFile::Stream::clearDecodedFrames()
+{
+    std::size_t bytes = 0;
+
+    for (std::list<DecodedFrame>::const_iterator it = _decodedFrames.begin(); it != _decodedFrames.end(); ++it) {
+        bytes += it->data.size();
+    }
+    _decodedFrames.clear();
+    gFrameRingBudget.release(bytes);
+}
+
 // get stream start time
 int64_t
 FFmpegFile::getStreamStartTime(Stream & stream)
@@ -654,6 +951,23 @@ FFmpegFile::getStreamFrames(Stream & stream)
     return frames;
 } // FFmpegFile::getStreamFrames
 
+// the maximum number of decoders of a file
+static std::size_t
+getMaxDecoders()
+{
+#ifdef OFX_IO_MT_FFMPEG
+    const char* decodersEnv = std::getenv(kFFmpegDecodersEnv);
+    if (decodersEnv) {
+        return (std::size_t)std::max( 1L, std::strtol(decodersEnv, NULL, 10) );
+    }
+
+    return (std::size_t)std::max( 1, std::min( (int)MultiThread::getNumCPUs(), kFFmpegDecodersDefaultMax ) );
+#else
+    // the reader is instance-safe: only one frame is decoded at a time
+    return 1;
+#endif
+}
+
 FFmpegFile::FFmpegFile(const string & filename)
     : _filename(filename)
     , _context(NULL)
@@ -666,13 +980,64 @@ FFmpegFile::FFmpegFile(const string & filename)
     , _lock()
     , _invalidStateLock()
 #endif
+    , _keyFramesByPts()
+    , _keyFramesByDts()
+    , _keyFramesReady(false)
+    , _abortIndexing(false)
+    , _indexThread(NULL)
+    , _keyFramesLock()
+    , _primary(NULL)
+    , _decoders(1, this)
+    , _decoderBusy(1, false)
+    , _maxDecoders( getMaxDecoders() )
+    , _decodersMutex()
+    , _decoderAvailable()
+    , _decoderSettings()
 {
+    _decoderSettings.colorMatrixTypeOverride = 0;
+    _decoderSettings.doNotAttachPrefix = true;
+    _decoderSettings.matchMetaFormat = true;
+    open();
+}
+
+FFmpegFile::FFmpegFile(const string & filename,
+                       FFmpegFile* primary)
+    : _filename(filename)
+    , _context(NULL)
+    , _format(NULL)
+    , _streams()
+    , _errorMsg()
+    , _invalidState(false)
+    , _avPacket()
 #ifdef OFX_IO_MT_FFMPEG
-    //MultiThread::AutoMutex guard(_lock); // not needed in a constructor: we are the only owner
+    , _lock()
+    , _invalidStateLock()
 #endif
+    , _keyFramesByPts()
+    , _keyFramesByDts()
+    , _keyFramesReady(false)
+    , _abortIndexing(false)
+    , _indexThread(NULL)
+    , _keyFramesLock()
+    , _primary(primary)
+    , _decoders()
+    , _decoderBusy()
+    , _maxDecoders(1)
+    , _decodersMutex()
+    , _decoderAvailable()
+    , _decoderSettings()
+{
+    _decoderSettings.colorMatrixTypeOverride = 0;
+    _decoderSettings.doNotAttachPrefix = true;
+    _decoderSettings.matchMetaFormat = true;
+    open();
+}
 
+void
+FFmpegFile::open()
+{
 #if TRACE_FILE_OPEN
-    std::cout << "FFmpeg Reader=" << this << "::c'tor(): filename=" << filename << std::endl;
+    std::cout << "FFmpeg Reader=" << this << "::open(): filename=" << _filename << std::endl;
 #endif
 
     assert( !_filename.empty() );
@@ -887,17 +1252,56 @@ FFmpegFile::FFmpegFile(const string & filename)
         stream->_startPTS = getStreamStartTime(*stream);
         stream->_frames   = getStreamFrames(*stream);
 
+        // set the number of decoded frames kept in memory
+        {
+            // all the decoders of the pool, including the primary file, share the budget of the file
+            const std::size_t poolSize = _primary ? _primary->_maxDecoders : _maxDecoders;
+            const std::size_t ringSize = gFrameRingBudget.size() / std::max(poolSize, (std::size_t)1);
+            std::size_t frameBytes = (std::size_t)stream->_width * stream->_height * stream->_numberOfComponents * (stream->_bitDepth > 8 ? sizeof(unsigned short) : sizeof(unsigned char));
+            if (frameBytes > 0) {
+                // the frames of all the streams are also limited by the budget when they are decoded
+                stream->_decodedFramesMax = std::min( ringSize / frameBytes, (std::size_t)kFFmpegFrameRingMaxFrames );
+            }
+        }
+
         // save the stream
         _streams.push_back(stream);
     }
     if ( _streams.empty() ) {
         setError( unsuported_codec ? "unsupported codec..." : "unable to find video stream" );
+
+        return;
+    }
+
+    if (_primary) {
+        // decoders of the pool use the keyframe index of the primary file
+        return;
+    }
+
+    // index the keyframes in the background, unless every frame is a keyframe
+    const AVCodecDescriptor* codecDescriptor = avcodec_descriptor_get(_streams[0]->_codecContext->codec_id);
+    if ( !codecDescriptor || !(codecDescriptor->props & AV_CODEC_PROP_INTRA_ONLY) ) {
+        _indexThread = new tthread::thread(indexThreadFunction, this);
     }
 }
 
 // destructor
 FFmpegFile::~FFmpegFile()
 {
+    if (_indexThread) {
+        _abortIndexing = true;
+        _indexThread->join();
+        delete _indexThread;
+        _indexThread = NULL;
+    }
+
+    // the pool is not in use: decoders are only busy during decode()
+    for (std::size_t i = 1; i < _decoders.size(); ++i) {
+        assert(!_decoderBusy[i]);
+        delete _decoders[i]; // may be NULL
+    }
+    _decoders.clear();
+
 #ifdef OFX_IO_MT_FFMPEG
     AutoMutex guard(_lock);
 #endif
@@ -1024,6 +1428,177 @@ FFmpegFile::isInvalid() const
     return _invalidState;
 }
 
+void
+FFmpegFile::indexThreadFunction(void* arg)
+{
+    FFmpegFile* file = (FFmpegFile*)arg;
+
+    try {
+        file->buildFrameIndex();
+    } catch (...) {
+        // the index is only an optimization
+    }
+}
+
+void
+FFmpegFile::buildFrameIndex()
+{
+    const int streamIdx = _streams[0]->_idx;
+    long long fileSize = 0, mtime = 0;
+    const string cacheFile = getFrameIndexCacheFile(_filename, &fileSize, &mtime);
+    std::vector<int64_t> timestamps; // PTS and DTS of each keyframe
+
+    if ( cacheFile.empty() || !readFrameIndexCache(cacheFile, _filename, fileSize, mtime, streamIdx, &timestamps) ) {
+        timestamps.clear();
+        // use a separate demuxer: the packets are read, but not decoded
+        AVFormatContext* context = NULL;
+        if (avformat_open_input(&context, _filename.c_str(), NULL, NULL) < 0) {
+            return;
+        }
+        bool complete = false;
+        if ( (avformat_find_stream_info(context, NULL) >= 0) && ( streamIdx < (int)context->nb_streams ) ) {
+            AVPacket packet;
+            av_init_packet(&packet);
+            packet.data = NULL;
+            packet.size = 0;
+            int error = 0;
+            while ( !_abortIndexing && ( error = av_read_frame(context, &packet) ) >= 0 ) {
+                if ( (packet.stream_index == streamIdx) && (packet.flags & AV_PKT_FLAG_KEY) ) {
+                    timestamps.push_back(packet.pts);
+                    timestamps.push_back(packet.dts);
+                }
+                av_packet_unref(&packet);
+            }
+            complete = !_abortIndexing && ( error == (int)AVERROR_EOF );
+        }
+        avformat_close_input(&context);
+        if (!complete) {
+            return;
+        }
+        if ( !cacheFile.empty() ) {
+            writeFrameIndexCache(cacheFile, _filename, fileSize, mtime, streamIdx, timestamps);
+        }
+    }
+#if TRACE_FILE_OPEN
+    std::cout << "FFmpeg Reader=" << this << "::buildFrameIndex(): " << timestamps.size() / 2 << " keyframes" << std::endl;
+#endif
+
+    // depending on the demuxer, av_seek_frame() compares with the PTS or the DTS: seek to the smallest one,
+    // so that the seek never lands after the keyframe
+    std::vector<IndexedKeyFrame> keyFramesByPts;
+    std::vector<IndexedKeyFrame> keyFramesByDts;
+    for (std::size_t i = 0; i + 1 < timestamps.size(); i += 2) {
+        const int64_t pts = timestamps[i];
+        const int64_t dts = timestamps[i + 1];
+        IndexedKeyFrame keyFrame;
+        if ( pts == int64_t(AV_NOPTS_VALUE) ) {
+            keyFrame.seekTimestamp = dts;
+        } else if ( dts == int64_t(AV_NOPTS_VALUE) ) {
+            keyFrame.seekTimestamp = pts;
+        } else {
+            keyFrame.seekTimestamp = std::min(pts, dts);
+        }
+        if ( pts != int64_t(AV_NOPTS_VALUE) ) {
+            keyFrame.timestamp = pts;
+            keyFramesByPts.push_back(keyFrame);
+        }
+        if ( dts != int64_t(AV_NOPTS_VALUE) ) {
+            keyFrame.timestamp = dts;
+            keyFramesByDts.push_back(keyFrame);
+        }
+    }
+    std::stable_sort(keyFramesByPts.begin(), keyFramesByPts.end(), keyFrameTimestampLess);
+    std::stable_sort(keyFramesByDts.begin(), keyFramesByDts.end(), keyFrameTimestampLess);
+    {
+        tthread::lock_guard<tthread::fast_mutex> l(_keyFramesLock);
+        _keyFramesByPts.swap(keyFramesByPts);
+        _keyFramesByDts.swap(keyFramesByDts);
+        _keyFramesReady = !timestamps.empty();
+    }
+}
+
+bool
+FFmpegFile::keyFrameTimestampLess(const IndexedKeyFrame& a,
+                                  const IndexedKeyFrame& b)
+{
+    return a.timestamp < b.timestamp;
+}
+
+bool
+FFmpegFile::findKeyFrame(const Stream* stream,
+                         int frame,
+                         int* keyFrame,
+                         int64_t* seekTimestamp) const
+{
+    if ( _streams.empty() || (stream != _streams[0]) ) {
+        return false;
+    }
+
+    const FFmpegFile* indexed = _primary ? _primary : this;
+    tthread::lock_guard<tthread::fast_mutex> l(indexed->_keyFramesLock);
+    if (!indexed->_keyFramesReady) {
+        return false;
+    }
+    // the keyframes are sorted by timestamp, and the frame number increases with the timestamp:
+    // the keyframe that precedes the frame is the last one whose frame number is not after it
+    const std::vector<IndexedKeyFrame>& keyFrames = (stream->_timestampField == &AVPacket::pts) ? indexed->_keyFramesByPts : indexed->_keyFramesByDts;
+    FrameBeforeKeyFrame frameBeforeKeyFrame;
+    frameBeforeKeyFrame.stream = stream;
+    std::vector<IndexedKeyFrame>::const_iterator it = std::upper_bound(keyFrames.begin(), keyFrames.end(), frame, frameBeforeKeyFrame);
+    if ( it == keyFrames.begin() ) {
+        return false;
+    }
+    --it;
+    *keyFrame = stream->ptsToFrame(it->timestamp);
+    *seekTimestamp = it->seekTimestamp;
+
+    return true;
+}
+
+void
+FFmpegFile::convertFrame(Stream* stream,
+                         int srcColourRange,
+                         unsigned char* buffer)
+{
+    SwsContext* context = NULL;
+    {
+        context = stream->getConvertCtx(stream->_codecContext->pix_fmt, stream->_width, stream->_height,
+                                        srcColourRange,
+                                        stream->_outputPixelFormat, stream->_width, stream->_height);
+    }
+
+    // Scale if any of the decoding path has provided a convert
+    // context. Otherwise, no scaling/conversion is required after
+    // decoding the frame.
+    if (context) {
+        uint8_t *data[4];
+        int linesize[4];
+#if 0
+        {
+            AVPicture output;
+            avpicture_fill(&output, buffer, stream->_outputPixelFormat, stream->_width, stream->_height);
+            data[0] = output.data[0];
+            data[1] = output.data[1];
+            data[2] = output.data[2];
+            data[3] = output.data[3];
+            linesize[0] = output.linesize[0];
+            linesize[1] = output.linesize[1];
+            linesize[2] = output.linesize[2];
+            linesize[3] = output.linesize[3];
+        }
+#else
+        av_image_fill_arrays(data, linesize, buffer, stream->_outputPixelFormat, stream->_width, stream->_height, 1);
+#endif
+        sws_scale(context,
+                  stream->_avFrame->data,
+                  stream->_avFrame->linesize,
+                  0,
+                  stream->_height,
+                  data,
+                  linesize);
+    }
+}
+
 bool
 FFmpegFile::seekFrame(int frame,
                       Stream* stream)
@@ -1032,6 +1607,12 @@ FFmpegFile::seekFrame(int frame,
 
     avcodec_flush_buffers(stream->_codecContext);
     int64_t timestamp = stream->frameToPts(frame);
+    int keyFrame;
+    int64_t keyFrameTimestamp;
+    if ( findKeyFrame(stream, frame, &keyFrame, &keyFrameTimestamp) ) {
+        // seek exactly to the keyframe that precedes the frame
+        timestamp = keyFrameTimestamp;
+    }
     int error = av_seek_frame(_context, stream->_idx, timestamp, AVSEEK_FLAG_BACKWARD);
     if (error < 0) {
         // Seek error. Abort attempt to read and decode frames.
@@ -1043,6 +1624,135 @@ FFmpegFile::seekFrame(int frame,
     return true;
 }
 
+#define kDecoderSeekCost (INT_MAX / 2)
+
+int
+FFmpegFile::getDecodeCost(int frame) const
+{
+    if ( _streams.empty() ) {
+        return INT_MAX;
+    }
+    const Stream* stream = _streams[0];
+    if ( stream->hasDecodedFrame(frame) ) {
+        return 0;
+    }
+    if (stream->_decodeNextFrameOut == frame) {
+        return 1;
+    }
+    int keyFrame;
+    int64_t keyFrameTimestamp;
+    if ( (stream->_decodeNextFrameOut >= 0) && (stream->_decodeNextFrameOut < frame) &&
+         findKeyFrame(stream, frame, &keyFrame, &keyFrameTimestamp) && (keyFrame <= stream->_decodeNextFrameOut) ) {
+        // decodeFrame() will decode forward
+        return 1 + frame - stream->_decodeNextFrameOut;
+    }
+
+    return kDecoderSeekCost;
+}
+
+FFmpegFile*
+FFmpegFile::acquireDecoder(int frame)
+{
+    assert(!_primary);
+    tthread::lock_guard<tthread::mutex> l(_decodersMutex);
+
+    for (;;) {
+        std::size_t best = _decoders.size();
+        int bestCost = INT_MAX;
+        std::size_t nDecoders = 0; // opened or being opened
+        std::size_t freeSlot = _decoders.size();
+        for (std::size_t i = 0; i < _decoders.size(); ++i) {
+            if ( !_decoderBusy[i] && _decoders[i] ) {
+                int cost = _decoders[i]->getDecodeCost(frame);
+                if (cost < bestCost) {
+                    best = i;
+                    bestCost = cost;
+                }
+            }
+            if ( _decoders[i] || _decoderBusy[i] ) {
+                ++nDecoders;
+            } else {
+                freeSlot = i;
+            }
+        }
+        const bool canOpenDecoder = nDecoders < _maxDecoders;
+        if ( ( best < _decoders.size() ) && ( (bestCost < kDecoderSeekCost) || !canOpenDecoder ) ) {
+            _decoderBusy[best] = true;
+            FFmpegFile* decoder = _decoders[best];
+            if ( !decoder->_streams.empty() ) {
+                // apply the settings of the pool: the decoder is now busy, so no other thread uses its stream
+                Stream* stream = decoder->_streams[0];
+                if (stream->_colorMatrixTypeOverride != _decoderSettings.colorMatrixTypeOverride) {
+                    stream->_colorMatrixTypeOverride = _decoderSettings.colorMatrixTypeOverride;
+                    stream->_resetConvertCtx = true;
+                    stream->clearDecodedFrames();
+                }
+                stream->_doNotAttachPrefix = _decoderSettings.doNotAttachPrefix;
+                stream->_matchMetaFormat = _decoderSettings.matchMetaFormat;
+            }
+
+            return decoder;
+        }
+        if (canOpenDecoder) {
+            // all decoders are busy, or would have to seek: open a new one, without holding the lock
+            // (the slot is marked busy, and slots are never removed, so its index remains valid)
+            const std::size_t slot = freeSlot;
+            if ( slot == _decoders.size() ) {
+                _decoders.push_back(NULL);
+                _decoderBusy.push_back(true);
+            } else {
+                _decoderBusy[slot] = true;
+            }
+            _decodersMutex.unlock();
+            FFmpegFile* decoder = NULL;
+            try {
+                decoder = new FFmpegFile(_filename, this);
+            } catch (...) {
+                decoder = NULL;
+            }
+            _decodersMutex.lock();
+            if ( decoder && !decoder->isInvalid() && !decoder->_streams.empty() ) {
+#if TRACE_FILE_OPEN
+                std::cout << "FFmpeg Reader=" << this << "::acquireDecoder(): opened decoder " << slot << std::endl;
+#endif
+                // the settings are applied when it is acquired
+                _decoders[slot] = decoder;
+                _decoderBusy[slot] = false;
+                _decoderAvailable.notify_all();
+                continue;
+            }
+            delete decoder;
+            // leave the slot empty and do not try again
+            _decoderBusy[slot] = false;
+            _maxDecoders = std::max( (std::size_t)1, nDecoders );
+            _decoderAvailable.notify_all();
+            continue;
+        }
+        _decoderAvailable.wait(_decodersMutex);
+    }
+}
+
+void
+FFmpegFile::releaseDecoder(FFmpegFile* decoder)
+{
+    assert(!_primary);
+    {
+        tthread::lock_guard<tthread::mutex> l(_decodersMutex);
+        for (std::size_t i = 0; i < _decoders.size(); ++i) {
+            if (_decoders[i] == decoder) {
+                _decoderBusy[i] = false;
+                if ( (decoder != this) && decoder->isInvalid() ) {
+                    // it failed, another one will be opened if necessary
+                    delete decoder;
+                    _decoders[i] = NULL;
+                }
+                break;
+            }
+        }
+    }
+    _decoderAvailable.notify_all();
+}
+
 // decode a single frame into the buffer thread safe
 bool
 FFmpegFile::decode(const ImageEffect* plugin,
@@ -1051,11 +1761,32 @@ FFmpegFile::decode(const ImageEffect* plugin,
                    int maxRetries,
                    unsigned char* buffer)
 {
-    const unsigned int streamIdx = 0;
+    FFmpegFile* decoder = acquireDecoder(frame - 1);
+    bool hasPicture = false;
 
-#ifdef OFX_IO_MT_FFMPEG
-    AutoMutex guard(_lock);
-#endif
+    try {
+        hasPicture = decoder->decodeFrame(plugin, frame, loadNearest, maxRetries, buffer);
+    } catch (...) {
+        releaseDecoder(decoder);
+        throw;
+    }
+    if ( !hasPicture && (decoder != this) && decoder->isInvalid() ) {
+        // report the error on this file
+        setError( decoder->_errorMsg.c_str() );
+    }
+    releaseDecoder(decoder);
+
+    return hasPicture;
+}
+
+bool
+FFmpegFile::decodeFrame(const ImageEffect* plugin,
+                        int frame,
+                        bool loadNearest,
+                        int maxRetries,
+                        unsigned char* buffer)
+{
+    const unsigned int streamIdx = 0;
 
     if ( streamIdx >= _streams.size() ) {
         return false;
@@ -1090,6 +1821,16 @@ FFmpegFile::decode(const ImageEffect* plugin,
     std::cout << "FFmpeg Reader=" << this << "::decode(): frame=" << desiredFrame << ", videoStream=" << streamIdx << ", streamIdx=" << stream->_idx << std::endl;
 #endif
 
+    // the frame may have been decoded recently (e.g. when stepping backwards after a seek)
+    const std::size_t frameBytes = getBufferBytesCount();
+    if ( stream->getDecodedFrame(desiredFrame, buffer, frameBytes) ) {
+#if TRACE_DECODE_PROCESS
+        std::cout << "  Frame found in the decoded frames" << std::endl;
+#endif
+
+        return true;
+    }
+
     // Number of read retries remaining when decode stall is detected before we give up (in the case of post-seek stalls,
     // such retries are applied only after we've searched all the way back to the start of the file and failed to find a
     // successful start point for playback)..
@@ -1124,7 +1865,16 @@ FFmpegFile::decode(const ImageEffect* plugin,
     int lastSeekedFrame = -1; // 0-based index of the last frame to which we seeked when seek in progress / negative when no
     // seek in progress,
 
-    if (desiredFrame != stream->_decodeNextFrameOut) {
+    // If the keyframe index shows that the desired frame is after the next frame out of decode, in the same GOP,
+    // decoding forward is cheaper than seeking back to that keyframe.
+    int keyFrame;
+    int64_t keyFrameTimestamp;
+    if ( (stream->_decodeNextFrameOut >= 0) && (stream->_decodeNextFrameOut < desiredFrame) &&
+         findKeyFrame(stream, desiredFrame, &keyFrame, &keyFrameTimestamp) && (keyFrame <= stream->_decodeNextFrameOut) ) {
+#if TRACE_DECODE_PROCESS
+        std::cout << "  Next frame expected out=" << stream->_decodeNextFrameOut << ", keyframe=" << keyFrame << ", decoding forward" << std::endl;
+#endif
+    } else if (desiredFrame != stream->_decodeNextFrameOut) {
 #if TRACE_DECODE_PROCESS
         std::cout << "  Next frame expected out=" << stream->_decodeNextFrameOut << ", Seeking to desired frame" << std::endl;
 #endif
@@ -1428,51 +2178,29 @@ FFmpegFile::decode(const ImageEffect* plugin,
                 std::cout << ", is desired frame" << std::endl;
 #endif
 
-                SwsContext* context = NULL;
-                {
-                    context = stream->getConvertCtx(stream->_codecContext->pix_fmt, stream->_width, stream->_height,
-                                                    srcColourRange,
-                                                    stream->_outputPixelFormat, stream->_width, stream->_height);
-                }
+                convertFrame(stream, srcColourRange, buffer);
 
-                // Scale if any of the decoding path has provided a convert
-                // context. Otherwise, no scaling/conversion is required after
-                // decoding the frame.
-                if (context) {
-                    uint8_t *data[4];
-                    int linesize[4];
-#if 0
-                    {
-                        AVPicture output;
-                        avpicture_fill(&output, buffer, stream->_outputPixelFormat, stream->_width, stream->_height);
-                        data[0] = output.data[0];
-                        data[1] = output.data[1];
-                        data[2] = output.data[2];
-                        data[3] = output.data[3];
-                        linesize[0] = output.linesize[0];
-                        linesize[1] = output.linesize[1];
-                        linesize[2] = output.linesize[2];
-                        linesize[3] = output.linesize[3];
-                    }
-#else
-                    av_image_fill_arrays(data, linesize, buffer, stream->_outputPixelFormat, stream->_width, stream->_height, 1);
-#endif
-                    sws_scale(context,
-                              stream->_avFrame->data,
-                              stream->_avFrame->linesize,
-                              0,
-                              stream->_height,
-                              data,
-                              linesize);
+                // keep it, in case it is read again
+                unsigned char* frameBuffer = stream->newDecodedFrame(desiredFrame, frameBytes);
+                if (frameBuffer) {
+                    std::copy(buffer, buffer + frameBytes, frameBuffer);
                 }
 
                 hasPicture = true;
-            }
+            } else {
 #if TRACE_DECODE_PROCESS
-            else {
                 std::cout << ", is not desired frame (" << desiredFrame << ")" << std::endl;
-            }
 #endif
+                // keep the frames that precede the desired frame, so that stepping backwards does not
+                // decode the whole GOP again
+                if ( (stream->_decodeNextFrameOut >= 0) && (stream->_decodeNextFrameOut < desiredFrame) &&
+                     ( desiredFrame - stream->_decodeNextFrameOut < (int)stream->_decodedFramesMax ) ) {
+                    unsigned char* frameBuffer = stream->newDecodedFrame(stream->_decodeNextFrameOut, frameBytes);
+                    if (frameBuffer) {
+                        convertFrame(stream, srcColourRange, frameBuffer);
+                    }
+                }
+            }
 
             // Advance next output frame expected from decode.
             ++stream->_decodeNextFrameOut;
@@ -1573,7 +2301,7 @@ FFmpegFile::decode(const ImageEffect* plugin,
     }
 
     return hasPicture;
-} // FFmpegFile::decode
+} // FFmpegFile::decodeFrame
 
 bool
 FFmpegFile::getFPS(double & fps,
@@ -1629,102 +2357,23 @@ FFmpegFile::getBufferBytesCount() const
     return stream->_width * stream->_height * stream->_numberOfComponents * pixelDepth;
 }
 
-FFmpegFileManager::FFmpegFileManager()
-    : _files()
-    , _lock(NULL)
-{
-}
-
-FFmpegFileManager::~FFmpegFileManager()
-{
-    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
-        for (std::list<FFmpegFile*>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-            delete *it2;
-        }
-    }
-    _files.clear();
-    delete _lock;
-}
-
-void
-FFmpegFileManager::init()
-{
-    _lock = new FFmpegFile::Mutex;
-}
-
-void
-FFmpegFileManager::clear(void const * plugin)
-{
-    assert(_lock);
-    FFmpegFile::AutoMutex guard(*_lock);
-    FilesMap::iterator found = _files.find(plugin);
-    if ( found != _files.end() ) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            delete *it;
-        }
-        _files.erase(found);
-    }
-}
-
-FFmpegFile*
-FFmpegFileManager::get(void const * plugin,
-                       const string &filename) const
+std::size_t
+FFmpegFile::getMemorySize() const
 {
-    if (filename.empty() || !plugin) {
-        return 0;
-    }
-    assert(_lock);
-    FFmpegFile::AutoMutex guard(*_lock);
-    FilesMap::iterator found = _files.find(plugin);
-    if ( found != _files.end() ) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            if ( (*it)->getFilename() == filename ) {
-                if ( (*it)->isInvalid() ) {
-                    delete *it;
-                    found->second.erase(it);
-                    break;
-                } else {
-                    return *it;
-                }
-            }
-        }
+    if ( _streams.empty() ) {
+        return sizeof(FFmpegFile);
     }
 
-    return NULL;
-}
-
-FFmpegFile*
-FFmpegFileManager::getOrCreate(void const * plugin,
-                               const string &filename) const
-{
-    if (filename.empty() || !plugin) {
-        return 0;
-    }
-    assert(_lock);
-    FFmpegFile::AutoMutex guard(*_lock);
-    FilesMap::iterator found = _files.find(plugin);
-    if ( found != _files.end() ) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            if ( (*it)->getFilename() == filename ) {
-                if ( (*it)->isInvalid() ) {
-                    delete *it;
-                    found->second.erase(it);
-                    break;
-                } else {
-                    return *it;
-                }
+    std::size_t decoders = 0;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_decodersMutex);
+        for (std::size_t i = 0; i < _decoders.size(); ++i) {
+            if (_decoders[i]) {
+                ++decoders;
             }
         }
     }
 
-    FFmpegFile* file = new FFmpegFile(filename);
-    if ( found == _files.end() ) {
-        std::list<FFmpegFile*> fileList;
-        fileList.push_back(file);
-        _files.insert( make_pair(plugin, fileList) );
-    } else {
-        found->second.push_back(file);
-    }
-
-    return file;
+    // each decoder has its output buffer and its ring of decoded frames
+    return sizeof(FFmpegFile) + std::max(decoders, (std::size_t)1) * getBufferBytesCount() * (1 + _streams[0]->_decodedFramesMax);
 }
@@ -51,12 +51,15 @@ extern "C" {
 }
 #include "FFmpegCompat.h"
 
+#include "ofxsMacros.h"
 #include "ofxsMultiThread.h"
-#ifndef OFX_USE_MULTITHREAD_MUTEX
 // some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
 // prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+// (the keyframe index and the decoder pool always use the fast mutex and tinythread)
 #include "fast_mutex.h"
-#endif
+#include "tinythread.h"
+
+#include "FileHandleCache.h"
 
 #define CHECKMSG(x, msg) \
     { \
@@ -95,11 +98,29 @@ extern "C" {
 
 #define kChunkSizeKey "fn_log2chunksize"
 
+// Directory where the keyframe indexes of the video files are cached (default is the temporary directory).
+// Set it to an empty string to disable the on-disk index cache.
+#define kFFmpegIndexDirEnv "OFX_IO_FFMPEG_INDEX_DIR"
+
+// Maximum size in megabytes of the decoded frames kept by all the video streams of the process, so that stepping
+// backwards in a GOP does not decode the whole GOP again (0 disables it).
+#define kFFmpegFrameRingSizeEnv "OFX_IO_FFMPEG_FRAME_RING_MB"
+#define kFFmpegFrameRingSizeDefault 256
+#define kFFmpegFrameRingMaxFrames 64
+
+// Maximum number of decoders opened on the same file to decode frames in parallel
+// (default is the number of CPUs, up to kFFmpegDecodersDefaultMax).
+#define kFFmpegDecodersEnv "OFX_IO_FFMPEG_DECODERS"
+#define kFFmpegDecodersDefaultMax 8
+
 namespace OFX {
 class ImageEffect;
 }
 
+// An FFmpegFile is checked out from the FileHandleCache by ReadFFmpeg. It is shared by the render
+// threads, which decode frames in parallel using its decoder pool.
 class FFmpegFile
+    : public OFX::IO::FileHandleCache::Handle
 {
 public:
 #ifdef OFX_USE_MULTITHREAD_MUTEX
@@ -148,6 +169,18 @@ private:
         // since the last seek. This is part of a guard mechanism to detect when decode appears to have
         // stalled and ensure that FFmpegFile::decode() does not loop indefinitely.
 
+        // The frames most recently output by the decoder, converted to _outputPixelFormat.
+        // After a seek, the frames of the GOP that precede the desired frame are kept too, so that the following
+        // backward steps are served from memory.
+        struct DecodedFrame
+        {
+            int frame; // 0-based
+            std::vector<unsigned char> data;
+        };
+
+        std::list<DecodedFrame> _decodedFrames; // most recently used first
+        std::size_t _decodedFramesMax; // maximum number of frames in _decodedFrames
+
         Stream()
             : _idx(0)
             , _avstream(NULL)
@@ -174,6 +207,8 @@ private:
             , _decodeNextFrameIn(-1)
             , _decodeNextFrameOut(-1)
             , _accumDecodeLatency(0)
+            , _decodedFrames()
+            , _decodedFramesMax(0)
         {
             // The purpose of this is to avoid an RGB->RGB conversion.
             // This saves memory and improves performance. For example
@@ -190,6 +225,8 @@ private:
 
         ~Stream()
         {
+            clearDecodedFrames();
+
             if (_avFrame) {
                 av_free(_avFrame);
             }
@@ -255,6 +292,27 @@ private:
 
         static double GetStreamAspectRatio(Stream* stream);
 
+        bool hasDecodedFrame(int frame) const
+        {
+            for (std::list<DecodedFrame>::const_iterator it = _decodedFrames.begin(); it != _decodedFrames.end(); ++it) {
+                if (it->frame == frame) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // copy a frame from _decodedFrames to buffer, return false if it is not there
+        bool getDecodedFrame(int frame, unsigned char* buffer, std::size_t size);
+
+        // return the buffer where the given frame should be stored, reusing the least recently used one
+        // if _decodedFrames is full, or NULL if decoded frames are not kept
+        unsigned char* newDecodedFrame(int frame, std::size_t size);
+
+        // remove the decoded frames, and give their memory back to the budget shared by all the streams
+        void clearDecodedFrames();
+
         // Generate the conversion context used by SoftWareScaler if not already set.
         // |reset| forces recalculation of cached context.
         SwsContext* getConvertCtx(AVPixelFormat srcPixelFormat, int srcWidth, int srcHeight, int srcColorRange, AVPixelFormat dstPixelFormat, int dstWidth, int dstHeight);
@@ -291,6 +349,82 @@ private:
     mutable Mutex _invalidStateLock;
 #endif
 
+    // Keyframe index of the first video stream, used to seek exactly to the keyframe that precedes a frame,
+    // or to decode forward when that keyframe is before the next frame out of the decoder.
+    // It is built in a background thread when the file is opened (or read from the on-disk cache), and is
+    // not used until it is complete: until then, decode() relies on av_seek_frame() and stall detection.
+    struct IndexedKeyFrame
+    {
+        int64_t timestamp; // the PTS or the DTS, which numbers the frames
+        int64_t seekTimestamp; // the smallest of the PTS and the DTS
+    };
+
+    // compares a frame number with the frame number of a keyframe, for std::upper_bound()
+    struct FrameBeforeKeyFrame
+    {
+        const Stream* stream;
+
+        bool operator()(int frame, const IndexedKeyFrame& keyFrame) const
+        {
+            return frame < stream->ptsToFrame(keyFrame.timestamp);
+        }
+    };
+
+    std::vector<IndexedKeyFrame> _keyFramesByPts; // sorted by PTS, used if the frames are numbered by their PTS
+    std::vector<IndexedKeyFrame> _keyFramesByDts; // sorted by DTS, used if the frames are numbered by their DTS
+    bool _keyFramesReady;
+    volatile bool _abortIndexing;
+    tthread::thread* _indexThread;
+    mutable tthread::fast_mutex _keyFramesLock;
+
+    static void indexThreadFunction(void* arg);
+
+    static bool keyFrameTimestampLess(const IndexedKeyFrame& a, const IndexedKeyFrame& b);
+
+    // read the packets of the first video stream without decoding them and record its keyframes
+    void buildFrameIndex();
+
+    // find the last indexed keyframe at or before frame, and the timestamp to pass to av_seek_frame() to land on it
+    bool findKeyFrame(const Stream* stream, int frame, int* keyFrame, int64_t* seekTimestamp) const;
+
+    // Decoder pool: decode() is not serialized by a lock on the file, but uses one of several decoders,
+    // each being another FFmpegFile opened on the same file (with its own demuxer and codec contexts),
+    // and used by one thread at a time. The pool grows up to _maxDecoders when all decoders are busy or
+    // would have to seek, and each frame is decoded by the idle decoder whose position is closest to it.
+    // The keyframe index of the primary file is shared by all the decoders of its pool.
+    FFmpegFile* _primary; // the file that owns the pool of this decoder, or NULL if this is the primary file
+    std::vector<FFmpegFile*> _decoders; // the pool, starting with the primary file itself (NULL if a decoder failed to open)
+    std::vector<bool> _decoderBusy;
+    std::size_t _maxDecoders;
+    mutable tthread::mutex _decodersMutex;
+    tthread::condition_variable _decoderAvailable;
+
+    // the settings of the first video stream, set on the primary file and applied to a decoder when it is
+    // acquired, so that the streams of the decoders are only modified by the thread that uses them
+    struct DecoderSettings
+    {
+        int colorMatrixTypeOverride; // 0 means no override (default)
+        bool doNotAttachPrefix;
+        bool matchMetaFormat;
+    };
+
+    mutable DecoderSettings _decoderSettings; // protected by _decodersMutex
+
+    // constructor of the decoders of the pool
+    FFmpegFile(const std::string& filename, FFmpegFile* primary);
+
+    void open();
+
+    FFmpegFile* acquireDecoder(int frame);
+
+    void releaseDecoder(FFmpegFile* decoder);
+
+    // the cost of decoding frame (0-based) with this decoder, from its current position
+    int getDecodeCost(int frame) const;
+
+    // decode a single frame into the buffer (stream 0), not thread safe
+    bool decodeFrame(const OFX::ImageEffect* plugin, int frame, bool loadNearest, int maxRetries, unsigned char* buffer);
+
     // set reader error
     void setError(const char* msg, const char* prefix = 0);
 
@@ -312,6 +446,9 @@ private:
 
     bool seekFrame(int frame, Stream* stream);
 
+    // convert the frame output by the decoder to the stream output pixel format
+    void convertFrame(Stream* stream, int srcColourRange, unsigned char* buffer);
+
 public:
 
     //FFmpegFile();
@@ -320,7 +457,14 @@ public:
     FFmpegFile(const std::string& filename);
 
     // destructor
-    ~FFmpegFile();
+    virtual ~FFmpegFile();
+
+    // FileHandleCache::Handle: the output buffers and the decoded frames kept by the decoders
+    virtual std::size_t getMemorySize() const OVERRIDE FINAL;
+
+    virtual bool isShareable() const OVERRIDE FINAL { return true; }
+
+    virtual bool isValid() const OVERRIDE FINAL { return !isInvalid(); }
 
     const std::string& getFilename() const
     {
@@ -341,36 +485,24 @@ public:
 
     void setColorMatrixTypeOverride(int colorMatrixType) const
     {
-        if ( _streams.empty() ) {
-            return;
-        }
+        // applied to each decoder of the pool by acquireDecoder(), by the thread that uses it
+        tthread::lock_guard<tthread::mutex> l(_decodersMutex);
 
-        // mov64Reader::decode always uses stream 0
-        Stream* stream = _streams[0];
-        stream->_colorMatrixTypeOverride = colorMatrixType;
-        stream->_resetConvertCtx = true;
+        _decoderSettings.colorMatrixTypeOverride = colorMatrixType;
     }
 
     void setDoNotAttachPrefix(bool doNotAttachPrefix) const
     {
-        if ( _streams.empty() ) {
-            return;
-        }
+        tthread::lock_guard<tthread::mutex> l(_decodersMutex);
 
-        // mov64Reader::decode always uses stream 0
-        Stream* stream = _streams[0];
-        stream->_doNotAttachPrefix = doNotAttachPrefix;
+        _decoderSettings.doNotAttachPrefix = doNotAttachPrefix;
     }
 
     void setMatchMetaFormat(bool matchMetaFormat) const
     {
-        if ( _streams.empty() ) {
-            return;
-        }
+        tthread::lock_guard<tthread::mutex> l(_decodersMutex);
 
-        // mov64Reader::decode always uses stream 0
-        Stream* stream = _streams[0];
-        stream->_matchMetaFormat = matchMetaFormat;
+        _decoderSettings.matchMetaFormat = matchMetaFormat;
     }
 
     bool isRec709Format() const
@@ -489,26 +621,4 @@ public:
 };
 
 
-class FFmpegFileManager
-{
-    ///For each plug-in instance, a list of opened files
-    typedef std::map<void const *, std::list<FFmpegFile*> > FilesMap;
-    mutable FilesMap _files;
-    mutable FFmpegFile::Mutex* _lock;
-
-public:
-
-    FFmpegFileManager();
-
-    ~FFmpegFileManager();
-
-    void init();
-
-    void clear(void const * plugin);
-
-    FFmpegFile* get(void const * plugin, const std::string &filename) const;
-    FFmpegFile* getOrCreate(void const * plugin, const std::string &filename) const;
-};
-
-
 #endif /* defined(__Io__FFmpegHandler__) */
@@ -84,12 +84,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 class ReadFFmpegPlugin
     : public GenericReaderPlugin
 {
-    FFmpegFileManager& _manager;
     IntParam *_maxRetries;
 
 public:
 
-    ReadFFmpegPlugin(FFmpegFileManager& manager, OfxImageEffectHandle handle, const vector<string>& extensions);
+    ReadFFmpegPlugin(OfxImageEffectHandle handle, const vector<string>& extensions);
 
     virtual ~ReadFFmpegPlugin();
 
@@ -134,13 +133,23 @@ private:
     virtual bool getSequenceTimeDomain(const string& filename, OfxRangeI &range) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, string *error, int* tile_width, int* tile_height) OVERRIDE FINAL;
     virtual bool getFrameRate(const string& filename, double* fps) const OVERRIDE FINAL;
+    virtual void clearAnyCache() OVERRIDE FINAL;
 };
 
-ReadFFmpegPlugin::ReadFFmpegPlugin(FFmpegFileManager& manager,
-                                   OfxImageEffectHandle handle,
+// The files opened by an instance are checked out from the FileHandleCache with the instance as owner,
+// so that they are closed when the instance is destroyed or reads another file.
+static FileHandleCache::Handle*
+createFile(const string& filename,
+           void* /*arg*/)
+{
+    return new FFmpegFile(filename);
+}
+
+typedef FileHandleCache::Checkout<FFmpegFile> FFmpegFileCheckout;
+
+ReadFFmpegPlugin::ReadFFmpegPlugin(OfxImageEffectHandle handle,
                                    const vector<string>& extensions)
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
-    , _manager(manager)
     , _maxRetries(NULL)
 {
     _maxRetries = fetchIntParam(kParamMaxRetries);
@@ -158,6 +167,13 @@ ReadFFmpegPlugin::ReadFFmpegPlugin(FFmpegFileManager& manager,
 
 ReadFFmpegPlugin::~ReadFFmpegPlugin()
 {
+    FileHandleCache::instance().purge(this);
+}
+
+void
+ReadFFmpegPlugin::clearAnyCache()
+{
+    FileHandleCache::instance().purge(this);
 }
 
 /**
@@ -171,7 +187,6 @@ void
 ReadFFmpegPlugin::restoreStateFromParams()
 {
     GenericReaderPlugin::restoreStateFromParams();
-    //_manager.getOrCreate(this, filename);
 }
 
 bool
@@ -253,15 +268,12 @@ ReadFFmpegPlugin::guessParamsFromFilename(const string& filename,
                                           int *componentCount)
 {
     assert(colorspace && filePremult && components && componentCount);
-    FFmpegFile* file = _manager.get(this, filename);
-    if (!file) {
-        //Clear all opened files by this plug-in since the user changed the selected file/sequence
-        _manager.clear(this);
-        file = _manager.getOrCreate(this, filename);
-    }
+    //Close all files opened by this plug-in since the user changed the selected file/sequence
+    FileHandleCache::instance().purge(this);
+    FFmpegFileCheckout file(this, filename, createFile, NULL);
 
-    if ( !file || file->isInvalid() ) {
-        if (file) {
+    if ( !file.get() || file->isInvalid() ) {
+        if ( file.get() ) {
             //setPersistentMessage(Message::eMessageError, "", file->getError());
         } else {
             //setPersistentMessage(Message::eMessageError, "", "Cannot open file.");
@@ -322,9 +334,9 @@ ReadFFmpegPlugin::decode(const string& filename,
                          int pixelComponentCount,
                          int rowBytes)
 {
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFileCheckout file(this, filename, createFile, NULL);
 
-    if ( file && file->isInvalid() ) {
+    if ( file.get() && file->isInvalid() ) {
         setPersistentMessage( Message::eMessageError, "", file->getError() );
 
         return;
@@ -342,7 +354,7 @@ ReadFFmpegPlugin::decode(const string& filename,
     assert( (pixelComponents == ePixelComponentRGB && pixelComponentCount == 3) || (pixelComponents == ePixelComponentRGBA && pixelComponentCount == 4) || (pixelComponents == ePixelComponentAlpha && pixelComponentCount == 1) );
 
     ///blindly ignore the filename, we suppose that the file is the same than the file loaded in the changedParam
-    if (!file) {
+    if ( !file.get() ) {
         setPersistentMessage(Message::eMessageError, "", filename +  ": Missing frame");
         throwSuiteStatusException(kOfxStatFailed);
 
@@ -430,8 +442,8 @@ ReadFFmpegPlugin::getSequenceTimeDomain(const string& filename,
 
     int width, height, frames;
     double ap;
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
-    if ( !file || file->isInvalid() ) {
+    FFmpegFileCheckout file(this, filename, createFile, NULL);
+    if ( !file.get() || file->isInvalid() ) {
         range.min = range.max = 0.;
 
         return false;
@@ -450,8 +462,8 @@ ReadFFmpegPlugin::getFrameRate(const string& filename,
 {
     assert(fps);
 
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
-    if ( !file || file->isInvalid() ) {
+    FFmpegFileCheckout file(this, filename, createFile, NULL);
+    if ( !file.get() || file->isInvalid() ) {
         return false;
     }
 
@@ -471,9 +483,9 @@ ReadFFmpegPlugin::getFrameBounds(const string& filename,
                                  int* tile_height)
 {
     assert(bounds && par);
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
-    if ( !file || file->isInvalid() ) {
-        if (error && file) {
+    FFmpegFileCheckout file(this, filename, createFile, NULL);
+    if ( !file.get() || file->isInvalid() ) {
+        if ( error && file.get() ) {
             *error = file->getError();
         }
 
@@ -501,21 +513,18 @@ ReadFFmpegPlugin::getFrameBounds(const string& filename,
 class ReadFFmpegPluginFactory
     : public PluginFactoryHelper<ReadFFmpegPluginFactory>
 {
-    auto_ptr<FFmpegFileManager> _manager;
-
 public:
     ReadFFmpegPluginFactory(const string& id,
                             unsigned int verMaj,
                             unsigned int verMin)
         : PluginFactoryHelper<ReadFFmpegPluginFactory>(id, verMaj, verMin)
-        , _manager()
     {}
 
     virtual void load() OVERRIDE FINAL;
     virtual void unload() OVERRIDE FINAL
     {
-        _manager.reset(NULL);
         _extensions.clear();
+        GenericReaderUnload();
     }
 
     virtual ImageEffect* createInstance(OfxImageEffectHandle handle, ContextEnum context) OVERRIDE FINAL;
@@ -953,9 +962,6 @@ ReadFFmpegPluginFactory::describe(ImageEffectDescriptor &desc)
     avcodec_register_all();
     av_register_all();
 
-    _manager.reset(new FFmpegFileManager);
-    _manager->init();
-
     // Thus effect prefers sequential render, but will still give correct results otherwise
     desc.getPropertySet().propSetInt(kOfxImageEffectInstancePropSequentialRender, 2, false);
 }
@@ -998,7 +1004,7 @@ ImageEffect*
 ReadFFmpegPluginFactory::createInstance(OfxImageEffectHandle handle,
                                         ContextEnum /*context*/)
 {
-    ReadFFmpegPlugin* ret =  new ReadFFmpegPlugin(*_manager, handle, _extensions);
+    ReadFFmpegPlugin* ret =  new ReadFFmpegPlugin(handle, _extensions);
 
     ret->restoreStateFromParams();
 
@@ -36,11 +36,13 @@
 #endif
 
 #include <cstdio>
+#include <cstdlib> // getenv, strtol
 #include <cstring> // strncpy
 #include <cfloat> // DBL_MAX
 #include <climits> // INT_MAX
 #include <sstream>
 #include <algorithm>
+#include <map>
 #include <string>
 #include <cctype> // ::tolower
 #ifdef DEBUG
@@ -99,20 +101,9 @@ extern "C" {
 #endif
 
 #include "ofxsMultiThread.h"
-#ifdef OFX_USE_MULTITHREAD_MUTEX
-namespace {
-typedef OFX::MultiThread::Mutex Mutex;
-typedef OFX::MultiThread::AutoMutex AutoMutex;
-}
-#else
-// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
-// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
-#include "fast_mutex.h"
-namespace {
-typedef tthread::fast_mutex Mutex;
-typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
-}
-#endif
+// the reorder buffer needs condition variables, which the MT-Suite does not have:
+// use the threads by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "tinythread.h"
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -168,6 +159,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSupportsAlpha false
 #define kSupportsXY false
 
+// Maximum number of frames the reorder buffer may hold ahead of the next frame to encode.
+// Frames rendered further ahead wait until the encoder catches up.
+// Defaults to the number of CPUs.
+#define kWriteFFmpegReorderFramesEnv "OFX_IO_FFMPEG_REORDER_FRAMES"
+
 #define kParamFormat "format"
 #define kParamFormatLabel "Container"
 #define kParamFormatHint "Output format/container."
@@ -1287,6 +1283,15 @@ private:
     int writeAudio(AVFormatContext* avFormatContext, AVStream* avStream, bool flush);
     int writeVideo(AVFormatContext* avFormatContext, AVStream* avStream, bool flush, double time, const float *pixelData = NULL, const OfxRectI* bounds = NULL, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
     int writeToFile(AVFormatContext* avFormatContext, bool finalise, double time, const float *pixelData = NULL, const OfxRectI* bounds = NULL, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
+    AVFrame* convertFrame(AVCodecContext* avCodecContext, const float *pixelData, int pixelDataNComps, int rowBytes);
+    int encodeFrame(AVFormatContext* avFormatContext, AVStream* avStream, AVFrame* avFrame, bool flush, double time, string* errorMessage);
+    static void freeFrame(AVFrame* avFrame);
+
+    // the reorder buffer: encode() converts frames in parallel and queues them,
+    // and the mux thread feeds them to the encoder in presentation order.
+    static void muxThreadFunction(void* arg);
+    void muxFrames();
+    void stopMuxThread();
 
     int colourSpaceConvert(MyAVPicture* avPicture, AVFrame* avFrame, AVPixelFormat srcPixelFormat, AVPixelFormat dstPixelFormat, AVCodecContext* avCodecContext);
 
@@ -1312,8 +1317,15 @@ private:
     AVStream* _streamVideo;
     AVStream* _streamAudio;
     AVStream* _streamTimecode;
-    Mutex _nextFrameToEncodeMutex;
+    tthread::mutex _nextFrameToEncodeMutex; //< protects _nextFrameToEncode and the reorder buffer
+    tthread::condition_variable _frameQueued; //< signaled when a frame is added to the reorder buffer, or when muxing must stop
+    tthread::condition_variable _frameEncoded; //< signaled when _nextFrameToEncode changes
     int _nextFrameToEncode; //< the frame index we need to encode next, INT_MIN means uninitialized
+    std::map<int, AVFrame*> _queuedFrames; //< converted frames waiting to be encoded, by frame index
+    unsigned int _maxQueuedFrames; //< how far ahead of _nextFrameToEncode a frame may be queued
+    tthread::thread* _muxThread;
+    bool _stopMuxing;
+    string _muxError; //< error reported by the mux thread, reported to the host by the next call to encode() or endEncode()
     int _firstFrameToEncode;
     int _lastFrameToEncode;
     int _frameStep;
@@ -1349,9 +1361,9 @@ private:
     ChoiceParam* _mbDecision;
 #endif
 
-    // Used in writeVideo as a contiguous buffer. The size of the buffer remains throughout
-    // the encoding of the whole video. Since the plug-in is instanceSafe, we do not need to lock it
-    // since 2 renders will never use it at the same time.
+    // Used in encodeFrame as a contiguous buffer. The size of the buffer remains throughout
+    // the encoding of the whole video. We do not need to lock it, since it is only used
+    // by the mux thread, and by endEncode once the mux thread has stopped.
     // We do not use a vector<uint8_t> here because of unnecessary initialization
     // http://stackoverflow.com/questions/17347254/why-is-allocation-and-deallocation-of-stdvector-slower-than-dynamic-array-on-m
     uint8_t* _scratchBuffer;
@@ -1590,7 +1602,14 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
     , _streamAudio(NULL)
     , _streamTimecode(NULL)
     , _nextFrameToEncodeMutex()
+    , _frameQueued()
+    , _frameEncoded()
     , _nextFrameToEncode(INT_MIN)
+    , _queuedFrames()
+    , _maxQueuedFrames(1)
+    , _muxThread(NULL)
+    , _stopMuxing(false)
+    , _muxError()
     , _firstFrameToEncode(1)
     , _lastFrameToEncode(1)
     , _frameStep(1)
@@ -1666,6 +1685,7 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
 
 WriteFFmpegPlugin::~WriteFFmpegPlugin()
 {
+    stopMuxThread();
     delete [] _scratchBuffer;
     _scratchBufferSize = 0;
 }
@@ -3507,6 +3527,8 @@ WriteFFmpegPlugin::colourSpaceConvert(MyAVPicture* avPicture,
               height,
               avFrame->data, // dst
               avFrame->linesize); // dst rowbytes
+    // the context was allocated above, it is not cached between frames
+    sws_freeContext(convertCtx);
 
     return ret;
 }
@@ -3567,217 +3589,271 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
     if ( !avFormatContext || ( !flush && (!pixelData || !bounds) ) ) {
         return -7;
     }
-    int ret = 0;
-    // First convert from Nuke floating point RGB to either 16-bit or 8-bit RGB.
-    // Create a buffer to hold either  16-bit or 8-bit RGB.
     AVCodecContext* avCodecContext = avStream->codec;
     assert(avCodecContext);
     if (!avCodecContext) {
         return -8;
     }
-    // Create another buffer to convert from either 16-bit or 8-bit RGB
-    // to the input pixel format required by the encoder.
-    AVPixelFormat pixelFormatCodec = avCodecContext->pix_fmt;
-    int width = _rodPixel.x2 - _rodPixel.x1;
-    int height = _rodPixel.y2 - _rodPixel.y1;
-    MyAVPicture avPicture;
     AVFrame* avFrame = NULL;
 
     if (!flush) {
         assert(pixelData && bounds);
         assert(bounds->x1 == _rodPixel.x1 && bounds->x2 == _rodPixel.x2 &&
                bounds->y1 == _rodPixel.y1 && bounds->y2 == _rodPixel.y2);
+        avFrame = convertFrame(avCodecContext, pixelData, pixelDataNComps, rowBytes);
+        if (!avFrame) {
+            return -1;
+        }
+    }
 
-        const bool hasAlpha = alphaEnabled();
-        AVPixelFormat pixelFormatNuke;
-        if (hasAlpha) {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
-        } else {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48 : AV_PIX_FMT_RGB24;
-        }
-
-        ret = avPicture.alloc(width, height, pixelFormatNuke);
-        if (!ret) {
-            // Convert floating point values to unsigned values.
-            assert(rowBytes && rowBytes >= (int)sizeof(float) * width * pixelDataNComps);
-            const int numDestChannels = hasAlpha ? 4 : 3;
-
-            for (int y = 0; y < height; ++y) {
-                int srcY = height - 1 - y;
-                const float* src_pixels = (float*)( (char*)pixelData + srcY * rowBytes );
-
-                if (avCodecContext->bits_per_raw_sample > 8) {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA64 || pixelFormatNuke == AV_PIX_FMT_RGB48);
-
-                    // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
-                    assert(avPicture.linesize[0] / 2 >= width * numDestChannels);
-                    unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(avPicture.data[0]) + y * (avPicture.linesize[0] / 2);
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<65536>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
-                        }
-                    }
-                } else {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA || pixelFormatNuke == AV_PIX_FMT_RGB24);
-
-                    assert(avPicture.linesize[0] >= width * numDestChannels);
-                    unsigned char* dst_pixels = avPicture.data[0] + y * avPicture.linesize[0];
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<256>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
-                        }
-                    }
+    string errorMessage;
+    int ret = encodeFrame(avFormatContext, avStream, avFrame, flush, time, &errorMessage);
+    if ( !errorMessage.empty() ) {
+        setPersistentMessage(Message::eMessageError, "", errorMessage);
+    }
+    freeFrame(avFrame);
+
+    return ret;
+} // WriteFFmpegPlugin::writeVideo
+
+////////////////////////////////////////////////////////////////////////////////
+// convertFrame
+//
+// Convert Nuke float RGB values to a newly allocated frame in the pixel format
+// of the encoder.
+// This only reads the codec context, so that several frames may be converted
+// concurrently while another thread is encoding.
+//
+// @return the frame, to be released with freeFrame(), or NULL on failure.
+//
+AVFrame*
+WriteFFmpegPlugin::convertFrame(AVCodecContext* avCodecContext,
+                                const float *pixelData,
+                                int pixelDataNComps,
+                                int rowBytes)
+{
+    // First convert from Nuke floating point RGB to either 16-bit or 8-bit RGB.
+    // Create a buffer to hold either  16-bit or 8-bit RGB.
+    // Create another buffer to convert from either 16-bit or 8-bit RGB
+    // to the input pixel format required by the encoder.
+    AVPixelFormat pixelFormatCodec = avCodecContext->pix_fmt;
+    int width = _rodPixel.x2 - _rodPixel.x1;
+    int height = _rodPixel.y2 - _rodPixel.y1;
+    MyAVPicture avPicture;
+    const bool hasAlpha = alphaEnabled();
+    AVPixelFormat pixelFormatNuke;
+    if (hasAlpha) {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
+    } else {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48 : AV_PIX_FMT_RGB24;
+    }
+
+    if ( avPicture.alloc(width, height, pixelFormatNuke) ) {
+        return NULL;
+    }
+    // Convert floating point values to unsigned values.
+    assert(rowBytes && rowBytes >= (int)sizeof(float) * width * pixelDataNComps);
+    const int numDestChannels = hasAlpha ? 4 : 3;
+
+    for (int y = 0; y < height; ++y) {
+        int srcY = height - 1 - y;
+        const float* src_pixels = (float*)( (char*)pixelData + srcY * rowBytes );
+
+        if (avCodecContext->bits_per_raw_sample > 8) {
+            assert(pixelFormatNuke == AV_PIX_FMT_RGBA64 || pixelFormatNuke == AV_PIX_FMT_RGB48);
+
+            // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
+            assert(avPicture.linesize[0] / 2 >= width * numDestChannels);
+            unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(avPicture.data[0]) + y * (avPicture.linesize[0] / 2);
+
+            for (int x = 0; x < width; ++x) {
+                int srcCol = x * pixelDataNComps;
+                int dstCol = x * numDestChannels;
+                dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
+                dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
+                dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
+                if (hasAlpha) {
+                    dst_pixels[dstCol + 3] = floatToInt<65536>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
                 }
             }
-
-            avFrame = av_frame_alloc(); // Create an AVFrame structure and initialise to zero.
-            assert(avFrame);
-            if (!avFrame) {
-                ret = -1;
-            } else {
-                // For any codec an
-                // intermediate buffer is allocated for the
-                // colour space conversion.
-                int bufferSize = av_image_alloc(avFrame->data, avFrame->linesize, avCodecContext->width, avCodecContext->height, pixelFormatCodec, 1);
-                if (bufferSize > 0) {
-                    // Set the frame fields for a video buffer as some
-                    // encoders rely on them, e.g. Lossless JPEG.
-                    avFrame->width = avCodecContext->width;
-                    avFrame->height = avCodecContext->height;
-                    avFrame->format = pixelFormatCodec;
-
-                    colourSpaceConvert(&avPicture, avFrame, pixelFormatNuke, pixelFormatCodec, avCodecContext);
-
-                    // see ffmpeg.c:1199 from ffmpeg 3.2.2
-                    // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
-                    avFrame->quality = avCodecContext->global_quality;
-                    avFrame->pict_type = AV_PICTURE_TYPE_NONE;
-                } else {
-                    // av_image_alloc failed.
-                    ret = -1;
+        } else {
+            assert(pixelFormatNuke == AV_PIX_FMT_RGBA || pixelFormatNuke == AV_PIX_FMT_RGB24);
+
+            assert(avPicture.linesize[0] >= width * numDestChannels);
+            unsigned char* dst_pixels = avPicture.data[0] + y * avPicture.linesize[0];
+
+            for (int x = 0; x < width; ++x) {
+                int srcCol = x * pixelDataNComps;
+                int dstCol = x * numDestChannels;
+                dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
+                dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
+                dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
+                if (hasAlpha) {
+                    dst_pixels[dstCol + 3] = floatToInt<256>( (pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1. );
                 }
             }
         }
     }
 
-    if (!ret) {
-        bool error = false;
-        if (avFrame) {
-            //avFrame->pts = AV_NOPTS_VALUE; // let ffmpeg guess the pts
-            avFrame->pts = ( (int)time - _firstFrameToEncode );
-            av_frame_set_pkt_duration(avFrame, 1);
+    AVFrame* avFrame = av_frame_alloc(); // Create an AVFrame structure and initialise to zero.
+    assert(avFrame);
+    if (!avFrame) {
+        return NULL;
+    }
+    // For any codec an
+    // intermediate buffer is allocated for the
+    // colour space conversion.
+    int bufferSize = av_image_alloc(avFrame->data, avFrame->linesize, avCodecContext->width, avCodecContext->height, pixelFormatCodec, 1);
+    if (bufferSize <= 0) {
+        // av_image_alloc failed.
+        av_frame_free(&avFrame);
+
+        return NULL;
+    }
+    // Set the frame fields for a video buffer as some
+    // encoders rely on them, e.g. Lossless JPEG.
+    avFrame->width = avCodecContext->width;
+    avFrame->height = avCodecContext->height;
+    avFrame->format = pixelFormatCodec;
+
+    colourSpaceConvert(&avPicture, avFrame, pixelFormatNuke, pixelFormatCodec, avCodecContext);
+
+    // see ffmpeg.c:1199 from ffmpeg 3.2.2
+    // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
+    avFrame->quality = avCodecContext->global_quality;
+    avFrame->pict_type = AV_PICTURE_TYPE_NONE;
+
+    return avFrame;
+} // WriteFFmpegPlugin::convertFrame
+
+// Release a frame allocated by convertFrame().
+void
+WriteFFmpegPlugin::freeFrame(AVFrame* avFrame)
+{
+    if (avFrame) {
+        // the image buffer was allocated by av_image_alloc()
+        av_freep(avFrame->data);
+        av_frame_free(&avFrame);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// encodeFrame
+//
+// Encode a frame converted by convertFrame() and write the resulting packet
+// to the file. This does not call any OFX suite function, so that it may be
+// called from the mux thread: errors are returned in |errorMessage|.
+//
+// @param avFrame The frame to encode, or NULL if |flush| is true.
+//
+// @return 0 if successful,
+//         -10 if |flush| is true and the encoder has no more packets,
+//         <0 otherwise.
+//
+int
+WriteFFmpegPlugin::encodeFrame(AVFormatContext* avFormatContext,
+                               AVStream* avStream,
+                               AVFrame* avFrame,
+                               bool flush,
+                               double time,
+                               string* errorMessage)
+{
+    AVCodecContext* avCodecContext = avStream->codec;
+    int ret = 0;
+    bool error = false;
+
+    if (avFrame) {
+        //avFrame->pts = AV_NOPTS_VALUE; // let ffmpeg guess the pts
+        avFrame->pts = ( (int)time - _firstFrameToEncode );
+        av_frame_set_pkt_duration(avFrame, 1);
+    }
+    if ( (avFormatContext->oformat->flags & AVFMT_RAWPICTURE) != 0 &&
+         avCodecContext->codec->id == AV_CODEC_ID_RAWVIDEO ) {
+        // see ffmpeg.c:1168 in ffmpeg 3.2.2
+        /* raw pictures are written as AVPicture structure to
+           avoid any copies. We support temporarily the older
+           method. */
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.flags |= AV_PKT_FLAG_KEY;
+        pkt.stream_index = avStream->index;
+        pkt.data = avFrame ? avFrame->data[0] : NULL;
+        pkt.size = sizeof(AVPicture);
+        pkt.pts  = pkt.dts  = time - _firstFrameToEncode;
+        const int writeResult = av_write_frame(avFormatContext, &pkt);
+        const bool writeSucceeded = (writeResult == 0);
+        if (!writeSucceeded) {
+            error = true;
         }
-        if ( (avFormatContext->oformat->flags & AVFMT_RAWPICTURE) != 0 &&
-              avCodecContext->codec->id == AV_CODEC_ID_RAWVIDEO ) {
-            // see ffmpeg.c:1168 in ffmpeg 3.2.2
-            /* raw pictures are written as AVPicture structure to
-             avoid any copies. We support temporarily the older
-             method. */
-            AVPacket pkt;
-            av_init_packet(&pkt);
-            pkt.flags |= AV_PKT_FLAG_KEY;
-            pkt.stream_index = avStream->index;
-            pkt.data = avFrame ? avFrame->data[0] : NULL;
-            pkt.size = sizeof(AVPicture);
-            pkt.pts  = pkt.dts  = time - _firstFrameToEncode;
-            const int writeResult = av_write_frame(avFormatContext, &pkt);
-            const bool writeSucceeded = (writeResult == 0);
-            if (!writeSucceeded) {
-                error = true;
-            }
+    } else {
+        // Use a contiguous block of memory. This is to scope the
+        // buffer allocation and ensure that memory is released even
+        // if errors or exceptions occur. A vector will allocate
+        // contiguous memory.
+
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        // NOTE: If |flush| is true, then avFrame will be NULL at this point as
+        //       alloc will not have been called.
+        pkt.stream_index = avStream->index;
+        pkt.data = &_scratchBuffer[0];
+        pkt.size = _scratchBufferSize;
+        // Encode a frame of video.
+        //
+        // Note that the uncompressed source frame to be encoded must be in an
+        // appropriate pixel format for the encoder prior to calling this method as
+        // this method does NOT perform an pixel format conversion, e.g. through using
+        // Sws_xxx.
+        int got_packet = 0;
+        int encodeResult = avcodec_encode_video2(avCodecContext, &pkt, avFrame, &got_packet);
+        // coded_frame is deprecated
+        // see https://ffmpeg.org/pipermail/ffmpeg-cvslog/2015-July/092046.html
+        //if (avCodecContext->coded_frame && !ret && got_packet) {
+        //    avCodecContext->coded_frame->pts = pkt.pts;
+        //    avCodecContext->coded_frame->key_frame = !!(pkt.flags & AV_PKT_FLAG_KEY);
+        //}
+        if (encodeResult < 0) {
+            // Report the error.
+            char szError[1024] = { 0 };
+            av_strerror( encodeResult, szError, sizeof(szError) );
+            *errorMessage = string("Cannot encode frame: ") + szError;
+            error = true;
         } else {
-            // Use a contiguous block of memory. This is to scope the
-            // buffer allocation and ensure that memory is released even
-            // if errors or exceptions occur. A vector will allocate
-            // contiguous memory.
-
-            AVPacket pkt;
-            av_init_packet(&pkt);
-            // NOTE: If |flush| is true, then avFrame will be NULL at this point as
-            //       alloc will not have been called.
-            pkt.stream_index = avStream->index;
-            pkt.data = &_scratchBuffer[0];
-            pkt.size = _scratchBufferSize;
-            // Encode a frame of video.
-            //
-            // Note that the uncompressed source frame to be encoded must be in an
-            // appropriate pixel format for the encoder prior to calling this method as
-            // this method does NOT perform an pixel format conversion, e.g. through using
-            // Sws_xxx.
-            int got_packet = 0;
-            int encodeResult = avcodec_encode_video2(avCodecContext, &pkt, avFrame, &got_packet);
-            // coded_frame is deprecated
-            // see https://ffmpeg.org/pipermail/ffmpeg-cvslog/2015-July/092046.html
-            //if (avCodecContext->coded_frame && !ret && got_packet) {
-            //    avCodecContext->coded_frame->pts = pkt.pts;
-            //    avCodecContext->coded_frame->key_frame = !!(pkt.flags & AV_PKT_FLAG_KEY);
-            //}
-            if (encodeResult < 0) {
-                // Report the error.
-                char szError[1024] = { 0 };
-                av_strerror( encodeResult, szError, sizeof(szError) );
-                setPersistentMessage(Message::eMessageError, "", string("Cannot encode frame: ") + szError);
-                error = true;
-            } else {
-                if (flush && !got_packet) {
-                    // Flag that the flush is complete.
-                    ret = -10;
-                }
-                if (got_packet) {
-                    // codecs with AV_CODEC_CAP_DELAY (e.g. png with multithreading) may not return a packet although encoding was successful
-                    // coded_frame is deprecated
-                    // see https://ffmpeg.org/pipermail/ffmpeg-cvslog/2015-July/092046.html
-                    //if (avCodecContext->coded_frame && (avCodecContext->coded_frame->pts != AV_NOPTS_VALUE))
-                    //    //pkt.pts = av_rescale_q(avCodecContext->coded_frame->pts, avCodecContext->time_base, avStream->time_base);
-                    //    pkt.pts = avCodecContext->coded_frame->pts;
-                    //    av_packet_rescale_ts(&pkt, avCodecContext->time_base, avStream->time_base);
-                    //if (avCodecContext->coded_frame && avCodecContext->coded_frame->key_frame)
-                    //    pkt.flags |= AV_PKT_FLAG_KEY;
-                    av_packet_rescale_ts(&pkt, avCodecContext->time_base, avStream->time_base);
-
-                    const int writeResult = av_write_frame(avFormatContext, &pkt);
-                    const bool writeSucceeded = (writeResult == 0);
-                    if (!writeSucceeded) {
-                        // Report the error.
-                        char szError[1024] = { 0 };
-                        av_strerror( writeResult, szError, sizeof(szError) );
-                        setPersistentMessage(Message::eMessageError, "", string("Cannot write frame: ") + szError);
-                        error = true;
-                    }
+            if (flush && !got_packet) {
+                // Flag that the flush is complete.
+                ret = -10;
+            }
+            if (got_packet) {
+                // codecs with AV_CODEC_CAP_DELAY (e.g. png with multithreading) may not return a packet although encoding was successful
+                // coded_frame is deprecated
+                // see https://ffmpeg.org/pipermail/ffmpeg-cvslog/2015-July/092046.html
+                //if (avCodecContext->coded_frame && (avCodecContext->coded_frame->pts != AV_NOPTS_VALUE))
+                //    //pkt.pts = av_rescale_q(avCodecContext->coded_frame->pts, avCodecContext->time_base, avStream->time_base);
+                //    pkt.pts = avCodecContext->coded_frame->pts;
+                //    av_packet_rescale_ts(&pkt, avCodecContext->time_base, avStream->time_base);
+                //if (avCodecContext->coded_frame && avCodecContext->coded_frame->key_frame)
+                //    pkt.flags |= AV_PKT_FLAG_KEY;
+                av_packet_rescale_ts(&pkt, avCodecContext->time_base, avStream->time_base);
+
+                const int writeResult = av_write_frame(avFormatContext, &pkt);
+                const bool writeSucceeded = (writeResult == 0);
+                if (!writeSucceeded) {
+                    // Report the error.
+                    char szError[1024] = { 0 };
+                    av_strerror( writeResult, szError, sizeof(szError) );
+                    *errorMessage = string("Cannot write frame: ") + szError;
+                    error = true;
                 }
             }
         }
-        if (error) {
-            av_log(avCodecContext, AV_LOG_ERROR, "error writing frame to file\n");
-            ret = -2;
-        }
     }
-
-    // If the source frame buffer address is not the
-    // same as the output buffer address, assume that
-    // an intermediate buffer was allocated above and
-    // must now be released.
-    if (avFrame) {
-        if (avFrame->data[0] != avPicture.data[0]) {
-            av_freep(avFrame->data);
-        }
-        av_frame_free(&avFrame);
+    if (error) {
+        av_log(avCodecContext, AV_LOG_ERROR, "error writing frame to file\n");
+        ret = -2;
     }
 
     return ret;
-} // WriteFFmpegPlugin::writeVideo
+} // WriteFFmpegPlugin::encodeFrame
 
 ////////////////////////////////////////////////////////////////////////////////
 // writeToFile
@@ -4336,29 +4412,32 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
 
     // Flag that we didn't encode any frame yet
     {
-        AutoMutex lock(_nextFrameToEncodeMutex);
+        tthread::lock_guard<tthread::mutex> lock(_nextFrameToEncodeMutex);
         _nextFrameToEncode = (int)args.frameRange.min;
         _firstFrameToEncode = (int)args.frameRange.min;
         _lastFrameToEncode = (int)args.frameRange.max;
-        _frameStep = (int)args.frameStep;
+        _frameStep = std::max(1, (int)args.frameStep);
+        _muxError.clear();
+        _stopMuxing = false;
+
+        // frames rendered too far ahead of the encoder wait until it catches up
+        int maxQueuedFrames = std::min( (int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS );
+        const char* reorderFramesEnv = std::getenv(kWriteFFmpegReorderFramesEnv);
+        if (reorderFramesEnv) {
+            long value = std::strtol(reorderFramesEnv, NULL, 10);
+            if (value > 0) {
+                maxQueuedFrames = (int)std::min(value, 1024L);
+            }
+        }
+        _maxQueuedFrames = std::max(1, maxQueuedFrames);
     }
 
     _isOpen = true;
     _error = CLEANUP;
-} // WriteFFmpegPlugin::beginEncode
 
-inline void
-sleep(const unsigned int milliseconds)
-{
-#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
-    Sleep(milliseconds);
-#else
-    struct timespec tv;
-    tv.tv_sec = milliseconds / 1000;
-    tv.tv_nsec = (milliseconds % 1000) * 1000000;
-    nanosleep(&tv, 0);
-#endif
-}
+    // all frames go through the mux thread, which encodes them in presentation order
+    _muxThread = new tthread::thread(muxThreadFunction, this);
+} // WriteFFmpegPlugin::beginEncode
 
 #define checkAvError() if (error < 0) { \
         char errorBuf[1024]; \
@@ -4416,57 +4495,163 @@ WriteFFmpegPlugin::encode(const string& filename,
         return;
     }
 
-    ///Check that we're really encoding in sequential order
+    const int frame = (int)time;
+    string muxError;
+    bool aborted = false;
+    bool alreadyEncoded = false;
+    ///Frames may be rendered in any order, but they are encoded in sequential order:
+    ///wait until this frame fits in the reorder buffer, so that the number of frames
+    ///kept in memory is bounded.
     {
-        AutoMutex lock(_nextFrameToEncodeMutex);
+        tthread::lock_guard<tthread::mutex> lock(_nextFrameToEncodeMutex);
 
-        while (_nextFrameToEncode != time && _nextFrameToEncode != INT_MIN) {
-            lock.unlock();
-            sleep(1);
-            lock.relock();
+        while ( _nextFrameToEncode != INT_MIN && _muxError.empty() &&
+                (frame - _nextFrameToEncode) / _frameStep >= (int)_maxQueuedFrames ) {
+            _frameEncoded.wait(_nextFrameToEncodeMutex);
         }
+        muxError = _muxError;
+        aborted = (_nextFrameToEncode == INT_MIN);
+        alreadyEncoded = !aborted && (frame < _nextFrameToEncode || _queuedFrames.count(frame) > 0);
+    }
+    if ( !muxError.empty() ) {
+        setPersistentMessage(Message::eMessageError, "", muxError);
+        throwSuiteStatusException(kOfxStatFailed);
 
-        if (_nextFrameToEncode == INT_MIN) {
-            // Another thread aborted
-            if ( abort() ) {
-                setPersistentMessage(Message::eMessageError, "", "Render aborted");
-            }
-            throwSuiteStatusException(kOfxStatFailed);
-
-            return;
+        return;
+    }
+    if (aborted) {
+        // Another thread aborted
+        if ( abort() ) {
+            setPersistentMessage(Message::eMessageError, "", "Render aborted");
         }
-        try {
-            _error = IGNORE_FINISH;
+        throwSuiteStatusException(kOfxStatFailed);
 
+        return;
+    }
+    if (alreadyEncoded) {
+        stringstream ss;
+        ss << "Frame " << frame << " was already written";
+        setPersistentMessage( Message::eMessageError, "", ss.str() );
+        throwSuiteStatusException(kOfxStatFailed);
 
-            if (_isOpen) {
-                _error = CLEANUP;
+        return;
+    }
 
-                if (!_streamVideo) {
-                    throwSuiteStatusException(kOfxStatErrBadHandle);
+    // The conversion to the codec pixel format is done by the render thread,
+    // so that several frames are converted concurrently.
+    assert(bounds.x1 == _rodPixel.x1 && bounds.x2 == _rodPixel.x2 &&
+           bounds.y1 == _rodPixel.y1 && bounds.y2 == _rodPixel.y2);
+    AVFrame* avFrame = convertFrame(_streamVideo->codec, pixelData, pixelDataNComps, rowBytes);
 
-                    return;
-                }
-                assert(_formatContext);
-                if ( !writeToFile(_formatContext, false, time, pixelData, &bounds, pixelDataNComps, dstNComps, rowBytes) ) {
-                    _error = SUCCESS;
-                    _nextFrameToEncode = (int)time + _frameStep;
-                    if ( abort() ) {
-                        _nextFrameToEncode = INT_MIN;
-                    }
-                } else {
-                    throwSuiteStatusException(kOfxStatFailed);
+    bool queued = false;
+    {
+        tthread::lock_guard<tthread::mutex> lock(_nextFrameToEncodeMutex);
 
-                    return;
-                }
+        if ( avFrame && (_nextFrameToEncode != INT_MIN) && !abort() ) {
+            if ( !_queuedFrames.insert( std::make_pair(frame, avFrame) ).second ) {
+                // the same frame was rendered twice concurrently, keep the first one
+                freeFrame(avFrame);
             }
-        } catch (const std::exception& e) {
+            queued = true;
+            _error = SUCCESS;
+            _frameQueued.notify_all();
+        } else {
+            // the conversion failed, or the render was aborted: stop the mux thread and the other render threads
             _nextFrameToEncode = INT_MIN;
-            throw e;
+            _frameQueued.notify_all();
+            _frameEncoded.notify_all();
+        }
+    }
+    if (!queued) {
+        freeFrame(avFrame);
+        if ( abort() ) {
+            setPersistentMessage(Message::eMessageError, "", "Render aborted");
+        } else if (!avFrame) {
+            setPersistentMessage(Message::eMessageError, "", "Cannot convert frame to the codec pixel format");
         }
-    } // MultiThread::AutoMutex lock(_nextFrameToEncodeMutex);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
 } // WriteFFmpegPlugin::encode
 
+////////////////////////////////////////////////////////////////////////////////
+// muxFrames
+// Body of the mux thread, started by beginEncode(): encode the queued frames
+// in presentation order, as soon as the next frame to encode is available.
+// Returns when stopMuxThread() was called and the next frame is not in the
+// reorder buffer, or when the render was aborted or failed.
+//
+void
+WriteFFmpegPlugin::muxThreadFunction(void* arg)
+{
+    static_cast<WriteFFmpegPlugin*>(arg)->muxFrames();
+}
+
+void
+WriteFFmpegPlugin::muxFrames()
+{
+    tthread::lock_guard<tthread::mutex> lock(_nextFrameToEncodeMutex);
+
+    for (;;) {
+        if (_nextFrameToEncode == INT_MIN) {
+            return;
+        }
+        std::map<int, AVFrame*>::iterator it = _queuedFrames.find(_nextFrameToEncode);
+        if ( it == _queuedFrames.end() ) {
+            if (_stopMuxing) {
+                return;
+            }
+            _frameQueued.wait(_nextFrameToEncodeMutex);
+            continue;
+        }
+        const int frame = it->first;
+        AVFrame* avFrame = it->second;
+        _queuedFrames.erase(it);
+
+        // encode without holding the lock, so that render threads may queue frames meanwhile
+        _nextFrameToEncodeMutex.unlock();
+        string errorMessage;
+        const int ret = encodeFrame(_formatContext, _streamVideo, avFrame, false, frame, &errorMessage);
+        freeFrame(avFrame);
+        _nextFrameToEncodeMutex.lock();
+
+        if (ret) {
+            _muxError = errorMessage.empty() ? string("Cannot write frame") : errorMessage;
+            _nextFrameToEncode = INT_MIN;
+        } else if (_nextFrameToEncode != INT_MIN) {
+            _nextFrameToEncode = frame + _frameStep;
+        }
+        _frameEncoded.notify_all();
+    }
+}
+
+// Encode the remaining consecutive frames, wait for the mux thread to finish,
+// and release the frames that could not be encoded.
+void
+WriteFFmpegPlugin::stopMuxThread()
+{
+    if (!_muxThread) {
+        return;
+    }
+    {
+        tthread::lock_guard<tthread::mutex> lock(_nextFrameToEncodeMutex);
+        _stopMuxing = true;
+        _frameQueued.notify_all();
+    }
+    _muxThread->join();
+    delete _muxThread;
+    _muxThread = NULL;
+
+    tthread::lock_guard<tthread::mutex> lock(_nextFrameToEncodeMutex);
+    for (std::map<int, AVFrame*>::iterator it = _queuedFrames.begin(); it != _queuedFrames.end(); ++it) {
+        freeFrame(it->second);
+    }
+    _queuedFrames.clear();
+    _stopMuxing = false;
+    _frameEncoded.notify_all();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // finish
 // Complete the encoding, finalise and close the file.
@@ -4481,10 +4666,20 @@ WriteFFmpegPlugin::encode(const string& filename,
 void
 WriteFFmpegPlugin::endEncode(const EndSequenceRenderArguments & /*args*/)
 {
+    // encode the frames remaining in the reorder buffer
+    stopMuxThread();
+
     if (!_formatContext) {
         return;
     }
+    if ( !_muxError.empty() ) {
+        // the encoder or the muxer failed: the file cannot be finalised
+        setPersistentMessage(Message::eMessageError, "", _muxError);
+        freeFormat();
+        throwSuiteStatusException(kOfxStatFailed);
 
+        return;
+    }
 
     if (_error == IGNORE_FINISH) {
         freeFormat();
@@ -5140,6 +5335,7 @@ WriteFFmpegPlugin::changedClip(const InstanceChangedArgs &/*args*/,
 void
 WriteFFmpegPlugin::freeFormat()
 {
+    stopMuxThread();
     if (_streamVideo) {
         avcodec_close(_streamVideo->codec);
         _streamVideo = NULL;
@@ -5156,8 +5352,9 @@ WriteFFmpegPlugin::freeFormat()
         _formatContext = NULL;
     }
     {
-        AutoMutex lock(_nextFrameToEncodeMutex);
+        tthread::lock_guard<tthread::mutex> lock(_nextFrameToEncodeMutex);
         _nextFrameToEncode = INT_MIN;
+        _muxError.clear();
         _firstFrameToEncode = 1;
         _lastFrameToEncode = 1;
         _frameStep = 1;
@@ -0,0 +1,97 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * Runtime detection of the x86 instruction sets used by the SIMD code paths.
+ */
+
+#ifndef IO_CPUFeatures_h
+#define IO_CPUFeatures_h
+
+#include "IOUtility.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#define OFX_IO_CPU_FEATURES_X86
+#include <intrin.h>
+#elif defined(__GNUC__) || defined(__clang__)
+#define OFX_IO_CPU_FEATURES_X86
+#include <cpuid.h>
+#endif
+#endif
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+struct CPUFeatures
+{
+    bool sse41;
+    bool avx;
+    bool avx2;
+    bool f16c;
+};
+
+/**
+ * @brief Get the instruction sets supported by the CPU and the OS (AVX needs the OS to save the YMM registers).
+ * All features are false on non-x86 CPUs and unknown compilers. This runs cpuid: callers should keep the result.
+ **/
+inline CPUFeatures
+getCPUFeatures()
+{
+    CPUFeatures features;
+
+    features.sse41 = false;
+    features.avx = false;
+    features.avx2 = false;
+    features.f16c = false;
+#if defined(OFX_IO_CPU_FEATURES_X86)
+#  ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    int nIds = info[0];
+    if (nIds >= 1) {
+        __cpuid(info, 1);
+        features.sse41 = (info[2] & (1 << 19)) != 0;
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        features.avx = (info[2] & (1 << 28)) != 0 && osxsave && ( (_xgetbv(0) & 6) == 6 );
+        features.f16c = features.avx && (info[2] & (1 << 29)) != 0;
+        if (features.avx && nIds >= 7) {
+            __cpuidex(info, 7, 0);
+            features.avx2 = (info[1] & (1 << 5)) != 0;
+        }
+    }
+#  else
+    __builtin_cpu_init();
+    features.sse41 = __builtin_cpu_supports("sse4.1") != 0;
+    features.avx = __builtin_cpu_supports("avx") != 0;
+    features.avx2 = __builtin_cpu_supports("avx2") != 0;
+    // older compilers do not know __builtin_cpu_supports("f16c"), but the OS support is the one of AVX
+    unsigned int eax, ebx, ecx, edx;
+    if ( features.avx && __get_cpuid(1, &eax, &ebx, &ecx, &edx) ) {
+        features.f16c = (ecx & bit_F16C) != 0;
+    }
+#  endif
+#endif
+
+    return features;
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // ifndef IO_CPUFeatures_h
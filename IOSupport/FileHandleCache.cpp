@@ -0,0 +1,258 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * A process-wide cache of open files, shared by the readers.
+ */
+
+#include "FileHandleCache.h"
+#include "FileHeaderCache.h"
+
+#include <cstdlib> // getenv, strtol
+#ifdef DEBUG
+#include <cstdio>
+#define DBG(x) x
+#else
+#define DBG(x) (void)0
+#endif
+
+#include "ofxsMultiThread.h"
+
+using std::string;
+using std::vector;
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+typedef MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+
+static FileHandleCache gFileHandleCache;
+
+FileHandleCache&
+FileHandleCache::instance()
+{
+    return gFileHandleCache;
+}
+
+FileHandleCache::FileHandleCache()
+    : _lock()
+    , _entries()
+    , _openFiles(0)
+    , _size(0)
+    , _maxFiles(kFileHandleCacheMaxFilesDefault)
+    , _maxSize( (std::size_t)kFileHandleCacheSizeDefault << 20 )
+    , _hits(0)
+    , _misses(0)
+    , _evictions(0)
+{
+    const char* maxFilesEnv = std::getenv(kFileHandleCacheMaxFilesEnv);
+
+    if (maxFilesEnv) {
+        long maxFiles = std::strtol(maxFilesEnv, NULL, 10);
+        _maxFiles = (maxFiles > 0) ? (std::size_t)maxFiles : 0;
+    }
+    const char* maxSizeEnv = std::getenv(kFileHandleCacheSizeEnv);
+    if (maxSizeEnv) {
+        long maxSizeMB = std::strtol(maxSizeEnv, NULL, 10);
+        _maxSize = (maxSizeMB > 0) ? ( (std::size_t)maxSizeMB << 20 ) : 0;
+    }
+}
+
+FileHandleCache::~FileHandleCache()
+{
+    DBG( std::printf("FileHandleCache: %llu hits, %llu misses, %llu evictions\n", _hits, _misses, _evictions) );
+    for (EntryList::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+        delete (*it)->handle;
+        delete *it;
+    }
+}
+
+FileHandleCache::Handle*
+FileHandleCache::checkout(const void* owner,
+                          const string& filename,
+                          CreateFunc create,
+                          void* arg)
+{
+    long long mtime = 0;
+    long long fileSize = 0;
+    long long inode = 0;
+    const bool gotStamp = FileHeaderCache::getFileStamp(filename, &mtime, &fileSize, &inode);
+    vector<Handle*> toDelete;
+    Handle* cached = NULL;
+    {
+        AutoMutex l(_lock);
+        EntryList::iterator it = _entries.begin();
+        while ( !cached && it != _entries.end() ) {
+            EntryList::iterator next = it;
+            ++next;
+            Entry* entry = *it;
+            if ( !entry->removed && (entry->owner == owner) && (entry->filename == filename) ) {
+                if ( !gotStamp || (entry->mtime != mtime) || (entry->fileSize != fileSize) || (entry->inode != inode) || !entry->handle->isValid() ) {
+                    // the file was modified or removed since it was opened
+                    removeLocked(it, &toDelete);
+                } else if ( (entry->users == 0) || entry->handle->isShareable() ) {
+                    ++entry->users;
+                    ++_hits;
+                    // this is now the most recently used entry
+                    _entries.splice(_entries.begin(), _entries, it);
+                    cached = entry->handle;
+                }
+            }
+            it = next;
+        }
+        if (!cached) {
+            ++_misses;
+        }
+    }
+    deleteHandles(&toDelete);
+    if (cached) {
+        return cached;
+    }
+
+    // open the file outside of the lock: this may take a while
+    Handle* handle = create(filename, arg);
+    if (!handle) {
+        return NULL;
+    }
+
+    Entry* entry = new Entry;
+    entry->owner = owner;
+    entry->filename = filename;
+    entry->mtime = mtime;
+    entry->fileSize = fileSize;
+    entry->inode = inode;
+    entry->handle = handle;
+    entry->memorySize = handle->getMemorySize();
+    entry->users = 1;
+    entry->removed = !gotStamp || !isEnabled(); // closed when checked in
+    {
+        AutoMutex l(_lock);
+        _entries.push_front(entry);
+        if (!entry->removed) {
+            ++_openFiles;
+            _size += entry->memorySize;
+            evictLocked(&toDelete);
+        }
+    }
+    deleteHandles(&toDelete);
+
+    return handle;
+} // FileHandleCache::checkout
+
+void
+FileHandleCache::checkin(Handle* handle)
+{
+    if (!handle) {
+        return;
+    }
+    vector<Handle*> toDelete;
+    {
+        AutoMutex l(_lock);
+        for (EntryList::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            Entry* entry = *it;
+            if ( (entry->handle != handle) || (entry->users == 0) ) {
+                continue;
+            }
+            --entry->users;
+            if (entry->removed) {
+                if (entry->users == 0) {
+                    toDelete.push_back(entry->handle);
+                    _entries.erase(it);
+                    delete entry;
+                }
+            } else if ( !handle->isValid() ) {
+                removeLocked(it, &toDelete);
+            } else {
+                // the memory used by the handle may have changed while it was used
+                const std::size_t memorySize = handle->getMemorySize();
+                _size = _size - entry->memorySize + memorySize;
+                entry->memorySize = memorySize;
+                evictLocked(&toDelete);
+            }
+            break;
+        }
+    }
+    deleteHandles(&toDelete);
+}
+
+void
+FileHandleCache::purge(const void* owner)
+{
+    vector<Handle*> toDelete;
+    {
+        AutoMutex l(_lock);
+        EntryList::iterator it = _entries.begin();
+        while ( it != _entries.end() ) {
+            EntryList::iterator next = it;
+            ++next;
+            if ( !(*it)->removed && ( !owner || ( (*it)->owner == owner ) ) ) {
+                removeLocked(it, &toDelete);
+            }
+            it = next;
+        }
+    }
+    deleteHandles(&toDelete);
+}
+
+void
+FileHandleCache::removeLocked(EntryList::iterator it,
+                              vector<Handle*>* toDelete)
+{
+    Entry* entry = *it;
+
+    assert(!entry->removed);
+    --_openFiles;
+    _size -= entry->memorySize;
+    if (entry->users == 0) {
+        toDelete->push_back(entry->handle);
+        _entries.erase(it);
+        delete entry;
+    } else {
+        entry->removed = true;
+    }
+}
+
+void
+FileHandleCache::evictLocked(vector<Handle*>* toDelete)
+{
+    // close the least recently used idle files until the cache fits in the budgets.
+    // Files that are in use cannot be closed, so the budgets may be exceeded temporarily.
+    EntryList::iterator it = _entries.end();
+    while ( ( (_openFiles > _maxFiles) || (_size > _maxSize) ) && ( it != _entries.begin() ) ) {
+        --it;
+        if ( (*it)->removed || ( (*it)->users > 0 ) ) {
+            continue;
+        }
+        EntryList::iterator victim = it;
+        ++it;
+        removeLocked(victim, toDelete);
+        ++_evictions;
+    }
+}
+
+void
+FileHandleCache::deleteHandles(vector<Handle*>* handles)
+{
+    for (vector<Handle*>::const_iterator it = handles->begin(); it != handles->end(); ++it) {
+        delete *it;
+    }
+    handles->clear();
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
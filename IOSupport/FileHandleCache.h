@@ -0,0 +1,199 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * A process-wide cache of open files, shared by the readers.
+ */
+
+#ifndef IO_FileHandleCache_h
+#define IO_FileHandleCache_h
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "IOUtility.h"
+#include "fast_mutex.h"
+
+// maximum number of files kept open by all readers (0 disables the cache: files are closed after each use).
+// The default value can be overriden using the environment variable OFX_IO_OPEN_FILES
+#define kFileHandleCacheMaxFilesEnv "OFX_IO_OPEN_FILES"
+#define kFileHandleCacheMaxFilesDefault 64
+
+// maximum memory used by the files kept open (decoder state, line buffers...), in megabytes.
+// The default value can be overriden using the environment variable OFX_IO_OPEN_FILES_SIZE
+#define kFileHandleCacheSizeEnv "OFX_IO_OPEN_FILES_SIZE"
+#define kFileHandleCacheSizeDefault 256
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+/**
+ * @brief A process-wide LRU cache of open files, shared by all readers.
+ *
+ * Opening a file and parsing its header is expensive, so readers check out a handle on the file
+ * from the cache for the duration of each call, and check it in afterwards instead of closing it.
+ * Handles are keyed by an owner (a reader instance if the handle depends on its parameters, or any
+ * per-plugin tag else) and the file name, and a handle is reopened if the file was modified.
+ *
+ * A handle that is not shareable is checked out by one thread at a time: if all the handles of a
+ * file are in use, a new handle is opened, so that several threads can read the same file.
+ * The least recently used idle handles are closed when the number of open files or their memory
+ * exceed the budgets.
+ **/
+class FileHandleCache
+{
+public:
+    /**
+     * @brief An open file. Derive this to hold the reader-specific objects.
+     **/
+    class Handle
+    {
+    public:
+        Handle() {}
+
+        virtual ~Handle() {}
+
+        /// The approximate memory used by the open file, counted against the memory budget.
+        virtual std::size_t getMemorySize() const = 0;
+
+        /// Can several threads use the handle at the same time?
+        virtual bool isShareable() const { return false; }
+
+        /// A handle that is not valid anymore (e.g. after a read error) is closed when it is checked in.
+        virtual bool isValid() const { return true; }
+    };
+
+    /// Opens a handle on filename, or returns NULL. May throw.
+    typedef Handle* (*CreateFunc)(const std::string& filename, void* arg);
+
+    /**
+     * @brief Checks a handle in when it goes out of scope.
+     **/
+    template <class T>
+    class Checkout
+    {
+    public:
+        Checkout()
+            : _handle(NULL)
+        {
+        }
+
+        Checkout(const void* owner,
+                 const std::string& filename,
+                 CreateFunc create,
+                 void* arg)
+            : _handle( static_cast<T*>( FileHandleCache::instance().checkout(owner, filename, create, arg) ) )
+        {
+        }
+
+        ~Checkout()
+        {
+            reset();
+        }
+
+        void reset(T* handle = NULL)
+        {
+            if (_handle && _handle != handle) {
+                FileHandleCache::instance().checkin(_handle);
+            }
+            _handle = handle;
+        }
+
+        T* get() const { return _handle; }
+
+        T* operator->() const { return _handle; }
+
+    private:
+        // non-copyable
+        Checkout(const Checkout&);
+        Checkout& operator=(const Checkout&);
+
+        T* _handle;
+    };
+
+    static FileHandleCache& instance();
+
+    FileHandleCache();
+
+    ~FileHandleCache();
+
+    bool isEnabled() const
+    {
+        return _maxFiles > 0;
+    }
+
+    /**
+     * @brief Get a handle on filename for owner, calling create(filename, arg) to open it if no idle
+     * handle is available. Returns NULL if create() returned NULL. Each successful call must be
+     * matched by a call to checkin().
+     **/
+    Handle* checkout(const void* owner, const std::string& filename, CreateFunc create, void* arg);
+
+    /**
+     * @brief Give back a handle returned by checkout(). It is closed if it is not valid anymore,
+     * or if the cache is over budget.
+     **/
+    void checkin(Handle* handle);
+
+    /**
+     * @brief Close all the handles of owner, or all handles if owner is NULL.
+     * Handles that are in use are closed when they are checked in.
+     **/
+    void purge(const void* owner);
+
+private:
+    struct Entry
+    {
+        const void* owner;
+        std::string filename;
+        long long mtime;
+        long long fileSize;
+        long long inode;
+        Handle* handle;
+        std::size_t memorySize;
+        int users; // number of checkouts
+        bool removed; // removed from the cache while in use, close the file when users reaches 0
+    };
+
+    typedef std::list<Entry*> EntryList;
+    typedef tthread::fast_mutex Mutex;
+
+    // must be called with _lock held. Closed handles are added to toDelete, to be deleted outside the lock.
+    void removeLocked(EntryList::iterator it, std::vector<Handle*>* toDelete);
+    void evictLocked(std::vector<Handle*>* toDelete);
+
+    // delete and clear handles
+    static void deleteHandles(std::vector<Handle*>* handles);
+
+    mutable Mutex _lock;
+    EntryList _entries; // the most recently used entry comes first, removed entries stay in the list until they are checked in
+    std::size_t _openFiles;
+    std::size_t _size;
+    std::size_t _maxFiles;
+    std::size_t _maxSize;
+    unsigned long long _hits;
+    unsigned long long _misses;
+    unsigned long long _evictions;
+};
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // ifndef IO_FileHandleCache_h
@@ -0,0 +1,495 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * A process-wide cache of the file headers parsed by the readers.
+ */
+
+#include "FileHeaderCache.h"
+
+#include <cstdio> // fopen, rename
+#include <cstdlib> // getenv, strtol
+#include <locale>
+#include <sstream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h> // getpid
+#endif
+
+#include "ofxsMultiThread.h"
+#include "tinythread.h"
+
+// first line of the index file. Change the version when the format of the entries changes.
+#define kFileHeaderCacheFileMagic "openfx-io header cache 2"
+
+using std::string;
+using std::vector;
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+typedef MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+
+// escape the characters used as separators in the index file
+static string
+escape(const string& s)
+{
+    string ret;
+
+    ret.reserve( s.size() );
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+        case '\\':
+            ret += "\\\\";
+            break;
+        case '\t':
+            ret += "\\t";
+            break;
+        case '\n':
+            ret += "\\n";
+            break;
+        case '\r':
+            ret += "\\r";
+            break;
+        default:
+            ret += s[i];
+            break;
+        }
+    }
+
+    return ret;
+}
+
+static string
+unescape(const string& s)
+{
+    string ret;
+
+    ret.reserve( s.size() );
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        if ( (s[i] != '\\') || (i + 1 == s.size()) ) {
+            ret += s[i];
+            continue;
+        }
+        ++i;
+        switch (s[i]) {
+        case 't':
+            ret += '\t';
+            break;
+        case 'n':
+            ret += '\n';
+            break;
+        case 'r':
+            ret += '\r';
+            break;
+        default:
+            ret += s[i];
+            break;
+        }
+    }
+
+    return ret;
+}
+
+FileHeaderCache::Header::Header()
+    : hasBounds(false)
+    , bounds()
+    , format()
+    , par(1.)
+    , tileWidth(0)
+    , tileHeight(0)
+    , hasParams(false)
+    , colorspace()
+    , premult(0)
+    , components(0)
+    , componentCount(0)
+    , hasFrameRate(false)
+    , fps(0.)
+    , hasMetadata(false)
+    , metadata()
+{
+    bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+    format = bounds;
+}
+
+bool
+FileHeaderCache::getFileStamp(const string& path,
+                              long long *mtime,
+                              long long *size,
+                              long long *inode)
+{
+#ifdef _WIN32
+    std::wstring wpath;
+    wpath.resize( MultiByteToWideChar (CP_UTF8, 0, path.c_str(), -1, NULL, 0) );
+    MultiByteToWideChar ( CP_UTF8, 0, path.c_str(), -1, &wpath[0], (int)wpath.size() );
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if ( !GetFileAttributesExW(wpath.c_str(), GetFileExInfoStandard, &attr) ) {
+        return false;
+    }
+    // FILETIME counts 100ns intervals. There is no inode number without opening the file.
+    *mtime = ( ( (long long)attr.ftLastWriteTime.dwHighDateTime << 32 ) | attr.ftLastWriteTime.dwLowDateTime ) * 100;
+    *size = ( (long long)attr.nFileSizeHigh << 32 ) | attr.nFileSizeLow;
+    *inode = 0;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    // a file rewritten within the same second must be detected: use the nanoseconds, and the inode
+    // (a file replaced by a rename gets a new one)
+#ifdef __APPLE__
+    *mtime = (long long)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    *mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    *size = (long long)st.st_size;
+    *inode = (long long)st.st_ino;
+#endif
+
+    return true;
+} // FileHeaderCache::getFileStamp
+
+static FileHeaderCache gFileHeaderCache;
+
+FileHeaderCache&
+FileHeaderCache::instance()
+{
+    return gFileHeaderCache;
+}
+
+FileHeaderCache::FileHeaderCache()
+    : _lock()
+    , _entries()
+    , _lru()
+    , _maxEntries(kFileHeaderCacheSizeDefault)
+    , _indexFile()
+    , _loaded(false)
+    , _modified(false)
+    , _purgedPrefixes()
+{
+    const char* maxEntriesEnv = std::getenv(kFileHeaderCacheSizeEnv);
+
+    if (maxEntriesEnv) {
+        long maxEntries = std::strtol(maxEntriesEnv, NULL, 10);
+        _maxEntries = (maxEntries > 0) ? (std::size_t)maxEntries : 0;
+    }
+    const char* indexFileEnv = std::getenv(kFileHeaderCacheFileEnv);
+    if (indexFileEnv) {
+        _indexFile = indexFileEnv;
+    }
+}
+
+FileHeaderCache::~FileHeaderCache()
+{
+    if ( _loaded && _modified && !_indexFile.empty() ) {
+        saveLocked();
+    }
+}
+
+void
+FileHeaderCache::save()
+{
+    AutoMutex l(_lock);
+
+    if ( _loaded && _modified && !_indexFile.empty() ) {
+        saveLocked();
+        _modified = false;
+    }
+}
+
+bool
+FileHeaderCache::get(const string& key,
+                     const string& filename,
+                     Header* header)
+{
+    if ( !isEnabled() ) {
+        return false;
+    }
+    // stat the file outside of the lock: this may take a while on network storage
+    long long mtime = 0;
+    long long fileSize = 0;
+    long long inode = 0;
+    const bool gotStamp = getFileStamp(filename, &mtime, &fileSize, &inode);
+    AutoMutex l(_lock);
+    loadLocked();
+    EntryMap::iterator it = _entries.find( EntryKey(key, filename) );
+    if ( it == _entries.end() ) {
+        return false;
+    }
+    if ( !gotStamp || (it->second.mtime != mtime) || (it->second.fileSize != fileSize) || (it->second.inode != inode) ) {
+        // the file was modified or removed since its header was cached
+        _lru.erase(it->second.lru);
+        _entries.erase(it);
+        _modified = true;
+
+        return false;
+    }
+    // this is now the most recently used entry
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+    *header = it->second.header;
+
+    return true;
+}
+
+void
+FileHeaderCache::set(const string& key,
+                     const string& filename,
+                     const Header& header)
+{
+    if ( !isEnabled() ) {
+        return;
+    }
+    long long mtime = 0;
+    long long fileSize = 0;
+    long long inode = 0;
+    if ( !getFileStamp(filename, &mtime, &fileSize, &inode) ) {
+        return;
+    }
+    AutoMutex l(_lock);
+    loadLocked();
+    const EntryKey entryKey(key, filename);
+    EntryMap::iterator it = _entries.find(entryKey);
+    if ( it == _entries.end() ) {
+        _lru.push_front(entryKey);
+        it = _entries.insert( std::make_pair( entryKey, Entry() ) ).first;
+        it->second.lru = _lru.begin();
+    } else {
+        _lru.splice(_lru.begin(), _lru, it->second.lru);
+        if ( (it->second.mtime != mtime) || (it->second.fileSize != fileSize) || (it->second.inode != inode) ) {
+            // the file was modified: forget what was cached
+            it->second.header = Header();
+        }
+    }
+    Entry& entry = it->second;
+    entry.mtime = mtime;
+    entry.fileSize = fileSize;
+    entry.inode = inode;
+    if (header.hasBounds) {
+        entry.header.hasBounds = true;
+        entry.header.bounds = header.bounds;
+        entry.header.format = header.format;
+        entry.header.par = header.par;
+        entry.header.tileWidth = header.tileWidth;
+        entry.header.tileHeight = header.tileHeight;
+    }
+    if (header.hasParams) {
+        entry.header.hasParams = true;
+        entry.header.colorspace = header.colorspace;
+        entry.header.premult = header.premult;
+        entry.header.components = header.components;
+        entry.header.componentCount = header.componentCount;
+    }
+    if (header.hasFrameRate) {
+        entry.header.hasFrameRate = true;
+        entry.header.fps = header.fps;
+    }
+    if (header.hasMetadata) {
+        entry.header.hasMetadata = true;
+        entry.header.metadata = header.metadata;
+    }
+    _modified = true;
+    evictLocked();
+} // FileHeaderCache::set
+
+void
+FileHeaderCache::purge(const string& keyPrefix)
+{
+    AutoMutex l(_lock);
+
+    // the index file must not bring the purged headers back
+    loadLocked();
+    _purgedPrefixes.push_back(keyPrefix);
+    EntryMap::iterator it = _entries.begin();
+    while ( it != _entries.end() ) {
+        EntryMap::iterator next = it;
+        ++next;
+        if (it->first.first.compare(0, keyPrefix.size(), keyPrefix) == 0) {
+            _lru.erase(it->second.lru);
+            _entries.erase(it);
+            _modified = true;
+        }
+        it = next;
+    }
+}
+
+void
+FileHeaderCache::evictLocked()
+{
+    while (_entries.size() > _maxEntries) {
+        _entries.erase( _lru.back() );
+        _lru.pop_back();
+    }
+}
+
+void
+FileHeaderCache::loadLocked()
+{
+    if (_loaded) {
+        return;
+    }
+    _loaded = true;
+    readIndexLocked();
+}
+
+void
+FileHeaderCache::readIndexLocked()
+{
+    if ( _indexFile.empty() ) {
+        return;
+    }
+    std::FILE* file = std::fopen(_indexFile.c_str(), "rb");
+    if (!file) {
+        return;
+    }
+    string data;
+    char buf[65536];
+    std::size_t n;
+    while ( ( n = std::fread(buf, 1, sizeof(buf), file) ) > 0 ) {
+        data.append(buf, n);
+    }
+    std::fclose(file);
+
+    std::size_t pos = data.find('\n');
+    if ( (pos == string::npos) || (data.compare(0, pos, kFileHeaderCacheFileMagic) != 0) ) {
+        // not an index file, or another version
+        return;
+    }
+    ++pos;
+    // entries are saved from the least recently used to the most recently used. The entries that are
+    // already in memory are more recent, and the read entries go after them.
+    EntryKeyList readKeys;
+    while ( pos < data.size() ) {
+        std::size_t end = data.find('\n', pos);
+        if (end == string::npos) {
+            end = data.size();
+        }
+        vector<string> fields;
+        std::size_t fieldBegin = pos;
+        for (std::size_t i = pos; i <= end; ++i) {
+            if ( (i == end) || (data[i] == '\t') ) {
+                fields.push_back( data.substr(fieldBegin, i - fieldBegin) );
+                fieldBegin = i + 1;
+            }
+        }
+        pos = end + 1;
+        if (fields.size() != 7) {
+            continue;
+        }
+        Entry entry;
+        std::istringstream numbers(fields[2] + ' ' + fields[3] + ' ' + fields[5]);
+        numbers.imbue( std::locale::classic() );
+        Header& h = entry.header;
+        numbers >> entry.mtime >> entry.fileSize >> entry.inode
+                >> h.hasBounds >> h.bounds.x1 >> h.bounds.y1 >> h.bounds.x2 >> h.bounds.y2
+                >> h.format.x1 >> h.format.y1 >> h.format.x2 >> h.format.y2 >> h.par >> h.tileWidth >> h.tileHeight
+                >> h.hasParams >> h.premult >> h.components >> h.componentCount
+                >> h.hasFrameRate >> h.fps >> h.hasMetadata;
+        if ( numbers.fail() ) {
+            continue;
+        }
+        h.colorspace = unescape(fields[4]);
+        h.metadata = unescape(fields[6]);
+        const EntryKey entryKey( unescape(fields[0]), unescape(fields[1]) );
+        if ( isPurgedLocked(entryKey.first) ) {
+            continue;
+        }
+        if ( _entries.find(entryKey) != _entries.end() ) {
+            // the header in memory is the most recent
+            continue;
+        }
+        readKeys.push_front(entryKey);
+        entry.lru = readKeys.begin();
+        _entries.insert( std::make_pair(entryKey, entry) );
+    }
+    _lru.splice(_lru.end(), readKeys);
+    evictLocked();
+} // FileHeaderCache::readIndexLocked
+
+bool
+FileHeaderCache::isPurgedLocked(const string& key) const
+{
+    for (vector<string>::const_iterator it = _purgedPrefixes.begin(); it != _purgedPrefixes.end(); ++it) {
+        if (key.compare(0, it->size(), *it) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+FileHeaderCache::saveLocked()
+{
+    // other processes sharing the index file may have saved headers since it was loaded: keep them
+    readIndexLocked();
+
+    std::ostringstream out;
+
+    out.imbue( std::locale::classic() );
+    out.precision(17);
+    out << kFileHeaderCacheFileMagic << '\n';
+    for (EntryKeyList::reverse_iterator it = _lru.rbegin(); it != _lru.rend(); ++it) {
+        const Entry& entry = _entries[*it];
+        const Header& h = entry.header;
+        out << escape(it->first) << '\t' << escape(it->second) << '\t'
+            << entry.mtime << '\t' << entry.fileSize << ' ' << entry.inode << '\t'
+            << escape(h.colorspace) << '\t'
+            << h.hasBounds << ' ' << h.bounds.x1 << ' ' << h.bounds.y1 << ' ' << h.bounds.x2 << ' ' << h.bounds.y2 << ' '
+            << h.format.x1 << ' ' << h.format.y1 << ' ' << h.format.x2 << ' ' << h.format.y2 << ' '
+            << h.par << ' ' << h.tileWidth << ' ' << h.tileHeight << ' '
+            << h.hasParams << ' ' << h.premult << ' ' << h.components << ' ' << h.componentCount << ' '
+            << h.hasFrameRate << ' ' << h.fps << ' ' << h.hasMetadata << '\t'
+            << escape(h.metadata) << '\n';
+    }
+    const string data = out.str();
+
+    // write a temporary file and rename it, so that other processes never read a partial index.
+    // The process and thread ids make its name unique, even if several processes save the index at once.
+    std::ostringstream tmpName;
+#ifdef _WIN32
+    tmpName << _indexFile << '.' << GetCurrentProcessId() << '.' << tthread::this_thread::get_id() << ".tmp";
+#else
+    tmpName << _indexFile << '.' << getpid() << '.' << tthread::this_thread::get_id() << ".tmp";
+#endif
+    const string tmpFile = tmpName.str();
+    std::FILE* file = std::fopen(tmpFile.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    const bool written = (std::fwrite(data.data(), 1, data.size(), file) == data.size());
+    if ( (std::fclose(file) != 0) || !written ) {
+        std::remove( tmpFile.c_str() );
+
+        return;
+    }
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows
+    std::remove( _indexFile.c_str() );
+#endif
+    if (std::rename( tmpFile.c_str(), _indexFile.c_str() ) != 0) {
+        std::remove( tmpFile.c_str() );
+    }
+} // FileHeaderCache::saveLocked
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
@@ -0,0 +1,161 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * A process-wide cache of the file headers parsed by the readers.
+ */
+
+#ifndef IO_FileHeaderCache_h
+#define IO_FileHeaderCache_h
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "IOUtility.h"
+#include "fast_mutex.h"
+
+// maximum number of file headers kept by all readers (0 disables the cache).
+// The default value can be overriden using the environment variable OFX_IO_HEADER_CACHE_SIZE
+#define kFileHeaderCacheSizeEnv "OFX_IO_HEADER_CACHE_SIZE"
+#define kFileHeaderCacheSizeDefault 100000
+
+// index file where the headers are saved when the plug-in is unloaded (and when the process exits), and loaded from when the cache is first
+// used, so that they are kept across sessions (e.g. "$HOME/.cache/openfx-io-headers"). Not set by default.
+// The value can be set using the environment variable OFX_IO_HEADER_CACHE_FILE
+#define kFileHeaderCacheFileEnv "OFX_IO_HEADER_CACHE_FILE"
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+/**
+ * @brief A process-wide LRU cache of the information that readers get from file headers, shared by all instances.
+ *
+ * Getting the bounds of each frame of a long sequence means opening and parsing thousands of files, which
+ * takes seconds on network storage, and is done again each time the project is loaded or a parameter changes.
+ * Headers are keyed by a reader-specific key (which must contain the values of the parameters that change the
+ * results) and the file name, and are only returned if the size, modification time and inode of the file did not change.
+ **/
+class FileHeaderCache
+{
+public:
+    struct Header
+    {
+        Header();
+
+        // results of GenericReaderPlugin::getFrameBounds()
+        bool hasBounds;
+        OfxRectI bounds;
+        OfxRectI format;
+        double par;
+        int tileWidth;
+        int tileHeight;
+
+        // results of GenericReaderPlugin::guessParamsFromFilename()
+        bool hasParams;
+        std::string colorspace;
+        int premult; // OFX::PreMultiplicationEnum
+        int components; // OFX::PixelComponentEnum
+        int componentCount;
+
+        // results of GenericReaderPlugin::getFrameRate()
+        bool hasFrameRate;
+        double fps;
+
+        // the file metadata, as displayed by the reader
+        bool hasMetadata;
+        std::string metadata;
+    };
+
+    static FileHeaderCache& instance();
+
+    FileHeaderCache();
+
+    ~FileHeaderCache();
+
+    bool isEnabled() const
+    {
+        return _maxEntries > 0;
+    }
+
+    /**
+     * @brief Get the header of filename cached under key. Returns false if there is none,
+     * or if the file was modified since it was cached.
+     **/
+    bool get(const std::string& key, const std::string& filename, Header* header);
+
+    /**
+     * @brief Cache the parts of header that are set (hasBounds, hasParams...) for filename under key,
+     * keeping the other parts of the cached header if the file was not modified.
+     **/
+    void set(const std::string& key, const std::string& filename, const Header& header);
+
+    /**
+     * @brief Forget the headers whose key starts with keyPrefix, or all headers if keyPrefix is empty.
+     **/
+    void purge(const std::string& keyPrefix);
+
+    /**
+     * @brief Write the index file, if there is one and headers changed since it was loaded. The headers that
+     * other processes saved meanwhile are kept. Called by the reader factories when they are unloaded.
+     **/
+    void save();
+
+    /// The modification time (in nanoseconds), size and inode of a file, used to detect that a file was rewritten.
+    static bool getFileStamp(const std::string& filename, long long *mtime, long long *size, long long *inode);
+
+private:
+    typedef std::pair<std::string, std::string> EntryKey; // (key, filename)
+    typedef std::list<EntryKey> EntryKeyList;
+
+    struct Entry
+    {
+        long long mtime;
+        long long fileSize;
+        long long inode;
+        Header header;
+        EntryKeyList::iterator lru; // position in _lru
+    };
+
+    typedef std::map<EntryKey, Entry> EntryMap;
+    typedef tthread::fast_mutex Mutex;
+
+    // must be called with _lock held
+    void loadLocked();
+    void readIndexLocked(); // add the entries of the index file that are not in memory
+    void saveLocked();
+    void evictLocked();
+    bool isPurgedLocked(const std::string& key) const;
+
+    mutable Mutex _lock;
+    EntryMap _entries;
+    EntryKeyList _lru; // the most recently used entry comes first
+    std::size_t _maxEntries;
+    std::string _indexFile;
+    bool _loaded; // was the index file loaded?
+    bool _modified; // were entries added or removed since the index file was loaded?
+    std::vector<std::string> _purgedPrefixes; // the entries of the index file with these key prefixes are not read
+};
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // ifndef IO_FileHeaderCache_h
@@ -41,6 +41,8 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
+#include <algorithm>
 #ifdef DEBUG
 #include <cstdio>
 #define DBG(x) x
@@ -48,6 +50,8 @@
 #define DBG(x) (void)0
 #endif
 #include <string>
+#include <sstream>
+#include <iomanip>
 #include <stdexcept>
 #include <ofxsParam.h>
 #include <ofxsImageEffect.h>
@@ -60,6 +64,15 @@
 namespace OCIO = OCIO_NAMESPACE;
 #endif
 
+// the fast CPU mode interpolates the four RGB0 nodes of a tetrahedron with one vector each
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCIO_BAKED_LUT_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define OCIO_BAKED_LUT_NEON
+#endif
+
 using std::string;
 
 NAMESPACE_OFX_ENTER
@@ -266,6 +279,7 @@ GenericOCIO::GenericOCIO(ImageEffect* parent)
     , _contextValue3(NULL)
     , _contextKey4(NULL)
     , _contextValue4(NULL)
+    , _fastCPU(NULL)
     , _config()
 #endif
 {
@@ -311,6 +325,9 @@ GenericOCIO::GenericOCIO(ImageEffect* parent)
         assert(_contextKey1 && _contextKey2 && _contextKey3 && _contextKey4);
         assert(_contextValue1 && _contextValue2 && _contextValue3 && _contextValue4);
     }
+    if ( _parent->paramExists(kOCIOParamFastCPU) ) {
+        _fastCPU = _parent->fetchBooleanParam(kOCIOParamFastCPU);
+    }
 #endif
     // setup the GUI
     // setValue() may be called from createInstance, according to
@@ -574,6 +591,40 @@ GenericOCIO::getLocalContext(double time) const
     return context;
 } // GenericOCIO::getLocalContext
 
+// The OCIOProcessorCache key of the processor from inputSpace to outputSpace.
+static string
+getColorSpaceProcessorKey(const OCIO::ConstConfigRcPtr& config,
+                          const OCIO::ConstContextRcPtr& context,
+                          const string& inputSpace,
+                          const string& outputSpace)
+{
+    string description("ColorSpace");
+
+    OCIOProcessorCache::appendKey(&description, inputSpace);
+    OCIOProcessorCache::appendKey(&description, outputSpace);
+
+    return OCIOProcessorCache::getKey(config, context, description);
+}
+
+// Get the processor from inputSpace to outputSpace from the OCIOProcessorCache, creating it if necessary.
+static OCIO::ConstProcessorRcPtr
+getCachedProcessor(const OCIO::ConstConfigRcPtr& config,
+                   const OCIO::ConstContextRcPtr& context,
+                   const string& inputSpace,
+                   const string& outputSpace,
+                   const string& key)
+{
+    OCIOProcessorCache& cache = OCIOProcessorCache::instance();
+    OCIO::ConstProcessorRcPtr proc = cache.get(key);
+
+    if (!proc) {
+        proc = config->getProcessor( context, inputSpace.c_str(), outputSpace.c_str() );
+        cache.set(key, proc);
+    }
+
+    return proc;
+}
+
 #endif // ifdef OFX_IO_USING_OCIO
 
 bool
@@ -599,7 +650,8 @@ GenericOCIO::isIdentity(double time) const
     try {
         // maybe the names are not the same, but it's still a no-op (e.g. "scene_linear" and "linear")
         OCIO::ConstContextRcPtr context = getLocalContext(time);//_config->getCurrentContext();
-        OCIO::ConstProcessorRcPtr proc = _config->getProcessor( context, inputSpace.c_str(), outputSpace.c_str() );
+        const string key = getColorSpaceProcessorKey(_config, context, inputSpace, outputSpace);
+        OCIO::ConstProcessorRcPtr proc = getCachedProcessor(_config, context, inputSpace, outputSpace, key);
 
         return proc->isNoOp();
     } catch (const std::exception& e) {
@@ -726,11 +778,11 @@ GenericOCIO::apply(double time,
     assert(_created);
 #ifdef OFX_IO_USING_OCIO
     BitDepthEnum bitDepth = img->getPixelDepth();
-    if (bitDepth != eBitDepthFloat) {
-        throw std::runtime_error("OCIO: invalid pixel depth (only float is supported)");
+    if ( (bitDepth != eBitDepthFloat) && (bitDepth != eBitDepthUShort) && (bitDepth != eBitDepthUByte) ) {
+        throw std::runtime_error("OCIO: invalid pixel depth (only float, 16-bit and 8-bit are supported)");
     }
 
-    apply( time, renderWindow, (float*)img->getPixelData(), img->getBounds(), img->getPixelComponents(), img->getPixelComponentCount(), img->getRowBytes() );
+    apply( time, renderWindow, img->getPixelData(), img->getBounds(), img->getPixelComponents(), img->getPixelComponentCount(), bitDepth, img->getRowBytes() );
 #endif
 }
 
@@ -754,16 +806,57 @@ GenericOCIO::setValues(const OCIO::ConstContextRcPtr &context,
                        const string& inputSpace,
                        const string& outputSpace)
 {
+    // the local context is a new object at each call, so compare the cache keys instead
+    const string key = getColorSpaceProcessorKey(_config, context, inputSpace, outputSpace);
     AutoMutex guard(_procMutex);
 
-    if ( !_proc ||
-         ( context != _procContext) ||
-         ( inputSpace != _procInputSpace) ||
-         ( outputSpace != _procOutputSpace) ) {
-        _procContext = context;
-        _procInputSpace = inputSpace;
-        _procOutputSpace = outputSpace;
-        _proc = _config->getProcessor( context, inputSpace.c_str(), outputSpace.c_str() );
+    if ( !_proc || (key != _procKey) ) {
+        _proc = getCachedProcessor(_config, context, inputSpace, outputSpace, key);
+        _procKey = key;
+    }
+}
+
+template <class PIX, int maxValue>
+void
+OCIOProcessor::processIntegerPixels(const OfxRectI& renderWindow,
+                                    int numChannels)
+{
+    const int width = renderWindow.x2 - renderWindow.x1;
+    // most transforms are separable, and integer pixels are then simply looked up
+    // (without a processor, when only the baked LUT was loaded, each row is converted)
+    OCIOChannelLutRcPtr channelLut;
+    if (_proc) {
+        channelLut = OCIOProcessorCache::instance().getChannelLut(_proc, maxValue);
+    }
+    const bool separable = channelLut && channelLut->isSeparable();
+    // else each row is converted to float and back, so that no float image is needed
+    std::vector<float> row;
+
+    if (!separable) {
+        row.resize( (std::size_t)width * numChannels );
+    }
+    const float scale = 1.f / maxValue;
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        if ( _effect.abort() ) {
+            break;
+        }
+        PIX* pix = (PIX*)( (char*)_dstPixelData + (std::size_t)(y - _dstBounds.y1) * _dstRowBytes ) + (std::size_t)(renderWindow.x1 - _dstBounds.x1) * numChannels;
+        if (separable) {
+            channelLut->apply(pix, width, numChannels);
+            continue;
+        }
+        for (std::size_t i = 0; i < row.size(); ++i) {
+            row[i] = pix[i] * scale;
+        }
+        if (_bakedLut) {
+            _bakedLut->apply(&row[0], width, numChannels);
+        } else {
+            OCIO::PackedImageDesc img(&row[0], width, 1, numChannels);
+            _proc->apply(img);
+        }
+        for (std::size_t i = 0; i < row.size(); ++i) {
+            pix[i] = (PIX)floatToInt(row[i], maxValue);
+        }
     }
 }
 
@@ -777,7 +870,7 @@ OCIOProcessor::multiThreadProcessImages(OfxRectI renderWindow)
         return;
     }
 #ifdef OFX_IO_USING_OCIO
-    if (!_proc) {
+    if (!_proc && !_bakedLut) {
         throw std::logic_error("OCIO configuration not loaded");
     }
     int numChannels;
@@ -800,7 +893,21 @@ OCIOProcessor::multiThreadProcessImages(OfxRectI renderWindow)
     size_t pixelDataOffset = (size_t)(renderWindow.y1 - _dstBounds.y1) * _dstRowBytes + (size_t)(renderWindow.x1 - _dstBounds.x1) * pixelBytes;
     float *pix = (float *) ( ( (char *) _dstPixelData ) + pixelDataOffset ); // (char*)dstImg->getPixelAddress(renderWindow.x1, renderWindow.y1);
     try {
-        if (_proc) {
+        if (_dstBitDepth == eBitDepthUByte) {
+            processIntegerPixels<unsigned char, 255>(renderWindow, numChannels);
+        } else if (_dstBitDepth == eBitDepthUShort) {
+            processIntegerPixels<unsigned short, 65535>(renderWindow, numChannels);
+        } else if (_dstBitDepth != eBitDepthFloat) {
+            throwSuiteStatusException(kOfxStatErrFormat);
+        } else if (_bakedLut) {
+            for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+                if ( _effect.abort() ) {
+                    break;
+                }
+                _bakedLut->apply(pix, renderWindow.x2 - renderWindow.x1, numChannels);
+                pix = (float *) ( ( (char *) pix ) + _dstRowBytes );
+            }
+        } else if (_proc) {
             OCIO::PackedImageDesc img(pix, renderWindow.x2 - renderWindow.x1, renderWindow.y2 - renderWindow.y1, numChannels, sizeof(float), pixelBytes, _dstRowBytes);
             _proc->apply(img);
         }
@@ -840,6 +947,19 @@ GenericOCIO::apply(double time,
                    PixelComponentEnum pixelComponents,
                    int pixelComponentCount,
                    int rowBytes)
+{
+    apply(time, renderWindow, (void*)pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+}
+
+void
+GenericOCIO::apply(double time,
+                   const OfxRectI& renderWindow,
+                   void *pixelData,
+                   const OfxRectI& bounds,
+                   PixelComponentEnum pixelComponents,
+                   int pixelComponentCount,
+                   BitDepthEnum bitDepth,
+                   int rowBytes)
 {
     assert(_created);
 #ifdef OFX_IO_USING_OCIO
@@ -872,9 +992,14 @@ GenericOCIO::apply(double time,
 
     OCIOProcessor processor(*_parent);
     // set the images
-    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
 
     processor.setProcessor(proc);
+    if (_fastCPU) {
+        string inputSpace;
+        getInputColorspaceAtTime(time, inputSpace);
+        processor.setBakedLut( getFastCPULut(_fastCPU, time, _config, inputSpace, proc, &_bakedLut) );
+    }
 
     // set the render window
     processor.setRenderWindow(renderWindow);
@@ -954,12 +1079,23 @@ GenericOCIO::changedParam(const InstanceChangedArgs &args,
             _ocioConfigFile->getValue(filename);
             _parent->sendMessage(Message::eMessageError, "", string("Cannot load OCIO config file \"") + filename + '"');
         }
+    } else if ( (paramName == kOCIOParamFastCPUError) && (args.reason == eChangeUserEdit) ) {
+        string inputSpace;
+        getInputColorspaceAtTime(args.time, inputSpace);
+        showFastCPUError( _parent, _config, inputSpace, getOrCreateProcessor(args.time) );
     } else if ( (paramName == kOCIOHelpButton) || (paramName == kOCIOHelpLooksButton) || (paramName == kOCIOHelpDisplaysButton) ) {
         string msg = "OpenColorIO Help\n"
                      "The OCIO configuration file can be set using the \"OCIO\" environment variable, which should contain the full path to the .ocio file.\n"
                      "OpenColorIO version (compiled with / running with): " OCIO_VERSION "/";
         msg += OCIO::GetVersion();
         msg += '\n';
+        {
+            OCIOProcessorCache::Stats stats = OCIOProcessorCache::instance().getStats();
+            std::ostringstream ss;
+            ss << "OCIO processor cache: " << stats.size << " processors, " << stats.hits << " hits, "
+               << stats.misses << " misses, " << stats.evictions << " evictions.\n";
+            msg += ss.str();
+        }
         if (_config) {
             string configdesc = _config->getDescription();
             configdesc = whitespacify( trim(configdesc) );
@@ -1288,6 +1424,13 @@ GenericOCIO::purgeCaches()
 {
 #ifdef OFX_IO_USING_OCIO
     OCIO::ClearAllCaches();
+    OCIOProcessorCache::instance().purge();
+    {
+        AutoMutex guard(_procMutex);
+        _proc.reset();
+        _procKey.clear();
+    }
+    _bakedLut.reset();
 #endif
 }
 
@@ -1534,5 +1677,878 @@ GenericOCIO::describeInContextContext(ImageEffectDescriptor &desc,
 #endif // ifdef OFX_IO_USING_OCIO
 } // GenericOCIO::describeInContextContext
 
+void
+GenericOCIO::describeInContextFastCPU(ImageEffectDescriptor &desc,
+                                      ContextEnum /*context*/,
+                                      PageParamDescriptor *page)
+{
+#ifdef OFX_IO_USING_OCIO
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kOCIOParamFastCPU);
+        param->setLabelAndHint(kOCIOParamFastCPULabel, kOCIOParamFastCPUHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        param->setLayoutHint(eLayoutHintNoNewLine, 1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        PushButtonParamDescriptor* param = desc.definePushButtonParam(kOCIOParamFastCPUError);
+        param->setLabelAndHint(kOCIOParamFastCPUErrorLabel, kOCIOParamFastCPUErrorHint);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+#endif
+}
+
+#ifdef OFX_IO_USING_OCIO
+OCIOBakedLutRcPtr
+GenericOCIO::getFastCPULut(BooleanParam* fastCPU,
+                           double time,
+                           const OCIO::ConstConfigRcPtr& config,
+                           const string& inputSpace,
+                           const OCIO::ConstProcessorRcPtr& proc,
+                           OCIOBakedLutRef* lastLut)
+{
+    if ( !fastCPU || !proc || !fastCPU->getValueAtTime(time) ) {
+        return OCIOBakedLutRcPtr();
+    }
+    const OCIOBakedLut::Shaper shaper = OCIOBakedLut::Shaper::fromColorSpace(config, inputSpace);
+    if (lastLut) {
+        return lastLut->get(proc, shaper);
+    }
+
+    return OCIOProcessorCache::instance().getBakedLut(proc, shaper);
+}
+
+void
+GenericOCIO::showFastCPUError(ImageEffect* effect,
+                              const OCIO::ConstConfigRcPtr& config,
+                              const string& inputSpace,
+                              const OCIO::ConstProcessorRcPtr& proc)
+{
+    if (!proc) {
+        effect->sendMessage(Message::eMessageError, "", "Cannot create OCIO processor");
+
+        return;
+    }
+    try {
+        OCIOBakedLutRcPtr lut = OCIOProcessorCache::instance().getBakedLut( proc, OCIOBakedLut::Shaper::fromColorSpace(config, inputSpace) );
+        effect->sendMessage( Message::eMessageMessage, "", lut->getErrorReport(proc) );
+    } catch (const OCIO::Exception &e) {
+        effect->sendMessage( Message::eMessageError, "", string("OpenColorIO error: ") + e.what() );
+    }
+}
+
+#endif
+
+#ifdef OFX_IO_USING_OCIO
+OCIOBakedLut::Shaper::Shaper()
+    : log2(false)
+    , min(0.f)
+    , max(1.f)
+    , offset(0.f)
+{
+}
+
+OCIOBakedLut::Shaper
+OCIOBakedLut::Shaper::fromColorSpace(const OCIO::ConstConfigRcPtr& config,
+                                     const string& colorSpace)
+{
+    Shaper shaper;
+    OCIO::ConstColorSpaceRcPtr cs;
+
+    if (config) {
+        try {
+            cs = config->getColorSpace( colorSpace.c_str() );
+        } catch (const OCIO::Exception &) {
+        }
+    }
+    if (!cs) {
+        return shaper;
+    }
+    // same defaults as OCIO
+    if (cs->getAllocation() == OCIO::ALLOCATION_LG2) {
+        shaper.log2 = true;
+        shaper.min = -10.f;
+        shaper.max = 6.f;
+    }
+    const int nVars = cs->getAllocationNumVars();
+    if (nVars > 0) {
+        std::vector<float> vars(nVars);
+        cs->getAllocationVars(&vars[0]);
+        if (nVars >= 2) {
+            shaper.min = vars[0];
+            shaper.max = vars[1];
+        }
+        if ( shaper.log2 && (nVars >= 3) ) {
+            shaper.offset = vars[2];
+        }
+    }
+    if ( !(shaper.min < shaper.max) ) {
+        // degenerate allocation
+        const bool log2 = shaper.log2;
+        shaper = Shaper();
+        if (log2) {
+            shaper.log2 = true;
+            shaper.min = -10.f;
+            shaper.max = 6.f;
+        }
+    }
+
+    return shaper;
+}
+
+float
+OCIOBakedLut::Shaper::apply(float x) const
+{
+    float v = x;
+
+    if (log2) {
+        v = x + offset;
+        v = (v > 0.f) ? (float)( std::log(v) / M_LN2 ) : min;
+    }
+    const float t = (v - min) / (max - min);
+
+    // NaNs go to 0
+    return (t > 0.f) ? (t < 1.f ? t : 1.f) : 0.f;
+}
+
+float
+OCIOBakedLut::Shaper::invert(float t) const
+{
+    const float v = min + t * (max - min);
+
+    if (log2) {
+        return (float)std::pow(2., (double)v) - offset;
+    }
+
+    return v;
+}
+
+// the LUT coordinate of a float is interpolated from the entries for its 16 high bits (sign, exponent and
+// 7 mantissa bits), so that the log2 of the shaper is not computed for each pixel
+static inline float
+shapeCoord(const float* shaperLut,
+           float x)
+{
+    unsigned int bits;
+
+    std::memcpy( &bits, &x, sizeof(bits) );
+    const float* entry = shaperLut + (bits >> 16);
+
+    return entry[0] + (entry[1] - entry[0]) * ( (bits & 0xffff) * (1.f / 65536.f) );
+}
+
+// Bakes the lattice of a 3D LUT, each thread taking a band of blue slices.
+class OCIOLutBaker
+    : public MultiThread::Processor
+{
+public:
+    OCIOLutBaker(const OCIO::ConstProcessorRcPtr& proc,
+                 const std::vector<float>& nodes,
+                 float* rgb)
+        : _proc(proc)
+        , _nodes(nodes)
+        , _rgb(rgb)
+    {
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int n = kOCIOBakedLutSize;
+        const int b1 = (int)( (long long)n * threadID / nThreads );
+        const int b2 = (int)( (long long)n * (threadID + 1) / nThreads );
+
+        if (b2 <= b1) {
+            return;
+        }
+        float* rgb = _rgb + (std::size_t)b1 * n * n * 3;
+        float* pix = rgb;
+        for (int b = b1; b < b2; ++b) {
+            for (int g = 0; g < n; ++g) {
+                for (int r = 0; r < n; ++r) {
+                    pix[0] = _nodes[r];
+                    pix[1] = _nodes[g];
+                    pix[2] = _nodes[b];
+                    pix += 3;
+                }
+            }
+        }
+        OCIO::PackedImageDesc img(rgb, n, n * (b2 - b1), 3);
+        _proc->apply(img);
+    }
+
+    const OCIO::ConstProcessorRcPtr& _proc;
+    const std::vector<float>& _nodes;
+    float* _rgb;
+};
+
+OCIOBakedLut::OCIOBakedLut(const OCIO::ConstProcessorRcPtr& proc,
+                           const Shaper& shaper)
+    : _shaper(shaper)
+    , _shaperLut(kShaperLutSize)
+    , _lut()
+    , _shaperLutData(NULL)
+    , _lutData(NULL)
+{
+    assert(proc);
+    const int n = kOCIOBakedLutSize;
+
+    for (unsigned int i = 0; i < 65536; ++i) {
+        const unsigned int bits = i << 16;
+        float x;
+        std::memcpy( &x, &bits, sizeof(x) );
+        _shaperLut[i] = _shaper.apply(x) * (n - 1);
+    }
+    // the last entry is only used to interpolate within the last NaN
+    _shaperLut[65536] = _shaperLut[65535];
+
+    std::vector<float> nodes(n);
+    for (int i = 0; i < n; ++i) {
+        nodes[i] = _shaper.invert( (float)i / (n - 1) );
+    }
+    std::vector<float> rgb( (std::size_t)n * n * n * 3 );
+    OCIOLutBaker baker(proc, nodes, &rgb[0]);
+    baker.multiThread();
+
+    // pad to RGB0, so that a node is loaded with a single vector load
+    _lut.resize(kLutDataSize);
+    for (std::size_t i = 0; i < (std::size_t)n * n * n; ++i) {
+        _lut[i * 4 + 0] = rgb[i * 3 + 0];
+        _lut[i * 4 + 1] = rgb[i * 3 + 1];
+        _lut[i * 4 + 2] = rgb[i * 3 + 2];
+        _lut[i * 4 + 3] = 0.f;
+    }
+    setData(&_shaperLut[0], &_lut[0]);
+}
+
+OCIOBakedLut::OCIOBakedLut(const Shaper& shaper)
+    : _shaper(shaper)
+    , _shaperLut()
+    , _lut()
+    , _shaperLutData(NULL)
+    , _lutData(NULL)
+{
+}
+
+void
+OCIOBakedLut::apply(float* pix,
+                    int n,
+                    int nComps) const
+{
+    const int size = kOCIOBakedLutSize;
+    const int sr = 4;
+    const int sg = 4 * size;
+    const int sb = 4 * size * size;
+    const float* shaperLut = _shaperLutData;
+    const float* lut = _lutData;
+
+    assert(shaperLut && lut);
+
+    for (int i = 0; i < n; ++i, pix += nComps) {
+        const float fr = shapeCoord(shaperLut, pix[0]);
+        const float fg = shapeCoord(shaperLut, pix[1]);
+        const float fb = shapeCoord(shaperLut, pix[2]);
+        const int ir = std::min( (int)fr, size - 2 );
+        const int ig = std::min( (int)fg, size - 2 );
+        const int ib = std::min( (int)fb, size - 2 );
+        const float dr = fr - ir;
+        const float dg = fg - ig;
+        const float db = fb - ib;
+        // tetrahedral interpolation: find the tetrahedron containing the point, and the weights of its vertices
+        int o1, o2;
+        float w1, w2, w3;
+        if (dr > dg) {
+            if (dg > db) {
+                o1 = sr; o2 = sr + sg; w1 = dr; w2 = dg; w3 = db;
+            } else if (dr > db) {
+                o1 = sr; o2 = sr + sb; w1 = dr; w2 = db; w3 = dg;
+            } else {
+                o1 = sb; o2 = sb + sr; w1 = db; w2 = dr; w3 = dg;
+            }
+        } else {
+            if (db > dg) {
+                o1 = sb; o2 = sb + sg; w1 = db; w2 = dg; w3 = dr;
+            } else if (db > dr) {
+                o1 = sg; o2 = sg + sb; w1 = dg; w2 = db; w3 = dr;
+            } else {
+                o1 = sg; o2 = sg + sr; w1 = dg; w2 = dr; w3 = db;
+            }
+        }
+        const float* c = lut + ir * sr + ig * sg + ib * sb;
+        const int o3 = sr + sg + sb;
+#if defined(OCIO_BAKED_LUT_SSE2)
+        __m128 v = _mm_mul_ps( _mm_loadu_ps(c), _mm_set1_ps(1.f - w1) );
+        v = _mm_add_ps( v, _mm_mul_ps( _mm_loadu_ps(c + o1), _mm_set1_ps(w1 - w2) ) );
+        v = _mm_add_ps( v, _mm_mul_ps( _mm_loadu_ps(c + o2), _mm_set1_ps(w2 - w3) ) );
+        v = _mm_add_ps( v, _mm_mul_ps( _mm_loadu_ps(c + o3), _mm_set1_ps(w3) ) );
+        float out[4];
+        _mm_storeu_ps(out, v);
+        pix[0] = out[0];
+        pix[1] = out[1];
+        pix[2] = out[2];
+#elif defined(OCIO_BAKED_LUT_NEON)
+        float32x4_t v = vmulq_n_f32(vld1q_f32(c), 1.f - w1);
+        v = vmlaq_n_f32(v, vld1q_f32(c + o1), w1 - w2);
+        v = vmlaq_n_f32(v, vld1q_f32(c + o2), w2 - w3);
+        v = vmlaq_n_f32(v, vld1q_f32(c + o3), w3);
+        float out[4];
+        vst1q_f32(out, v);
+        pix[0] = out[0];
+        pix[1] = out[1];
+        pix[2] = out[2];
+#else
+        for (int k = 0; k < 3; ++k) {
+            pix[k] = c[k] * (1.f - w1) + c[o1 + k] * (w1 - w2) + c[o2 + k] * (w2 - w3) + c[o3 + k] * w3;
+        }
+#endif
+    }
+} // OCIOBakedLut::apply
+
+OCIOBakedLut::Error
+OCIOBakedLut::measureError(const OCIO::ConstProcessorRcPtr& proc) const
+{
+    // sample the middle of the cells of a grid that is not aligned with the LUT nodes
+    const int n = (kOCIOBakedLutSize + 1) / 2;
+    const std::size_t count = (std::size_t)n * n * n;
+    std::vector<float> input(count * 3);
+    float* pix = &input[0];
+
+    for (int b = 0; b < n; ++b) {
+        for (int g = 0; g < n; ++g) {
+            for (int r = 0; r < n; ++r) {
+                pix[0] = _shaper.invert( (r + 0.5f) / n );
+                pix[1] = _shaper.invert( (g + 0.5f) / n );
+                pix[2] = _shaper.invert( (b + 0.5f) / n );
+                pix += 3;
+            }
+        }
+    }
+    std::vector<float> exact(input);
+    OCIO::PackedImageDesc img(&exact[0], n, n * n, 3);
+    proc->apply(img);
+    std::vector<float> baked(input);
+    apply(&baked[0], (int)count, 3);
+
+    Error error;
+    error.maxError = 0.f;
+    std::memset( error.input, 0, sizeof(error.input) );
+    std::memset( error.exact, 0, sizeof(error.exact) );
+    std::memset( error.baked, 0, sizeof(error.baked) );
+    for (std::size_t i = 0; i < count; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            const float e = std::abs(baked[i * 3 + k] - exact[i * 3 + k]);
+            // NaNs produced by the exact transform are ignored
+            if (e > error.maxError) {
+                error.maxError = e;
+                for (int j = 0; j < 3; ++j) {
+                    error.input[j] = input[i * 3 + j];
+                    error.exact[j] = exact[i * 3 + j];
+                    error.baked[j] = baked[i * 3 + j];
+                }
+            }
+        }
+    }
+
+    return error;
+} // OCIOBakedLut::measureError
+
+string
+OCIOBakedLut::getErrorReport(const OCIO::ConstProcessorRcPtr& proc) const
+{
+    const int n = (kOCIOBakedLutSize + 1) / 2;
+    const Error error = measureError(proc);
+    std::ostringstream os;
+
+    os << "Fast CPU mode: maximum error " << error.maxError << " on " << n << 'x' << n << 'x' << n << " points";
+    if (error.maxError > 0.f) {
+        os << ", for input (" << error.input[0] << ", " << error.input[1] << ", " << error.input[2] << ')';
+        os << "\nexact: (" << error.exact[0] << ", " << error.exact[1] << ", " << error.exact[2] << ')';
+        os << "\nfast: (" << error.baked[0] << ", " << error.baked[1] << ", " << error.baked[2] << ')';
+    }
+    os << "\nInput range: ";
+    if (_shaper.log2) {
+        os << "log2 from " << _shaper.min << " to " << _shaper.max;
+        if (_shaper.offset != 0.f) {
+            os << " with offset " << _shaper.offset;
+        }
+    } else {
+        os << _shaper.min << " to " << _shaper.max;
+    }
+    os << ", values outside of this range are clamped.";
+
+    return os.str();
+}
+
+// maximum difference between the output of a processor on a color and the output of its channel LUTs, relative to
+// the output value (above 1) for the processor to be considered separable: only float rounding differences are allowed
+#define kOCIOChannelLutTolerance 1e-5f
+
+static inline bool
+isNearlyEqual(float a,
+              float b)
+{
+    // NaNs are never equal
+    return std::abs(a - b) <= kOCIOChannelLutTolerance * std::max( 1.f, std::abs(b) );
+}
+
+OCIOChannelLut::OCIOChannelLut(const OCIO::ConstProcessorRcPtr& proc,
+                               int maxValue)
+    : _maxValue(maxValue)
+    , _separable(false)
+    , _lut( (std::size_t)(maxValue + 1) * 3 )
+{
+    assert(proc && 0 < maxValue && maxValue <= 65535);
+    const int size = maxValue + 1;
+
+    // Separability is checked on the float outputs at 16-bit precision, whatever maxValue is: 8-bit results
+    // would hide the cross-channel terms that are smaller than a code value.
+    // The channel curves are computed on a gray ramp, with an alpha ramp in the other direction to check that
+    // alpha is not modified.
+    const int checkMaxValue = 65535;
+    const int checkSize = checkMaxValue + 1;
+    const float checkScale = 1.f / checkMaxValue;
+    std::vector<float> ramp( (std::size_t)checkSize * 4 );
+    for (int i = 0; i < checkSize; ++i) {
+        ramp[i * 4 + 0] = ramp[i * 4 + 1] = ramp[i * 4 + 2] = i * checkScale;
+        ramp[i * 4 + 3] = (checkMaxValue - i) * checkScale;
+    }
+    std::vector<float> curves(ramp);
+    {
+        OCIO::PackedImageDesc img(&curves[0], checkSize, 1, 4);
+        proc->apply(img);
+    }
+    bool separable = true;
+    for (int i = 0; separable && i < checkSize; ++i) {
+        separable = (curves[i * 4 + 3] == ramp[i * 4 + 3]);
+    }
+
+    // each channel must only depend on itself: check that proc gives the same result as the curves on the nodes
+    // of the kOCIOBakedLutSize^3 lattice (which contains the nodes of the 17^3 and 33^3 LUTs of .cube and .3dl
+    // files), and on the centers of its cells, so that a cross-channel change between nodes is also seen.
+    // The colors are processed one blue plane at a time, and the check stops at the first difference.
+    const int cells = kOCIOBakedLutSize - 1;
+    std::vector<int> codes;
+    codes.reserve(2 * cells + 1);
+    for (int k = 0; k <= 2 * cells; ++k) {
+        codes.push_back( (k * checkMaxValue + cells) / (2 * cells) );
+    }
+    std::vector<float> plane( (std::size_t)(cells + 1) * (cells + 1) * 4 );
+    for (int center = 0; separable && center < 2; ++center) {
+        // the nodes are the even codes, the centers of the cells the odd codes
+        const int n = center ? cells : (cells + 1);
+        for (int b = 0; separable && b < n; ++b) {
+            const int cb = codes[2 * b + center];
+            float* pix = &plane[0];
+            for (int g = 0; g < n; ++g) {
+                for (int r = 0; r < n; ++r) {
+                    pix[0] = codes[2 * r + center] * checkScale;
+                    pix[1] = codes[2 * g + center] * checkScale;
+                    pix[2] = cb * checkScale;
+                    pix[3] = 1.f;
+                    pix += 4;
+                }
+            }
+            {
+                OCIO::PackedImageDesc img(&plane[0], n, n, 4);
+                proc->apply(img);
+            }
+            pix = &plane[0];
+            for (int g = 0; separable && g < n; ++g) {
+                const int cg = codes[2 * g + center];
+                for (int r = 0; separable && r < n; ++r) {
+                    const int cr = codes[2 * r + center];
+                    separable = ( isNearlyEqual(pix[0], curves[cr * 4 + 0]) &&
+                                  isNearlyEqual(pix[1], curves[cg * 4 + 1]) &&
+                                  isNearlyEqual(pix[2], curves[cb * 4 + 2]) &&
+                                  pix[3] == 1.f );
+                    pix += 4;
+                }
+            }
+        }
+    }
+    _separable = separable;
+    if (!separable) {
+        return;
+    }
+
+    // the LUTs for integer pixels with values in [0, maxValue]
+    std::vector<float> lutCurves;
+    const float* out = &curves[0];
+    if (maxValue != checkMaxValue) {
+        const float scale = 1.f / maxValue;
+        lutCurves.resize( (std::size_t)size * 4 );
+        for (int i = 0; i < size; ++i) {
+            lutCurves[i * 4 + 0] = lutCurves[i * 4 + 1] = lutCurves[i * 4 + 2] = i * scale;
+            lutCurves[i * 4 + 3] = 1.f;
+        }
+        OCIO::PackedImageDesc img(&lutCurves[0], size, 1, 4);
+        proc->apply(img);
+        out = &lutCurves[0];
+    }
+    for (int i = 0; i < size; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            _lut[c * size + i] = (unsigned short)floatToInt(out[i * 4 + c], maxValue);
+        }
+    }
+} // OCIOChannelLut::OCIOChannelLut
+
+#endif // OFX_IO_USING_OCIO
+
+#ifdef OFX_IO_USING_OCIO
+static OCIOProcessorCache gOCIOProcessorCache;
+
+OCIOProcessorCache&
+OCIOProcessorCache::instance()
+{
+    return gOCIOProcessorCache;
+}
+
+OCIOProcessorCache::OCIOProcessorCache()
+    : _lock()
+    , _entries()
+    , _lru()
+    , _lutLock()
+    , _lutBuilt()
+    , _bakedLuts()
+    , _channelLuts()
+    , _maxEntries(kOCIOProcessorCacheSizeDefault)
+    , _hits(0)
+    , _misses(0)
+    , _evictions(0)
+{
+    const char* maxEntriesEnv = std::getenv(kOCIOProcessorCacheSizeEnv);
+
+    if (maxEntriesEnv) {
+        long maxEntries = std::strtol(maxEntriesEnv, NULL, 10);
+        _maxEntries = (maxEntries > 0) ? (std::size_t)maxEntries : 0;
+    }
+}
+
+OCIOProcessorCache::~OCIOProcessorCache()
+{
+    DBG( std::printf("OCIOProcessorCache: %llu hits, %llu misses, %llu evictions\n", _hits, _misses, _evictions) );
+}
+
+string
+OCIOProcessorCache::getKey(const OCIO::ConstConfigRcPtr& config,
+                           const OCIO::ConstContextRcPtr& context,
+                           const string& description)
+{
+    // the config cache ID covers the colorspace definitions and the files they reference, and the
+    // context cache ID the variables that may be used by the transform (e.g. in a FileTransform path)
+    string key( config->getCacheID(context) );
+
+    key += '|';
+    if (context) {
+        key += context->getCacheID();
+    }
+    key += '|';
+    key += description;
+
+    return key;
+}
+
+void
+OCIOProcessorCache::appendKey(string* description,
+                              const string& value)
+{
+    std::ostringstream ss;
+
+    ss << value.size() << ':' << value << ';';
+    *description += ss.str();
+}
+
+void
+OCIOProcessorCache::appendKey(string* description,
+                              double value)
+{
+    std::ostringstream ss;
+
+    ss << std::setprecision(17) << value << ';';
+    *description += ss.str();
+}
+
+void
+OCIOProcessorCache::appendKey(string* description,
+                              int value)
+{
+    std::ostringstream ss;
+
+    ss << value << ';';
+    *description += ss.str();
+}
+
+OCIO::ConstProcessorRcPtr
+OCIOProcessorCache::get(const string& key)
+{
+    MultiThread::AutoMutexT<Mutex> l(_lock);
+    EntryMap::iterator it = _entries.find(key);
+
+    if ( it == _entries.end() ) {
+        ++_misses;
+
+        return OCIO::ConstProcessorRcPtr();
+    }
+    ++_hits;
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+
+    return it->second.proc;
+}
+
+void
+OCIOProcessorCache::set(const string& key,
+                        const OCIO::ConstProcessorRcPtr& proc)
+{
+    if ( (_maxEntries == 0) || !proc ) {
+        return;
+    }
+    // the evicted processors are destroyed outside of the lock, since they may hold large LUTs
+    std::vector<OCIO::ConstProcessorRcPtr> evicted;
+    {
+        MultiThread::AutoMutexT<Mutex> l(_lock);
+        EntryMap::iterator it = _entries.find(key);
+        if ( it != _entries.end() ) {
+            // another thread created the same processor meanwhile
+            it->second.proc = proc;
+            _lru.splice(_lru.begin(), _lru, it->second.lru);
+
+            return;
+        }
+        _lru.push_front(key);
+        Entry& entry = _entries[key];
+        entry.proc = proc;
+        entry.lru = _lru.begin();
+        while (_entries.size() > _maxEntries) {
+            EntryMap::iterator last = _entries.find( _lru.back() );
+            assert( last != _entries.end() );
+            evicted.push_back(last->second.proc);
+            _entries.erase(last);
+            _lru.pop_back();
+            ++_evictions;
+        }
+    }
+}
+
+void
+OCIOProcessorCache::purge()
+{
+    EntryMap entries;
+    BakedLutList bakedLuts;
+    ChannelLutList channelLuts;
+    {
+        MultiThread::AutoMutexT<Mutex> l(_lock);
+        _entries.swap(entries);
+        _lru.clear();
+    }
+    {
+        // pending LUTs are not cached when they are built
+        tthread::lock_guard<tthread::mutex> l(_lutLock);
+        _bakedLuts.swap(bakedLuts);
+        _channelLuts.swap(channelLuts);
+    }
+}
+
+OCIOProcessorCache::BakedLutList::iterator
+OCIOProcessorCache::findBakedLutLocked(const OCIO::ConstProcessorRcPtr& proc,
+                                       const OCIOBakedLut::Shaper& shaper)
+{
+    BakedLutList::iterator it = _bakedLuts.begin();
+
+    while ( it != _bakedLuts.end() && !( (it->proc == proc) && (it->shaper == shaper) ) ) {
+        ++it;
+    }
+
+    return it;
+}
+
+OCIOBakedLutRcPtr
+OCIOProcessorCache::getBakedLut(const OCIO::ConstProcessorRcPtr& proc,
+                                const OCIOBakedLut::Shaper& shaper)
+{
+    assert(proc);
+    // the evicted LUTs are destroyed outside of the lock
+    BakedLutList evicted;
+    tthread::lock_guard<tthread::mutex> l(_lutLock);
+    for (;;) {
+        BakedLutList::iterator it = findBakedLutLocked(proc, shaper);
+        if ( it == _bakedLuts.end() ) {
+            break;
+        }
+        if (it->lut) {
+            _bakedLuts.splice(_bakedLuts.begin(), _bakedLuts, it);
+
+            return it->lut;
+        }
+        // another thread is baking it
+        _lutBuilt.wait(_lutLock);
+    }
+    BakedLut pending;
+    pending.proc = proc;
+    pending.shaper = shaper;
+    _bakedLuts.push_front(pending);
+
+    // baking is multithreaded: the workers may be shared with renders that need other LUTs meanwhile
+    OCIOBakedLutRcPtr lut;
+    _lutLock.unlock();
+    try {
+        lut.reset( new OCIOBakedLut(proc, shaper) );
+    } catch (...) {
+        _lutLock.lock();
+        BakedLutList::iterator it = findBakedLutLocked(proc, shaper);
+        if ( it != _bakedLuts.end() ) {
+            _bakedLuts.erase(it);
+        }
+        _lutBuilt.notify_all();
+        throw;
+    }
+    _lutLock.lock();
+    // the pending entry is gone if the cache was purged meanwhile: the LUT is then not cached
+    BakedLutList::iterator it = findBakedLutLocked(proc, shaper);
+    if ( it != _bakedLuts.end() ) {
+        it->lut = lut;
+        _bakedLuts.splice(_bakedLuts.begin(), _bakedLuts, it);
+    }
+    // evict the least recently used LUTs, but not those that are being baked
+    it = _bakedLuts.end();
+    while ( (_bakedLuts.size() > kOCIOBakedLutCacheSize) && ( it != _bakedLuts.begin() ) ) {
+        BakedLutList::iterator last = --it;
+        if (last->lut) {
+            ++it;
+            evicted.splice(evicted.begin(), _bakedLuts, last);
+        }
+    }
+    _lutBuilt.notify_all();
+
+    return lut;
+} // OCIOProcessorCache::getBakedLut
+
+OCIOProcessorCache::ChannelLutList::iterator
+OCIOProcessorCache::findChannelLutLocked(const OCIO::ConstProcessorRcPtr& proc,
+                                         int maxValue)
+{
+    ChannelLutList::iterator it = _channelLuts.begin();
+
+    while ( it != _channelLuts.end() && !( (it->proc == proc) && (it->maxValue == maxValue) ) ) {
+        ++it;
+    }
+
+    return it;
+}
+
+OCIOChannelLutRcPtr
+OCIOProcessorCache::getChannelLut(const OCIO::ConstProcessorRcPtr& proc,
+                                  int maxValue)
+{
+    assert(proc);
+    ChannelLutList evicted;
+    tthread::lock_guard<tthread::mutex> l(_lutLock);
+    for (;;) {
+        ChannelLutList::iterator it = findChannelLutLocked(proc, maxValue);
+        if ( it == _channelLuts.end() ) {
+            break;
+        }
+        if (it->lut) {
+            _channelLuts.splice(_channelLuts.begin(), _channelLuts, it);
+
+            return it->lut;
+        }
+        // another thread is building it
+        _lutBuilt.wait(_lutLock);
+    }
+    ChannelLut pending;
+    pending.proc = proc;
+    pending.maxValue = maxValue;
+    _channelLuts.push_front(pending);
+
+    OCIOChannelLutRcPtr lut;
+    _lutLock.unlock();
+    try {
+        lut.reset( new OCIOChannelLut(proc, maxValue) );
+    } catch (...) {
+        _lutLock.lock();
+        ChannelLutList::iterator it = findChannelLutLocked(proc, maxValue);
+        if ( it != _channelLuts.end() ) {
+            _channelLuts.erase(it);
+        }
+        _lutBuilt.notify_all();
+        throw;
+    }
+    _lutLock.lock();
+    ChannelLutList::iterator it = findChannelLutLocked(proc, maxValue);
+    if ( it != _channelLuts.end() ) {
+        it->lut = lut;
+        _channelLuts.splice(_channelLuts.begin(), _channelLuts, it);
+    }
+    it = _channelLuts.end();
+    while ( (_channelLuts.size() > kOCIOChannelLutCacheSize) && ( it != _channelLuts.begin() ) ) {
+        ChannelLutList::iterator last = --it;
+        if (last->lut) {
+            ++it;
+            evicted.splice(evicted.begin(), _channelLuts, last);
+        }
+    }
+    _lutBuilt.notify_all();
+
+    return lut;
+} // OCIOProcessorCache::getChannelLut
+
+OCIOBakedLutRcPtr
+OCIOBakedLutRef::get(const OCIO::ConstProcessorRcPtr& proc,
+                     const OCIOBakedLut::Shaper& shaper)
+{
+    {
+        MultiThread::AutoMutexT<tthread::fast_mutex> l(_mutex);
+        if ( _lut && (_proc == proc) && (_lut->getShaper() == shaper) ) {
+            return _lut;
+        }
+    }
+    OCIOBakedLutRcPtr lut = OCIOProcessorCache::instance().getBakedLut(proc, shaper);
+    // the previous LUT is destroyed outside of the lock
+    OCIO::ConstProcessorRcPtr oldProc;
+    OCIOBakedLutRcPtr oldLut;
+    {
+        MultiThread::AutoMutexT<tthread::fast_mutex> l(_mutex);
+        oldProc = _proc;
+        oldLut = _lut;
+        _proc = proc;
+        _lut = lut;
+    }
+
+    return lut;
+}
+
+void
+OCIOBakedLutRef::reset()
+{
+    OCIO::ConstProcessorRcPtr oldProc;
+    OCIOBakedLutRcPtr oldLut;
+    MultiThread::AutoMutexT<tthread::fast_mutex> l(_mutex);
+
+    oldProc.swap(_proc);
+    oldLut.swap(_lut);
+}
+
+OCIOProcessorCache::Stats
+OCIOProcessorCache::getStats() const
+{
+    MultiThread::AutoMutexT<Mutex> l(_lock);
+    Stats stats;
+
+    stats.hits = _hits;
+    stats.misses = _misses;
+    stats.evictions = _evictions;
+    stats.size = _entries.size();
+
+    return stats;
+}
+
+#endif // OFX_IO_USING_OCIO
+
 NAMESPACE_OFX_IO_EXIT
 NAMESPACE_OFX_EXIT
@@ -24,17 +24,21 @@
 #ifndef IO_GenericOCIO_h
 #define IO_GenericOCIO_h
 
+#include <cassert>
+#include <cstddef>
+#include <list>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsPixelProcessor.h"
 #include "ofxsMultiThread.h"
-#ifndef OFX_USE_MULTITHREAD_MUTEX
 // some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
 // prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+// (it is also used by the OCIOProcessorCache, which is created before the host suites are available)
 #include "fast_mutex.h"
-#endif
+#include "tinythread.h"
 
 // define OFX_OCIO_CHOICE to enable the colorspace choice popup menu
 #define OFX_OCIO_CHOICE
@@ -72,6 +76,30 @@ NAMESPACE_OFX_ENTER
 #define kOCIOParamOutputSpaceLabel ""
 #endif
 
+// maximum number of OCIO processors kept by all the OCIO plug-ins (0 disables the cache).
+// The default value can be overriden using the environment variable OFX_IO_OCIO_PROCESSORS
+#define kOCIOProcessorCacheSizeEnv "OFX_IO_OCIO_PROCESSORS"
+#define kOCIOProcessorCacheSizeDefault 64
+
+// number of nodes along each axis of the 3D LUTs used by the fast CPU mode
+#define kOCIOBakedLutSize 65
+// number of baked LUTs kept by the OCIOProcessorCache (each takes 65^3*16 bytes, about 4.4MB).
+// Each instance also keeps the LUT it used last (see OCIOBakedLutRef), so that this only bounds the LUTs kept for
+// instances that changed their transform.
+#define kOCIOBakedLutCacheSize 4
+// number of per-channel LUTs for 8-bit and 16-bit images kept by the OCIOProcessorCache (at most 384KB each)
+#define kOCIOChannelLutCacheSize 16
+
+#define kOCIOParamFastCPU "ocioFastCPU"
+#define kOCIOParamFastCPULabel "Fast CPU"
+#define kOCIOParamFastCPUHint \
+    "When rendering on the CPU, bake the transform into a 65x65x65 3D LUT with a shaper, " \
+    "and apply it with a tetrahedral interpolation, as is done on the GPU. This is much faster for display transforms and complex looks, but approximate, " \
+    "and input values outside of the allocation of the input colorspace are clamped. Press \"Measure Error\" to compare with the exact transform."
+#define kOCIOParamFastCPUError "ocioFastCPUError"
+#define kOCIOParamFastCPUErrorLabel "Measure Error..."
+#define kOCIOParamFastCPUErrorHint "Measure the maximum difference between the fast CPU mode and the exact transform, at the current time."
+
 #define kOCIOParamContext "Context"
 #define kOCIOParamContextLabel "OCIO Context"
 #define kOCIOParamContextHint \
@@ -89,6 +117,186 @@ NAMESPACE_OFX_ENTER
 #define kOCIOParamContextKey4 "key4"
 #define kOCIOParamContextValue4 "value4"
 
+#ifdef OFX_IO_USING_OCIO
+/// Convert a value in [0,1] to an integer in [0,maxValue] (NaNs give 0), as done by the OCIO processors for 8-bit and 16-bit images.
+inline int
+floatToInt(float v,
+           int maxValue)
+{
+    if ( !(v > 0.f) ) {
+        return 0;
+    }
+    if (v >= 1.f) {
+        return maxValue;
+    }
+
+    return (int)(v * maxValue + 0.5f);
+}
+
+/**
+ * @brief An OCIO processor baked into a 1D shaper and a 3D LUT, for the fast CPU mode.
+ *
+ * Applying the whole chain of OCIO ops to each pixel is expensive for display transforms and complex
+ * looks, while a tetrahedral interpolation in a 3D LUT has a fixed, low cost. The result is approximate:
+ * getErrorReport() measures the maximum error against the exact processor, so that users can choose.
+ * As in the OCIO GPU path, the shaper maps the allocation of the input colorspace (uniform or log2) to
+ * the LUT domain, and values outside of the allocation are clamped.
+ **/
+class OCIOBakedLut
+{
+public:
+    struct Shaper
+    {
+        Shaper();
+
+        /// The shaper for the allocation of colorSpace (uniform on [0,1] if it is not in config).
+        static Shaper fromColorSpace(const OCIO_NAMESPACE::ConstConfigRcPtr& config, const std::string& colorSpace);
+
+        bool operator==(const Shaper& other) const
+        {
+            return log2 == other.log2 && min == other.min && max == other.max && offset == other.offset;
+        }
+
+        /// Map x to [0,1].
+        float apply(float x) const;
+
+        /// The inverse of apply() on [0,1].
+        float invert(float t) const;
+
+        bool log2; // log2 or uniform allocation
+        float min;
+        float max;
+        float offset; // added before taking the log2
+    };
+
+    struct Error
+    {
+        float maxError; // maximum absolute difference, over all channels
+        float input[3];
+        float exact[3];
+        float baked[3];
+    };
+
+    /// Number of entries of the shaper LUT (see getShaperLutData()).
+    static const std::size_t kShaperLutSize = 65536 + 1;
+
+    /// Number of floats of the 3D LUT (see getLutData()).
+    static const std::size_t kLutDataSize = (std::size_t)kOCIOBakedLutSize * kOCIOBakedLutSize * kOCIOBakedLutSize * 4;
+
+    OCIOBakedLut(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, const Shaper& shaper);
+
+    virtual ~OCIOBakedLut() {}
+
+    const Shaper& getShaper() const { return _shaper; }
+
+    /// The prepared LUT data, e.g. to save it to a file: kShaperLutSize and kLutDataSize floats.
+    const float* getShaperLutData() const { return _shaperLutData; }
+    const float* getLutData() const { return _lutData; }
+
+    /// Apply the LUT to n RGB or RGBA (nComps = 3 or 4) pixels. Alpha is left unchanged.
+    void apply(float* pix, int n, int nComps) const;
+
+    /// Compare with proc (the processor that was baked) on points between the LUT nodes, within the shaper range.
+    Error measureError(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc) const;
+
+    /// The result of measureError(), as a message for the user.
+    std::string getErrorReport(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc) const;
+
+protected:
+    /// For LUTs whose data is stored elsewhere (e.g. in a memory-mapped file): the subclass must call setData().
+    explicit OCIOBakedLut(const Shaper& shaper);
+
+    /// Use data that was obtained from getShaperLutData() and getLutData() with the same shaper. It is not copied.
+    void setData(const float* shaperLutData, const float* lutData)
+    {
+        _shaperLutData = shaperLutData;
+        _lutData = lutData;
+    }
+
+private:
+    // non-copyable
+    OCIOBakedLut(const OCIOBakedLut&);
+    OCIOBakedLut& operator=(const OCIOBakedLut&);
+
+    Shaper _shaper;
+    std::vector<float> _shaperLut; // LUT coordinate of each float, indexed by its 16 high bits
+    std::vector<float> _lut; // RGB0 nodes, red varies fastest
+    const float* _shaperLutData; // &_shaperLut[0], unless the data is stored by a subclass
+    const float* _lutData; // &_lut[0], unless the data is stored by a subclass
+};
+
+typedef OCIO_SHARED_PTR<const OCIOBakedLut> OCIOBakedLutRcPtr;
+
+/**
+ * @brief The per-channel 1D LUTs of an OCIO processor, for 8-bit and 16-bit pixels.
+ *
+ * Many transforms (log/lin conversions, gammas, 1D LUT files) process each channel independently: integer
+ * pixels can then be looked up directly, without converting them to float and back.
+ * OCIO does not expose the ops of a processor, so whether it is separable is checked on the nodes and cell centers
+ * of a kOCIOBakedLutSize^3 lattice, by comparing the float outputs of the processor with those of its channel
+ * curves at 16-bit precision.
+ **/
+class OCIOChannelLut
+{
+public:
+    OCIOChannelLut(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, int maxValue);
+
+    int getMaxValue() const { return _maxValue; }
+
+    /// Does each output channel only depend on the same input channel, with alpha unchanged? If not, apply() must not be used.
+    bool isSeparable() const { return _separable; }
+
+    /// Apply the LUTs to n RGB or RGBA (nComps = 3 or 4) pixels with values in [0, maxValue].
+    template <class PIX>
+    void apply(PIX* pix, int n, int nComps) const
+    {
+        assert(_separable);
+        const unsigned short* r = &_lut[0];
+        const unsigned short* g = r + _maxValue + 1;
+        const unsigned short* b = g + _maxValue + 1;
+        for (int i = 0; i < n; ++i, pix += nComps) {
+            pix[0] = (PIX)r[pix[0]];
+            pix[1] = (PIX)g[pix[1]];
+            pix[2] = (PIX)b[pix[2]];
+        }
+    }
+
+private:
+    int _maxValue;
+    bool _separable;
+    std::vector<unsigned short> _lut; // the R, G and B LUTs, of maxValue + 1 entries each
+};
+
+typedef OCIO_SHARED_PTR<const OCIOChannelLut> OCIOChannelLutRcPtr;
+
+/**
+ * @brief The baked LUT an instance used last, kept with the instance next to its processor.
+ *
+ * The OCIOProcessorCache only keeps the last kOCIOBakedLutCacheSize baked LUTs: with more instances in fast CPU
+ * mode, each of them would otherwise bake its LUT again at each render.
+ **/
+class OCIOBakedLutRef
+{
+public:
+    OCIOBakedLutRef()
+        : _mutex()
+        , _proc()
+        , _lut()
+    {}
+
+    /// proc baked with shaper: the kept LUT if it matches, else the one from the OCIOProcessorCache, which is then kept.
+    OCIOBakedLutRcPtr get(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, const OCIOBakedLut::Shaper& shaper);
+
+    void reset();
+
+private:
+    tthread::fast_mutex _mutex;
+    OCIO_NAMESPACE::ConstProcessorRcPtr _proc; // keeps the processor alive, so that its address is not reused
+    OCIOBakedLutRcPtr _lut;
+};
+
+#endif // ifdef OFX_IO_USING_OCIO
+
 class OCIOOpenGLContextData
 {
 public:
@@ -152,6 +360,8 @@ public:
 
     void apply(double time, const OfxRectI& renderWindow, OFX::Image* dstImg);
     void apply(double time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    /// Apply to pixelData in place, which may be float, or 8-bit or 16-bit (bitDepth).
+    void apply(double time, const OfxRectI& renderWindow, void *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, OFX::BitDepthEnum bitDepth, int rowBytes);
     void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName);
     void purgeCaches();
     void getInputColorspaceDefault(std::string &v) const;
@@ -176,10 +386,29 @@ public:
     static void describeInContextInput(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, OFX::PageParamDescriptor *page, const char* inputSpaceNameDefault, const char* inputSpaceLabel = kOCIOParamInputSpaceLabel);
     static void describeInContextOutput(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, OFX::PageParamDescriptor *page, const char* outputSpaceNameDefault, const char* outputSpaceLabel = kOCIOParamOutputSpaceLabel);
     static void describeInContextContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, OFX::PageParamDescriptor *page);
+    static void describeInContextFastCPU(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, OFX::PageParamDescriptor *page);
 
 #ifdef OFX_IO_USING_OCIO
     void setValues(const std::string& inputSpace, const std::string& outputSpace);
     void setValues(const OCIO_NAMESPACE::ConstContextRcPtr &context, const std::string& inputSpace, const std::string& outputSpace);
+
+    /**
+     * @brief The baked version of proc if the kOCIOParamFastCPU parameter of effect is checked at time, else a NULL pointer.
+     * The shaper is built from the allocation of inputSpace. Used by GenericOCIO and the OCIO plug-ins, which pass
+     * the LUT they keep in lastLut.
+     **/
+    static OCIOBakedLutRcPtr getFastCPULut(OFX::BooleanParam* fastCPU,
+                                           double time,
+                                           const OCIO_NAMESPACE::ConstConfigRcPtr& config,
+                                           const std::string& inputSpace,
+                                           const OCIO_NAMESPACE::ConstProcessorRcPtr& proc,
+                                           OCIOBakedLutRef* lastLut);
+
+    /// Show the error of the baked version of proc to the user (see kOCIOParamFastCPUError).
+    static void showFastCPUError(OFX::ImageEffect* effect,
+                                 const OCIO_NAMESPACE::ConstConfigRcPtr& config,
+                                 const std::string& inputSpace,
+                                 const OCIO_NAMESPACE::ConstProcessorRcPtr& proc);
 #endif
 
     // Calls inputCheck and outputCheck
@@ -224,15 +453,14 @@ private:
     OFX::StringParam* _contextValue3;
     OFX::StringParam* _contextKey4;
     OFX::StringParam* _contextValue4;
+    OFX::BooleanParam* _fastCPU;
 
     OCIO_NAMESPACE::ConstConfigRcPtr _config;
 
     mutable Mutex _procMutex;
     OCIO_NAMESPACE::ConstProcessorRcPtr _proc;
-    OCIO_NAMESPACE::ConstContextRcPtr _procContext;
-    std::string _procInputSpace;
-    std::string _procOutputSpace;
-    //OCIO_NAMESPACE::ConstTransformRcPtr _procTransform;
+    std::string _procKey; // the OCIOProcessorCache key of _proc
+    OCIOBakedLutRef _bakedLut; // the baked version of _proc (see kOCIOParamFastCPU)
 #endif
 };
 
@@ -245,10 +473,11 @@ public:
     OCIOProcessor(OFX::ImageEffect &instance)
         : OFX::PixelProcessor(instance)
         , _proc()
+        , _bakedLut()
         , _instance(&instance)
     {}
 
-    // and do some processing
+    // and do some processing. The destination image may be float, or 8-bit or 16-bit, which is processed in place.
     void multiThreadProcessImages(OfxRectI procWindow);
 
     void setProcessor(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc)
@@ -256,11 +485,132 @@ public:
         _proc = proc;
     }
 
+    /// If set, apply lut (the baked version of the processor) instead of the processor (see kOCIOParamFastCPU).
+    /// The processor may then be left unset, but is still used if it is set, for 8-bit and 16-bit separable transforms.
+    void setBakedLut(const OCIOBakedLutRcPtr& lut)
+    {
+        _bakedLut = lut;
+    }
+
 private:
+    template <class PIX, int maxValue>
+    void processIntegerPixels(const OfxRectI& procWindow, int numChannels);
+
     OCIO_NAMESPACE::ConstProcessorRcPtr _proc;
+    OCIOBakedLutRcPtr _bakedLut;
     OFX::ImageEffect* _instance;
 };
 
+/**
+ * @brief A process-wide LRU cache of OCIO processors, shared by all the OCIO plug-ins and GenericOCIO instances.
+ *
+ * Getting a processor resolves the transform against the config, and may read and parse LUT files.
+ * Processors are cached under a key made of the config and context cache IDs and a description of the
+ * transform (see getKey()), so that instances using the same transform, or animated parameters going
+ * back to previous values, share the same processor.
+ * Each user also keeps the processor it used last with its key, so that the cache is only looked up
+ * when the key changes, and rendering the tiles of a frame never takes the cache lock.
+ **/
+class OCIOProcessorCache
+{
+public:
+    struct Stats
+    {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+        std::size_t size;
+    };
+
+    static OCIOProcessorCache& instance();
+
+    OCIOProcessorCache();
+
+    ~OCIOProcessorCache();
+
+    /**
+     * @brief The key of the processor for a transform in config, with the variables of context.
+     * description must contain everything that defines the transform (see appendKey()).
+     **/
+    static std::string getKey(const OCIO_NAMESPACE::ConstConfigRcPtr& config,
+                              const OCIO_NAMESPACE::ConstContextRcPtr& context,
+                              const std::string& description);
+
+    /// Helpers to build a transform description: each value is appended unambiguously, doubles without rounding.
+    static void appendKey(std::string* description, const std::string& value);
+    static void appendKey(std::string* description, double value);
+    static void appendKey(std::string* description, int value);
+
+    /// Get the processor cached under key, or a NULL pointer if there is none.
+    OCIO_NAMESPACE::ConstProcessorRcPtr get(const std::string& key);
+
+    /// Cache proc under key, evicting the least recently used processors if the cache is full.
+    void set(const std::string& key, const OCIO_NAMESPACE::ConstProcessorRcPtr& proc);
+
+    /// Forget all processors (e.g. when a LUT file was modified).
+    void purge();
+
+    /**
+     * @brief Get proc baked into a 3D LUT with shaper, baking it if it is not one of the last kOCIOBakedLutCacheSize
+     * LUTs that were baked. Baking takes the time of applying proc to a kOCIOBakedLutSize^3 image: threads needing
+     * the LUT that is being baked wait for it, and other LUTs can be baked meanwhile.
+     **/
+    OCIOBakedLutRcPtr getBakedLut(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, const OCIOBakedLut::Shaper& shaper);
+
+    /// Get the 1D LUTs of proc for integer pixels with values in [0, maxValue], building them if necessary.
+    OCIOChannelLutRcPtr getChannelLut(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, int maxValue);
+
+    Stats getStats() const;
+
+private:
+    typedef std::list<std::string> KeyList;
+
+    struct Entry
+    {
+        OCIO_NAMESPACE::ConstProcessorRcPtr proc;
+        KeyList::iterator lru; // position in _lru
+    };
+
+    typedef std::map<std::string, Entry> EntryMap;
+    typedef tthread::fast_mutex Mutex;
+
+    struct BakedLut
+    {
+        OCIO_NAMESPACE::ConstProcessorRcPtr proc; // keeps the processor alive, so that its address is not reused
+        OCIOBakedLut::Shaper shaper;
+        OCIOBakedLutRcPtr lut; // NULL while it is being baked
+    };
+
+    typedef std::list<BakedLut> BakedLutList;
+
+    struct ChannelLut
+    {
+        OCIO_NAMESPACE::ConstProcessorRcPtr proc;
+        int maxValue;
+        OCIOChannelLutRcPtr lut; // NULL while it is being built
+    };
+
+    typedef std::list<ChannelLut> ChannelLutList;
+
+    // must be called with _lutLock held. The entry may be pending (with a NULL lut).
+    BakedLutList::iterator findBakedLutLocked(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, const OCIOBakedLut::Shaper& shaper);
+    ChannelLutList::iterator findChannelLutLocked(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, int maxValue);
+
+    mutable Mutex _lock;
+    EntryMap _entries;
+    KeyList _lru; // the most recently used key comes first
+    // LUTs are built without holding a lock: baking is multithreaded, and channel LUTs are needed by render threads.
+    // A pending entry is added while a LUT is built, so that the other threads needing it wait for it.
+    tthread::mutex _lutLock; // protects _bakedLuts and _channelLuts
+    tthread::condition_variable _lutBuilt; // signaled when a pending LUT is built, or failed
+    BakedLutList _bakedLuts; // the most recently used LUT comes first
+    ChannelLutList _channelLuts; // the most recently used LUT comes first
+    std::size_t _maxEntries;
+    unsigned long long _hits;
+    unsigned long long _misses;
+    unsigned long long _evictions;
+};
+
 #endif
 
 NAMESPACE_OFX_IO_EXIT
@@ -26,9 +26,17 @@
 #include <climits>
 #include <cmath>
 #include <cfloat> // DBL_MAX
+#include <cstdlib> // getenv, malloc
+#include <cstring> // memcpy
 #include <memory>
+#include <typeinfo>
 #include <algorithm>
 #include <fstream>
+#include <list>
+#include <map>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
 #ifdef DEBUG
 #include <cstdio>
 #define DBG(x) x
@@ -44,6 +52,11 @@
 #include "ofxsCopier.h"
 #include "ofxsCoords.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+// the decoded frames cache and the prefetcher are global objects, which may be constructed before the host suites are fetched:
+// always use the fast mutex and threads by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#include "tinythread.h"
 
 #ifdef OFX_EXTENSIONS_TUTTLE
 #include <tuttle/ofxReadWrite.h>
@@ -56,6 +69,8 @@
 #include "GenericOCIO.h"
 #endif
 #include "IOUtility.h"
+#include "FileHeaderCache.h"
+#include "CPUFeatures.h"
 
 #ifdef OFX_IO_USING_OCIO
 namespace OCIO = OCIO_NAMESPACE;
@@ -231,6 +246,20 @@ enum MissingEnum
 
 #define GENERIC_READER_USE_MULTI_THREAD
 
+// the post-decode pass processes the render window in bands whose full-resolution rows fit in that many bytes
+#define kReaderPostProcessBandBytes (256 * 1024)
+
+// maximum size of the decoded frames cache shared by all readers, in megabytes (0 disables the cache).
+// The default value can be overriden using the environment variable OFX_IO_DECODE_CACHE_SIZE
+#define kDecodedFrameCacheSizeEnv "OFX_IO_DECODE_CACHE_SIZE"
+#define kDecodedFrameCacheSizeDefault 512
+
+// number of frames read ahead in the background during sequential renders (0 disables read-ahead).
+// The default value can be overriden using the environment variable OFX_IO_PREFETCH_FRAMES
+#define kSequencePrefetchFramesEnv "OFX_IO_PREFETCH_FRAMES"
+#define kSequencePrefetchFramesDefault 4
+#define kSequencePrefetchThreads 2 // the number of background reading threads
+
 static bool gHostIsNatron   = false;
 static bool gHostSupportsRGBA   = false;
 static bool gHostSupportsRGB    = false;
@@ -254,6 +283,566 @@ premultString(PreMultiplicationEnum e)
     return "Unknown";
 }
 
+/**
+ * @brief A process-wide LRU cache of decoded frames, shared by all GenericReaderPlugin instances.
+ *
+ * Entries hold the float buffers returned by decode() or decodePlane(), before unpremultiplication,
+ * colorspace conversion and downscaling, so that scrubbing back and forth, re-rendering a tile of a frame
+ * that was already read, or changing the colorspace, do not read the file again.
+ * Entries are keyed by the reader instance, the file (name, modification time and size), the time, the view
+ * and the plane. A lookup succeeds if a cached window contains the requested window.
+ **/
+class DecodedFrameCache
+{
+public:
+    typedef tthread::fast_mutex Mutex;
+    typedef MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+
+    struct Key
+    {
+        const void* owner; // the instance that decoded the frame: decoded pixels may depend on its parameters
+        string filename;
+        long long mtime;
+        long long fileSize;
+        long long inode;
+        double time;
+        int view;
+        unsigned int mipmapLevel; // the level of the file that was decoded (0 is the full-res image)
+        PixelComponentEnum comps;
+        string rawComps;
+        int numChans;
+
+        Key()
+            : owner(NULL)
+            , filename()
+            , mtime(0)
+            , fileSize(0)
+            , inode(0)
+            , time(0.)
+            , view(0)
+            , mipmapLevel(0)
+            , comps(ePixelComponentNone)
+            , rawComps()
+            , numChans(0)
+        {
+        }
+
+        bool operator==(const Key& other) const
+        {
+            return owner == other.owner &&
+                   time == other.time &&
+                   view == other.view &&
+                   mipmapLevel == other.mipmapLevel &&
+                   comps == other.comps &&
+                   numChans == other.numChans &&
+                   mtime == other.mtime &&
+                   fileSize == other.fileSize &&
+                   inode == other.inode &&
+                   filename == other.filename &&
+                   rawComps == other.rawComps;
+        }
+    };
+
+    DecodedFrameCache()
+        : _lock()
+        , _entries()
+        , _size(0)
+        , _maxSize( (size_t)kDecodedFrameCacheSizeDefault << 20 )
+    {
+        const char* maxSizeEnv = std::getenv(kDecodedFrameCacheSizeEnv);
+
+        if (maxSizeEnv) {
+            long maxSizeMB = std::strtol(maxSizeEnv, NULL, 10);
+            _maxSize = (maxSizeMB > 0) ? ( (size_t)maxSizeMB << 20 ) : 0;
+        }
+    }
+
+    ~DecodedFrameCache()
+    {
+        for (EntryList::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            std::free( (*it)->data );
+            delete *it;
+        }
+    }
+
+    bool isEnabled() const
+    {
+        return _maxSize > 0;
+    }
+
+    /**
+     * @brief Copy the window of a cached frame to dstPixelData. Returns false if no cached window contains it.
+     **/
+    bool get(const Key& key,
+             const OfxRectI& window,
+             float* dstPixelData,
+             const OfxRectI& dstBounds,
+             int dstRowBytes)
+    {
+        Entry* entry = NULL;
+        {
+            AutoMutex l(_lock);
+            for (EntryList::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+                if ( windowContains( (*it)->window, window ) && ( (*it)->key == key ) ) {
+                    entry = *it;
+                    ++entry->users;
+                    // this is now the most recently used entry
+                    _entries.splice(_entries.begin(), _entries, it);
+                    break;
+                }
+            }
+        }
+        if (!entry) {
+            return false;
+        }
+        // copy outside of the lock: the entry cannot be freed while it is used
+        const int pixelBytes = key.numChans * sizeof(float);
+        copyWindow(window, pixelBytes,
+                   entry->data, entry->window, (entry->window.x2 - entry->window.x1) * pixelBytes,
+                   dstPixelData, dstBounds, dstRowBytes);
+        release(entry);
+
+        return true;
+    }
+
+    /**
+     * @brief Is there a cached window that contains window?
+     **/
+    bool contains(const Key& key,
+                  const OfxRectI& window)
+    {
+        AutoMutex l(_lock);
+
+        for (EntryList::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if ( windowContains( (*it)->window, window ) && ( (*it)->key == key ) ) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Add a copy of the window of srcPixelData to the cache, evicting the least recently used frames if necessary.
+     **/
+    void insert(const Key& key,
+                const OfxRectI& window,
+                const float* srcPixelData,
+                const OfxRectI& srcBounds,
+                int srcRowBytes)
+    {
+        const int pixelBytes = key.numChans * sizeof(float);
+        const int rowBytes = (window.x2 - window.x1) * pixelBytes;
+        const size_t size = (size_t)(window.y2 - window.y1) * (size_t)rowBytes;
+
+        if ( (size == 0) || (size > _maxSize) || contains(key, window) ) {
+            // too large, or another thread already cached this window
+            return;
+        }
+        float* data = (float*)std::malloc(size);
+        if (!data) {
+            return;
+        }
+        copyWindow(window, pixelBytes, srcPixelData, srcBounds, srcRowBytes, data, window, rowBytes);
+        adopt(key, window, data);
+    }
+
+    /**
+     * @brief Add a buffer allocated with malloc() holding the packed rows of window to the cache,
+     * which takes ownership of it.
+     **/
+    void adopt(const Key& key,
+               const OfxRectI& window,
+               float* data)
+    {
+        const size_t size = (size_t)(window.y2 - window.y1) * (size_t)(window.x2 - window.x1) * key.numChans * sizeof(float);
+
+        if (size > _maxSize) {
+            std::free(data);
+
+            return;
+        }
+
+        Entry* entry = new Entry;
+        entry->key = key;
+        entry->window = window;
+        entry->size = size;
+        entry->data = data;
+        entry->users = 0;
+        entry->removed = false;
+
+        AutoMutex l(_lock);
+        _entries.push_front(entry);
+        _size += size;
+        while ( (_size > _maxSize) && (_entries.size() > 1) ) {
+            EntryList::iterator last = _entries.end();
+            --last;
+            removeLocked(last);
+        }
+    }
+
+    /**
+     * @brief Remove all frames decoded by owner, or all frames if owner is NULL.
+     **/
+    void purge(const void* owner)
+    {
+        AutoMutex l(_lock);
+        EntryList::iterator it = _entries.begin();
+
+        while ( it != _entries.end() ) {
+            EntryList::iterator next = it;
+            ++next;
+            if ( !owner || ( (*it)->key.owner == owner ) ) {
+                removeLocked(it);
+            }
+            it = next;
+        }
+    }
+
+private:
+    struct Entry
+    {
+        Key key;
+        OfxRectI window;
+        size_t size;
+        float* data; // packed rows covering window
+        int users; // number of threads currently copying data
+        bool removed; // removed from the cache while in use, free data when users reaches 0
+    };
+
+    typedef std::list<Entry*> EntryList;
+
+    static bool windowContains(const OfxRectI& outer,
+                         const OfxRectI& inner)
+    {
+        return outer.x1 <= inner.x1 && inner.x2 <= outer.x2 && outer.y1 <= inner.y1 && inner.y2 <= outer.y2;
+    }
+
+    static void copyWindow(const OfxRectI& window,
+                           int pixelBytes,
+                           const float* srcPixelData,
+                           const OfxRectI& srcBounds,
+                           int srcRowBytes,
+                           float* dstPixelData,
+                           const OfxRectI& dstBounds,
+                           int dstRowBytes)
+    {
+        const size_t lineBytes = (size_t)(window.x2 - window.x1) * pixelBytes;
+        const char* src = (const char*)srcPixelData + (std::ptrdiff_t)(window.y1 - srcBounds.y1) * srcRowBytes + (std::ptrdiff_t)(window.x1 - srcBounds.x1) * pixelBytes;
+        char* dst = (char*)dstPixelData + (std::ptrdiff_t)(window.y1 - dstBounds.y1) * dstRowBytes + (std::ptrdiff_t)(window.x1 - dstBounds.x1) * pixelBytes;
+
+        for (int y = window.y1; y < window.y2; ++y, src += srcRowBytes, dst += dstRowBytes) {
+            std::memcpy(dst, src, lineBytes);
+        }
+    }
+
+    // must be called with _lock held
+    void removeLocked(EntryList::iterator it)
+    {
+        Entry* entry = *it;
+
+        _entries.erase(it);
+        _size -= entry->size;
+        if (entry->users == 0) {
+            std::free(entry->data);
+            delete entry;
+        } else {
+            entry->removed = true;
+        }
+    }
+
+    void release(Entry* entry)
+    {
+        bool mustFree;
+        {
+            AutoMutex l(_lock);
+            --entry->users;
+            mustFree = (entry->users == 0) && entry->removed;
+        }
+        if (mustFree) {
+            std::free(entry->data);
+            delete entry;
+        }
+    }
+
+    Mutex _lock;
+    EntryList _entries; // the most recently used entry comes first
+    size_t _size;
+    size_t _maxSize;
+};
+
+static DecodedFrameCache gDecodedFrameCache;
+
+/**
+ * @brief A process-wide pool of threads that read the next frames of image sequences into the decoded frames cache.
+ *
+ * During sequential renders (playback or batch), render() schedules the frames that follow the current frame,
+ * and these are decoded in the background while the current frame is processed (OCIO, premult, downscaling).
+ * Image sequences stored on network storage are usually limited by I/O latency rather than by the CPU,
+ * so overlapping reads with processing gives close to real-time playback.
+ * When render() needs a frame that is being read, it waits for it. A frame that is still queued is
+ * removed from the queue and read by render() itself.
+ **/
+class SequencePrefetcher
+{
+public:
+    struct Request
+    {
+        GenericReaderPlugin* owner;
+        string filename;
+        double time;
+        int view;
+        unsigned int mipmapLevel;
+        OfxRectI window;
+        PixelComponentEnum comps;
+        int numChans;
+        string rawComps;
+
+        bool isSameFrame(const void* otherOwner,
+                         const string& otherFilename,
+                         double otherTime,
+                         int otherView,
+                         PixelComponentEnum otherComps,
+                         const string& otherRawComps) const
+        {
+            return owner == otherOwner && time == otherTime && view == otherView && comps == otherComps &&
+                   filename == otherFilename && rawComps == otherRawComps;
+        }
+    };
+
+    SequencePrefetcher()
+        : _mutex()
+        , _cond()
+        , _threads()
+        , _queue()
+        , _running()
+        , _lastTime()
+        , _frames(kSequencePrefetchFramesDefault)
+        , _quit(false)
+    {
+        const char* framesEnv = std::getenv(kSequencePrefetchFramesEnv);
+
+        if (framesEnv) {
+            _frames = std::max(0, (int)std::strtol(framesEnv, NULL, 10) );
+        }
+    }
+
+    ~SequencePrefetcher()
+    {
+        {
+            tthread::lock_guard<tthread::mutex> l(_mutex);
+            _quit = true;
+            _queue.clear();
+        }
+        _cond.notify_all();
+        for (std::size_t i = 0; i < _threads.size(); ++i) {
+            _threads[i]->join();
+            delete _threads[i];
+        }
+    }
+
+    // the number of frames to read ahead
+    int frames() const
+    {
+        return _frames;
+    }
+
+    /**
+     * @brief Returns 1 if owner is rendering forward, -1 if it is rendering backward.
+     **/
+    int direction(const void* owner,
+                  double time)
+    {
+        tthread::lock_guard<tthread::mutex> l(_mutex);
+        std::map<const void*, double>::iterator found = _lastTime.find(owner);
+        int dir = 1;
+
+        if ( found != _lastTime.end() ) {
+            dir = (time < found->second) ? -1 : 1;
+            found->second = time;
+        } else {
+            _lastTime[owner] = time;
+        }
+
+        return dir;
+    }
+
+    /**
+     * @brief Replace the queued requests of owner for this plane by requests.
+     * Requests for frames that are already being read are ignored.
+     **/
+    void schedule(const void* owner,
+                  PixelComponentEnum comps,
+                  const string& rawComps,
+                  const std::list<Request>& requests)
+    {
+        {
+            tthread::lock_guard<tthread::mutex> l(_mutex);
+            if (_quit) {
+                return;
+            }
+            std::list<Request>::iterator it = _queue.begin();
+            while ( it != _queue.end() ) {
+                if ( (it->owner == owner) && (it->comps == comps) && (it->rawComps == rawComps) ) {
+                    it = _queue.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (std::list<Request>::const_iterator r = requests.begin(); r != requests.end(); ++r) {
+                if ( !find(_running, owner, r->filename, r->time, r->view, r->comps, r->rawComps) ) {
+                    _queue.push_back(*r);
+                }
+            }
+            if ( _threads.empty() && !_queue.empty() ) {
+                for (int i = 0; i < kSequencePrefetchThreads; ++i) {
+                    _threads.push_back( new tthread::thread(threadFunction, this) );
+                }
+            }
+        }
+        _cond.notify_all();
+    }
+
+    /**
+     * @brief Called before reading a frame: if it is being read in the background, wait until it is in the cache.
+     * If it is still queued, remove it from the queue.
+     **/
+    void waitFor(const void* owner,
+                 const string& filename,
+                 double time,
+                 int view,
+                 PixelComponentEnum comps,
+                 const string& rawComps)
+    {
+        tthread::lock_guard<tthread::mutex> l(_mutex);
+        std::list<Request>::iterator it = _queue.begin();
+
+        while ( it != _queue.end() ) {
+            if ( it->isSameFrame(owner, filename, time, view, comps, rawComps) ) {
+                it = _queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        while ( find(_running, owner, filename, time, view, comps, rawComps) ) {
+            _cond.wait(_mutex);
+        }
+    }
+
+    /**
+     * @brief Remove all the requests of owner, and wait for those that are being read.
+     **/
+    void cancel(const void* owner)
+    {
+        tthread::lock_guard<tthread::mutex> l(_mutex);
+        std::list<Request>::iterator it = _queue.begin();
+
+        while ( it != _queue.end() ) {
+            if (it->owner == owner) {
+                it = _queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (;;) {
+            bool ownerIsRunning = false;
+            for (std::list<Request>::const_iterator r = _running.begin(); r != _running.end(); ++r) {
+                if (r->owner == owner) {
+                    ownerIsRunning = true;
+                    break;
+                }
+            }
+            if (!ownerIsRunning) {
+                break;
+            }
+            _cond.wait(_mutex);
+        }
+        _lastTime.erase(owner);
+    }
+
+    /**
+     * @brief Returns true if the calling thread is one of the background reading threads.
+     **/
+    bool isWorkerThread()
+    {
+        const tthread::thread::id self = tthread::this_thread::get_id();
+        tthread::lock_guard<tthread::mutex> l(_mutex);
+
+        for (std::size_t i = 0; i < _threads.size(); ++i) {
+            if (_threads[i]->get_id() == self) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    static bool find(const std::list<Request>& requests,
+                     const void* owner,
+                     const string& filename,
+                     double time,
+                     int view,
+                     PixelComponentEnum comps,
+                     const string& rawComps)
+    {
+        for (std::list<Request>::const_iterator it = requests.begin(); it != requests.end(); ++it) {
+            if ( it->isSameFrame(owner, filename, time, view, comps, rawComps) ) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static void threadFunction(void* arg)
+    {
+        static_cast<SequencePrefetcher*>(arg)->run();
+    }
+
+    void run()
+    {
+        for (;;) {
+            std::list<Request>::iterator current;
+            {
+                tthread::lock_guard<tthread::mutex> l(_mutex);
+                while ( !_quit && _queue.empty() ) {
+                    _cond.wait(_mutex);
+                }
+                if (_quit) {
+                    return;
+                }
+                // move the request from the queue to the running list
+                _running.splice(_running.end(), _queue, _queue.begin());
+                current = _running.end();
+                --current;
+            }
+            try {
+                current->owner->prefetchFrame(current->filename, current->time, current->view, current->mipmapLevel, current->window,
+                                              current->comps, current->numChans, current->rawComps);
+            } catch (...) {
+                // errors are reported when render() reads the frame
+            }
+            {
+                tthread::lock_guard<tthread::mutex> l(_mutex);
+                _running.erase(current);
+            }
+            _cond.notify_all();
+        }
+    }
+
+    tthread::mutex _mutex;
+    tthread::condition_variable _cond; // signaled when a request is queued or finished, or on exit
+    std::vector<tthread::thread*> _threads;
+    std::list<Request> _queue;
+    std::list<Request> _running;
+    std::map<const void*, double> _lastTime; // the last sequence time rendered by each instance
+    int _frames;
+    bool _quit;
+};
+
+static SequencePrefetcher gSequencePrefetcher;
+
 GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
                                          const std::vector<string>& extensions,
                                          bool supportsRGBA,
@@ -355,6 +944,8 @@ GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
 
 GenericReaderPlugin::~GenericReaderPlugin()
 {
+    gSequencePrefetcher.cancel(this);
+    gDecodedFrameCache.purge(this);
 }
 
 void
@@ -894,37 +1485,9 @@ GenericReaderPlugin::getStartingTime() const
     return startingTime;
 }
 
-void
-GenericReaderPlugin::copyPixelData(const OfxRectI& renderWindow,
-                                   const void *srcPixelData,
-                                   const OfxRectI& srcBounds,
-                                   PixelComponentEnum srcPixelComponents,
-                                   int srcPixelComponentCount,
-                                   BitDepthEnum srcBitDepth,
-                                   int srcRowBytes,
-                                   void *dstPixelData,
-                                   const OfxRectI& dstBounds,
-                                   PixelComponentEnum dstPixelComponents,
-                                   int dstPixelComponentCount,
-                                   BitDepthEnum dstBitDepth,
-                                   int dstRowBytes)
-{
-    assert(srcPixelData && dstPixelData);
-    assert(srcBounds.y1 <= renderWindow.y1 && renderWindow.y1 <= renderWindow.y2 && renderWindow.y2 <= srcBounds.y2);
-    assert(srcBounds.x1 <= renderWindow.x1 && renderWindow.x1 <= renderWindow.x2 && renderWindow.x2 <= srcBounds.x2);
-
-#ifdef GENERIC_READER_USE_MULTI_THREAD
-    copyPixels(*this, renderWindow,
-               srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
-               dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
-#else
-    copyPixelsNT(*this, renderWindow,
-                 srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
-                 dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
-#endif
-}
-
 // update the window of dst defined by nextRenderWindow by halving the corresponding area in src.
+// srcRoD is the area where src pixels are defined (pixels outside of it are not used), and
+// srcBounds is the area actually covered by srcPixels.
 // proofread and fixed by F. Devernay on 3/10/2014
 template <typename PIX>
 static void
@@ -932,6 +1495,7 @@ halveWindow(const OfxRectI& nextRenderWindow,
             const PIX* srcPixels,
             const OfxRectI& srcBounds,
             int srcRowBytes,
+            const OfxRectI& srcRoD,
             PIX* dstPixels,
             const OfxRectI& dstBounds,
             int dstRowBytes,
@@ -942,18 +1506,18 @@ halveWindow(const OfxRectI& nextRenderWindow,
     const PIX* srcData =  srcPixels - (srcBounds.x1 * nComponents + srcRowSize * srcBounds.y1);
     PIX* dstData = dstPixels - (dstBounds.x1 * nComponents + dstRowSize * dstBounds.y1);
 
-    assert(nextRenderWindow.x1 * 2 >= (srcBounds.x1 - 1) && (nextRenderWindow.x2 - 1) * 2 < srcBounds.x2 &&
-           nextRenderWindow.y1 * 2 >= (srcBounds.y1 - 1) && (nextRenderWindow.y2 - 1) * 2 < srcBounds.y2);
+    assert(nextRenderWindow.x1 * 2 >= (srcRoD.x1 - 1) && (nextRenderWindow.x2 - 1) * 2 < srcRoD.x2 &&
+           nextRenderWindow.y1 * 2 >= (srcRoD.y1 - 1) && (nextRenderWindow.y2 - 1) * 2 < srcRoD.y2);
     for (int y = nextRenderWindow.y1; y < nextRenderWindow.y2; ++y) {
         const PIX* srcLineStart = srcData + y * 2 * srcRowSize;
         PIX* dstLineStart = dstData + y * dstRowSize;
-        bool pickNextRow = (y * 2) < (srcBounds.y2 - 1);
-        bool pickThisRow = (y * 2) >= (srcBounds.y1);
+        bool pickNextRow = (y * 2) < (srcRoD.y2 - 1);
+        bool pickThisRow = (y * 2) >= (srcRoD.y1);
         int sumH = (int)pickNextRow + (int)pickThisRow;
         assert(sumH == 1 || sumH == 2);
         for (int x = nextRenderWindow.x1; x < nextRenderWindow.x2; ++x) {
-            bool pickNextCol = (x * 2) < (srcBounds.x2 - 1);
-            bool pickThisCol = (x * 2) >= (srcBounds.x1);
+            bool pickNextCol = (x * 2) < (srcRoD.x2 - 1);
+            bool pickThisCol = (x * 2) >= (srcRoD.x1);
             int sumW = (int)pickThisCol + (int)pickNextCol;
             assert(sumW == 1 || sumW == 2);
             for (int k = 0; k < nComponents; ++k) {
@@ -976,170 +1540,308 @@ halveWindow(const OfxRectI& nextRenderWindow,
     }
 }
 
-template <typename PIX>
-static void
-buildMipMapLevelGeneric(ImageEffect* instance,
-                        const OfxRectI& originalRenderWindow,
-                        const OfxRectI& renderWindowFullRes,
-                        unsigned int level,
-                        const PIX* srcPixels,
-                        const OfxRectI& srcBounds,
-                        int srcRowBytes,
-                        PIX* dstPixels,
-                        const OfxRectI& dstBounds,
-                        int dstRowBytes,
-                        int nComponents)
-{
-    assert(level > 0);
-
-    auto_ptr<ImageMemory> tmpMem;
-    size_t tmpMemSize = 0;
-    PIX* nextImg = NULL;
-    const PIX* previousImg = srcPixels;
-    OfxRectI previousBounds = srcBounds;
-    int previousRowBytes = srcRowBytes;
-    OfxRectI nextRenderWindow = renderWindowFullRes;
-
-    ///Build all the mipmap levels until we reach the one we are interested in
-    for (unsigned int i = 1; i < level; ++i) {
-        // loop invariant:
-        // - previousImg, previousBounds, previousRowBytes describe the data ate the level before i
-        // - nextRenderWindow contains the renderWindow at the level before i
-        //
-        ///Halve the smallest enclosing po2 rect as we need to render a minimum of the renderWindow
-        nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-#     ifdef DEBUG
-        {
-            // check that doing i times 1 level is the same as doing i levels
-            OfxRectI nrw = downscalePowerOfTwoSmallestEnclosing(renderWindowFullRes, i);
-            assert(nrw.x1 == nextRenderWindow.x1 && nrw.x2 == nextRenderWindow.x2 && nrw.y1 == nextRenderWindow.y1 && nrw.y2 == nextRenderWindow.y2);
-        }
-#     endif
-        ///Allocate a temporary image if necessary, or reuse the previously allocated buffer
-        int nextRowBytes =  (nextRenderWindow.x2 - nextRenderWindow.x1)  * nComponents * sizeof(PIX);
-        size_t newMemSize =  (size_t)(nextRenderWindow.y2 - nextRenderWindow.y1) * (size_t)nextRowBytes;
-        if ( !tmpMem.get() ) {
-            // there should be enough memory: no need to reallocate
-            assert(tmpMemSize >= newMemSize);
-        } else {
-            tmpMem.reset( new ImageMemory(newMemSize, instance) );
-            tmpMemSize = newMemSize;
+// Post-decode processing of the temporary image, fused in a single pass:
+// unpremult -> OCIO -> downscale to the render scale -> premult (or copy) to dst.
+//
+// The render window is processed in bands of output rows. For each band, the full-resolution rows
+// it depends on are converted in place in the temporary image, and the intermediate mipmap levels
+// are computed in small per-thread buffers, so that every step works on data that is still in cache
+// and no full-size intermediate image has to be allocated.
+// The result is the same as applying each step to the whole image, since halving uses the same
+// level windows as before (each band only clips them vertically).
+class ReaderPostProcessor
+    : public PixelProcessor
+{
+public:
+    // ctor
+    ReaderPostProcessor(ImageEffect &instance)
+        : PixelProcessor(instance)
+        , _srcPixelData(NULL)
+        , _srcBounds()
+        , _srcRowBytes(0)
+        , _srcWindow()
+        , _levels(0)
+        , _unpremult(false)
+        , _premult(false)
+#ifdef OFX_IO_USING_OCIO
+        , _proc()
+#endif
+    {
+        _srcBounds.x1 = _srcBounds.y1 = _srcBounds.x2 = _srcBounds.y2 = 0;
+        _srcWindow = _srcBounds;
+    }
+
+    // srcPixelData is modified in place by unpremult and color conversion.
+    // srcWindow is the window of src that maps to the render window at the given mipmap level.
+    void setSrcImg(float* srcPixelData,
+                   const OfxRectI& srcBounds,
+                   int srcRowBytes,
+                   const OfxRectI& srcWindow,
+                   unsigned int levels)
+    {
+        _srcPixelData = srcPixelData;
+        _srcBounds = srcBounds;
+        _srcRowBytes = srcRowBytes;
+        _srcWindow = srcWindow;
+        _levels = levels;
+    }
+
+    void setPremult(bool unpremult,
+                    bool premult)
+    {
+        _unpremult = unpremult;
+        _premult = premult;
+    }
+
+#ifdef OFX_IO_USING_OCIO
+    void setProcessor(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc)
+    {
+        _proc = proc;
+    }
+
+#endif
+
+    // and do some processing
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        assert(_srcPixelData && _dstPixelData);
+        assert(_dstPixelComponentCount > 0);
+        // the processor splits the render window in horizontal bands only, which the halving relies on
+        assert(procWindow.x1 == _renderWindow.x1 && procWindow.x2 == _renderWindow.x2);
+
+        // number of output rows per band, so that the full-resolution rows of a band fit in kReaderPostProcessBandBytes
+        size_t srcRowBytes = (size_t)(_srcBounds.x2 - _srcBounds.x1) * _dstPixelComponentCount * sizeof(float);
+        int srcRows = std::max( 1, (int)(kReaderPostProcessBandBytes / std::max(srcRowBytes, (size_t)1)) );
+        int bandRows = std::max(1, srcRows >> _levels);
+        std::vector<float> levelBuffers[2];
+
+        for (int y = procWindow.y1; y < procWindow.y2; y += bandRows) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            OfxRectI band = procWindow;
+            band.y1 = y;
+            band.y2 = std::min(y + bandRows, procWindow.y2);
+            processBand(band, levelBuffers);
+        }
+    }
+
+private:
+    void processBand(const OfxRectI& band,
+                     std::vector<float> levelBuffers[2])
+    {
+        if (_levels == 0) {
+            colorConvert(band);
+            copyToDst(band, _srcPixelData, _srcBounds, _srcRowBytes);
+
+            return;
         }
-        nextImg = (float*)tmpMem->lock();
 
-        halveWindow<PIX>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, nextImg, nextRenderWindow, nextRowBytes, nComponents);
+        // the full-resolution rows of the band
+        OfxRectI srcBand = _srcBounds;
+        srcBand.y1 = std::max( _srcBounds.y1, band.y1 * (1 << _levels) );
+        srcBand.y2 = std::min( _srcBounds.y2, band.y2 * (1 << _levels) );
+        if (srcBand.y1 < srcBand.y2) {
+            colorConvert(srcBand);
+        }
 
-        ///Switch for next pass
-        previousBounds = nextRenderWindow;
-        previousRowBytes = nextRowBytes;
-        previousImg = nextImg;
+        // halve level by level, like buildMipMapLevel did on the whole image:
+        // previousRoD is the full window at the level before i, previousBounds the part of it held by the band
+        const float* previousImg = _srcPixelData;
+        OfxRectI previousBounds = _srcBounds;
+        int previousRowBytes = _srcRowBytes;
+        OfxRectI previousRoD = _srcBounds;
+        OfxRectI levelWindow = _srcWindow;
+        for (unsigned int i = 1; i <= _levels; ++i) {
+            levelWindow = downscalePowerOfTwoSmallestEnclosing(levelWindow, 1);
+            OfxRectI nextRenderWindow = levelWindow;
+            nextRenderWindow.y1 = std::max( levelWindow.y1, band.y1 * (1 << (_levels - i)) );
+            nextRenderWindow.y2 = std::min( levelWindow.y2, band.y2 * (1 << (_levels - i)) );
+            if (nextRenderWindow.y1 >= nextRenderWindow.y2) {
+                return;
+            }
+
+            float* nextImg;
+            OfxRectI nextBounds;
+            int nextRowBytes;
+            if ( (i == _levels) && !_premult ) {
+                ///On the last iteration halve directly into the dstPixels
+                ///The levelWindow should be equal to the original render window.
+                assert(levelWindow.x1 == _renderWindow.x1 && levelWindow.x2 == _renderWindow.x2 &&
+                       levelWindow.y1 == _renderWindow.y1 && levelWindow.y2 == _renderWindow.y2);
+                nextImg = (float*)_dstPixelData;
+                nextBounds = _dstBounds;
+                nextRowBytes = _dstRowBytes;
+            } else {
+                // the two buffers alternate between levels, and are reused by the next bands
+                std::vector<float>& buffer = levelBuffers[i & 1];
+                buffer.resize( (size_t)(nextRenderWindow.x2 - nextRenderWindow.x1) * (size_t)(nextRenderWindow.y2 - nextRenderWindow.y1) * _dstPixelComponentCount );
+                nextImg = &buffer.front();
+                nextBounds = nextRenderWindow;
+                nextRowBytes = (nextRenderWindow.x2 - nextRenderWindow.x1) * _dstPixelComponentCount * sizeof(float);
+            }
+
+            halveWindow<float>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, previousRoD, nextImg, nextBounds, nextRowBytes, _dstPixelComponentCount);
+
+            ///Switch for next pass
+            previousImg = nextImg;
+            previousBounds = nextBounds;
+            previousRowBytes = nextRowBytes;
+            previousRoD = levelWindow;
+        }
+        if (_premult) {
+            copyToDst(band, previousImg, previousBounds, previousRowBytes);
+        }
     }
-    // here:
-    // - previousImg, previousBounds, previousRowBytes describe the data ate the level before 'level'
-    // - nextRenderWindow contains the renderWindow at the level before 'level'
 
-    ///On the last iteration halve directly into the dstPixels
-    ///The nextRenderWindow should be equal to the original render window.
-    nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-    assert(originalRenderWindow.x1 == nextRenderWindow.x1 && originalRenderWindow.x2 == nextRenderWindow.x2 &&
-           originalRenderWindow.y1 == nextRenderWindow.y1 && originalRenderWindow.y2 == nextRenderWindow.y2);
+    // unpremult and color-convert window of src in place
+    void colorConvert(const OfxRectI& window)
+    {
+        if (_unpremult) {
+            // only the part of src that maps to the render window was unpremultiplied by the separate pass,
+            // keep it that way.
+            OfxRectI unpremultWindow;
+            if ( intersect(window, _srcWindow, &unpremultWindow) ) {
+                assert(_dstPixelComponentCount == 4);
+                for (int y = unpremultWindow.y1; y < unpremultWindow.y2; ++y) {
+                    float* pix = srcPixelAddress(unpremultWindow.x1, y);
+                    for (int x = unpremultWindow.x1; x < unpremultWindow.x2; ++x, pix += 4) {
+                        float alpha = pix[3];
+                        if (alpha > FLT_MIN) {
+                            pix[0] /= alpha;
+                            pix[1] /= alpha;
+                            pix[2] /= alpha;
+                        }
+                    }
+                }
+            }
+        }
+#ifdef OFX_IO_USING_OCIO
+        if (_proc) {
+            if ( (_dstPixelComponents != ePixelComponentRGBA) && (_dstPixelComponents != ePixelComponentRGB) ) {
+                throwSuiteStatusException(kOfxStatErrFormat);
 
-    halveWindow<PIX>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, dstPixels, dstBounds, dstRowBytes, nComponents);
-    // mem and tmpMem are freed at destruction
-} // buildMipMapLevelGeneric
+                return;
+            }
+            // no nested multithreading here: this is called from the processor's threads
+            int pixelBytes = _dstPixelComponentCount * sizeof(float);
+            try {
+                OCIO_NAMESPACE::PackedImageDesc img(srcPixelAddress(window.x1, window.y1), window.x2 - window.x1, window.y2 - window.y1,
+                                                    _dstPixelComponentCount, sizeof(float), pixelBytes, _srcRowBytes);
+                _proc->apply(img);
+            } catch (OCIO_NAMESPACE::Exception &e) {
+                _effect.setPersistentMessage( Message::eMessageError, "", std::string("OpenColorIO error: ") + e.what() );
+                throw std::runtime_error( std::string("OpenColorIO error: ") + e.what() );
+            }
+        }
+#endif
+    }
 
-// update the window of dst defined by originalRenderWindow by mipmapping the windows of src defined by renderWindowFullRes
-// proofread and fixed by F. Devernay on 3/10/2014
-template <typename PIX, int nComponents>
-static void
-buildMipMapLevel(ImageEffect* instance,
-                 const OfxRectI& originalRenderWindow,
-                 const OfxRectI& renderWindowFullRes,
-                 unsigned int level,
-                 const PIX* srcPixels,
-                 const OfxRectI& srcBounds,
-                 int srcRowBytes,
-                 PIX* dstPixels,
-                 const OfxRectI& dstBounds,
-                 int dstRowBytes)
-{
-    buildMipMapLevelGeneric<PIX>(instance, originalRenderWindow, renderWindowFullRes, level, srcPixels, srcBounds, srcRowBytes
-                                 , dstPixels, dstBounds, dstRowBytes, nComponents);
-}
+    // copy window from pixels to dst, premultiplying if required
+    void copyToDst(const OfxRectI& window,
+                   const float* pixels,
+                   const OfxRectI& bounds,
+                   int rowBytes)
+    {
+        assert(bounds.x1 <= window.x1 && window.x2 <= bounds.x2 && bounds.y1 <= window.y1 && window.y2 <= bounds.y2);
+        int nComponents = _dstPixelComponentCount;
+        size_t windowRowBytes = (size_t)(window.x2 - window.x1) * nComponents * sizeof(float);
+        for (int y = window.y1; y < window.y2; ++y) {
+            const float* srcPix = (const float*)( (const char*)pixels + (ptrdiff_t)(y - bounds.y1) * rowBytes ) + (ptrdiff_t)(window.x1 - bounds.x1) * nComponents;
+            float* dstPix = (float*)( (char*)_dstPixelData + (ptrdiff_t)(y - _dstBounds.y1) * _dstRowBytes ) + (ptrdiff_t)(window.x1 - _dstBounds.x1) * nComponents;
+            if (!_premult) {
+                std::memcpy(dstPix, srcPix, windowRowBytes);
+                continue;
+            }
+            assert(nComponents == 4);
+            for (int x = window.x1; x < window.x2; ++x, srcPix += 4, dstPix += 4) {
+                float alpha = srcPix[3];
+                dstPix[0] = srcPix[0] * alpha;
+                dstPix[1] = srcPix[1] * alpha;
+                dstPix[2] = srcPix[2] * alpha;
+                dstPix[3] = alpha;
+            }
+        }
+    }
+
+    float* srcPixelAddress(int x,
+                           int y)
+    {
+        return (float*)( (char*)_srcPixelData + (ptrdiff_t)(y - _srcBounds.y1) * _srcRowBytes ) + (ptrdiff_t)(x - _srcBounds.x1) * _dstPixelComponentCount;
+    }
+
+private:
+    float* _srcPixelData;
+    OfxRectI _srcBounds;
+    int _srcRowBytes;
+    OfxRectI _srcWindow;
+    unsigned int _levels;
+    bool _unpremult;
+    bool _premult;
+#ifdef OFX_IO_USING_OCIO
+    OCIO_NAMESPACE::ConstProcessorRcPtr _proc;
+#endif
+};
 
 void
-GenericReaderPlugin::scalePixelData(const OfxRectI& originalRenderWindow,
-                                    const OfxRectI& renderWindow,
-                                    unsigned int levels,
-                                    const void* srcPixelData,
-                                    PixelComponentEnum srcPixelComponents,
-                                    int srcPixelComponentCount,
-                                    BitDepthEnum srcPixelDepth,
-                                    const OfxRectI& srcBounds,
-                                    int srcRowBytes,
-                                    void* dstPixelData,
-                                    PixelComponentEnum dstPixelComponents,
-                                    int dstPixelComponentCount,
-                                    BitDepthEnum dstPixelDepth,
-                                    const OfxRectI& dstBounds,
-                                    int dstRowBytes)
+GenericReaderPlugin::postProcessPixelData(double time,
+                                          const OfxRectI& renderWindow,
+                                          const OfxRectI& renderWindowFullRes,
+                                          unsigned int levels,
+                                          bool unpremult,
+                                          bool colorConvert,
+                                          bool premult,
+                                          float* srcPixelData,
+                                          const OfxRectI& srcBounds,
+                                          int srcRowBytes,
+                                          float* dstPixelData,
+                                          const OfxRectI& dstBounds,
+                                          PixelComponentEnum pixelComponents,
+                                          int pixelComponentCount,
+                                          int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
 
-    // do the rendering
-    if ( (dstPixelDepth != eBitDepthFloat) ||
-         ( ( dstPixelComponents != ePixelComponentRGBA) &&
-           ( dstPixelComponents != ePixelComponentRGB) &&
-           ( dstPixelComponents != ePixelComponentXY) &&
-           ( dstPixelComponents != ePixelComponentAlpha) &&
-           ( dstPixelComponents != ePixelComponentCustom) ) ||
-         ( dstPixelDepth != srcPixelDepth) ||
-         ( dstPixelComponents != srcPixelComponents) ||
-         ( dstPixelComponentCount != srcPixelComponentCount) ) {
+    if ( ( ( pixelComponents == ePixelComponentRGBA) && !_supportsRGBA ) ||
+         ( ( pixelComponents == ePixelComponentRGB) && !_supportsRGB ) ||
+         ( ( pixelComponents == ePixelComponentXY) && !_supportsXY ) ||
+         ( ( pixelComponents == ePixelComponentAlpha) && !_supportsAlpha ) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
     }
+    if ( (unpremult || premult) && (pixelComponents != ePixelComponentRGBA) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
 
-    if (dstPixelComponents == ePixelComponentRGBA) {
-        if (!_supportsRGBA) {
-            throwSuiteStatusException(kOfxStatErrFormat);
-
-            return;
-        }
-        buildMipMapLevel<float, 4>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    } else if (dstPixelComponents == ePixelComponentRGB) {
-        if (!_supportsRGB) {
-            throwSuiteStatusException(kOfxStatErrFormat);
-
-            return;
-        }
-        buildMipMapLevel<float, 3>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    } else if (dstPixelComponents == ePixelComponentXY) {
-        if (!_supportsXY) {
-            throwSuiteStatusException(kOfxStatErrFormat);
+        return;
+    }
 
-            return;
-        }
-        buildMipMapLevel<float, 2>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    }  else if (dstPixelComponents == ePixelComponentAlpha) {
-        if (!_supportsAlpha) {
-            throwSuiteStatusException(kOfxStatErrFormat);
+    ReaderPostProcessor processor(*this);
+    processor.setDstImg(dstPixelData, dstBounds, pixelComponents, pixelComponentCount, eBitDepthFloat, dstRowBytes);
+    processor.setSrcImg(srcPixelData, srcBounds, srcRowBytes, renderWindowFullRes, levels);
+    processor.setPremult(unpremult, premult);
+#ifdef OFX_IO_USING_OCIO
+    if ( colorConvert && !_ocio->isIdentity(time) ) {
+        OCIO_NAMESPACE::ConstProcessorRcPtr proc = _ocio->getOrCreateProcessor(time);
+        if (!proc) {
+            setPersistentMessage( Message::eMessageError, "", "Cannot create OCIO processor" );
+            throwSuiteStatusException(kOfxStatFailed);
 
             return;
         }
-        buildMipMapLevel<float, 1>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
-    } else {
-        assert(dstPixelComponents == ePixelComponentCustom);
-
-        buildMipMapLevelGeneric<float>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                       srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, dstPixelComponentCount);
+        processor.setProcessor(proc);
     }
-} // GenericReaderPlugin::scalePixelData
+#else
+    (void)time;
+    (void)colorConvert;
+#endif
+    processor.setRenderWindow(renderWindow);
+#ifdef GENERIC_READER_USE_MULTI_THREAD
+    processor.process();
+#else
+    processor.multiThreadProcessImages(renderWindow);
+#endif
+}
 
 /* set up and run a copy processor */
 static void
@@ -1175,120 +1877,6 @@ GenericReaderPlugin::fillWithBlack(const OfxRectI &renderWindow,
     setupAndFillWithBlack(fred, renderWindow, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
 }
 
-static void
-setupAndProcess(PixelProcessorFilterBase & processor,
-                int premultChannel,
-                const OfxRectI &renderWindow,
-                const void *srcPixelData,
-                const OfxRectI& srcBounds,
-                PixelComponentEnum srcPixelComponents,
-                int srcPixelComponentCount,
-                BitDepthEnum srcPixelDepth,
-                int srcRowBytes,
-                void *dstPixelData,
-                const OfxRectI& dstBounds,
-                PixelComponentEnum dstPixelComponents,
-                int dstPixelComponentCount,
-                BitDepthEnum dstPixelDepth,
-                int dstRowBytes)
-{
-    assert(srcPixelData && dstPixelData);
-
-    // make sure bit depths are sane
-    if ( (srcPixelDepth != dstPixelDepth) || (srcPixelComponents != dstPixelComponents) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
-
-    // set the images
-    processor.setDstImg(dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstPixelDepth, dstRowBytes);
-    processor.setSrcImg(srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, 0);
-
-    // set the render window
-    processor.setRenderWindow(renderWindow);
-
-    processor.setPremultMaskMix(true, premultChannel, 1.);
-
-    // Call the base class process member, this will call the derived templated process code
-    processor.process();
-}
-
-void
-GenericReaderPlugin::unPremultPixelData(const OfxRectI &renderWindow,
-                                        const void *srcPixelData,
-                                        const OfxRectI& srcBounds,
-                                        PixelComponentEnum srcPixelComponents,
-                                        int srcPixelComponentCount,
-                                        BitDepthEnum srcPixelDepth,
-                                        int srcRowBytes,
-                                        void *dstPixelData,
-                                        const OfxRectI& dstBounds,
-                                        PixelComponentEnum dstPixelComponents,
-                                        int dstPixelComponentCount,
-                                        BitDepthEnum dstBitDepth,
-                                        int dstRowBytes)
-{
-    assert(srcPixelData && dstPixelData);
-
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
-    if (dstPixelComponents == ePixelComponentRGBA) {
-        if (!_supportsRGBA) {
-            throwSuiteStatusException(kOfxStatErrFormat);
-
-            return;
-        }
-        PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
-        setupAndProcess(fred, 3, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
-    } else {
-        ///other pixel components means you want to copy only...
-        assert(false);
-    }
-}
-
-void
-GenericReaderPlugin::premultPixelData(const OfxRectI &renderWindow,
-                                      const void *srcPixelData,
-                                      const OfxRectI& srcBounds,
-                                      PixelComponentEnum srcPixelComponents,
-                                      int srcPixelComponentCount,
-                                      BitDepthEnum srcPixelDepth,
-                                      int srcRowBytes,
-                                      void *dstPixelData,
-                                      const OfxRectI& dstBounds,
-                                      PixelComponentEnum dstPixelComponents,
-                                      int dstPixelComponentCount,
-                                      BitDepthEnum dstBitDepth,
-                                      int dstRowBytes)
-{
-    assert(srcPixelData && dstPixelData);
-
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
-
-    if (dstPixelComponents == ePixelComponentRGBA) {
-        if (!_supportsRGBA) {
-            throwSuiteStatusException(kOfxStatErrFormat);
-
-            return;
-        }
-        PixelCopierPremult<float, 4, 1, float, 4, 1> fred(*this);
-        setupAndProcess(fred, 3, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
-    } else {
-        ///other pixel components means you want to copy only...
-        assert(false);
-    }
-}
-
 bool
 GenericReaderPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments &args,
                                            OfxRectD &rod)
@@ -1342,7 +1930,7 @@ GenericReaderPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments &ar
     OfxRectI bounds, format;
     double par = 1.;
     int tile_width, tile_height;
-    bool success = getFrameBounds(filename, sequenceTime, &bounds, &format, &par, &error, &tile_width, &tile_height);
+    bool success = getFrameBoundsCached(filename, sequenceTime, &bounds, &format, &par, &error, &tile_width, &tile_height);
     if (!success) {
         setPersistentMessage(Message::eMessageError, "", error);
         throwSuiteStatusException(kOfxStatFailed);
@@ -1394,6 +1982,35 @@ public:
     }
 };
 
+// Calls beginDecodePlanes() before the planes of a frame are decoded by a multi-plane reader,
+// and endDecodePlanes() when leaving render(), even if decoding threw an exception.
+class DecodePlanesGuard
+{
+public:
+    DecodePlanesGuard(GenericReaderPlugin* reader,
+                      const string& filename,
+                      OfxTime time,
+                      int view,
+                      const std::list<GenericReaderPlugin::PlaneToRender>& planes)
+        : _reader(NULL)
+    {
+        if ( reader->_isMultiPlanar && (planes.size() > 1) ) {
+            reader->beginDecodePlanes(filename, time, view, planes);
+            _reader = reader;
+        }
+    }
+
+    ~DecodePlanesGuard()
+    {
+        if (_reader) {
+            _reader->endDecodePlanes();
+        }
+    }
+
+private:
+    GenericReaderPlugin* _reader;
+};
+
 void
 GenericReaderPlugin::render(const RenderArguments &args)
 {
@@ -1667,7 +2284,7 @@ GenericReaderPlugin::render(const RenderArguments &args)
     string error;
 
     ///if the plug-in doesn't support tiles, just render the full rod
-    bool success = getFrameBounds(filename, sequenceTime, &frameBounds, &format, &par, &error, &tile_width, &tile_height);
+    bool success = getFrameBoundsCached(filename, sequenceTime, &frameBounds, &format, &par, &error, &tile_width, &tile_height);
     ///We shouldve checked above for any failure, now this is too late.
     if (!success) {
         setPersistentMessage(Message::eMessageError, "", error);
@@ -1676,6 +2293,23 @@ GenericReaderPlugin::render(const RenderArguments &args)
         return;
     }
 
+    // if the file contains the image at a lower resolution (e.g. a MIP level), decode it rather than downscaling
+    // the full-res image: frameBounds, the tile size and downscaleLevels are then relative to that level
+    unsigned int fileMipmapLevel = 0;
+    if ( kSupportsRenderScale && (downscaleLevels > 0) ) {
+        OfxRectI levelBounds;
+        int levelTileWidth = 0, levelTileHeight = 0;
+        fileMipmapLevel = getFileMipmapLevel(filename, sequenceTime, args.renderView, downscaleLevels, &levelBounds, &levelTileWidth, &levelTileHeight);
+        assert(fileMipmapLevel <= (unsigned int)downscaleLevels);
+        if (fileMipmapLevel > 0) {
+            DBG( std::printf("decode file mipmap level %u\n", fileMipmapLevel) );
+            frameBounds = levelBounds;
+            tile_width = levelTileWidth;
+            tile_height = levelTileHeight;
+            downscaleLevels -= fileMipmapLevel;
+        }
+    }
+
     renderWindowFullRes = upscalePowerOfTwo(args.renderWindow, downscaleLevels); // works even if downscaleLevels == 0
 
     // Intersect the full res renderwindow to the real rod,
@@ -1689,6 +2323,9 @@ GenericReaderPlugin::render(const RenderArguments &args)
     //See below: we round the render window to the tile size
     renderWindowNotRounded = renderWindowFullRes;
 
+    // let multi-plane readers read the file once for all planes
+    DecodePlanesGuard decodePlanesGuard(this, filename, sequenceTime, args.renderView, planes);
+
     for (std::list<PlaneToRender>::iterator it = planes.begin(); it != planes.end(); ++it) {
         // Read into a temporary image, apply colorspace conversion, then copy
         bool isOCIOIdentity;
@@ -1763,15 +2400,14 @@ GenericReaderPlugin::render(const RenderArguments &args)
                              ( (filePremult == eImageUnPreMultiplied || !isOCIOIdentity) && outputPremult == eImagePreMultiplied ) );
 
 
-        if ( !mustPremult && isOCIOIdentity && ( !kSupportsRenderScale || (renderMipmapLevel == 0) ) ) {
-            // no colorspace conversion, no premultiplication, no proxy, just read file
+        if ( !mustPremult && isOCIOIdentity && ( !kSupportsRenderScale || (renderMipmapLevel == 0) || (fileMipmapLevel == renderMipmapLevel) ) ) {
+            // no colorspace conversion, no premultiplication, no proxy, no downscaling, just read file
             DBG( std::printf("decode (to dst)\n") );
 
-            if (!_isMultiPlanar) {
-                decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, it->pixelData, firstBounds, it->comps, it->numChans, it->rowBytes);
-            } else {
-                decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, it->pixelData, firstBounds, it->comps, it->numChans, it->rawComps, it->rowBytes);
+            if (args.sequentialRenderStatus) {
+                prefetchNextFrames(filename, sequenceTime, args.renderView, fileMipmapLevel, useProxy, args.renderWindow, *it);
             }
+            decodeWithCache(filename, sequenceTime, args.renderView, fileMipmapLevel, args.sequentialRenderStatus, args.interactiveRenderStatus, args.renderWindow, it->pixelData, firstBounds, it->comps, it->numChans, it->rawComps, it->rowBytes);
         } else {
             int pixelBytes;
             if (it->comps == ePixelComponentCustom) {
@@ -1823,81 +2459,25 @@ GenericReaderPlugin::render(const RenderArguments &args)
             // read file
             DBG( std::printf("decode (to tmp)\n") );
 
-            if (!_isMultiPlanar) {
-                decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, tmpRowBytes);
-            } else {
-                decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, it->rawComps, tmpRowBytes);
+            if (args.sequentialRenderStatus) {
+                prefetchNextFrames(filename, sequenceTime, args.renderView, fileMipmapLevel, useProxy, renderWindowFullRes, *it);
             }
+            decodeWithCache(filename, sequenceTime, args.renderView, fileMipmapLevel, args.sequentialRenderStatus, args.interactiveRenderStatus, renderWindowFullRes, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, it->rawComps, tmpRowBytes);
 
             if ( abort() ) {
                 return;
             }
 
-            ///do the color-space conversion
-            if ( !isOCIOIdentity && (it->comps != ePixelComponentAlpha) && (it->comps != ePixelComponentXY) ) {
-                if (filePremult == eImagePreMultiplied) {
-                    assert(remappedComponents == ePixelComponentRGBA);
-                    DBG( std::printf("unpremult (tmp in-place)\n") );
-                    //tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = tmpPixelData[3] = 0.5;
-                    unPremultPixelData(renderWindowNotRounded, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes);
-
-                    if ( abort() ) {
-                        return;
-                    }
-
-                    //assert(tmpPixelData[0] == 1. && tmpPixelData[1] == 1. && tmpPixelData[2] == 1. && tmpPixelData[3] == 0.5);
-                }
-#ifdef OFX_IO_USING_OCIO
-                DBG( std::printf("OCIO (tmp in-place)\n") );
-                _ocio->apply(args.time, renderWindowFullRes, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, tmpRowBytes);
-#endif
-            }
-
-            if ( kSupportsRenderScale && (downscaleLevels > 0) ) {
-                if (!mustPremult) {
-                    // we can write directly to dstPixelData
-                    /// adjust the scale to match the given output image
-                    DBG( std::printf("scale (no premult, tmp to dst)\n") );
-                    scalePixelData(args.renderWindow, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData, remappedComponents,
-                                   it->numChans, firstDepth, renderWindowFullRes, tmpRowBytes, it->pixelData,
-                                   remappedComponents, it->numChans, firstDepth, firstBounds, it->rowBytes);
-                } else {
-                    // allocate a temporary image (we must avoid reading from dstPixelData, in case several threads are rendering the same area)
-                    int mem2RowBytes = (firstBounds.x2 - firstBounds.x1) * pixelBytes;
-                    size_t mem2Size = (size_t)(firstBounds.y2 - firstBounds.y1) * (size_t)mem2RowBytes;
-                    ImageMemory mem2(mem2Size, this);
-                    float *scaledPixelData = (float*)mem2.lock();
-
-                    /// adjust the scale to match the given output image
-                    DBG( std::printf("scale (tmp to scaled)\n") );
-                    scalePixelData(args.renderWindow, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData,
-                                   remappedComponents, it->numChans, firstDepth,
-                                   renderWindowFullRes, tmpRowBytes, scaledPixelData,
-                                   remappedComponents, it->numChans, firstDepth,
-                                   firstBounds, mem2RowBytes);
-
-                    if ( abort() ) {
-                        return;
-                    }
-
-                    // apply premult
-                    DBG( std::printf("premult (scaled to dst)\n") );
-                    //scaledPixelData[0] = scaledPixelData[1] = scaledPixelData[2] = 1.; scaledPixelData[3] = 0.5;
-                    premultPixelData(args.renderWindow, scaledPixelData, firstBounds, remappedComponents,  it->numChans, firstDepth, mem2RowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                    //assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
-                }
-            } else {
-                // copy
-                if (mustPremult) {
-                    DBG( std::printf("premult (no scale, tmp to dst)\n") );
-                    //tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = 1.; tmpPixelData[3] = 0.5;
-                    premultPixelData(args.renderWindow, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                    //assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
-                } else {
-                    DBG( std::printf("copy (no premult no scale, tmp to dst)\n") );
-                    copyPixelData(args.renderWindow, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                }
-            }
+            // unpremult, do the color-space conversion, adjust the scale to match the given output image and premult,
+            // all in a single pass (we must avoid reading from dstPixelData, in case several threads are rendering the same area)
+            bool colorConvert = ( !isOCIOIdentity && (it->comps != ePixelComponentAlpha) && (it->comps != ePixelComponentXY) );
+            bool unpremult = ( colorConvert && (filePremult == eImagePreMultiplied) );
+            assert(!unpremult || remappedComponents == ePixelComponentRGBA);
+            unsigned int levels = kSupportsRenderScale ? (unsigned int)downscaleLevels : 0;
+            DBG( std::printf("post-process (unpremult=%d ocio=%d levels=%u premult=%d, tmp to dst)\n", (int)unpremult, (int)colorConvert, levels, (int)mustPremult) );
+            postProcessPixelData(args.time, args.renderWindow, renderWindowNotRounded, levels, unpremult, colorConvert, mustPremult,
+                                 tmpPixelData, renderWindowFullRes, tmpRowBytes,
+                                 it->pixelData, firstBounds, remappedComponents, it->numChans, it->rowBytes);
             mem.unlock();
         }
     } // for (std::list<PlaneToRender>::iterator it = planes.begin(); it!=planes.end(); ++it) {
@@ -1934,6 +2514,186 @@ GenericReaderPlugin::decodePlane(const string& /*filename*/,
     //does nothing
 }
 
+void
+GenericReaderPlugin::decodeFileMipmapLevel(const string& /*filename*/,
+                                           OfxTime /*time*/,
+                                           int /*view*/,
+                                           bool /*isPlayback*/,
+                                           unsigned int /*level*/,
+                                           const OfxRectI& /*renderWindow*/,
+                                           float */*pixelData*/,
+                                           const OfxRectI& /*bounds*/,
+                                           PixelComponentEnum /*pixelComponents*/,
+                                           int /*pixelComponentCount*/,
+                                           const string& /*rawComponents*/,
+                                           int /*rowBytes*/)
+{
+    //does nothing
+}
+
+void
+GenericReaderPlugin::decodeWithCache(const string& filename,
+                                     OfxTime time,
+                                     int view,
+                                     unsigned int mipmapLevel,
+                                     bool isPlayback,
+                                     bool isInteractive,
+                                     const OfxRectI& renderWindow,
+                                     float *pixelData,
+                                     const OfxRectI& bounds,
+                                     PixelComponentEnum pixelComponents,
+                                     int pixelComponentCount,
+                                     const string& rawComponents,
+                                     int rowBytes)
+{
+    DecodedFrameCache::Key key;
+    bool cacheable = gDecodedFrameCache.isEnabled() && FileHeaderCache::getFileStamp(filename, &key.mtime, &key.fileSize, &key.inode);
+
+    if (cacheable) {
+        key.owner = this;
+        key.filename = filename;
+        key.time = time;
+        key.view = view;
+        key.mipmapLevel = mipmapLevel;
+        key.comps = pixelComponents;
+        key.rawComps = rawComponents;
+        key.numChans = pixelComponentCount;
+        gSequencePrefetcher.waitFor(this, filename, time, view, pixelComponents, rawComponents);
+        if ( gDecodedFrameCache.get(key, renderWindow, pixelData, bounds, rowBytes) ) {
+            DBG( std::printf("decode (from cache)\n") );
+
+            return;
+        }
+    }
+
+    if (mipmapLevel > 0) {
+        decodeFileMipmapLevel(filename, time, view, isPlayback, mipmapLevel, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+    } else if (!_isMultiPlanar) {
+        decode(filename, time, view, isPlayback, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rowBytes);
+    } else {
+        decodePlane(filename, time, view, isPlayback, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+    }
+
+    // only keep frames that are likely to be rendered again: a batch render reads each frame once
+    if ( cacheable && isInteractive && !abort() ) {
+        gDecodedFrameCache.insert(key, renderWindow, pixelData, bounds, rowBytes);
+    }
+}
+
+void
+GenericReaderPlugin::prefetchNextFrames(const string& filename,
+                                        double sequenceTime,
+                                        int view,
+                                        unsigned int mipmapLevel,
+                                        bool useProxy,
+                                        const OfxRectI& renderWindow,
+                                        const PlaneToRender& plane)
+{
+    // the prefetch threads are not host action threads: only readers that do not read parameters while decoding are prefetched
+    if ( !isDecodeParamFree() || !gDecodedFrameCache.isEnabled() || (gSequencePrefetcher.frames() <= 0) || isVideoStream(filename) ) {
+        return;
+    }
+
+    const int direction = gSequencePrefetcher.direction(this, sequenceTime);
+    const int firstFrame = _firstFrame->getValue();
+    const int lastFrame = _lastFrame->getValue();
+    std::list<SequencePrefetcher::Request> requests;
+
+    for (int i = 1; i <= gSequencePrefetcher.frames(); ++i) {
+        double t = std::floor(sequenceTime + 0.5) + i * direction;
+        if ( (t < firstFrame) || (t > lastFrame) ) {
+            break;
+        }
+        SequencePrefetcher::Request r;
+        GetFilenameRetCodeEnum getFilenameAtSequenceTimeRet = getFilenameAtSequenceTime(t, useProxy, true, &r.filename);
+        if ( (getFilenameAtSequenceTimeRet != eGetFileNameReturnedFullRes) && (getFilenameAtSequenceTimeRet != eGetFileNameReturnedProxy) ) {
+            continue;
+        }
+        r.owner = this;
+        r.time = t;
+        r.view = view;
+        r.mipmapLevel = mipmapLevel;
+        r.window = renderWindow;
+        r.comps = plane.comps;
+        r.numChans = plane.numChans;
+        r.rawComps = plane.rawComps;
+        requests.push_back(r);
+    }
+    gSequencePrefetcher.schedule(this, plane.comps, plane.rawComps, requests);
+}
+
+void
+GenericReaderPlugin::prefetchFrame(const string& filename,
+                                   OfxTime time,
+                                   int view,
+                                   unsigned int mipmapLevel,
+                                   const OfxRectI& renderWindow,
+                                   PixelComponentEnum pixelComponents,
+                                   int pixelComponentCount,
+                                   const string& rawComponents)
+{
+    DecodedFrameCache::Key key;
+
+    if ( !FileHeaderCache::getFileStamp(filename, &key.mtime, &key.fileSize, &key.inode) ) {
+        return;
+    }
+    key.owner = this;
+    key.filename = filename;
+    key.time = time;
+    key.view = view;
+    key.mipmapLevel = mipmapLevel;
+    key.comps = pixelComponents;
+    key.rawComps = rawComponents;
+    key.numChans = pixelComponentCount;
+    if ( gDecodedFrameCache.contains(key, renderWindow) ) {
+        return;
+    }
+
+    int rowBytes = (renderWindow.x2 - renderWindow.x1) * pixelComponentCount * sizeof(float);
+    size_t memSize = (size_t)(renderWindow.y2 - renderWindow.y1) * (size_t)rowBytes;
+    // this is not called from a render action: use malloc() rather than the host memory suite
+    float* pixelData = (float*)std::malloc(memSize);
+    if (!pixelData) {
+        return;
+    }
+    try {
+        if (mipmapLevel > 0) {
+            decodeFileMipmapLevel(filename, time, view, true, mipmapLevel, renderWindow, pixelData, renderWindow, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+        } else if (!_isMultiPlanar) {
+            decode(filename, time, view, true, renderWindow, pixelData, renderWindow, pixelComponents, pixelComponentCount, rowBytes);
+        } else {
+            decodePlane(filename, time, view, true, renderWindow, pixelData, renderWindow, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+        }
+    } catch (...) {
+        std::free(pixelData);
+        throw;
+    }
+    gDecodedFrameCache.adopt(key, renderWindow, pixelData);
+}
+
+bool
+GenericReaderPlugin::isPrefetching() const
+{
+    return gSequencePrefetcher.isWorkerThread();
+}
+
+void
+GenericReaderPlugin::setDecodeMessage(Message::MessageTypeEnum type,
+                                      const string& message)
+{
+    if ( !isPrefetching() ) {
+        setPersistentMessage(type, "", message);
+    }
+}
+
+void
+GenericReaderPlugin::clearDecodedFrames()
+{
+    // frames being read in the background may have been decoded with the previous parameters
+    gSequencePrefetcher.cancel(this);
+    gDecodedFrameCache.purge(this);
+}
+
 bool
 GenericReaderPlugin::checkExtension(const string& ext)
 {
@@ -1982,7 +2742,7 @@ GenericReaderPlugin::changedFilename(const InstanceChangedArgs &args)
     _customFPS->getValue(customFps);
     if (!customFps) {
         double fps;
-        bool gotFps = getFrameRate(filename, &fps);
+        bool gotFps = getFrameRateCached(filename, &fps);
         if (gotFps) {
             _fps->setValue(fps);
         }
@@ -2029,7 +2789,7 @@ GenericReaderPlugin::changedFilename(const InstanceChangedArgs &args)
         PreMultiplicationEnum filePremult = eImageOpaque;
 
         assert( !_guessedParams->getValue() );
-        bool success = guessParamsFromFilename(filename, &colorspace, &filePremult, &components, &componentCount);
+        bool success = guessParamsFromFilenameCached(filename, &colorspace, &filePremult, &components, &componentCount);
         if (!success) {
             return;
         }
@@ -2117,6 +2877,31 @@ GenericReaderPlugin::changedFilename(const InstanceChangedArgs &args)
     } // if ( args.reason == eChangeUserEdit && !_guessedParams->getValue() ) {
 } // GenericReaderPlugin::changedFilename
 
+// is this one of the parameters created by GenericReaderDescribeInContextBegin() or GenericReaderDescribeInContextEnd()?
+static bool
+isGenericReaderParam(const string& paramName)
+{
+    return ( paramName == kParamFilename || paramName == kParamProxy || paramName == kParamProxyThreshold ||
+             paramName == kParamOriginalProxyScale || paramName == kParamCustomProxyScale || paramName == kParamOnMissingFrame ||
+             paramName == kParamFrameMode || paramName == kParamTimeOffset || paramName == kParamStartingTime ||
+             paramName == kParamOriginalFrameRange || paramName == kParamFirstFrame || paramName == kParamLastFrame ||
+             paramName == kParamBefore || paramName == kParamAfter || paramName == kParamTimeDomainUserEdited ||
+             paramName == kParamFilePremult || paramName == kParamOutputPremult || paramName == kParamOutputComponents ||
+             paramName == kParamFrameRate || paramName == kParamCustomFps || paramName == kParamGuessedParams ||
+#ifdef OFX_IO_USING_OCIO
+             paramName == kParamInputSpaceSet ||
+             paramName == kOCIOParamConfigFile || paramName == kOCIOParamInputSpace || paramName == kOCIOParamOutputSpace ||
+#ifdef OFX_OCIO_CHOICE
+             paramName == kOCIOParamInputSpaceChoice || paramName == kOCIOParamOutputSpaceChoice || paramName == kOCIOHelpButton ||
+#endif
+             paramName == kOCIOParamContextKey1 || paramName == kOCIOParamContextValue1 ||
+             paramName == kOCIOParamContextKey2 || paramName == kOCIOParamContextValue2 ||
+             paramName == kOCIOParamContextKey3 || paramName == kOCIOParamContextValue3 ||
+             paramName == kOCIOParamContextKey4 || paramName == kOCIOParamContextValue4 ||
+#endif
+             paramName == kNatronOfxParamStringSublabelName );
+}
+
 void
 GenericReaderPlugin::changedParam(const InstanceChangedArgs &args,
                                   const string &paramName)
@@ -2131,6 +2916,13 @@ GenericReaderPlugin::changedParam(const InstanceChangedArgs &args,
 
     // please check the reason for each parameter when it makes sense!
 
+    // the decoded frames only depend on the file contents and on the format-specific parameters:
+    // the filename, the proxy file and the components are part of the cache key, and the other
+    // GenericReader parameters (including OCIO) are applied after decoding.
+    if ( (args.reason != eChangeTime) && !isGenericReaderParam(paramName) ) {
+        clearDecodedFrames();
+    }
+
     if (paramName == kParamFilename) {
         // must clear persistent message, or render() is not called by Nuke after an error
         clearPersistentMessage();
@@ -2296,7 +3088,7 @@ GenericReaderPlugin::changedParam(const InstanceChangedArgs &args,
                 _fileParam->getValueAtTime(timeDomain.min, filename);
 
                 double fps;
-                bool gotFps = getFrameRate(filename, &fps);
+                bool gotFps = getFrameRateCached(filename, &fps);
                 if  (gotFps) {
                     _fps->setValue(fps);
                 }
@@ -2408,7 +3200,7 @@ GenericReaderPlugin::getClipPreferences(ClipPreferencesSetter &clipPreferences)
             double par = 1.;
             string error;
             int tile_width, tile_height;
-            bool success = getFrameBounds(filename, timeDomain.min, &bounds, &format, &par, &error, &tile_width, &tile_height);
+            bool success = getFrameBoundsCached(filename, timeDomain.min, &bounds, &format, &par, &error, &tile_width, &tile_height);
             if (success) {
                 clipPreferences.setPixelAspectRatio(*_outputClip, par);
                 clipPreferences.setOutputFormat(format);
@@ -2422,7 +3214,7 @@ GenericReaderPlugin::getClipPreferences(ClipPreferencesSetter &clipPreferences)
                 _fps->getValue(fps);
                 clipPreferences.setOutputFrameRate(fps);
             } else {
-                success = getFrameRate(filename, &fps);
+                success = getFrameRateCached(filename, &fps);
                 if (success) {
                     clipPreferences.setOutputFrameRate(fps);
                 }
@@ -2435,6 +3227,8 @@ void
 GenericReaderPlugin::purgeCaches()
 {
     clearAnyCache();
+    FileHeaderCache::instance().purge( getHeaderCacheKeyPrefix() );
+    clearDecodedFrames();
 #ifdef OFX_IO_USING_OCIO
     _ocio->purgeCaches();
 #endif
@@ -2507,10 +3301,10 @@ GenericReaderPlugin::detectProxyScale(const string& originalFileName,
     string error;
     double originalPAR = 1., proxyPAR = 1.;
     int tile_width, tile_height;
-    bool success = getFrameBounds(originalFileName, time, &originalBounds, &originalFormat, &originalPAR, &error, &tile_width, &tile_height);
+    bool success = getFrameBoundsCached(originalFileName, time, &originalBounds, &originalFormat, &originalPAR, &error, &tile_width, &tile_height);
 
     proxyBounds.x1 = proxyBounds.x2 = proxyBounds.y1 = proxyBounds.y2 = 0.f;
-    success = success && getFrameBounds(proxyFileName, time, &proxyBounds, &proxyFormat, &proxyPAR, &error, &tile_width, &tile_height);
+    success = success && getFrameBoundsCached(proxyFileName, time, &proxyBounds, &proxyFormat, &proxyPAR, &error, &tile_width, &tile_height);
     OfxPointD ret;
     if ( !success ||
          (originalBounds.x1 == originalBounds.x2) ||
@@ -2531,6 +3325,453 @@ GenericReaderPlugin::detectProxyScale(const string& originalFileName,
     return ret;
 }
 
+string
+GenericReaderPlugin::getHeaderCacheKeyPrefix() const
+{
+    // the class of the plug-in: different readers may return different results for the same file
+    return string( typeid(*this).name() ) + '|';
+}
+
+bool
+GenericReaderPlugin::getHeaderCacheKeyForFile(const string& filename,
+                                              string* key)
+{
+    // the bounds of the frames of a video stream depend on the time
+    if ( !FileHeaderCache::instance().isEnabled() || filename.empty() || isVideoStream(filename) ) {
+        return false;
+    }
+    *key = getHeaderCacheKeyPrefix();
+
+    return getHeaderCacheKey(key);
+}
+
+bool
+GenericReaderPlugin::getFrameBoundsCached(const string& filename,
+                                          OfxTime time,
+                                          OfxRectI *bounds,
+                                          OfxRectI *format,
+                                          double *par,
+                                          string *error,
+                                          int* tile_width,
+                                          int* tile_height)
+{
+    string key;
+    const bool cacheable = getHeaderCacheKeyForFile(filename, &key);
+    FileHeaderCache::Header header;
+
+    if ( cacheable && FileHeaderCache::instance().get(key, filename, &header) && header.hasBounds ) {
+        *bounds = header.bounds;
+        *format = header.format;
+        *par = header.par;
+        *tile_width = header.tileWidth;
+        *tile_height = header.tileHeight;
+
+        return true;
+    }
+    if ( !getFrameBounds(filename, time, bounds, format, par, error, tile_width, tile_height) ) {
+        return false;
+    }
+    if (cacheable) {
+        header = FileHeaderCache::Header();
+        header.hasBounds = true;
+        header.bounds = *bounds;
+        header.format = *format;
+        header.par = *par;
+        header.tileWidth = *tile_width;
+        header.tileHeight = *tile_height;
+        FileHeaderCache::instance().set(key, filename, header);
+    }
+
+    return true;
+}
+
+bool
+GenericReaderPlugin::getFrameRateCached(const string& filename,
+                                        double* fps)
+{
+    string key;
+    const bool cacheable = getHeaderCacheKeyForFile(filename, &key);
+    FileHeaderCache::Header header;
+
+    if ( cacheable && FileHeaderCache::instance().get(key, filename, &header) && header.hasFrameRate ) {
+        *fps = header.fps;
+
+        return true;
+    }
+    if ( !getFrameRate(filename, fps) ) {
+        return false;
+    }
+    if (cacheable) {
+        header = FileHeaderCache::Header();
+        header.hasFrameRate = true;
+        header.fps = *fps;
+        FileHeaderCache::instance().set(key, filename, header);
+    }
+
+    return true;
+}
+
+bool
+GenericReaderPlugin::guessParamsFromFilenameCached(const string& filename,
+                                                   string *colorspace,
+                                                   PreMultiplicationEnum *filePremult,
+                                                   PixelComponentEnum *components,
+                                                   int *componentCount)
+{
+    string key;
+    const bool cacheable = isGuessParamsCacheable() && getHeaderCacheKeyForFile(filename, &key);
+
+#ifdef OFX_IO_USING_OCIO
+    if (cacheable) {
+        // the guessed colorspace depends on the colorspaces of the config, and on the default input colorspace
+        OCIO::ConstConfigRcPtr config = _ocio->getConfig();
+        key += '|';
+        key += config ? config->getCacheID() : "";
+        key += '|';
+        key += *colorspace;
+    }
+#endif
+    FileHeaderCache::Header header;
+    if ( cacheable && FileHeaderCache::instance().get(key, filename, &header) && header.hasParams ) {
+        *colorspace = header.colorspace;
+        *filePremult = (PreMultiplicationEnum)header.premult;
+        *components = (PixelComponentEnum)header.components;
+        *componentCount = header.componentCount;
+
+        return true;
+    }
+    if ( !guessParamsFromFilename(filename, colorspace, filePremult, components, componentCount) ) {
+        return false;
+    }
+    if (cacheable) {
+        header = FileHeaderCache::Header();
+        header.hasParams = true;
+        header.colorspace = *colorspace;
+        header.premult = (int)*filePremult;
+        header.components = (int)*components;
+        header.componentCount = *componentCount;
+        FileHeaderCache::instance().set(key, filename, header);
+    }
+
+    return true;
+} // GenericReaderPlugin::guessParamsFromFilenameCached
+
+bool
+GenericReaderPlugin::getCachedMetadata(const string& filename,
+                                       string* metadata)
+{
+    string key;
+    FileHeaderCache::Header header;
+
+    if ( !getHeaderCacheKeyForFile(filename, &key) || !FileHeaderCache::instance().get(key, filename, &header) || !header.hasMetadata ) {
+        return false;
+    }
+    *metadata = header.metadata;
+
+    return true;
+}
+
+void
+GenericReaderPlugin::setCachedMetadata(const string& filename,
+                                       const string& metadata)
+{
+    string key;
+
+    if ( !getHeaderCacheKeyForFile(filename, &key) ) {
+        return;
+    }
+    FileHeaderCache::Header header;
+    header.hasMetadata = true;
+    header.metadata = metadata;
+    FileHeaderCache::instance().set(key, filename, header);
+}
+
+// SIMD row kernels for the most common conversions done by convertDepthAndComponents
+// (8-bit RGB/RGBA and 16-bit RGBA to float RGBA, e.g. PNG and FFmpeg frames).
+// They compute exactly the same thing as the scalar code in PixelConverterProcessor
+// (integer to float conversion, then multiplication by 1.f/srcMaxValue), so results are bit-exact.
+// The x86 kernels are selected at runtime depending on the CPU, NEON is always available on AArch64.
+// Setting the environment variable OFX_IO_SIMD to 0 disables them.
+#define kConvertSIMDEnv "OFX_IO_SIMD"
+
+#if ( defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86) ) && \
+    ( defined(_MSC_VER) || defined(__clang__) || ( defined(__GNUC__) && ( (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) ) ) )
+#define GENERIC_READER_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define GENERIC_READER_SIMD_TARGET(x)
+#else
+#define GENERIC_READER_SIMD_TARGET(x) __attribute__( ( target(x) ) )
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define GENERIC_READER_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*ConvertRow8Func)(const unsigned char* src, float* dst, int n);
+typedef void (*ConvertRow16Func)(const unsigned short* src, float* dst, int n);
+
+struct ConvertRowKernels
+{
+    ConvertRow8Func rgb8ToRGBA;
+    ConvertRow8Func rgba8ToRGBA;
+    ConvertRow16Func rgba16ToRGBA;
+};
+
+// convert the n last pixels of a row, that the SIMD kernels cannot load safely
+template<typename SRCPIX, int srcMaxValue, int nSrcComp>
+static void
+convertRowToRGBATail(const SRCPIX* src,
+                     float* dst,
+                     int n)
+{
+    for (int x = 0; x < n; ++x, src += nSrcComp, dst += 4) {
+        dst[0] = src[0] * (1.f / srcMaxValue);
+        dst[1] = src[1] * (1.f / srcMaxValue);
+        dst[2] = src[2] * (1.f / srcMaxValue);
+        dst[3] = (nSrcComp == 4) ? src[3] * (1.f / srcMaxValue) : 1.f;
+    }
+}
+
+#ifdef GENERIC_READER_SIMD_X86
+GENERIC_READER_SIMD_TARGET("sse4.1")
+static void
+convertRowRGB8ToRGBA_SSE41(const unsigned char* src,
+                           float* dst,
+                           int n)
+{
+    const __m128 scale = _mm_set1_ps(1.f / 255);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128i rgbToRGBx = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    int x = 0;
+
+    // 4 pixels at a time, loading 16 bytes (the last 4 belong to the next pixels)
+    for (; x + 6 <= n; x += 4) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128( (const __m128i*)(src + x * 3) ), rgbToRGBx);
+        for (int i = 0; i < 4; ++i) {
+            __m128 p = _mm_mul_ps(_mm_cvtepi32_ps( _mm_cvtepu8_epi32(v) ), scale);
+            _mm_storeu_ps( dst + (x + i) * 4, _mm_blend_ps(p, one, 8) );
+            v = _mm_srli_si128(v, 4);
+        }
+    }
+    convertRowToRGBATail<unsigned char, 255, 3>(src + x * 3, dst + x * 4, n - x);
+}
+
+GENERIC_READER_SIMD_TARGET("sse4.1")
+static void
+convertRowRGBA8ToRGBA_SSE41(const unsigned char* src,
+                            float* dst,
+                            int n)
+{
+    const __m128 scale = _mm_set1_ps(1.f / 255);
+    int x = 0;
+
+    for (; x + 4 <= n; x += 4) {
+        __m128i v = _mm_loadu_si128( (const __m128i*)(src + x * 4) );
+        for (int i = 0; i < 4; ++i) {
+            _mm_storeu_ps( dst + (x + i) * 4, _mm_mul_ps(_mm_cvtepi32_ps( _mm_cvtepu8_epi32(v) ), scale) );
+            v = _mm_srli_si128(v, 4);
+        }
+    }
+    convertRowToRGBATail<unsigned char, 255, 4>(src + x * 4, dst + x * 4, n - x);
+}
+
+GENERIC_READER_SIMD_TARGET("sse4.1")
+static void
+convertRowRGBA16ToRGBA_SSE41(const unsigned short* src,
+                             float* dst,
+                             int n)
+{
+    const __m128 scale = _mm_set1_ps(1.f / 65535);
+    int x = 0;
+
+    for (; x + 2 <= n; x += 2) {
+        __m128i v = _mm_loadu_si128( (const __m128i*)(src + x * 4) );
+        _mm_storeu_ps( dst + x * 4, _mm_mul_ps(_mm_cvtepi32_ps( _mm_cvtepu16_epi32(v) ), scale) );
+        _mm_storeu_ps( dst + x * 4 + 4, _mm_mul_ps(_mm_cvtepi32_ps( _mm_cvtepu16_epi32( _mm_srli_si128(v, 8) ) ), scale) );
+    }
+    convertRowToRGBATail<unsigned short, 65535, 4>(src + x * 4, dst + x * 4, n - x);
+}
+
+GENERIC_READER_SIMD_TARGET("avx2")
+static void
+convertRowRGB8ToRGBA_AVX2(const unsigned char* src,
+                          float* dst,
+                          int n)
+{
+    const __m256 scale = _mm256_set1_ps(1.f / 255);
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m128i rgbToRGBx = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    int x = 0;
+
+    // 8 pixels at a time, loading 2x16 bytes (the last 4 belong to the next pixels)
+    for (; x + 10 <= n; x += 8) {
+        for (int half = 0; half < 2; ++half) {
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128( (const __m128i*)(src + (x + half * 4) * 3) ), rgbToRGBx);
+            __m256 p0 = _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu8_epi32(v) ), scale);
+            __m256 p1 = _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu8_epi32( _mm_srli_si128(v, 8) ) ), scale);
+            _mm256_storeu_ps( dst + (x + half * 4) * 4, _mm256_blend_ps(p0, one, 0x88) );
+            _mm256_storeu_ps( dst + (x + half * 4) * 4 + 8, _mm256_blend_ps(p1, one, 0x88) );
+        }
+    }
+    convertRowToRGBATail<unsigned char, 255, 3>(src + x * 3, dst + x * 4, n - x);
+}
+
+GENERIC_READER_SIMD_TARGET("avx2")
+static void
+convertRowRGBA8ToRGBA_AVX2(const unsigned char* src,
+                           float* dst,
+                           int n)
+{
+    const __m256 scale = _mm256_set1_ps(1.f / 255);
+    int x = 0;
+
+    for (; x + 8 <= n; x += 8) {
+        __m256i v = _mm256_loadu_si256( (const __m256i*)(src + x * 4) );
+        __m128i lo = _mm256_castsi256_si128(v);
+        __m128i hi = _mm256_extracti128_si256(v, 1);
+        _mm256_storeu_ps( dst + x * 4, _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu8_epi32(lo) ), scale) );
+        _mm256_storeu_ps( dst + x * 4 + 8, _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu8_epi32( _mm_srli_si128(lo, 8) ) ), scale) );
+        _mm256_storeu_ps( dst + x * 4 + 16, _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu8_epi32(hi) ), scale) );
+        _mm256_storeu_ps( dst + x * 4 + 24, _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu8_epi32( _mm_srli_si128(hi, 8) ) ), scale) );
+    }
+    convertRowToRGBATail<unsigned char, 255, 4>(src + x * 4, dst + x * 4, n - x);
+}
+
+GENERIC_READER_SIMD_TARGET("avx2")
+static void
+convertRowRGBA16ToRGBA_AVX2(const unsigned short* src,
+                            float* dst,
+                            int n)
+{
+    const __m256 scale = _mm256_set1_ps(1.f / 65535);
+    int x = 0;
+
+    for (; x + 4 <= n; x += 4) {
+        __m256i v = _mm256_loadu_si256( (const __m256i*)(src + x * 4) );
+        _mm256_storeu_ps( dst + x * 4, _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_castsi256_si128(v) ) ), scale) );
+        _mm256_storeu_ps( dst + x * 4 + 8, _mm256_mul_ps(_mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_extracti128_si256(v, 1) ) ), scale) );
+    }
+    convertRowToRGBATail<unsigned short, 65535, 4>(src + x * 4, dst + x * 4, n - x);
+}
+
+#endif // GENERIC_READER_SIMD_X86
+
+#ifdef GENERIC_READER_SIMD_NEON
+template<int nSrcComp>
+static void
+convertRow8ToRGBA_NEON(const unsigned char* src,
+                       float* dst,
+                       int n)
+{
+    const float32x4_t scale = vdupq_n_f32(1.f / 255);
+    const float32x4_t one = vdupq_n_f32(1.f);
+    int x = 0;
+
+    for (; x + 8 <= n; x += 8) {
+        uint8x8_t c[4];
+        if (nSrcComp == 3) {
+            uint8x8x3_t p = vld3_u8(src + x * 3);
+            c[0] = p.val[0]; c[1] = p.val[1]; c[2] = p.val[2]; c[3] = p.val[2];
+        } else {
+            uint8x8x4_t p = vld4_u8(src + x * 4);
+            c[0] = p.val[0]; c[1] = p.val[1]; c[2] = p.val[2]; c[3] = p.val[3];
+        }
+        float32x4x4_t lo, hi;
+        for (int k = 0; k < 4; ++k) {
+            uint16x8_t w = vmovl_u8(c[k]);
+            lo.val[k] = vmulq_f32(vcvtq_f32_u32( vmovl_u16( vget_low_u16(w) ) ), scale);
+            hi.val[k] = vmulq_f32(vcvtq_f32_u32( vmovl_u16( vget_high_u16(w) ) ), scale);
+        }
+        if (nSrcComp == 3) {
+            lo.val[3] = one;
+            hi.val[3] = one;
+        }
+        vst4q_f32(dst + x * 4, lo);
+        vst4q_f32(dst + x * 4 + 16, hi);
+    }
+    convertRowToRGBATail<unsigned char, 255, nSrcComp>(src + x * nSrcComp, dst + x * 4, n - x);
+}
+
+static void
+convertRowRGBA16ToRGBA_NEON(const unsigned short* src,
+                            float* dst,
+                            int n)
+{
+    const float32x4_t scale = vdupq_n_f32(1.f / 65535);
+    int x = 0;
+
+    for (; x + 2 <= n; x += 2) {
+        uint16x8_t v = vld1q_u16(src + x * 4);
+        vst1q_f32( dst + x * 4, vmulq_f32(vcvtq_f32_u32( vmovl_u16( vget_low_u16(v) ) ), scale) );
+        vst1q_f32( dst + x * 4 + 4, vmulq_f32(vcvtq_f32_u32( vmovl_u16( vget_high_u16(v) ) ), scale) );
+    }
+    convertRowToRGBATail<unsigned short, 65535, 4>(src + x * 4, dst + x * 4, n - x);
+}
+
+#endif // GENERIC_READER_SIMD_NEON
+
+static ConvertRowKernels
+selectConvertRowKernels()
+{
+    ConvertRowKernels kernels = { NULL, NULL, NULL };
+    const char* env = std::getenv(kConvertSIMDEnv);
+
+    if ( env && (std::string(env) == "0") ) {
+        return kernels;
+    }
+#if defined(GENERIC_READER_SIMD_X86)
+    CPUFeatures cpu = getCPUFeatures();
+    if (cpu.avx2) {
+        kernels.rgb8ToRGBA = convertRowRGB8ToRGBA_AVX2;
+        kernels.rgba8ToRGBA = convertRowRGBA8ToRGBA_AVX2;
+        kernels.rgba16ToRGBA = convertRowRGBA16ToRGBA_AVX2;
+    } else if (cpu.sse41) {
+        kernels.rgb8ToRGBA = convertRowRGB8ToRGBA_SSE41;
+        kernels.rgba8ToRGBA = convertRowRGBA8ToRGBA_SSE41;
+        kernels.rgba16ToRGBA = convertRowRGBA16ToRGBA_SSE41;
+    }
+#elif defined(GENERIC_READER_SIMD_NEON)
+    kernels.rgb8ToRGBA = convertRow8ToRGBA_NEON<3>;
+    kernels.rgba8ToRGBA = convertRow8ToRGBA_NEON<4>;
+    kernels.rgba16ToRGBA = convertRowRGBA16ToRGBA_NEON;
+#endif
+
+    return kernels;
+}
+
+// selected once, when the plugin is loaded
+static const ConvertRowKernels gConvertRowKernels = selectConvertRowKernels();
+
+// the SIMD kernel converting a row of nSrcComp SRCPIX to float RGBA, or NULL to use the generic code
+template<typename SRCPIX, int srcMaxValue, int nSrcComp>
+struct ConvertRowToRGBA
+{
+    typedef void (*Func)(const SRCPIX* src, float* dst, int n);
+    static Func get() { return NULL; }
+};
+
+template<>
+struct ConvertRowToRGBA<unsigned char, 255, 3>
+{
+    typedef ConvertRow8Func Func;
+    static Func get() { return gConvertRowKernels.rgb8ToRGBA; }
+};
+
+template<>
+struct ConvertRowToRGBA<unsigned char, 255, 4>
+{
+    typedef ConvertRow8Func Func;
+    static Func get() { return gConvertRowKernels.rgba8ToRGBA; }
+};
+
+template<>
+struct ConvertRowToRGBA<unsigned short, 65535, 4>
+{
+    typedef ConvertRow16Func Func;
+    static Func get() { return gConvertRowKernels.rgba16ToRGBA; }
+};
+
 template<typename SRCPIX, int srcMaxValue, int nSrcComp, int nDstComp>
 class PixelConverterProcessor
     : public PixelProcessor
@@ -2539,6 +3780,7 @@ class PixelConverterProcessor
     int _dstBufferRowBytes;
     int _srcBufferRowBytes;
     OfxRectI _srcBufferBounds;
+    bool _checkAbort;
 
 public:
     // ctor
@@ -2547,6 +3789,7 @@ public:
         , _srcPixelData(NULL)
         , _dstBufferRowBytes(0)
         , _srcBufferRowBytes(0)
+        , _checkAbort(true)
     {
         assert(srcMaxValue);
         _srcBufferBounds.x1 = _srcBufferBounds.y1 = _srcBufferBounds.x2 = _srcBufferBounds.y2 = 0;
@@ -2568,14 +3811,21 @@ public:
         _dstPixelData = dstPixelData;
     }
 
+    void setCheckAbort(bool checkAbort)
+    {
+        _checkAbort = checkAbort;
+    }
+
     // and do some processing
     void multiThreadProcessImages(OfxRectI procWindow)
     {
         assert(nSrcComp == 1 || nSrcComp == 2 || nSrcComp == 3 || nSrcComp == 4);
         assert(nDstComp == 1 || nDstComp == 2 || nDstComp == 3 || nDstComp == 4);
 
+        typename ConvertRowToRGBA<SRCPIX, srcMaxValue, nSrcComp>::Func convertRow = (nDstComp == 4) ? ConvertRowToRGBA<SRCPIX, srcMaxValue, nSrcComp>::get() : NULL;
+
         for (int dsty = procWindow.y1; dsty < procWindow.y2; ++dsty) {
-            if ( _effect.abort() ) {
+            if ( _checkAbort && _effect.abort() ) {
                 break;
             }
 
@@ -2588,6 +3838,11 @@ public:
 
             assert(dst_pixels && src_pixels);
 
+            if (convertRow) {
+                convertRow(src_pixels + procWindow.x1 * nSrcComp, dst_pixels + procWindow.x1 * nDstComp, procWindow.x2 - procWindow.x1);
+                continue;
+            }
+
             for (int x = procWindow.x1; x < procWindow.x2; ++x) {
                 int srcCol = x * nSrcComp;
                 int dstCol = x * nDstComp;
@@ -2726,6 +3981,7 @@ public:
 template<typename SRCPIX, int srcMaxValue, int nSrcComp, int nDstComp>
 void
 convertForDstNComps(ImageEffect* effect,
+                    bool prefetching,
                     const SRCPIX* srcPixelData,
                     const OfxRectI& renderWindow,
                     const OfxRectI& srcBounds,
@@ -2737,12 +3993,19 @@ convertForDstNComps(ImageEffect* effect,
     PixelConverterProcessor<SRCPIX, srcMaxValue, nSrcComp, nDstComp> p(*effect);
     p.setValues(srcPixelData, srcBounds, srcRowBytes, dstPixelData,  dstRowBytes,  dstBounds);
     p.setRenderWindow(renderWindow);
-    p.process();
+    if (prefetching) {
+        // not a host action thread: convert in this thread, without calling the multithread suite or abort()
+        p.setCheckAbort(false);
+        p.multiThread(1);
+    } else {
+        p.process();
+    }
 }
 
 template<typename SRCPIX, int srcMaxValue, int nSrcComp>
 void
 convertForSrcNComps(ImageEffect* effect,
+                    bool prefetching,
                     const SRCPIX* srcPixelData,
                     const OfxRectI& renderWindow,
                     const OfxRectI& srcBounds,
@@ -2754,19 +4017,19 @@ convertForSrcNComps(ImageEffect* effect,
 {
     switch (dstPixelComponents) {
     case ePixelComponentAlpha: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 1>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 1>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
         break;
     }
     case ePixelComponentXY: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 2>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 2>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
         break;
     }
     case ePixelComponentRGB: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 3>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 3>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
         break;
     }
     case ePixelComponentRGBA: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 4>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 4>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
         break;
     }
     default:
@@ -2778,6 +4041,7 @@ convertForSrcNComps(ImageEffect* effect,
 template<typename SRCPIX, int srcMaxValue>
 void
 convertForDepth(ImageEffect* effect,
+                bool prefetching,
                 const SRCPIX* srcPixelData,
                 const OfxRectI& renderWindow,
                 const OfxRectI& srcBounds,
@@ -2790,16 +4054,16 @@ convertForDepth(ImageEffect* effect,
 {
     switch (srcPixelComponents) {
     case ePixelComponentAlpha:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 1>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 1>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
         break;
     case ePixelComponentXY:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 2>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 2>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
         break;
     case ePixelComponentRGB:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 3>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 3>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
         break;
     case ePixelComponentRGBA:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 4>(effect, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 4>(effect, prefetching, srcPixelData, renderWindow, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
         break;
     default:
         assert(false);
@@ -2819,15 +4083,17 @@ GenericReaderPlugin::convertDepthAndComponents(const void* srcPixelData,
                                                PixelComponentEnum dstPixelComponents,
                                                int dstRowBytes)
 {
+    const bool prefetching = isPrefetching();
+
     switch (srcBitDepth) {
     case eBitDepthFloat:
-        convertForDepth<float, 1>(this, (const float*)srcPixelData, renderWindow, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForDepth<float, 1>(this, prefetching, (const float*)srcPixelData, renderWindow, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
         break;
     case eBitDepthUShort:
-        convertForDepth<unsigned short, 65535>(this, (const unsigned short*)srcPixelData, renderWindow, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForDepth<unsigned short, 65535>(this, prefetching, (const unsigned short*)srcPixelData, renderWindow, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
         break;
     case eBitDepthUByte:
-        convertForDepth<unsigned char, 255>(this, (const unsigned char*)srcPixelData, renderWindow, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForDepth<unsigned char, 255>(this, prefetching, (const unsigned char*)srcPixelData, renderWindow, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
         break;
     default:
         assert(false);
@@ -3359,6 +4625,13 @@ GenericReaderDescribeInContextEnd(ImageEffectDescriptor &desc,
 #endif
 }
 
+void
+GenericReaderUnload()
+{
+    // keep the headers read in this session, even if the host never exits cleanly
+    FileHeaderCache::instance().save();
+}
+
 NAMESPACE_OFX_IO_EXIT
 NAMESPACE_OFX_EXIT
 
@@ -24,7 +24,9 @@
 #ifndef Io_GenericReader_h
 #define Io_GenericReader_h
 
+#include <list>
 #include <memory>
+#include <string>
 #include <ofxsImageEffect.h>
 #include <ofxsMacros.h>
 #include "IOUtility.h"
@@ -113,7 +115,7 @@ public:
     virtual void getClipPreferences(OFX::ClipPreferencesSetter &clipPreferences) OVERRIDE;
 
     /**
-     * @brief Overriden to clear any OCIO cache.
+     * @brief Overriden to clear any OCIO cache and the decoded frames of this instance.
      * This function calls clearAnyCache() if you have any cache to clear.
      **/
     virtual void purgeCaches(void) OVERRIDE;
@@ -158,6 +160,21 @@ protected:
 
     int getStartingTime() const;
 
+    /**
+     * @brief Remove the frames decoded by this instance from the decoded frames cache.
+     * Derived classes must call this when a parameter that changes the decoded pixels
+     * is handled without calling GenericReaderPlugin::changedParam().
+     **/
+    void clearDecodedFrames();
+
+    /**
+     * @brief Get the metadata of filename stored in the header cache by setCachedMetadata().
+     * Returns false if there is none or if the file was modified.
+     **/
+    bool getCachedMetadata(const std::string& filename, std::string* metadata);
+
+    void setCachedMetadata(const std::string& filename, const std::string& metadata);
+
     // get the value of kParamOutputComponents as a OFX::PixelComponentEnum
     OFX::PixelComponentEnum getOutputComponents() const;
 
@@ -215,6 +232,20 @@ private:
      **/
     virtual void clearAnyCache() {}
 
+    /**
+     * @brief The results of getFrameBounds(), getFrameRate() and guessParamsFromFilename() are kept in the
+     * process-wide FileHeaderCache, keyed by the plug-in, the file name, its size and its modification time.
+     * Override to append to key the values of the parameters that change these results, or return false
+     * if they must not be cached.
+     **/
+    virtual bool getHeaderCacheKey(std::string* /*key*/) const { return true; }
+
+    /**
+     * @brief Override to return true if guessParamsFromFilename() only depends on the file and on the OCIO config,
+     * and does not set any parameter, so that its results can be cached.
+     **/
+    virtual bool isGuessParamsCacheable() const { return false; }
+
 
     /**
      * @brief Overload this function to extract the bound of the pixel data
@@ -239,6 +270,21 @@ private:
     virtual bool getFrameRate(const std::string& /*filename*/,
                               double* /*fps*/) const { return false; }
 
+    /**
+     * @brief Override if the file may contain downscaled versions of the image (e.g. the MIP levels of a
+     * tiled image), so that render() decodes them rather than downscaling the full-resolution image.
+     * Returns the largest level <= maxLevel stored in the file whose size is exactly the size of the image at
+     * that render scale (ceil(width/2^level) x ceil(height/2^level)), with its bounds and tile size,
+     * or 0 if there is no such level. That level is then read with decodeFileMipmapLevel().
+     **/
+    virtual unsigned int getFileMipmapLevel(const std::string& /*filename*/,
+                                            OfxTime /*time*/,
+                                            int /*view*/,
+                                            unsigned int /*maxLevel*/,
+                                            OfxRectI* /*bounds*/,
+                                            int* /*tile_width*/,
+                                            int* /*tile_height*/) { return 0; }
+
     /**
      * @brief Override this function to actually decode the image contained in the file pointed to by filename.
      * If the file is a video-stream then you should decode the frame at the time given in parameters.
@@ -252,6 +298,66 @@ private:
     virtual void decodePlane(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
                              OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
 
+    /**
+     * @brief Same as decodePlane(), but decodes the given level returned by getFileMipmapLevel().
+     * renderWindow and bounds are in the pixel coordinates of that level.
+     **/
+    virtual void decodeFileMipmapLevel(const std::string& filename, OfxTime time, int view, bool isPlayback, unsigned int level, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                                       OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
+
+    /**
+     * @brief Called by render() before the planes of a frame are decoded, with the list of all these planes,
+     * and endDecodePlanes() is called by the same thread once they are decoded (or on error).
+     * Multi-plane readers may override these to read the file once for all the planes, and
+     * serve the decodePlane() calls made in between by the same thread from that single read.
+     **/
+    virtual void beginDecodePlanes(const std::string& /*filename*/, OfxTime /*time*/, int /*view*/, const std::list<PlaneToRender>& /*planes*/) {}
+    virtual void endDecodePlanes() {}
+
+    friend class DecodePlanesGuard;
+
+    /**
+     * @brief Calls decode() or decodePlane(), unless the decoded frames cache already holds
+     * a window of the same plane of the same file that contains renderWindow.
+     * Frames decoded during interactive renders are added to the cache.
+     * If mipmapLevel > 0, that level of the file is decoded with decodeFileMipmapLevel().
+     **/
+    void decodeWithCache(const std::string& filename, OfxTime time, int view, unsigned int mipmapLevel, bool isPlayback, bool isInteractive, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                         OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents, int rowBytes);
+
+    /**
+     * @brief During sequential renders, schedule the background read of the frames that follow sequenceTime
+     * in the render direction, using the same window and plane.
+     **/
+    void prefetchNextFrames(const std::string& filename, double sequenceTime, int view, unsigned int mipmapLevel, bool useProxy, const OfxRectI& renderWindow, const PlaneToRender& plane);
+
+    /**
+     * @brief Decode a frame in a background thread and add it to the decoded frames cache.
+     **/
+    void prefetchFrame(const std::string& filename, OfxTime time, int view, unsigned int mipmapLevel, const OfxRectI& renderWindow,
+                       OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, const std::string& rawComponents);
+
+    friend class SequencePrefetcher;
+
+    /**
+     * @brief Return true if decode(), decodePlane() and decodeFileMipmapLevel() do not read any parameter.
+     * Only these readers have the next frames of a sequence read ahead by the background prefetch threads,
+     * and their decoders must not call the host suites when isPrefetching() returns true.
+     **/
+    virtual bool isDecodeParamFree() const { return false; }
+
+    /**
+     * @brief Returns true if the calling thread is a background prefetch thread, which is not a host action thread:
+     * parameters, messages, abort() and the multithread suite must not be used from there.
+     **/
+    bool isPrefetching() const;
+
+    /**
+     * @brief Same as setPersistentMessage(), but does nothing when called from a prefetch thread:
+     * a frame that fails to decode there is not cached, and the error is reported when render() decodes it.
+     **/
+    void setDecodeMessage(OFX::Message::MessageTypeEnum type, const std::string& message);
+
 
     /**
      * @brief Override to indicate the time domain. Return false if you know that the
@@ -310,35 +416,27 @@ private:
                                                      std::string *filename) const WARN_UNUSED_RETURN;
 
 
-    void copyPixelData(const OfxRectI &renderWindow,
-                       const void *srcPixelData,
-                       const OfxRectI& srcBounds,
-                       OFX::PixelComponentEnum srcPixelComponents,
-                       int srcPixelComponentCount,
-                       OFX::BitDepthEnum srcPixelDepth,
-                       int srcRowBytes,
-                       void *dstPixelData,
-                       const OfxRectI& dstBounds,
-                       OFX::PixelComponentEnum dstPixelComponents,
-                       int dstPixelComponentCount,
-                       OFX::BitDepthEnum dstBitDepth,
-                       int dstRowBytes);
-
-    void scalePixelData(const OfxRectI& originalRenderWindow,
-                        const OfxRectI& renderWindow,
-                        unsigned int levels,
-                        const void* srcPixelData,
-                        OFX::PixelComponentEnum srcPixelComponents,
-                        int srcPixelComponentCount,
-                        OFX::BitDepthEnum srcPixelDepth,
-                        const OfxRectI& srcBounds,
-                        int srcRowBytes,
-                        void* dstPixelData,
-                        OFX::PixelComponentEnum dstPixelComponents,
-                        int dstPixelComponentCount,
-                        OFX::BitDepthEnum dstPixelDepth,
-                        const OfxRectI& dstBounds,
-                        int dstRowBytes);
+    /**
+     * @brief Post-processes the decoded image in srcPixelData (whose window renderWindowFullRes maps to
+     * renderWindow at the given mipmap level) and writes the result to dstPixelData: optional unpremult,
+     * color-space conversion, downscaling by 2^levels and premult are fused in a single multithreaded pass.
+     * srcPixelData is modified in place.
+     **/
+    void postProcessPixelData(double time,
+                              const OfxRectI& renderWindow,
+                              const OfxRectI& renderWindowFullRes,
+                              unsigned int levels,
+                              bool unpremult,
+                              bool colorConvert,
+                              bool premult,
+                              float* srcPixelData,
+                              const OfxRectI& srcBounds,
+                              int srcRowBytes,
+                              float* dstPixelData,
+                              const OfxRectI& dstBounds,
+                              OFX::PixelComponentEnum pixelComponents,
+                              int pixelComponentCount,
+                              int dstRowBytes);
 
     void fillWithBlack(const OfxRectI &renderWindow,
                        void *dstPixelData,
@@ -349,36 +447,25 @@ private:
                        int dstRowBytes);
 
 
-    void premultPixelData(const OfxRectI &renderWindow,
-                          const void *srcPixelData,
-                          const OfxRectI& srcBounds,
-                          OFX::PixelComponentEnum srcPixelComponents,
-                          int srcPixelComponentCount,
-                          OFX::BitDepthEnum srcPixelDepth,
-                          int srcRowBytes,
-                          void *dstPixelData,
-                          const OfxRectI& dstBounds,
-                          OFX::PixelComponentEnum dstPixelComponents,
-                          int dstPixelComponentCount,
-                          OFX::BitDepthEnum dstBitDepth,
-                          int dstRowBytes);
-
-    void unPremultPixelData(const OfxRectI &renderWindow,
-                            const void *srcPixelData,
-                            const OfxRectI& srcBounds,
-                            OFX::PixelComponentEnum srcPixelComponents,
-                            int srcPixelComponentCount,
-                            OFX::BitDepthEnum srcPixelDepth,
-                            int srcRowBytes,
-                            void *dstPixelData,
-                            const OfxRectI& dstBounds,
-                            OFX::PixelComponentEnum dstPixelComponents,
-                            int dstPixelComponentCount,
-                            OFX::BitDepthEnum dstBitDepth,
-                            int dstRowBytes);
-
     OfxPointD detectProxyScale(const std::string& originalFileName, const std::string& proxyFileName, OfxTime time);
 
+    /**
+     * @brief The prefix of the header cache keys of this plug-in.
+     **/
+    std::string getHeaderCacheKeyPrefix() const;
+
+    /**
+     * @brief The header cache key for filename, or false if its header must not be cached.
+     **/
+    bool getHeaderCacheKeyForFile(const std::string& filename, std::string* key);
+
+    /**
+     * @brief These call the corresponding virtual functions through the header cache.
+     **/
+    bool getFrameBoundsCached(const std::string& filename, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, std::string *error, int* tile_width, int* tile_height);
+    bool getFrameRateCached(const std::string& filename, double* fps);
+    bool guessParamsFromFilenameCached(const std::string& filename, std::string *colorspace, OFX::PreMultiplicationEnum *filePremult, OFX::PixelComponentEnum *components, int *componentCount);
+
     void setSequenceFromFile(const std::string& filename);
 
     void refreshSubLabel(OfxTime time);
@@ -448,6 +535,9 @@ void GenericReaderDescribe(OFX::ImageEffectDescriptor &desc,
 OFX::PageParamDescriptor* GenericReaderDescribeInContextBegin(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, bool isVideoStreamPlugin, bool supportsRGBA, bool supportsRGB, bool supportsXY, bool supportsAlpha, bool supportsTiles, bool addSeparatorAfterLastParameter);
 void GenericReaderDescribeInContextEnd(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context, OFX::PageParamDescriptor* page, const char* inputSpaceNameDefault, const char* outputSpaceNameDefault);
 
+/// Must be called by the unload() function of reader factories: saves the file header index.
+void GenericReaderUnload();
+
 #define mDeclareReaderPluginFactory(CLASS, UNLOADFUNCDEF, ISVIDEOSTREAM) \
     class CLASS \
         : public OFX::PluginFactoryHelper<CLASS>                       \
@@ -0,0 +1,219 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * A read-only memory mapping of a local file.
+ */
+
+#include "MappedFile.h"
+
+#include <cstdlib> // getenv, strtol
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/vfs.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+#endif
+
+using std::string;
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+// reads a boolean environment variable
+static bool
+getEnvFlag(const char* name,
+           bool defaultValue)
+{
+    const char* value = std::getenv(name);
+
+    if (!value || !*value) {
+        return defaultValue;
+    }
+
+    return std::strtol(value, NULL, 10) != 0;
+}
+
+static bool
+willNeed()
+{
+    static const bool willNeed = getEnvFlag(kMappedFileWillNeedEnv, false);
+
+    return willNeed;
+}
+
+#ifndef _WIN32
+// is the file open on fd on a local filesystem?
+static bool
+isLocalFile(int fd)
+{
+#if defined(__linux__)
+    struct statfs st;
+    if (fstatfs(fd, &st) != 0) {
+        return false;
+    }
+    switch ( (unsigned long)st.f_type ) {
+    case 0x6969UL:     // NFS
+    case 0x517BUL:     // SMB
+    case 0xFF534D42UL: // CIFS
+    case 0xFE534D42UL: // SMB2
+    case 0x5346414FUL: // AFS
+    case 0x73757245UL: // CODA
+    case 0x01021997UL: // 9P
+    case 0x00C36400UL: // CEPH
+    case 0x65735546UL: // FUSE (sshfs, cloud drives...)
+        return false;
+    default:
+        return true;
+    }
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+    struct statfs st;
+    if (fstatfs(fd, &st) != 0) {
+        return false;
+    }
+
+    return (st.f_flags & MNT_LOCAL) != 0;
+#else
+    (void)fd;
+
+    return true;
+#endif
+}
+#endif
+
+MappedFile::MappedFile()
+    : _data(NULL)
+    , _size(0)
+#ifdef _WIN32
+    , _mapping(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool
+MappedFile::isEnabled()
+{
+    static const bool enabled = getEnvFlag(kMappedFileEnv, kMappedFileDefault);
+
+    return enabled;
+}
+
+bool
+MappedFile::open(const string& filename)
+{
+    close();
+    if ( !isEnabled() ) {
+        return false;
+    }
+#ifdef _WIN32
+    std::wstring wpath;
+    wpath.resize( MultiByteToWideChar (CP_UTF8, 0, filename.c_str(), -1, NULL, 0) );
+    MultiByteToWideChar ( CP_UTF8, 0, filename.c_str(), -1, &wpath[0], (int)wpath.size() );
+    wchar_t volume[MAX_PATH + 1];
+    if ( !GetVolumePathNameW(wpath.c_str(), volume, MAX_PATH + 1) || (GetDriveTypeW(volume) == DRIVE_REMOTE) ) {
+        return false;
+    }
+    HANDLE file = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if ( !GetFileSizeEx(file, &fileSize) || (fileSize.QuadPart <= 0) || ( (unsigned long long)fileSize.QuadPart > (std::size_t)-1 ) ) {
+        CloseHandle(file);
+
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    // the mapping keeps the file open
+    CloseHandle(file);
+    if (!mapping) {
+        return false;
+    }
+    const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+
+        return false;
+    }
+    _mapping = mapping;
+    _data = (const char*)data;
+    _size = (std::size_t)fileSize.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if ( (fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size <= 0) ||
+         ( (unsigned long long)st.st_size > (std::size_t)-1 ) || !isLocalFile(fd) ) {
+        ::close(fd);
+
+        return false;
+    }
+    const std::size_t size = (std::size_t)st.st_size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file open
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    if ( willNeed() ) {
+        // start reading the whole file in the background, so that later page faults do not wait for the disk
+        madvise(data, size, MADV_WILLNEED);
+    }
+    _data = (const char*)data;
+    _size = size;
+#endif
+
+    return true;
+} // MappedFile::open
+
+void
+MappedFile::close()
+{
+    if (!_data) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(_data);
+    CloseHandle( (HANDLE)_mapping );
+    _mapping = NULL;
+#else
+    munmap( (void*)_data, _size );
+#endif
+    _data = NULL;
+    _size = 0;
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
@@ -0,0 +1,100 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/MrKepzie/openfx-io>,
+ * Copyright (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * A read-only memory mapping of a local file.
+ */
+
+#ifndef IO_MappedFile_h
+#define IO_MappedFile_h
+
+#include <cstddef>
+#include <string>
+
+#include "IOUtility.h"
+
+// set to 1 to read local files through memory mappings instead of the regular file API.
+// Mappings are disabled by default: the readers keep files open (and mapped) between renders, and reading
+// a mapped file that was truncated by another process raises SIGBUS instead of returning an error.
+// The default value can be overriden using the environment variable OFX_IO_MMAP
+#define kMappedFileEnv "OFX_IO_MMAP"
+#define kMappedFileDefault false
+
+// set to 1 to ask the system to read the whole file ahead (madvise(MADV_WILLNEED)) when it is mapped (ignored on Windows).
+// The default value can be overriden using the environment variable OFX_IO_MMAP_WILLNEED
+#define kMappedFileWillNeedEnv "OFX_IO_MMAP_WILLNEED"
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+/**
+ * @brief A read-only memory mapping of a whole file.
+ *
+ * Only regular files on local filesystems are mapped: on network filesystems, an I/O error while
+ * reading a mapped page raises a signal instead of returning an error, and page faults are much
+ * slower than large reads.
+ * The file must not be truncated while it is mapped. Replacing it (by writing a new file and
+ * renaming it) is safe: the mapping keeps the old contents.
+ **/
+class MappedFile
+{
+public:
+    MappedFile();
+
+    ~MappedFile();
+
+    /// Are memory mappings enabled (see kMappedFileEnv)?
+    static bool isEnabled();
+
+    /// Map filename. Returns false if mappings are disabled, if the file is not a non-empty regular file on a local
+    /// filesystem, or if it cannot be mapped: the caller should then read it through the regular file API.
+    bool open(const std::string& filename);
+
+    void close();
+
+    bool isOpen() const
+    {
+        return _data != NULL;
+    }
+
+    const char* data() const
+    {
+        return _data;
+    }
+
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    // non-copyable
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* _data;
+    std::size_t _size;
+#ifdef _WIN32
+    void* _mapping; // HANDLE
+#endif
+};
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // ifndef IO_MappedFile_h
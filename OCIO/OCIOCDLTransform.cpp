@@ -24,6 +24,15 @@
 #ifdef OFX_IO_USING_OCIO
 
 #include <cstdio> // fopen...
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// the CDL ops are applied to RGBA vectors
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCIO_CDL_SSE2
+#endif
 
 #include "ofxsProcessing.H"
 #include "ofxsThreadSuite.h"
@@ -181,6 +190,12 @@ private:
 
     OCIO::ConstProcessorRcPtr getProcessor(OfxTime time);
 
+    /// The grade at time, as given to OCIO's CDLTransform.
+    void getValues(OfxTime time, float sop[9], double* saturation, int* directioni);
+
+    /// Load the grade from the file the first time it is needed, if kParamReadFromFile is checked.
+    void loadCDLFromFileOnce();
+
     void updateCCCId();
 
     void refreshKnobEnabledState(bool readFromFile);
@@ -297,7 +312,26 @@ private:
                        BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
-    void apply(double time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    template <class PIX, int maxValue>
+    void copyPixelDataForDepth(bool unpremult,
+                               bool premult,
+                               bool maskmix,
+                               double time,
+                               const OfxRectI &renderWindow,
+                               const void *srcPixelData,
+                               const OfxRectI& srcBounds,
+                               PixelComponentEnum srcPixelComponents,
+                               int srcPixelComponentCount,
+                               BitDepthEnum srcPixelDepth,
+                               int srcRowBytes,
+                               void *dstPixelData,
+                               const OfxRectI& dstBounds,
+                               PixelComponentEnum dstPixelComponents,
+                               int dstPixelComponentCount,
+                               BitDepthEnum dstBitDepth,
+                               int dstRowBytes);
+
+    void apply(double time, const OfxRectI& renderWindow, void *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, BitDepthEnum bitDepth, int rowBytes);
 
     void setupAndCopy(PixelProcessorFilterBase & processor,
                       double time,
@@ -339,17 +373,7 @@ private:
 
     GenericOCIO::Mutex _procMutex;
     OCIO::ConstProcessorRcPtr _proc;
-    double _procSlope_r;
-    double _procSlope_g;
-    double _procSlope_b;
-    double _procOffset_r;
-    double _procOffset_g;
-    double _procOffset_b;
-    double _procPower_r;
-    double _procPower_g;
-    double _procPower_b;
-    double _procSaturation;
-    int _procDirection;
+    string _procKey; // the OCIOProcessorCache key of _proc
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     BooleanParam* _enableGPU;
@@ -378,17 +402,6 @@ OCIOCDLTransformPlugin::OCIOCDLTransformPlugin(OfxImageEffectHandle handle)
     , _mix(NULL)
     , _maskApply(NULL)
     , _maskInvert(NULL)
-    , _procSlope_r(-1)
-    , _procSlope_g(-1)
-    , _procSlope_b(-1)
-    , _procOffset_r(-1)
-    , _procOffset_g(-1)
-    , _procOffset_b(-1)
-    , _procPower_r(-1)
-    , _procPower_g(-1)
-    , _procPower_b(-1)
-    , _procSaturation(-1)
-    , _procDirection(-1)
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     , _enableGPU(NULL)
     , _openGLContextData(NULL)
@@ -504,83 +517,78 @@ OCIOCDLTransformPlugin::setupAndCopy(PixelProcessorFilterBase & processor,
     processor.process();
 }
 
+template <class PIX, int maxValue>
 void
-OCIOCDLTransformPlugin::copyPixelData(bool unpremult,
-                                      bool premult,
-                                      bool maskmix,
-                                      double time,
-                                      const OfxRectI& renderWindow,
-                                      const void *srcPixelData,
-                                      const OfxRectI& srcBounds,
-                                      PixelComponentEnum srcPixelComponents,
-                                      int srcPixelComponentCount,
-                                      BitDepthEnum srcBitDepth,
-                                      int srcRowBytes,
-                                      void *dstPixelData,
-                                      const OfxRectI& dstBounds,
-                                      PixelComponentEnum dstPixelComponents,
-                                      int dstPixelComponentCount,
-                                      BitDepthEnum dstBitDepth,
-                                      int dstRowBytes)
+OCIOCDLTransformPlugin::copyPixelDataForDepth(bool unpremult,
+                                              bool premult,
+                                              bool maskmix,
+                                              double time,
+                                              const OfxRectI& renderWindow,
+                                              const void *srcPixelData,
+                                              const OfxRectI& srcBounds,
+                                              PixelComponentEnum srcPixelComponents,
+                                              int srcPixelComponentCount,
+                                              BitDepthEnum srcBitDepth,
+                                              int srcRowBytes,
+                                              void *dstPixelData,
+                                              const OfxRectI& dstBounds,
+                                              PixelComponentEnum dstPixelComponents,
+                                              int dstPixelComponentCount,
+                                              BitDepthEnum dstBitDepth,
+                                              int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
     if (!unpremult && !premult && !maskmix) {
         copyPixels(*this, renderWindow,
                    srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                    dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if (unpremult && !premult && !maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierUnPremult<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierUnPremult<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && !premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierMaskMix<float, 4, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 4, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierMaskMix<float, 3, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 3, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierMaskMix<float, 1, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 1, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierPremultMaskMix<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierPremultMaskMix<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierPremultMaskMix<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
@@ -588,10 +596,471 @@ OCIOCDLTransformPlugin::copyPixelData(bool unpremult,
     } else {
         assert(false); // should never happen
     }
-} // OCIOCDLTransformPlugin::copyPixelData
+}
 
-OCIO::ConstProcessorRcPtr
-OCIOCDLTransformPlugin::getProcessor(OfxTime time)
+void
+OCIOCDLTransformPlugin::copyPixelData(bool unpremult,
+                                      bool premult,
+                                      bool maskmix,
+                                      double time,
+                                      const OfxRectI& renderWindow,
+                                      const void *srcPixelData,
+                                      const OfxRectI& srcBounds,
+                                      PixelComponentEnum srcPixelComponents,
+                                      int srcPixelComponentCount,
+                                      BitDepthEnum srcBitDepth,
+                                      int srcRowBytes,
+                                      void *dstPixelData,
+                                      const OfxRectI& dstBounds,
+                                      PixelComponentEnum dstPixelComponents,
+                                      int dstPixelComponentCount,
+                                      BitDepthEnum dstBitDepth,
+                                      int dstRowBytes)
+{
+    assert(srcPixelData && dstPixelData);
+    // do the rendering
+    if ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    switch (dstBitDepth) {
+    case eBitDepthUByte:
+        copyPixelDataForDepth<unsigned char, 255>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        copyPixelDataForDepth<unsigned short, 65535>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        copyPixelDataForDepth<float, 1>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+}
+
+// The OCIOProcessorCache key of a CDL processor.
+static string
+getCDLProcessorKey(const OCIO::ConstConfigRcPtr& config,
+                   const float sop[9],
+                   double saturation,
+                   int directioni)
+{
+    string description("CDL");
+
+    for (int i = 0; i < 9; ++i) {
+        OCIOProcessorCache::appendKey(&description, (double)sop[i]);
+    }
+    OCIOProcessorCache::appendKey( &description, (double)(float)saturation );
+    OCIOProcessorCache::appendKey(&description, directioni);
+
+    return OCIOProcessorCache::getKey(config, config->getCurrentContext(), description);
+}
+
+// Get a CDL processor from the OCIOProcessorCache, creating it if necessary.
+static OCIO::ConstProcessorRcPtr
+getCachedCDLProcessor(const OCIO::ConstConfigRcPtr& config,
+                      const float sop[9],
+                      double saturation,
+                      int directioni,
+                      const string& key)
+{
+    OCIOProcessorCache& cache = OCIOProcessorCache::instance();
+    OCIO::ConstProcessorRcPtr proc = cache.get(key);
+
+    if (!proc) {
+        OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
+        cc->setSOP(sop);
+        cc->setSat( (float)saturation );
+
+        if (directioni == 0) {
+            cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
+        } else {
+            cc->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
+        }
+
+        proc = config->getProcessor(cc);
+        cache.set(key, proc);
+    }
+
+    return proc;
+}
+
+/**
+ * @brief The ASC CDL in the forward direction, evaluated like the CPU ops of an OCIO CDLTransform processor.
+ *
+ * Building an OCIO processor for each new set of values takes a lock and is expensive when the grade is animated,
+ * while the CDL is a closed-form formula. OCIO applies it as a scale and offset matrix, an exponent clamping
+ * negative values (alpha included), and a saturation matrix. These ops are skipped and combined as OCIO's
+ * optimizer does, and each one does the same floating-point operations in the same order, so that the results
+ * are identical.
+ **/
+class CDLOps
+{
+public:
+    CDLOps(const float sop[9], float saturation);
+
+    bool isNoOp() const
+    {
+        return !_hasMatrix1 && !_hasExponent && !_hasMatrix2;
+    }
+
+    /// Apply the CDL to n RGB or RGBA (nComps = 3 or 4) pixels.
+    void apply(float* pix, int n, int nComps) const;
+
+#ifdef DEBUG
+    /// Compare with the OCIO processor of the same CDLTransform on a few colors, and print the differences.
+    void check(const float sop[9], float saturation) const;
+#endif
+
+private:
+    // an OCIO MatrixOffsetOp
+    struct MatrixOp
+    {
+        float m44[16]; // row-major
+        float offset4[4];
+        float columns[16]; // the columns of m44, for the vector code
+        bool diagonal;
+        bool hasOffset;
+    };
+
+    // returns false if the op is a no-op
+    static bool setMatrixOp(MatrixOp* op, const float m44[16], const float offset4[4]);
+
+    static void applyMatrixOp(const MatrixOp& op, float rgba[4]);
+
+    void applyPixel(float rgba[4]) const;
+
+    bool _hasMatrix1; // slope and offset (combined with the saturation if there is no exponent)
+    bool _hasExponent;
+    bool _hasMatrix2; // saturation
+    MatrixOp _matrix1;
+    float _exponent[4];
+    MatrixOp _matrix2;
+};
+
+CDLOps::CDLOps(const float sop[9],
+               float saturation)
+    : _hasMatrix1(false)
+    , _hasExponent(false)
+    , _hasMatrix2(false)
+{
+    const float scale[16] = {
+        sop[0], 0.f, 0.f, 0.f,
+        0.f, sop[1], 0.f, 0.f,
+        0.f, 0.f, sop[2], 0.f,
+        0.f, 0.f, 0.f, 1.f
+    };
+    const float offset[4] = { sop[3], sop[4], sop[5], 0.f };
+
+    _hasMatrix1 = setMatrixOp(&_matrix1, scale, offset);
+
+    _exponent[0] = sop[6];
+    _exponent[1] = sop[7];
+    _exponent[2] = sop[8];
+    _exponent[3] = 1.f;
+    _hasExponent = (_exponent[0] != 1.f) || (_exponent[1] != 1.f) || (_exponent[2] != 1.f);
+
+    // the saturation matrix of OCIO's MatrixTransform::Sat(), with the Rec.709 luma coefficients used by CDLTransform
+    const float luma[3] = { 0.2126f, 0.7152f, 0.0722f };
+    const float sat[16] = {
+        (1 - saturation) * luma[0] + saturation, (1 - saturation) * luma[1], (1 - saturation) * luma[2], 0.f,
+        (1 - saturation) * luma[0], (1 - saturation) * luma[1] + saturation, (1 - saturation) * luma[2], 0.f,
+        (1 - saturation) * luma[0], (1 - saturation) * luma[1], (1 - saturation) * luma[2] + saturation, 0.f,
+        0.f, 0.f, 0.f, 1.f
+    };
+    const float zero[4] = { 0.f, 0.f, 0.f, 0.f };
+    _hasMatrix2 = setMatrixOp(&_matrix2, sat, zero);
+
+    if (_hasMatrix1 && !_hasExponent && _hasMatrix2) {
+        // OCIO combines adjacent matrices (GetMxbCombine): m = m2 * m1, offset = m2 * offset1 + offset2
+        const float* m1 = _matrix1.m44;
+        const float* v1 = _matrix1.offset4;
+        const float* m2 = _matrix2.m44;
+        const float* v2 = _matrix2.offset4;
+        float m[16];
+        float v[4];
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                m[i * 4 + j] = m2[i * 4 + 0] * m1[0 * 4 + j] + m2[i * 4 + 1] * m1[1 * 4 + j] + m2[i * 4 + 2] * m1[2 * 4 + j] + m2[i * 4 + 3] * m1[3 * 4 + j];
+            }
+            v[i] = m2[i * 4 + 0] * v1[0] + m2[i * 4 + 1] * v1[1] + m2[i * 4 + 2] * v1[2] + m2[i * 4 + 3] * v1[3];
+            v[i] = v[i] + v2[i];
+        }
+        _hasMatrix1 = setMatrixOp(&_matrix1, m, v);
+        _hasMatrix2 = false;
+    }
+}
+
+bool
+CDLOps::setMatrixOp(MatrixOp* op,
+                    const float m44[16],
+                    const float offset4[4])
+{
+    std::memcpy( op->m44, m44, sizeof(op->m44) );
+    std::memcpy( op->offset4, offset4, sizeof(op->offset4) );
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            op->columns[j * 4 + i] = m44[i * 4 + j];
+        }
+    }
+    bool identity = true;
+    op->diagonal = true;
+    for (int i = 0; i < 16; ++i) {
+        if ( (i % 5) == 0 ) {
+            identity = identity && (m44[i] == 1.f);
+        } else if (m44[i] != 0.f) {
+            identity = false;
+            op->diagonal = false;
+        }
+    }
+    op->hasOffset = (offset4[0] != 0.f) || (offset4[1] != 0.f) || (offset4[2] != 0.f) || (offset4[3] != 0.f);
+
+    return !identity || op->hasOffset;
+}
+
+void
+CDLOps::applyMatrixOp(const MatrixOp& op,
+                      float rgba[4])
+{
+#ifdef OCIO_CDL_SSE2
+    __m128 v = _mm_loadu_ps(rgba);
+    if (op.diagonal) {
+        v = _mm_mul_ps( v, _mm_setr_ps(op.m44[0], op.m44[5], op.m44[10], op.m44[15]) );
+    } else {
+        // each lane is computed as r * m[0] + g * m[1] + b * m[2] + a * m[3], from left to right
+        __m128 s = _mm_mul_ps( _mm_loadu_ps(op.columns), _mm_shuffle_ps( v, v, _MM_SHUFFLE(0, 0, 0, 0) ) );
+        s = _mm_add_ps( s, _mm_mul_ps( _mm_loadu_ps(op.columns + 4), _mm_shuffle_ps( v, v, _MM_SHUFFLE(1, 1, 1, 1) ) ) );
+        s = _mm_add_ps( s, _mm_mul_ps( _mm_loadu_ps(op.columns + 8), _mm_shuffle_ps( v, v, _MM_SHUFFLE(2, 2, 2, 2) ) ) );
+        v = _mm_add_ps( s, _mm_mul_ps( _mm_loadu_ps(op.columns + 12), _mm_shuffle_ps( v, v, _MM_SHUFFLE(3, 3, 3, 3) ) ) );
+    }
+    if (op.hasOffset) {
+        v = _mm_add_ps( v, _mm_loadu_ps(op.offset4) );
+    }
+    _mm_storeu_ps(rgba, v);
+#else
+    if (op.diagonal) {
+        for (int k = 0; k < 4; ++k) {
+            rgba[k] *= op.m44[k * 5];
+        }
+    } else {
+        const float r = rgba[0];
+        const float g = rgba[1];
+        const float b = rgba[2];
+        const float a = rgba[3];
+        for (int k = 0; k < 4; ++k) {
+            const float* m = op.m44 + k * 4;
+            rgba[k] = r * m[0] + g * m[1] + b * m[2] + a * m[3];
+        }
+    }
+    if (op.hasOffset) {
+        for (int k = 0; k < 4; ++k) {
+            rgba[k] += op.offset4[k];
+        }
+    }
+#endif
+}
+
+void
+CDLOps::applyPixel(float rgba[4]) const
+{
+    if (_hasMatrix1) {
+        applyMatrixOp(_matrix1, rgba);
+    }
+    if (_hasExponent) {
+        for (int k = 0; k < 4; ++k) {
+            // std::max(0.f, x) as in OCIO: NaNs give 0
+            const float x = (rgba[k] > 0.f) ? rgba[k] : 0.f;
+            // pow(x, 1) is x
+            rgba[k] = (_exponent[k] == 1.f) ? x : std::pow(x, _exponent[k]);
+        }
+    }
+    if (_hasMatrix2) {
+        applyMatrixOp(_matrix2, rgba);
+    }
+}
+
+void
+CDLOps::apply(float* pix,
+              int n,
+              int nComps) const
+{
+    if (nComps == 4) {
+        for (int i = 0; i < n; ++i, pix += 4) {
+            applyPixel(pix);
+        }
+    } else {
+        // OCIO processes RGB pixels with a zero alpha
+        for (int i = 0; i < n; ++i, pix += nComps) {
+            float rgba[4] = { pix[0], pix[1], pix[2], 0.f };
+            applyPixel(rgba);
+            pix[0] = rgba[0];
+            pix[1] = rgba[1];
+            pix[2] = rgba[2];
+        }
+    }
+}
+
+#ifdef DEBUG
+void
+CDLOps::check(const float sop[9],
+              float saturation) const
+{
+    OCIO::ConstProcessorRcPtr proc;
+    try {
+        OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
+        OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
+        cc->setSOP(sop);
+        cc->setSat(saturation);
+        cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
+        proc = config->getProcessor(cc);
+    } catch (const OCIO::Exception &e) {
+        std::printf("ERROR: CDLOps::check: %s\n", e.what());
+
+        return;
+    }
+    // negative, zero, mid-gray, white and superwhite values, with various alphas
+    const float probes[][4] = {
+        { 0.f, 0.f, 0.f, 0.f },
+        { 0.18f, 0.18f, 0.18f, 1.f },
+        { 1.f, 1.f, 1.f, 1.f },
+        { 1.f, 0.5f, 0.25f, 0.5f },
+        { 0.02f, 0.4f, 0.9f, 1.f },
+        { -0.1f, 0.3f, 2.5f, 1.f },
+        { 4.f, -0.5f, 0.001f, 0.25f },
+        { -1.f, -1.f, -1.f, -1.f },
+    };
+    const int n = (int)( sizeof(probes) / sizeof(probes[0]) );
+    std::vector<float> exact(&probes[0][0], &probes[0][0] + n * 4);
+    std::vector<float> ours(exact);
+    OCIO::PackedImageDesc img(&exact[0], n, 1, 4);
+    proc->apply(img);
+    apply(&ours[0], n, 4);
+    for (int i = 0; i < n * 4; ++i) {
+        // NaNs compare equal
+        if ( (ours[i] != exact[i]) && ( (ours[i] == ours[i]) || (exact[i] == exact[i]) ) ) {
+            std::printf("ERROR: CDLOps::check: component %d of color %d is %.9g, OCIO gives %.9g\n", i % 4, i / 4, ours[i], exact[i]);
+        }
+    }
+}
+
+#endif // ifdef DEBUG
+
+// Applies a CDLOps in place, without an OCIO processor.
+class CDLProcessor
+    : public PixelProcessor
+{
+public:
+    CDLProcessor(ImageEffect &instance,
+                 const CDLOps& ops)
+        : PixelProcessor(instance)
+        , _ops(ops)
+    {
+    }
+
+private:
+    virtual void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL;
+
+    template <class PIX, int maxValue>
+    void processPixels(const OfxRectI& procWindow, int nComps);
+
+    const CDLOps& _ops;
+};
+
+template <class PIX, int maxValue>
+void
+CDLProcessor::processPixels(const OfxRectI& procWindow,
+                            int nComps)
+{
+    const int width = procWindow.x2 - procWindow.x1;
+    std::vector<float> row;
+
+    if (maxValue != 1) {
+        row.resize( (std::size_t)width * nComps );
+    }
+    const float scale = 1.f / maxValue;
+    for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+        if ( _effect.abort() ) {
+            break;
+        }
+        PIX* pix = (PIX*)( (char*)_dstPixelData + (std::size_t)(y - _dstBounds.y1) * _dstRowBytes ) + (std::size_t)(procWindow.x1 - _dstBounds.x1) * nComps;
+        if (maxValue == 1) {
+            _ops.apply( (float*)pix, width, nComps );
+            continue;
+        }
+        for (std::size_t i = 0; i < row.size(); ++i) {
+            row[i] = pix[i] * scale;
+        }
+        _ops.apply(&row[0], width, nComps);
+        for (std::size_t i = 0; i < row.size(); ++i) {
+            pix[i] = (PIX)floatToInt(row[i], maxValue);
+        }
+    }
+}
+
+void
+CDLProcessor::multiThreadProcessImages(OfxRectI procWindow)
+{
+    assert(_dstBounds.x1 <= procWindow.x1 && procWindow.x1 <= procWindow.x2 && procWindow.x2 <= _dstBounds.x2);
+    assert(_dstBounds.y1 <= procWindow.y1 && procWindow.y1 <= procWindow.y2 && procWindow.y2 <= _dstBounds.y2);
+    if ( (procWindow.y2 <= procWindow.y1) || (procWindow.x2 <= procWindow.x1) ) {
+        return;
+    }
+    int nComps;
+    switch (_dstPixelComponents) {
+    case ePixelComponentRGBA:
+        nComps = 4;
+        break;
+    case ePixelComponentRGB:
+        nComps = 3;
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    switch (_dstBitDepth) {
+    case eBitDepthUByte:
+        processPixels<unsigned char, 255>(procWindow, nComps);
+        break;
+    case eBitDepthUShort:
+        processPixels<unsigned short, 65535>(procWindow, nComps);
+        break;
+    case eBitDepthFloat:
+        processPixels<float, 1>(procWindow, nComps);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+}
+
+void
+OCIOCDLTransformPlugin::getValues(OfxTime time,
+                                  float sop[9],
+                                  double* saturation,
+                                  int* directioni)
+{
+    double slope_r, slope_g, slope_b;
+    _slope->getValueAtTime(time, slope_r, slope_g, slope_b);
+    double offset_r, offset_g, offset_b;
+    _offset->getValueAtTime(time, offset_r, offset_g, offset_b);
+    double power_r, power_g, power_b;
+    _power->getValueAtTime(time, power_r, power_g, power_b);
+    *saturation = _saturation->getValueAtTime(time);
+    *directioni = _direction->getValueAtTime(time);
+    sop[0] = (float)slope_r;
+    sop[1] = (float)slope_g;
+    sop[2] = (float)slope_b;
+    sop[3] = (float)offset_r;
+    sop[4] = (float)offset_g;
+    sop[5] = (float)offset_b;
+    sop[6] = (float)power_r;
+    sop[7] = (float)power_g;
+    sop[8] = (float)power_b;
+}
+
+void
+OCIOCDLTransformPlugin::loadCDLFromFileOnce()
 {
     if (_firstLoad) {
         _firstLoad = false;
@@ -601,64 +1070,26 @@ OCIOCDLTransformPlugin::getProcessor(OfxTime time)
             loadCDLFromFile();
         }
     }
+}
+
+OCIO::ConstProcessorRcPtr
+OCIOCDLTransformPlugin::getProcessor(OfxTime time)
+{
+    loadCDLFromFileOnce();
 
     float sop[9];
-    double slope_r, slope_g, slope_b;
-    _slope->getValueAtTime(time, slope_r, slope_g, slope_b);
-    double offset_r, offset_g, offset_b;
-    _offset->getValueAtTime(time, offset_r, offset_g, offset_b);
-    double power_r, power_g, power_b;
-    _power->getValueAtTime(time, power_r, power_g, power_b);
-    double saturation = _saturation->getValueAtTime(time);
-    int directioni = _direction->getValueAtTime(time);
+    double saturation;
+    int directioni;
+    getValues(time, sop, &saturation, &directioni);
 
     try {
+        OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
+        assert(config);
+        const string key = getCDLProcessorKey(config, sop, saturation, directioni);
         GenericOCIO::AutoMutex guard(_procMutex);
-        if ( !_proc ||
-             ( _procSlope_r != slope_r) ||
-             ( _procSlope_g != slope_g) ||
-             ( _procSlope_b != slope_b) ||
-             ( _procOffset_r != offset_r) ||
-             ( _procOffset_g != offset_g) ||
-             ( _procOffset_b != offset_b) ||
-             ( _procPower_r != power_r) ||
-             ( _procPower_g != power_g) ||
-             ( _procPower_b != power_b) ||
-             ( _procSaturation != saturation) ||
-             ( _procDirection != directioni) ) {
-            OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
-            assert(config);
-            OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
-            sop[0] = (float)slope_r;
-            sop[1] = (float)slope_g;
-            sop[2] = (float)slope_b;
-            sop[3] = (float)offset_r;
-            sop[4] = (float)offset_g;
-            sop[5] = (float)offset_b;
-            sop[6] = (float)power_r;
-            sop[7] = (float)power_g;
-            sop[8] = (float)power_b;
-            cc->setSOP(sop);
-            cc->setSat( (float)saturation );
-
-            if (directioni == 0) {
-                cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
-            } else {
-                cc->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
-            }
-
-            _proc = config->getProcessor(cc);
-            _procSlope_r = slope_r;
-            _procSlope_g = slope_g;
-            _procSlope_b = slope_b;
-            _procOffset_r = offset_r;
-            _procOffset_g = offset_g;
-            _procOffset_b = offset_b;
-            _procPower_r = power_r;
-            _procPower_g = power_g;
-            _procPower_b = power_b;
-            _procSaturation = saturation;
-            _procDirection = directioni;
+        if ( !_proc || (_procKey != key) ) {
+            _proc = getCachedCDLProcessor(config, sop, saturation, directioni, key);
+            _procKey = key;
         }
     } catch (const OCIO::Exception &e) {
         setPersistentMessage( Message::eMessageError, "", e.what() );
@@ -671,10 +1102,11 @@ OCIOCDLTransformPlugin::getProcessor(OfxTime time)
 void
 OCIOCDLTransformPlugin::apply(double time,
                               const OfxRectI& renderWindow,
-                              float *pixelData,
+                              void *pixelData,
                               const OfxRectI& bounds,
                               PixelComponentEnum pixelComponents,
                               int pixelComponentCount,
+                              BitDepthEnum bitDepth,
                               int rowBytes)
 {
     // are we in the image bounds
@@ -686,9 +1118,28 @@ OCIOCDLTransformPlugin::apply(double time,
         throw std::runtime_error("OCIO: invalid components (only RGB and RGBA are supported)");
     }
 
+    loadCDLFromFileOnce();
+    float sop[9];
+    double saturation;
+    int directioni;
+    getValues(time, sop, &saturation, &directioni);
+    if (directioni == 0) {
+        // the grade may change at each frame: apply it directly, without building an OCIO processor
+        const CDLOps ops( sop, (float)saturation );
+#ifdef DEBUG
+        ops.check( sop, (float)saturation );
+#endif
+        CDLProcessor processor(*this, ops);
+        processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
+        processor.setRenderWindow(renderWindow);
+        processor.process();
+
+        return;
+    }
+
     OCIOProcessor processor(*this);
     // set the images
-    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
 
     processor.setProcessor( getProcessor(time) );
 
@@ -799,7 +1250,7 @@ OCIOCDLTransformPlugin::renderGPU(const RenderArguments &args)
     BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
     PixelComponentEnum srcComponents = srcImg->getPixelComponents();
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -921,7 +1372,7 @@ OCIOCDLTransformPlugin::render(const RenderArguments &args)
     }
 
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -958,7 +1409,7 @@ OCIOCDLTransformPlugin::render(const RenderArguments &args)
     int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
     ImageMemory mem(memSize, this);
-    float *tmpPixelData = (float*)mem.lock();
+    void *tmpPixelData = mem.lock();
     bool premult;
     _premult->getValueAtTime(args.time, premult);
 
@@ -966,7 +1417,7 @@ OCIOCDLTransformPlugin::render(const RenderArguments &args)
     copyPixelData(premult, false, false, args.time, args.renderWindow, srcPixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, srcRowBytes, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     ///do the color-space conversion
-    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
+    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     // copy the color-converted window
     copyPixelData( false, premult, true, args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes, dstImg.get() );
@@ -981,52 +1432,32 @@ OCIOCDLTransformPlugin::isIdentity(const IsIdentityArguments &args,
     const double time = args.time;
     float sop[9];
     double saturation;
-    double r, g, b;
-
-    _slope->getValueAtTime(time, r, g, b);
-    sop[0] = (float)r;
-    sop[1] = (float)g;
-    sop[2] = (float)b;
-    _offset->getValueAtTime(time, r, g, b);
-    sop[3] = (float)r;
-    sop[4] = (float)g;
-    sop[5] = (float)b;
-    _power->getValueAtTime(time, r, g, b);
-    sop[6] = (float)r;
-    sop[7] = (float)g;
-    sop[8] = (float)b;
-    _saturation->getValueAtTime(time, saturation);
-    int _directioni;
-    _direction->getValueAtTime(time, _directioni);
-    string file;
-    _file->getValueAtTime(time, file);
-    string cccid;
-    _cccid->getValueAtTime(time, cccid);
-
-    try {
-        OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
-        if (!config) {
-            throw std::runtime_error("OCIO: no current config");
-        }
-        OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
-        cc->setSOP(sop);
-        cc->setSat( (float)saturation );
+    int directioni;
 
-        if (_directioni == 0) {
-            cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
-        } else {
-            cc->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
-        }
-
-        OCIO::ConstProcessorRcPtr proc = config->getProcessor(cc);
-        if ( proc->isNoOp() ) {
+    getValues(time, sop, &saturation, &directioni);
+    if (directioni == 0) {
+        if ( CDLOps( sop, (float)saturation ).isNoOp() ) {
             identityClip = _srcClip;
 
             return true;
         }
-    } catch (const std::exception &e) {
-        setPersistentMessage( Message::eMessageError, "", e.what() );
-        throwSuiteStatusException(kOfxStatFailed);
+    } else {
+        try {
+            OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
+            if (!config) {
+                throw std::runtime_error("OCIO: no current config");
+            }
+            const string key = getCDLProcessorKey(config, sop, saturation, directioni);
+            OCIO::ConstProcessorRcPtr proc = getCachedCDLProcessor(config, sop, saturation, directioni, key);
+            if ( proc->isNoOp() ) {
+                identityClip = _srcClip;
+
+                return true;
+            }
+        } catch (const std::exception &e) {
+            setPersistentMessage( Message::eMessageError, "", e.what() );
+            throwSuiteStatusException(kOfxStatFailed);
+        }
     }
 
     double mix;
@@ -1136,14 +1567,7 @@ OCIOCDLTransformPlugin::loadCDLFromFile()
 void
 OCIOCDLTransformPlugin::beginEdit()
 {
-    if (_firstLoad) {
-        _firstLoad = false;
-        bool readFromFile;
-        _readFromFile->getValue(readFromFile);
-        if (readFromFile) {
-            loadCDLFromFile();
-        }
-    }
+    loadCDLFromFileOnce();
 }
 
 void
@@ -1171,6 +1595,7 @@ OCIOCDLTransformPlugin::changedParam(const InstanceChangedArgs &args,
     } else if (paramName == kParamReload) {
         _version->setValue(_version->getValue() + 1); // invalidate the node cache
         OCIO::ClearAllCaches();
+        OCIOProcessorCache::instance().purge();
     } else if ( (paramName == kParamExport) && (args.reason == eChangeUserEdit) ) {
         string exportName;
         _export->getValueAtTime(args.time, exportName);
@@ -1288,6 +1713,8 @@ OCIOCDLTransformPluginFactory::describe(ImageEffectDescriptor &desc)
     desc.addSupportedContext(eContextPaint);
 
     // add supported pixel depths
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
     desc.setSupportsTiles(kSupportsTiles);
@@ -233,6 +233,27 @@ private:
                        BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
+    template <class PIX, int maxValue>
+    void copyPixelDataForDepth(bool unpremult,
+                               bool premult,
+                               int premultChannel,
+                               bool maskmix,
+                               double mix,
+                               double time,
+                               const OfxRectI &renderWindow,
+                               const void *srcPixelData,
+                               const OfxRectI& srcBounds,
+                               PixelComponentEnum srcPixelComponents,
+                               int srcPixelComponentCount,
+                               BitDepthEnum srcPixelDepth,
+                               int srcRowBytes,
+                               void *dstPixelData,
+                               const OfxRectI& dstBounds,
+                               PixelComponentEnum dstPixelComponents,
+                               int dstPixelComponentCount,
+                               BitDepthEnum dstBitDepth,
+                               int dstRowBytes);
+
     void setupAndCopy(PixelProcessorFilterBase & processor,
                       double time,
                       const OfxRectI &renderWindow,
@@ -373,53 +394,48 @@ OCIOColorSpacePlugin::setupAndCopy(PixelProcessorFilterBase & processor,
     processor.process();
 }
 
+template <class PIX, int maxValue>
 void
-OCIOColorSpacePlugin::copyPixelData(bool unpremult,
-                                    bool premult,
-                                    int premultChannel,
-                                    bool maskmix,
-                                    double mix,
-                                    double time,
-                                    const OfxRectI& renderWindow,
-                                    const void *srcPixelData,
-                                    const OfxRectI& srcBounds,
-                                    PixelComponentEnum srcPixelComponents,
-                                    int srcPixelComponentCount,
-                                    BitDepthEnum srcBitDepth,
-                                    int srcRowBytes,
-                                    void *dstPixelData,
-                                    const OfxRectI& dstBounds,
-                                    PixelComponentEnum dstPixelComponents,
-                                    int dstPixelComponentCount,
-                                    BitDepthEnum dstBitDepth,
-                                    int dstRowBytes)
+OCIOColorSpacePlugin::copyPixelDataForDepth(bool unpremult,
+                                            bool premult,
+                                            int premultChannel,
+                                            bool maskmix,
+                                            double mix,
+                                            double time,
+                                            const OfxRectI& renderWindow,
+                                            const void *srcPixelData,
+                                            const OfxRectI& srcBounds,
+                                            PixelComponentEnum srcPixelComponents,
+                                            int srcPixelComponentCount,
+                                            BitDepthEnum srcBitDepth,
+                                            int srcRowBytes,
+                                            void *dstPixelData,
+                                            const OfxRectI& dstBounds,
+                                            PixelComponentEnum dstPixelComponents,
+                                            int dstPixelComponentCount,
+                                            BitDepthEnum dstBitDepth,
+                                            int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
     if ( ( (!unpremult && !premult) || (unpremult && premult) ) && !maskmix ) {
         copyPixels(*this, renderWindow,
                    srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                    dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if (unpremult && !premult && !maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, 1.);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierUnPremult<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, 1.);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierUnPremult<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, 1.);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
@@ -427,19 +443,19 @@ OCIOColorSpacePlugin::copyPixelData(bool unpremult,
         } // switch
     } else if (!unpremult && !premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierMaskMix<float, 4, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 4, maxValue, true> fred(*this);
             fred.setPremultMaskMix(false, premultChannel, mix);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierMaskMix<float, 3, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 3, maxValue, true> fred(*this);
             fred.setPremultMaskMix(false, premultChannel, mix);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierMaskMix<float, 1, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 1, maxValue, true> fred(*this);
             fred.setPremultMaskMix(false, premultChannel, mix);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
@@ -447,19 +463,19 @@ OCIOColorSpacePlugin::copyPixelData(bool unpremult,
         } // switch
     } else if (!unpremult && premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierPremultMaskMix<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, mix);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierPremultMaskMix<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, mix);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierPremultMaskMix<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, mix);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
@@ -472,7 +488,50 @@ OCIOColorSpacePlugin::copyPixelData(bool unpremult,
         // unpremult && premult && maskmix
         assert(false); // should never happen
     }
-} // OCIOColorSpacePlugin::copyPixelData
+}
+
+void
+OCIOColorSpacePlugin::copyPixelData(bool unpremult,
+                                    bool premult,
+                                    int premultChannel,
+                                    bool maskmix,
+                                    double mix,
+                                    double time,
+                                    const OfxRectI& renderWindow,
+                                    const void *srcPixelData,
+                                    const OfxRectI& srcBounds,
+                                    PixelComponentEnum srcPixelComponents,
+                                    int srcPixelComponentCount,
+                                    BitDepthEnum srcBitDepth,
+                                    int srcRowBytes,
+                                    void *dstPixelData,
+                                    const OfxRectI& dstBounds,
+                                    PixelComponentEnum dstPixelComponents,
+                                    int dstPixelComponentCount,
+                                    BitDepthEnum dstBitDepth,
+                                    int dstRowBytes)
+{
+    assert(srcPixelData && dstPixelData);
+    // do the rendering
+    if ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    switch (dstBitDepth) {
+    case eBitDepthUByte:
+        copyPixelDataForDepth<unsigned char, 255>(unpremult, premult, premultChannel, maskmix, mix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        copyPixelDataForDepth<unsigned short, 65535>(unpremult, premult, premultChannel, maskmix, mix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        copyPixelDataForDepth<float, 1>(unpremult, premult, premultChannel, maskmix, mix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+}
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
 
@@ -574,7 +633,7 @@ OCIOColorSpacePlugin::renderGPU(const RenderArguments &args)
     BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
     PixelComponentEnum srcComponents = srcImg->getPixelComponents();
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -702,7 +761,7 @@ OCIOColorSpacePlugin::render(const RenderArguments &args)
     }
 
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -739,7 +798,7 @@ OCIOColorSpacePlugin::render(const RenderArguments &args)
     int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
     ImageMemory mem(memSize, this);
-    float *tmpPixelData = (float*)mem.lock();
+    void *tmpPixelData = mem.lock();
     bool premult;
     _premult->getValueAtTime(args.time, premult);
     int premultChannel;
@@ -751,7 +810,7 @@ OCIOColorSpacePlugin::render(const RenderArguments &args)
     copyPixelData(premult, false, premultChannel, false, 1., args.time, args.renderWindow, srcPixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, srcRowBytes, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     ///do the color-space conversion
-    _ocio->apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
+    _ocio->apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     // copy the color-converted window and apply masking
     copyPixelData( false, premult, premultChannel, true, mix, args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes, dstImg.get() );
@@ -856,6 +915,8 @@ OCIOColorSpacePluginFactory::describe(ImageEffectDescriptor &desc)
     desc.addSupportedContext(eContextPaint);
 
     // add supported pixel depths
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
     desc.setSupportsTiles(kSupportsTiles);
@@ -937,6 +998,8 @@ OCIOColorSpacePluginFactory::describeInContext(ImageEffectDescriptor &desc,
     }
 #endif
 
+    GenericOCIO::describeInContextFastCPU(desc, context, page);
+
     ofxsPremultDescribeParams(desc, page);
     ofxsMaskMixDescribeParams(desc, page);
 } // OCIOColorSpacePluginFactory::describeInContext
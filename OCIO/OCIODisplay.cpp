@@ -204,7 +204,7 @@ private:
     void displayCheck(double time);
     void viewCheck(double time, bool setDefaultIfInvalid = false);
 
-    void apply(double time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    void apply(double time, const OfxRectI& renderWindow, void *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, BitDepthEnum bitDepth, int rowBytes);
 
     OCIO::ConstProcessorRcPtr getProcessor(OfxTime time);
 
@@ -318,6 +318,25 @@ private:
                        BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
+    template <class PIX, int maxValue>
+    void copyPixelDataForDepth(bool unpremult,
+                               bool premult,
+                               int premultChannel,
+                               double time,
+                               const OfxRectI &renderWindow,
+                               const void *srcPixelData,
+                               const OfxRectI& srcBounds,
+                               PixelComponentEnum srcPixelComponents,
+                               int srcPixelComponentCount,
+                               BitDepthEnum srcPixelDepth,
+                               int srcRowBytes,
+                               void *dstPixelData,
+                               const OfxRectI& dstBounds,
+                               PixelComponentEnum dstPixelComponents,
+                               int dstPixelComponentCount,
+                               BitDepthEnum dstBitDepth,
+                               int dstRowBytes);
+
     void setupAndCopy(PixelProcessorFilterBase & processor,
                       double time,
                       const OfxRectI &renderWindow,
@@ -346,17 +365,14 @@ private:
     DoubleParam* _gain;
     DoubleParam* _gamma;
     ChoiceParam* _channel;
+    BooleanParam* _fastCPU;
 
     auto_ptr<GenericOCIO> _ocio;
 
     GenericOCIO::Mutex _procMutex;
     OCIO::ConstProcessorRcPtr _proc;
-    string _procInputSpace;
-    ChannelSelectorEnum _procChannel;
-    string _procDisplay;
-    string _procView;
-    double _procGain;
-    double _procGamma;
+    string _procKey; // the OCIOProcessorCache key of _proc
+    OCIOBakedLutRef _bakedLut; // the baked version of _proc (see kOCIOParamFastCPU)
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     BooleanParam* _enableGPU;
@@ -375,10 +391,8 @@ OCIODisplayPlugin::OCIODisplayPlugin(OfxImageEffectHandle handle)
     , _gain(NULL)
     , _gamma(NULL)
     , _channel(NULL)
+    , _fastCPU(NULL)
     , _ocio( new GenericOCIO(this) )
-    , _procChannel(eChannelSelectorRGB)
-    , _procGain(-1)
-    , _procGamma(-1)
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     , _enableGPU(NULL)
     , _openGLContextData(NULL)
@@ -403,6 +417,8 @@ OCIODisplayPlugin::OCIODisplayPlugin(OfxImageEffectHandle handle)
     assert(_display && _view && _gain && _gamma && _channel);
     _display = fetchStringParam(kParamDisplay);
     _view = fetchStringParam(kParamView);
+    _fastCPU = fetchBooleanParam(kOCIOParamFastCPU);
+    assert(_fastCPU);
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     _enableGPU = fetchBooleanParam(kParamEnableGPU);
@@ -559,51 +575,46 @@ OCIODisplayPlugin::setupAndCopy(PixelProcessorFilterBase & processor,
     processor.process();
 }
 
+template <class PIX, int maxValue>
 void
-OCIODisplayPlugin::copyPixelData(bool unpremult,
-                                 bool premult,
-                                 int premultChannel,
-                                 double time,
-                                 const OfxRectI& renderWindow,
-                                 const void *srcPixelData,
-                                 const OfxRectI& srcBounds,
-                                 PixelComponentEnum srcPixelComponents,
-                                 int srcPixelComponentCount,
-                                 BitDepthEnum srcBitDepth,
-                                 int srcRowBytes,
-                                 void *dstPixelData,
-                                 const OfxRectI& dstBounds,
-                                 PixelComponentEnum dstPixelComponents,
-                                 int dstPixelComponentCount,
-                                 BitDepthEnum dstBitDepth,
-                                 int dstRowBytes)
+OCIODisplayPlugin::copyPixelDataForDepth(bool unpremult,
+                                         bool premult,
+                                         int premultChannel,
+                                         double time,
+                                         const OfxRectI& renderWindow,
+                                         const void *srcPixelData,
+                                         const OfxRectI& srcBounds,
+                                         PixelComponentEnum srcPixelComponents,
+                                         int srcPixelComponentCount,
+                                         BitDepthEnum srcBitDepth,
+                                         int srcRowBytes,
+                                         void *dstPixelData,
+                                         const OfxRectI& dstBounds,
+                                         PixelComponentEnum dstPixelComponents,
+                                         int dstPixelComponentCount,
+                                         BitDepthEnum dstBitDepth,
+                                         int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
     if ( ( (!unpremult && !premult) || (unpremult && premult) ) ) {
         copyPixels(*this, renderWindow,
                    srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                    dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if (unpremult && !premult) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, 1.);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierUnPremult<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, 1.);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierUnPremult<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             fred.setPremultMaskMix(true, premultChannel, 1.);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
@@ -616,6 +627,47 @@ OCIODisplayPlugin::copyPixelData(bool unpremult,
     }
 }
 
+void
+OCIODisplayPlugin::copyPixelData(bool unpremult,
+                                 bool premult,
+                                 int premultChannel,
+                                 double time,
+                                 const OfxRectI& renderWindow,
+                                 const void *srcPixelData,
+                                 const OfxRectI& srcBounds,
+                                 PixelComponentEnum srcPixelComponents,
+                                 int srcPixelComponentCount,
+                                 BitDepthEnum srcBitDepth,
+                                 int srcRowBytes,
+                                 void *dstPixelData,
+                                 const OfxRectI& dstBounds,
+                                 PixelComponentEnum dstPixelComponents,
+                                 int dstPixelComponentCount,
+                                 BitDepthEnum dstBitDepth,
+                                 int dstRowBytes)
+{
+    assert(srcPixelData && dstPixelData);
+    // do the rendering
+    if ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    switch (dstBitDepth) {
+    case eBitDepthUByte:
+        copyPixelDataForDepth<unsigned char, 255>(unpremult, premult, premultChannel, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        copyPixelDataForDepth<unsigned short, 65535>(unpremult, premult, premultChannel, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        copyPixelDataForDepth<float, 1>(unpremult, premult, premultChannel, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+}
+
 OCIO::ConstProcessorRcPtr
 OCIODisplayPlugin::getProcessor(OfxTime time)
 {
@@ -635,99 +687,101 @@ OCIODisplayPlugin::getProcessor(OfxTime time)
         if (!config) {
             throw std::runtime_error("OCIO: no current config");
         }
+        OCIO::ConstContextRcPtr context = _ocio->getLocalContext(time);
+        string description("Display");
+        OCIOProcessorCache::appendKey(&description, inputSpace);
+        OCIOProcessorCache::appendKey(&description, (int)channel);
+        OCIOProcessorCache::appendKey(&description, display);
+        OCIOProcessorCache::appendKey(&description, view);
+        OCIOProcessorCache::appendKey(&description, gain);
+        OCIOProcessorCache::appendKey(&description, gamma);
+        const string key = OCIOProcessorCache::getKey(config, context, description);
         GenericOCIO::AutoMutex guard(_procMutex);
-        if ( !_proc ||
-             ( _procInputSpace != inputSpace) ||
-             ( _procChannel != channel) ||
-             ( _procDisplay != display) ||
-             ( _procView != view) ||
-             ( _procGain != gain) ||
-             ( _procGamma != gamma) ) {
-            OCIO::DisplayTransformRcPtr transform = OCIO::DisplayTransform::Create();
-            transform->setInputColorSpaceName( inputSpace.c_str() );
-
-            transform->setDisplay( display.c_str() );
-
-            transform->setView( view.c_str() );
-
-            // Specify an (optional) linear color correction
-            {
-                float m44[16];
-                float offset4[4];
-                const float slope4f[] = { (float)gain, (float)gain, (float)gain, (float)gain };
-                OCIO::MatrixTransform::Scale(m44, offset4, slope4f);
-
-                OCIO::MatrixTransformRcPtr mtx =  OCIO::MatrixTransform::Create();
-                mtx->setValue(m44, offset4);
-
-                transform->setLinearCC(mtx);
-            }
+        if ( !_proc || (_procKey != key) ) {
+            OCIOProcessorCache& cache = OCIOProcessorCache::instance();
+            _proc = cache.get(key);
+            if (!_proc) {
+                OCIO::DisplayTransformRcPtr transform = OCIO::DisplayTransform::Create();
+                transform->setInputColorSpaceName( inputSpace.c_str() );
 
-            // Specify an (optional) post-display transform.
-            {
-                float exponent = 1.0f / std::max(1e-6f, (float)gamma);
-                const float exponent4f[] = { exponent, exponent, exponent, exponent };
-                OCIO::ExponentTransformRcPtr cc =  OCIO::ExponentTransform::Create();
-                cc->setValue(exponent4f);
-                transform->setDisplayCC(cc);
-            }
+                transform->setDisplay( display.c_str() );
+
+                transform->setView( view.c_str() );
+
+                // Specify an (optional) linear color correction
+                {
+                    float m44[16];
+                    float offset4[4];
+                    const float slope4f[] = { (float)gain, (float)gain, (float)gain, (float)gain };
+                    OCIO::MatrixTransform::Scale(m44, offset4, slope4f);
+
+                    OCIO::MatrixTransformRcPtr mtx =  OCIO::MatrixTransform::Create();
+                    mtx->setValue(m44, offset4);
 
-            // Add Channel swizzling
-            {
-                int channelHot[4] = { 0, 0, 0, 0};
-
-                switch (channel) {
-                case eChannelSelectorLuminance:     // Luma
-                    channelHot[0] = 1;
-                    channelHot[1] = 1;
-                    channelHot[2] = 1;
-                    break;
-                //case eChannelSelectorMatteOverlay: //  Channel overlay mode. Do rgb, and then swizzle later
-                //    channelHot[0] = 1;
-                //    channelHot[1] = 1;
-                //    channelHot[2] = 1;
-                //    channelHot[3] = 1;
-                //    break;
-                case eChannelSelectorRGB:     // RGB
-                    channelHot[0] = 1;
-                    channelHot[1] = 1;
-                    channelHot[2] = 1;
-                    channelHot[3] = 1;
-                    break;
-                case eChannelSelectorR:     // R
-                    channelHot[0] = 1;
-                    break;
-                case eChannelSelectorG:     // G
-                    channelHot[1] = 1;
-                    break;
-                case eChannelSelectorB:     // B
-                    channelHot[2] = 1;
-                    break;
-                case eChannelSelectorA:     // A
-                    channelHot[3] = 1;
-                    break;
-                default:
-                    break;
+                    transform->setLinearCC(mtx);
                 }
 
-                float lumacoef[3];
-                config->getDefaultLumaCoefs(lumacoef);
-                float m44[16];
-                float offset[4];
-                OCIO::MatrixTransform::View(m44, offset, channelHot, lumacoef);
-                OCIO::MatrixTransformRcPtr swizzle = OCIO::MatrixTransform::Create();
-                swizzle->setValue(m44, offset);
-                transform->setChannelView(swizzle);
-            }
+                // Specify an (optional) post-display transform.
+                {
+                    float exponent = 1.0f / std::max(1e-6f, (float)gamma);
+                    const float exponent4f[] = { exponent, exponent, exponent, exponent };
+                    OCIO::ExponentTransformRcPtr cc =  OCIO::ExponentTransform::Create();
+                    cc->setValue(exponent4f);
+                    transform->setDisplayCC(cc);
+                }
+
+                // Add Channel swizzling
+                {
+                    int channelHot[4] = { 0, 0, 0, 0};
+
+                    switch (channel) {
+                    case eChannelSelectorLuminance:     // Luma
+                        channelHot[0] = 1;
+                        channelHot[1] = 1;
+                        channelHot[2] = 1;
+                        break;
+                    //case eChannelSelectorMatteOverlay: //  Channel overlay mode. Do rgb, and then swizzle later
+                    //    channelHot[0] = 1;
+                    //    channelHot[1] = 1;
+                    //    channelHot[2] = 1;
+                    //    channelHot[3] = 1;
+                    //    break;
+                    case eChannelSelectorRGB:     // RGB
+                        channelHot[0] = 1;
+                        channelHot[1] = 1;
+                        channelHot[2] = 1;
+                        channelHot[3] = 1;
+                        break;
+                    case eChannelSelectorR:     // R
+                        channelHot[0] = 1;
+                        break;
+                    case eChannelSelectorG:     // G
+                        channelHot[1] = 1;
+                        break;
+                    case eChannelSelectorB:     // B
+                        channelHot[2] = 1;
+                        break;
+                    case eChannelSelectorA:     // A
+                        channelHot[3] = 1;
+                        break;
+                    default:
+                        break;
+                    }
+
+                    float lumacoef[3];
+                    config->getDefaultLumaCoefs(lumacoef);
+                    float m44[16];
+                    float offset[4];
+                    OCIO::MatrixTransform::View(m44, offset, channelHot, lumacoef);
+                    OCIO::MatrixTransformRcPtr swizzle = OCIO::MatrixTransform::Create();
+                    swizzle->setValue(m44, offset);
+                    transform->setChannelView(swizzle);
+                }
 
-            OCIO::ConstContextRcPtr context = _ocio->getLocalContext(time);
-            _proc = config->getProcessor(context, transform, OCIO::TRANSFORM_DIR_FORWARD);
-            _procInputSpace = inputSpace;
-            _procChannel = channel;
-            _procDisplay = display;
-            _procView = view;
-            _procGain = gain;
-            _procGamma = gamma;
+                _proc = config->getProcessor(context, transform, OCIO::TRANSFORM_DIR_FORWARD);
+                cache.set(key, _proc);
+            }
+            _procKey = key;
         }
     } catch (const OCIO::Exception &e) {
         setPersistentMessage( Message::eMessageError, "", e.what() );
@@ -740,10 +794,11 @@ OCIODisplayPlugin::getProcessor(OfxTime time)
 void
 OCIODisplayPlugin::apply(double time,
                          const OfxRectI& renderWindow,
-                         float *pixelData,
+                         void *pixelData,
                          const OfxRectI& bounds,
                          PixelComponentEnum pixelComponents,
                          int pixelComponentCount,
+                         BitDepthEnum bitDepth,
                          int rowBytes)
 {
     // are we in the image bounds
@@ -757,9 +812,13 @@ OCIODisplayPlugin::apply(double time,
 
     OCIOProcessor processor(*this);
     // set the images
-    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
 
-    processor.setProcessor( getProcessor(time) );
+    OCIO::ConstProcessorRcPtr proc = getProcessor(time);
+    processor.setProcessor(proc);
+    string inputSpace;
+    _ocio->getInputColorspaceAtTime(time, inputSpace);
+    processor.setBakedLut( GenericOCIO::getFastCPULut(_fastCPU, time, _ocio->getConfig(), inputSpace, proc, &_bakedLut) );
 
     // set the render window
     processor.setRenderWindow(renderWindow);
@@ -877,7 +936,7 @@ OCIODisplayPlugin::renderGPU(const RenderArguments &args)
     BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
     PixelComponentEnum srcComponents = srcImg->getPixelComponents();
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -993,7 +1052,7 @@ OCIODisplayPlugin::render(const RenderArguments &args)
     }
 
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -1030,7 +1089,7 @@ OCIODisplayPlugin::render(const RenderArguments &args)
     int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
     ImageMemory mem(memSize, this);
-    float *tmpPixelData = (float*)mem.lock();
+    void *tmpPixelData = mem.lock();
     bool premult;
     _premult->getValueAtTime(args.time, premult);
     int premultChannel;
@@ -1040,7 +1099,7 @@ OCIODisplayPlugin::render(const RenderArguments &args)
     copyPixelData(premult, false, premultChannel, args.time, args.renderWindow, srcPixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, srcRowBytes, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     ///do the color-space conversion
-    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
+    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     // copy the color-converted window and apply masking
     copyPixelData( false, premult, premultChannel, args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes, dstImg.get() );
@@ -1097,6 +1156,10 @@ OCIODisplayPlugin::changedParam(const InstanceChangedArgs &args,
         if (view != viewOld) {
             _view->setValue(view);
         }
+    } else if ( (paramName == kOCIOParamFastCPUError) && (args.reason == eChangeUserEdit) ) {
+        string inputSpace;
+        _ocio->getInputColorspaceAtTime(args.time, inputSpace);
+        GenericOCIO::showFastCPUError( this, config, inputSpace, getProcessor(args.time) );
 #ifdef OFX_SUPPORTS_OPENGLRENDER
     } else if (paramName == kParamEnableGPU) {
         bool supportsGL = _enableGPU->getValueAtTime(args.time);
@@ -1148,6 +1211,8 @@ OCIODisplayPluginFactory::describe(ImageEffectDescriptor &desc)
     desc.addSupportedContext(eContextPaint);
 
     // add supported pixel depths
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
     desc.setSupportsTiles(kSupportsTiles);
@@ -1333,6 +1398,8 @@ OCIODisplayPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         }
     }
 
+    GenericOCIO::describeInContextFastCPU(desc, context, page);
+
     ofxsPremultDescribeParams(desc, page);
 } // OCIODisplayPluginFactory::describeInContext
 
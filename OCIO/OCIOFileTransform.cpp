@@ -31,8 +31,20 @@
 #  endif
 #endif // defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 
+#include <cstdio> // fopen, rename
+#include <cstdlib> // getenv
+#include <cstring>
+#include <iomanip>
+#include <list>
+#include <sstream>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h> // getpid
+#endif
 #ifdef DEBUG
-#include <cstdio>
+#define DBG(x) x
+#else
+#define DBG(x) (void)0
 #endif
 
 #include "ofxsProcessing.H"
@@ -43,6 +55,9 @@
 #include "ofxsMacros.h"
 #include "ofxsCoords.h"
 #include "GenericOCIO.h"
+#include "FileHeaderCache.h"
+#include "MappedFile.h"
+#include "tinythread.h"
 
 namespace OCIO = OCIO_NAMESPACE;
 
@@ -114,6 +129,405 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 static bool gHostIsNatron = false; // TODO: generate a CCCId choice param kParamCCCIDChoice from available IDs
 
+// directory where the LUTs baked for the fast CPU mode are saved (e.g. "/var/tmp/ofx-luts"), so that other
+// instances and processes on the same machine (e.g. the other jobs of a render farm) map them instead of parsing
+// and baking the LUT file again. The directory must exist. Not set by default.
+// The value can be set using the environment variable OFX_IO_OCIO_LUT_CACHE_DIR
+#define kLutFileCacheDirEnv "OFX_IO_OCIO_LUT_CACHE_DIR"
+
+// beginning of the cache files. Change the version when the format of the files or the baking changes.
+#define kLutFileCacheMagic "OFXIOLUT"
+#define kLutFileCacheVersion 1
+#define kLutFileCacheExtension ".ofxlut"
+#define kLutFileCacheByteOrder 0x01020304
+
+// the fixed-size beginning of a cache file, followed by the key, padded to 16 bytes, and the LUT data
+struct LutFileHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int byteOrder; // kLutFileCacheByteOrder, as written by the machine that saved the file
+    unsigned int lutSize; // kOCIOBakedLutSize
+    unsigned int keySize;
+    unsigned int shaperLog2;
+    float shaperMin;
+    float shaperMax;
+    float shaperOffset;
+};
+
+static std::size_t
+getLutFileDataOffset(std::size_t keySize)
+{
+    return (sizeof(LutFileHeader) + keySize + 15) & ~(std::size_t)15;
+}
+
+static std::size_t
+getLutFileSize(std::size_t keySize)
+{
+    return getLutFileDataOffset(keySize) + (OCIOBakedLut::kShaperLutSize + OCIOBakedLut::kLutDataSize) * sizeof(float);
+}
+
+// A baked LUT read from a cache file: its data stays in the mapping of the file, which is shared by all the processes
+// that use it, or is copied if the file cannot be mapped.
+class LutFileCacheLut
+    : public OCIOBakedLut
+{
+public:
+    explicit LutFileCacheLut(const Shaper& shaper)
+        : OCIOBakedLut(shaper)
+        , _mapping()
+        , _data()
+    {
+    }
+
+    virtual ~LutFileCacheLut() {}
+
+    /// Read the LUT saved under key in path. Returns NULL if the file does not exist or is not valid.
+    static OCIOBakedLutRcPtr load(const string& path, const string& key);
+
+private:
+    MappedFile _mapping;
+    std::vector<float> _data;
+};
+
+OCIOBakedLutRcPtr
+LutFileCacheLut::load(const string& path,
+                      const string& key)
+{
+    const std::size_t dataOffset = getLutFileDataOffset( key.size() );
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+
+    if (!file) {
+        return OCIOBakedLutRcPtr();
+    }
+    string prefix(dataOffset, '\0'); // header and key
+    LutFileHeader header;
+    if (std::fread(&prefix[0], 1, dataOffset, file) == dataOffset) {
+        std::memcpy( &header, prefix.data(), sizeof(header) );
+    } else {
+        std::memset( &header, 0, sizeof(header) );
+    }
+    if ( (std::memcmp(header.magic, kLutFileCacheMagic, sizeof(header.magic) ) != 0) ||
+         (header.version != kLutFileCacheVersion) ||
+         (header.byteOrder != kLutFileCacheByteOrder) ||
+         (header.lutSize != kOCIOBakedLutSize) ||
+         (header.keySize != key.size()) ||
+         (prefix.compare(sizeof(header), key.size(), key) != 0) ) {
+        // an older version, or the cache file of another state of the LUT file
+        std::fclose(file);
+
+        return OCIOBakedLutRcPtr();
+    }
+    Shaper shaper;
+    shaper.log2 = (header.shaperLog2 != 0);
+    shaper.min = header.shaperMin;
+    shaper.max = header.shaperMax;
+    shaper.offset = header.shaperOffset;
+    LutFileCacheLut* lut = new LutFileCacheLut(shaper);
+    OCIOBakedLutRcPtr ret(lut);
+
+    // map the data if possible, so that its pages are shared by all processes.
+    // The file may have been replaced since it was opened: check that the mapping is the same file.
+    if ( lut->_mapping.open(path) &&
+         (lut->_mapping.size() == getLutFileSize( key.size() )) &&
+         (std::memcmp(lut->_mapping.data(), prefix.data(), dataOffset) == 0) ) {
+        std::fclose(file);
+        const float* data = (const float*)(lut->_mapping.data() + dataOffset);
+        lut->setData(data, data + kShaperLutSize);
+
+        return ret;
+    }
+    lut->_mapping.close();
+    lut->_data.resize(kShaperLutSize + kLutDataSize);
+    const bool read = (std::fread(&lut->_data[0], sizeof(float), lut->_data.size(), file) == lut->_data.size());
+    std::fclose(file);
+    if (!read) {
+        return OCIOBakedLutRcPtr();
+    }
+    lut->setData(&lut->_data[0], &lut->_data[kShaperLutSize]);
+
+    return ret;
+} // LutFileCacheLut::load
+
+/**
+ * @brief A cache of the LUTs baked from LUT files for the fast CPU mode, saved to files in kLutFileCacheDirEnv.
+ *
+ * Parsing a large 3D LUT file and baking it takes hundreds of milliseconds, which every process rendering with
+ * the same LUT (e.g. each job of a render farm) would otherwise spend before its first frame.
+ * OCIO cannot be given LUT data that was already parsed, so what is saved is the baked LUT (see OCIOBakedLut),
+ * which is all the fast CPU mode needs: the LUT file is not read at all when the cache file is valid.
+ * Each LUT file, CCC id, direction and interpolation has its own cache file, which is only used while the size
+ * and modification time of the LUT file, the OCIO version and the baking did not change, and is replaced otherwise.
+ * The loaded LUTs are shared by all instances.
+ **/
+class LutFileCache
+{
+public:
+    static LutFileCache& instance();
+
+    LutFileCache();
+
+    bool isEnabled() const
+    {
+        return !_dir.empty();
+    }
+
+    /**
+     * @brief The name of the cache file for a transform and the key of its current state.
+     * Returns false if the transform cannot be cached, e.g. if the LUT file does not exist, or if the path is
+     * relative or contains context variables, since OCIO then resolves it using the config.
+     **/
+    static bool getKey(const string& file, const string& cccid, int direction, int interpolation, string* name, string* key);
+
+    /// Get the LUT saved under key, or a NULL pointer if there is none.
+    OCIOBakedLutRcPtr get(const string& name, const string& key);
+
+    /// Save lut under key, replacing the previous cache file for name.
+    void set(const string& name, const string& key, const OCIOBakedLutRcPtr& lut);
+
+    /// Forget the loaded LUTs (the cache files are checked again when they are needed).
+    void purge();
+
+private:
+    struct Entry
+    {
+        string name;
+        string key;
+        OCIOBakedLutRcPtr lut;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    // must be called with _lock held
+    OCIOBakedLutRcPtr findLocked(const string& name, const string& key);
+    void insertLocked(const Entry& entry, EntryList* evicted);
+
+    static bool save(const string& path, const string& key, const OCIOBakedLut& lut);
+
+    GenericOCIO::Mutex _lock;
+    EntryList _luts; // the most recently used LUT comes first
+    string _dir;
+};
+
+static LutFileCache gLutFileCache;
+
+LutFileCache&
+LutFileCache::instance()
+{
+    return gLutFileCache;
+}
+
+LutFileCache::LutFileCache()
+    : _lock()
+    , _luts()
+    , _dir()
+{
+    const char* dir = std::getenv(kLutFileCacheDirEnv);
+
+    if (dir && *dir) {
+        _dir = dir;
+        const char last = _dir[_dir.size() - 1];
+        if ( (last != '/') && (last != '\\') ) {
+            _dir += '/';
+        }
+    }
+}
+
+bool
+LutFileCache::getKey(const string& file,
+                     const string& cccid,
+                     int direction,
+                     int interpolation,
+                     string* name,
+                     string* key)
+{
+#ifdef _WIN32
+    const bool absolute = ( file.size() > 2 && file[1] == ':' && (file[2] == '/' || file[2] == '\\') ) ||
+                          ( file.size() > 1 && (file[0] == '/' || file[0] == '\\') && (file[1] == '/' || file[1] == '\\') );
+#else
+    const bool absolute = ( !file.empty() && (file[0] == '/') );
+#endif
+    if ( !absolute || (file.find('$') != string::npos) ) {
+        return false;
+    }
+    long long mtime;
+    long long size;
+    long long inode;
+    if ( !FileHeaderCache::getFileStamp(file, &mtime, &size, &inode) ) {
+        return false;
+    }
+    std::ostringstream os;
+    os << file << '\n' << cccid << '\n' << direction << '\n' << interpolation;
+    const string transform = os.str();
+    // the cache file is named after a hash (64-bit FNV-1a) of the transform, and the key is checked when it is read
+    unsigned long long hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < transform.size(); ++i) {
+        hash = (hash ^ (unsigned char)transform[i]) * 1099511628211ULL;
+    }
+    std::ostringstream nameStream;
+    nameStream << std::hex << std::setw(16) << std::setfill('0') << hash << kLutFileCacheExtension;
+    *name = nameStream.str();
+    os << '\n' << size << '\n' << mtime << '\n' << inode << '\n' << OCIO::GetVersion();
+    *key = os.str();
+
+    return true;
+}
+
+OCIOBakedLutRcPtr
+LutFileCache::findLocked(const string& name,
+                         const string& key)
+{
+    for (EntryList::iterator it = _luts.begin(); it != _luts.end(); ++it) {
+        if (it->name == name) {
+            if (it->key != key) {
+                // the LUT file was modified
+                return OCIOBakedLutRcPtr();
+            }
+            _luts.splice(_luts.begin(), _luts, it);
+
+            return it->lut;
+        }
+    }
+
+    return OCIOBakedLutRcPtr();
+}
+
+void
+LutFileCache::insertLocked(const Entry& entry,
+                           EntryList* evicted)
+{
+    for (EntryList::iterator it = _luts.begin(); it != _luts.end(); ++it) {
+        if (it->name == entry.name) {
+            evicted->splice(evicted->begin(), _luts, it);
+            break;
+        }
+    }
+    _luts.push_front(entry);
+    while (_luts.size() > kOCIOBakedLutCacheSize) {
+        evicted->splice( evicted->begin(), _luts, --_luts.end() );
+    }
+}
+
+OCIOBakedLutRcPtr
+LutFileCache::get(const string& name,
+                  const string& key)
+{
+    if ( !isEnabled() ) {
+        return OCIOBakedLutRcPtr();
+    }
+    {
+        GenericOCIO::AutoMutex l(_lock);
+        OCIOBakedLutRcPtr lut = findLocked(name, key);
+        if (lut) {
+            return lut;
+        }
+    }
+    Entry entry;
+    entry.name = name;
+    entry.key = key;
+    entry.lut = LutFileCacheLut::load(_dir + name, key);
+    if (!entry.lut) {
+        return OCIOBakedLutRcPtr();
+    }
+    // the evicted LUTs are unmapped outside of the lock
+    EntryList evicted;
+    {
+        GenericOCIO::AutoMutex l(_lock);
+        insertLocked(entry, &evicted);
+    }
+
+    return entry.lut;
+}
+
+void
+LutFileCache::set(const string& name,
+                  const string& key,
+                  const OCIOBakedLutRcPtr& lut)
+{
+    if ( !isEnabled() || !lut ) {
+        return;
+    }
+    if ( !save(_dir + name, key, *lut) ) {
+        DBG( std::printf( "LutFileCache: cannot write %s\n", (_dir + name).c_str() ) );
+    }
+    Entry entry;
+    entry.name = name;
+    entry.key = key;
+    entry.lut = lut;
+    EntryList evicted;
+    {
+        GenericOCIO::AutoMutex l(_lock);
+        insertLocked(entry, &evicted);
+    }
+}
+
+void
+LutFileCache::purge()
+{
+    EntryList evicted;
+    {
+        GenericOCIO::AutoMutex l(_lock);
+        evicted.swap(_luts);
+    }
+}
+
+bool
+LutFileCache::save(const string& path,
+                   const string& key,
+                   const OCIOBakedLut& lut)
+{
+    LutFileHeader header;
+
+    std::memset( &header, 0, sizeof(header) );
+    std::memcpy( header.magic, kLutFileCacheMagic, sizeof(header.magic) );
+    header.version = kLutFileCacheVersion;
+    header.byteOrder = kLutFileCacheByteOrder;
+    header.lutSize = kOCIOBakedLutSize;
+    header.keySize = (unsigned int)key.size();
+    const OCIOBakedLut::Shaper& shaper = lut.getShaper();
+    header.shaperLog2 = shaper.log2 ? 1 : 0;
+    header.shaperMin = shaper.min;
+    header.shaperMax = shaper.max;
+    header.shaperOffset = shaper.offset;
+    string prefix( (const char*)&header, sizeof(header) );
+    prefix += key;
+    prefix.resize(getLutFileDataOffset( key.size() ), '\0');
+
+    // write a temporary file and rename it, so that other processes never read a partial file, and processes
+    // that mapped the previous file keep its contents.
+    // Processes and threads baking the same LUT at the same time each write their own temporary file.
+    std::ostringstream tmp;
+#ifdef _WIN32
+    tmp << path << '.' << GetCurrentProcessId() << '.' << tthread::this_thread::get_id() << ".tmp";
+#else
+    tmp << path << '.' << getpid() << '.' << tthread::this_thread::get_id() << ".tmp";
+#endif
+    const string tmpFile = tmp.str();
+    std::FILE* file = std::fopen(tmpFile.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    const bool written = ( std::fwrite(prefix.data(), 1, prefix.size(), file) == prefix.size() &&
+                           std::fwrite(lut.getShaperLutData(), sizeof(float), OCIOBakedLut::kShaperLutSize, file) == OCIOBakedLut::kShaperLutSize &&
+                           std::fwrite(lut.getLutData(), sizeof(float), OCIOBakedLut::kLutDataSize, file) == OCIOBakedLut::kLutDataSize );
+    if ( (std::fclose(file) != 0) || !written ) {
+        std::remove( tmpFile.c_str() );
+
+        return false;
+    }
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows
+    std::remove( path.c_str() );
+#endif
+    if (std::rename( tmpFile.c_str(), path.c_str() ) != 0) {
+        std::remove( tmpFile.c_str() );
+
+        return false;
+    }
+
+    return true;
+} // LutFileCache::save
+
 class OCIOFileTransformPlugin
     : public ImageEffect
 {
@@ -156,6 +570,10 @@ private:
 
     OCIO::ConstProcessorRcPtr getProcessor(OfxTime time);
 
+    /// The baked LUT for the fast CPU mode, if it is enabled, loaded from the LUT file cache if possible.
+    /// proc is set to the processor if it had to be built.
+    OCIOBakedLutRcPtr getFastCPULut(OfxTime time, OCIO::ConstProcessorRcPtr* proc);
+
     void updateCCCId();
 
     void copyPixelData(bool unpremult,
@@ -268,7 +686,26 @@ private:
                        BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
-    void apply(double time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    template <class PIX, int maxValue>
+    void copyPixelDataForDepth(bool unpremult,
+                               bool premult,
+                               bool maskmix,
+                               double time,
+                               const OfxRectI &renderWindow,
+                               const void *srcPixelData,
+                               const OfxRectI& srcBounds,
+                               PixelComponentEnum srcPixelComponents,
+                               int srcPixelComponentCount,
+                               BitDepthEnum srcPixelDepth,
+                               int srcRowBytes,
+                               void *dstPixelData,
+                               const OfxRectI& dstBounds,
+                               PixelComponentEnum dstPixelComponents,
+                               int dstPixelComponentCount,
+                               BitDepthEnum dstBitDepth,
+                               int dstRowBytes);
+
+    void apply(double time, const OfxRectI& renderWindow, void *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, BitDepthEnum bitDepth, int rowBytes);
 
     void setupAndCopy(PixelProcessorFilterBase & processor,
                       double time,
@@ -301,13 +738,18 @@ private:
     DoubleParam* _mix;
     BooleanParam* _maskApply;
     BooleanParam* _maskInvert;
+    BooleanParam* _fastCPU;
 
     GenericOCIO::Mutex _procMutex;
     OCIO::ConstProcessorRcPtr _proc;
-    string _procFile;
-    string _procCCCId;
-    int _procDirection;
-    int _procInterpolation;
+    string _procKey; // the OCIOProcessorCache key of _proc
+    OCIOBakedLutRef _bakedLut; // the baked version of _proc (see kOCIOParamFastCPU)
+
+    // the LUT returned by getFastCPULut() with the parameter values it was obtained for, so that renders do not
+    // stat the LUT file and hash its key each time. Like the processor, it is only refreshed by the Reload button.
+    GenericOCIO::Mutex _fastCPULutMutex;
+    string _fastCPULutParams;
+    OCIOBakedLutRcPtr _fastCPULut;
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     BooleanParam* _enableGPU;
@@ -330,8 +772,7 @@ OCIOFileTransformPlugin::OCIOFileTransformPlugin(OfxImageEffectHandle handle)
     , _mix(NULL)
     , _maskApply(NULL)
     , _maskInvert(NULL)
-    , _procDirection(-1)
-    , _procInterpolation(-1)
+    , _fastCPU(NULL)
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     , _enableGPU(NULL)
     , _openGLContextData(NULL)
@@ -359,6 +800,8 @@ OCIOFileTransformPlugin::OCIOFileTransformPlugin(OfxImageEffectHandle handle)
     _maskApply = paramExists(kParamMaskApply) ? fetchBooleanParam(kParamMaskApply) : 0;
     _maskInvert = fetchBooleanParam(kParamMaskInvert);
     assert(_mix && _maskInvert);
+    _fastCPU = fetchBooleanParam(kOCIOParamFastCPU);
+    assert(_fastCPU);
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     _enableGPU = fetchBooleanParam(kParamEnableGPU);
     assert(_enableGPU);
@@ -436,83 +879,78 @@ OCIOFileTransformPlugin::setupAndCopy(PixelProcessorFilterBase & processor,
     processor.process();
 }
 
+template <class PIX, int maxValue>
 void
-OCIOFileTransformPlugin::copyPixelData(bool unpremult,
-                                       bool premult,
-                                       bool maskmix,
-                                       double time,
-                                       const OfxRectI& renderWindow,
-                                       const void *srcPixelData,
-                                       const OfxRectI& srcBounds,
-                                       PixelComponentEnum srcPixelComponents,
-                                       int srcPixelComponentCount,
-                                       BitDepthEnum srcBitDepth,
-                                       int srcRowBytes,
-                                       void *dstPixelData,
-                                       const OfxRectI& dstBounds,
-                                       PixelComponentEnum dstPixelComponents,
-                                       int dstPixelComponentCount,
-                                       BitDepthEnum dstBitDepth,
-                                       int dstRowBytes)
+OCIOFileTransformPlugin::copyPixelDataForDepth(bool unpremult,
+                                               bool premult,
+                                               bool maskmix,
+                                               double time,
+                                               const OfxRectI& renderWindow,
+                                               const void *srcPixelData,
+                                               const OfxRectI& srcBounds,
+                                               PixelComponentEnum srcPixelComponents,
+                                               int srcPixelComponentCount,
+                                               BitDepthEnum srcBitDepth,
+                                               int srcRowBytes,
+                                               void *dstPixelData,
+                                               const OfxRectI& dstBounds,
+                                               PixelComponentEnum dstPixelComponents,
+                                               int dstPixelComponentCount,
+                                               BitDepthEnum dstBitDepth,
+                                               int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
     if (!unpremult && !premult && !maskmix) {
         copyPixels(*this, renderWindow,
                    srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                    dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if (unpremult && !premult && !maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierUnPremult<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierUnPremult<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && !premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierMaskMix<float, 4, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 4, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierMaskMix<float, 3, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 3, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierMaskMix<float, 1, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 1, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierPremultMaskMix<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierPremultMaskMix<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierPremultMaskMix<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
@@ -520,7 +958,48 @@ OCIOFileTransformPlugin::copyPixelData(bool unpremult,
     } else {
         assert(false); // should never happen
     }
-} // OCIOFileTransformPlugin::copyPixelData
+}
+
+void
+OCIOFileTransformPlugin::copyPixelData(bool unpremult,
+                                       bool premult,
+                                       bool maskmix,
+                                       double time,
+                                       const OfxRectI& renderWindow,
+                                       const void *srcPixelData,
+                                       const OfxRectI& srcBounds,
+                                       PixelComponentEnum srcPixelComponents,
+                                       int srcPixelComponentCount,
+                                       BitDepthEnum srcBitDepth,
+                                       int srcRowBytes,
+                                       void *dstPixelData,
+                                       const OfxRectI& dstBounds,
+                                       PixelComponentEnum dstPixelComponents,
+                                       int dstPixelComponentCount,
+                                       BitDepthEnum dstBitDepth,
+                                       int dstRowBytes)
+{
+    assert(srcPixelData && dstPixelData);
+    // do the rendering
+    if ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    switch (dstBitDepth) {
+    case eBitDepthUByte:
+        copyPixelDataForDepth<unsigned char, 255>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        copyPixelDataForDepth<unsigned short, 65535>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        copyPixelDataForDepth<float, 1>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+}
 
 OCIO::ConstProcessorRcPtr
 OCIOFileTransformPlugin::getProcessor(OfxTime time)
@@ -538,43 +1017,47 @@ OCIOFileTransformPlugin::getProcessor(OfxTime time)
         if (!config) {
             throw std::runtime_error("OCIO: No current config");
         }
+        string description("File");
+        OCIOProcessorCache::appendKey(&description, file);
+        OCIOProcessorCache::appendKey(&description, cccid);
+        OCIOProcessorCache::appendKey(&description, directioni);
+        OCIOProcessorCache::appendKey(&description, interpolationi);
+        const string key = OCIOProcessorCache::getKey(config, config->getCurrentContext(), description);
         GenericOCIO::AutoMutex guard(_procMutex);
-        if ( !_proc ||
-             ( _procFile != file) ||
-             ( _procCCCId != cccid) ||
-             ( _procDirection != directioni) ||
-             ( _procInterpolation != interpolationi) ) {
-            OCIO::FileTransformRcPtr transform = OCIO::FileTransform::Create();
-            transform->setSrc( file.c_str() );
-            transform->setCCCId( cccid.c_str() );
-
-            if (directioni == 0) {
-                transform->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
-            } else {
-                transform->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
+        if ( !_proc || (_procKey != key) ) {
+            OCIOProcessorCache& cache = OCIOProcessorCache::instance();
+            _proc = cache.get(key);
+            if (!_proc) {
+                OCIO::FileTransformRcPtr transform = OCIO::FileTransform::Create();
+                transform->setSrc( file.c_str() );
+                transform->setCCCId( cccid.c_str() );
+
+                if (directioni == 0) {
+                    transform->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
+                } else {
+                    transform->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
+                }
+
+                if (interpolationi == 0) {
+                    transform->setInterpolation(OCIO::INTERP_NEAREST);
+                } else if (interpolationi == 1) {
+                    transform->setInterpolation(OCIO::INTERP_LINEAR);
+                } else if (interpolationi == 2) {
+                    transform->setInterpolation(OCIO::INTERP_TETRAHEDRAL);
+                } else if (interpolationi == 3) {
+                    transform->setInterpolation(OCIO::INTERP_BEST);
+                } else {
+                    // Should never happen
+                    setPersistentMessage(Message::eMessageError, "", "OCIO Interpolation value out of bounds");
+                    throwSuiteStatusException(kOfxStatFailed);
+
+                    return _proc;
+                }
+
+                _proc = config->getProcessor(transform, OCIO::TRANSFORM_DIR_FORWARD);
+                cache.set(key, _proc);
             }
-
-            if (interpolationi == 0) {
-                transform->setInterpolation(OCIO::INTERP_NEAREST);
-            } else if (interpolationi == 1) {
-                transform->setInterpolation(OCIO::INTERP_LINEAR);
-            } else if (interpolationi == 2) {
-                transform->setInterpolation(OCIO::INTERP_TETRAHEDRAL);
-            } else if (interpolationi == 3) {
-                transform->setInterpolation(OCIO::INTERP_BEST);
-            } else {
-                // Should never happen
-                setPersistentMessage(Message::eMessageError, "", "OCIO Interpolation value out of bounds");
-                throwSuiteStatusException(kOfxStatFailed);
-
-                return _proc;
-            }
-
-            _proc = config->getProcessor(transform, OCIO::TRANSFORM_DIR_FORWARD);
-            _procFile = file;
-            _procCCCId = cccid;
-            _procDirection = directioni;
-            _procInterpolation = interpolationi;
+            _procKey = key;
         }
     } catch (const std::exception &e) {
         setPersistentMessage( Message::eMessageError, "", e.what() );
@@ -584,13 +1067,64 @@ OCIOFileTransformPlugin::getProcessor(OfxTime time)
     return _proc;
 } // getProcessor
 
+OCIOBakedLutRcPtr
+OCIOFileTransformPlugin::getFastCPULut(OfxTime time,
+                                       OCIO::ConstProcessorRcPtr* proc)
+{
+    if ( !_fastCPU->getValueAtTime(time) ) {
+        return OCIOBakedLutRcPtr();
+    }
+    string file;
+    _file->getValueAtTime(time, file);
+    string cccid;
+    _cccid->getValueAtTime(time, cccid);
+    const int directioni = _direction->getValueAtTime(time);
+    const int interpolationi = _interpolation->getValueAtTime(time);
+    string params;
+    OCIOProcessorCache::appendKey(&params, file);
+    OCIOProcessorCache::appendKey(&params, cccid);
+    OCIOProcessorCache::appendKey(&params, directioni);
+    OCIOProcessorCache::appendKey(&params, interpolationi);
+    {
+        GenericOCIO::AutoMutex guard(_fastCPULutMutex);
+        if ( _fastCPULut && (_fastCPULutParams == params) ) {
+            return _fastCPULut;
+        }
+    }
+
+    LutFileCache& fileCache = LutFileCache::instance();
+    string name;
+    string key;
+    const bool cached = fileCache.isEnabled() && LutFileCache::getKey(file, cccid, directioni, interpolationi, &name, &key);
+    OCIOBakedLutRcPtr lut;
+    if (cached) {
+        lut = fileCache.get(name, key);
+    }
+    if (!lut) {
+        *proc = getProcessor(time);
+        // the input of a LUT file has no colorspace: the shaper is uniform on [0,1]
+        lut = GenericOCIO::getFastCPULut( _fastCPU, time, OCIO::ConstConfigRcPtr(), string(), *proc, &_bakedLut );
+        if (cached) {
+            fileCache.set(name, key, lut);
+        }
+    }
+    {
+        GenericOCIO::AutoMutex guard(_fastCPULutMutex);
+        _fastCPULutParams = params;
+        _fastCPULut = lut;
+    }
+
+    return lut;
+}
+
 void
 OCIOFileTransformPlugin::apply(double time,
                                const OfxRectI& renderWindow,
-                               float *pixelData,
+                               void *pixelData,
                                const OfxRectI& bounds,
                                PixelComponentEnum pixelComponents,
                                int pixelComponentCount,
+                               BitDepthEnum bitDepth,
                                int rowBytes)
 {
     // are we in the image bounds
@@ -604,12 +1138,19 @@ OCIOFileTransformPlugin::apply(double time,
 
     OCIOProcessor processor(*this);
     // set the images
-    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
 
     // set the render window
     processor.setRenderWindow(renderWindow);
 
-    processor.setProcessor( getProcessor(time) );
+    // with the fast CPU mode, the LUT file may not even be parsed
+    OCIO::ConstProcessorRcPtr proc;
+    OCIOBakedLutRcPtr lut = getFastCPULut(time, &proc);
+    if (!lut) {
+        proc = getProcessor(time);
+    }
+    processor.setProcessor(proc);
+    processor.setBakedLut(lut);
 
     // Call the base class process member, this will call the derived templated process code
     processor.process();
@@ -715,7 +1256,7 @@ OCIOFileTransformPlugin::renderGPU(const RenderArguments &args)
     BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
     PixelComponentEnum srcComponents = srcImg->getPixelComponents();
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -837,7 +1378,7 @@ OCIOFileTransformPlugin::render(const RenderArguments &args)
     }
 
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -874,7 +1415,7 @@ OCIOFileTransformPlugin::render(const RenderArguments &args)
     int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
     ImageMemory mem(memSize, this);
-    float *tmpPixelData = (float*)mem.lock();
+    void *tmpPixelData = mem.lock();
     bool premult;
     _premult->getValueAtTime(args.time, premult);
 
@@ -882,7 +1423,7 @@ OCIOFileTransformPlugin::render(const RenderArguments &args)
     copyPixelData(premult, false, false, args.time, args.renderWindow, srcPixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, srcRowBytes, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     ///do the color-space conversion
-    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
+    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     // copy the color-converted window
     copyPixelData( false, premult, true, args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes, dstImg.get() );
@@ -962,6 +1503,22 @@ OCIOFileTransformPlugin::changedParam(const InstanceChangedArgs &args,
     } else if ( (paramName == kParamReload) && (args.reason == eChangeUserEdit) ) {
         _version->setValue(_version->getValue() + 1); // invalidate the node cache
         OCIO::ClearAllCaches();
+        // the LUT file may have changed: forget the processors that were built from it
+        OCIOProcessorCache::instance().purge();
+        LutFileCache::instance().purge();
+        {
+            GenericOCIO::AutoMutex guard(_procMutex);
+            _proc.reset();
+            _procKey.clear();
+        }
+        _bakedLut.reset();
+        {
+            GenericOCIO::AutoMutex guard(_fastCPULutMutex);
+            _fastCPULutParams.clear();
+            _fastCPULut.reset();
+        }
+    } else if ( (paramName == kOCIOParamFastCPUError) && (args.reason == eChangeUserEdit) ) {
+        GenericOCIO::showFastCPUError( this, OCIO::ConstConfigRcPtr(), string(), getProcessor(args.time) );
 #ifdef OFX_SUPPORTS_OPENGLRENDER
     } else if (paramName == kParamEnableGPU) {
         bool supportsGL = _enableGPU->getValueAtTime(args.time);
@@ -1024,6 +1581,8 @@ OCIOFileTransformPluginFactory::describe(ImageEffectDescriptor &desc)
     desc.addSupportedContext(eContextPaint);
 
     // add supported pixel depths
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
     desc.setSupportsTiles(kSupportsTiles);
@@ -1152,6 +1711,8 @@ OCIOFileTransformPluginFactory::describeInContext(ImageEffectDescriptor &desc,
     }
 #endif
 
+    GenericOCIO::describeInContextFastCPU(desc, context, page);
+
     ofxsPremultDescribeParams(desc, page);
     ofxsMaskMixDescribeParams(desc, page);
 } // OCIOFileTransformPluginFactory::describeInContext
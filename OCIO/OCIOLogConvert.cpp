@@ -227,7 +227,26 @@ private:
                        BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
-    void apply(double time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    template <class PIX, int maxValue>
+    void copyPixelDataForDepth(bool unpremult,
+                               bool premult,
+                               bool maskmix,
+                               double time,
+                               const OfxRectI &renderWindow,
+                               const void *srcPixelData,
+                               const OfxRectI& srcBounds,
+                               PixelComponentEnum srcPixelComponents,
+                               int srcPixelComponentCount,
+                               BitDepthEnum srcPixelDepth,
+                               int srcRowBytes,
+                               void *dstPixelData,
+                               const OfxRectI& dstBounds,
+                               PixelComponentEnum dstPixelComponents,
+                               int dstPixelComponentCount,
+                               BitDepthEnum dstBitDepth,
+                               int dstRowBytes);
+
+    void apply(double time, const OfxRectI& renderWindow, void *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, BitDepthEnum bitDepth, int rowBytes);
 
     void setupAndCopy(PixelProcessorFilterBase & processor,
                       double time,
@@ -260,12 +279,14 @@ private:
     DoubleParam* _mix;
     BooleanParam* _maskApply;
     BooleanParam* _maskInvert;
+    BooleanParam* _fastCPU;
 
     OCIO::ConstConfigRcPtr _config;
 
     GenericOCIO::Mutex _procMutex;
     OCIO::ConstProcessorRcPtr _proc;
-    int _procMode;
+    string _procKey; // the OCIOProcessorCache key of _proc
+    OCIOBakedLutRef _bakedLut; // the baked version of _proc (see kOCIOParamFastCPU)
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     BooleanParam* _enableGPU;
@@ -286,7 +307,7 @@ OCIOLogConvertPlugin::OCIOLogConvertPlugin(OfxImageEffectHandle handle)
     , _mix(NULL)
     , _maskApply(NULL)
     , _maskInvert(NULL)
-    , _procMode(-1)
+    , _fastCPU(NULL)
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     , _enableGPU(NULL)
     , _openGLContextData(NULL)
@@ -312,6 +333,8 @@ OCIOLogConvertPlugin::OCIOLogConvertPlugin(OfxImageEffectHandle handle)
     _maskApply = paramExists(kParamMaskApply) ? fetchBooleanParam(kParamMaskApply) : 0;
     _maskInvert = fetchBooleanParam(kParamMaskInvert);
     assert(_mix && _maskInvert);
+    _fastCPU = fetchBooleanParam(kOCIOParamFastCPU);
+    assert(_fastCPU);
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     _enableGPU = fetchBooleanParam(kParamEnableGPU);
@@ -415,83 +438,78 @@ OCIOLogConvertPlugin::setupAndCopy(PixelProcessorFilterBase & processor,
     processor.process();
 }
 
+template <class PIX, int maxValue>
 void
-OCIOLogConvertPlugin::copyPixelData(bool unpremult,
-                                    bool premult,
-                                    bool maskmix,
-                                    double time,
-                                    const OfxRectI& renderWindow,
-                                    const void *srcPixelData,
-                                    const OfxRectI& srcBounds,
-                                    PixelComponentEnum srcPixelComponents,
-                                    int srcPixelComponentCount,
-                                    BitDepthEnum srcBitDepth,
-                                    int srcRowBytes,
-                                    void *dstPixelData,
-                                    const OfxRectI& dstBounds,
-                                    PixelComponentEnum dstPixelComponents,
-                                    int dstPixelComponentCount,
-                                    BitDepthEnum dstBitDepth,
-                                    int dstRowBytes)
+OCIOLogConvertPlugin::copyPixelDataForDepth(bool unpremult,
+                                            bool premult,
+                                            bool maskmix,
+                                            double time,
+                                            const OfxRectI& renderWindow,
+                                            const void *srcPixelData,
+                                            const OfxRectI& srcBounds,
+                                            PixelComponentEnum srcPixelComponents,
+                                            int srcPixelComponentCount,
+                                            BitDepthEnum srcBitDepth,
+                                            int srcRowBytes,
+                                            void *dstPixelData,
+                                            const OfxRectI& dstBounds,
+                                            PixelComponentEnum dstPixelComponents,
+                                            int dstPixelComponentCount,
+                                            BitDepthEnum dstBitDepth,
+                                            int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
     if (!unpremult && !premult && !maskmix) {
         copyPixels(*this, renderWindow,
                    srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                    dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if (unpremult && !premult && !maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierUnPremult<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierUnPremult<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && !premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierMaskMix<float, 4, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 4, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierMaskMix<float, 3, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 3, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierMaskMix<float, 1, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 1, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierPremultMaskMix<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierPremultMaskMix<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierPremultMaskMix<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow,
                          srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes,
                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
@@ -499,7 +517,48 @@ OCIOLogConvertPlugin::copyPixelData(bool unpremult,
     } else {
         assert(false); // should never happen
     }
-} // OCIOLogConvertPlugin::copyPixelData
+}
+
+void
+OCIOLogConvertPlugin::copyPixelData(bool unpremult,
+                                    bool premult,
+                                    bool maskmix,
+                                    double time,
+                                    const OfxRectI& renderWindow,
+                                    const void *srcPixelData,
+                                    const OfxRectI& srcBounds,
+                                    PixelComponentEnum srcPixelComponents,
+                                    int srcPixelComponentCount,
+                                    BitDepthEnum srcBitDepth,
+                                    int srcRowBytes,
+                                    void *dstPixelData,
+                                    const OfxRectI& dstBounds,
+                                    PixelComponentEnum dstPixelComponents,
+                                    int dstPixelComponentCount,
+                                    BitDepthEnum dstBitDepth,
+                                    int dstRowBytes)
+{
+    assert(srcPixelData && dstPixelData);
+    // do the rendering
+    if ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    switch (dstBitDepth) {
+    case eBitDepthUByte:
+        copyPixelDataForDepth<unsigned char, 255>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        copyPixelDataForDepth<unsigned short, 65535>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        copyPixelDataForDepth<float, 1>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+}
 
 OCIO::ConstProcessorRcPtr
 OCIOLogConvertPlugin::getProcessor(OfxTime time)
@@ -507,21 +566,32 @@ OCIOLogConvertPlugin::getProcessor(OfxTime time)
     int mode_i = _mode->getValueAtTime(time);
 
     try {
+        if (!_config) {
+            throw std::runtime_error("OCIO: no current config");
+        }
+        string description("LogConvert");
+        OCIOProcessorCache::appendKey(&description, mode_i);
+        const string key = OCIOProcessorCache::getKey(_config, _config->getCurrentContext(), description);
         GenericOCIO::AutoMutex guard(_procMutex);
-        if ( !_proc ||
-             ( _procMode != mode_i) ) {
-            const char * src = 0;
-            const char * dst = 0;
-
-            if (mode_i == 0) {
-                src = OCIO::ROLE_COMPOSITING_LOG;
-                dst = OCIO::ROLE_SCENE_LINEAR;
-            } else {
-                src = OCIO::ROLE_SCENE_LINEAR;
-                dst = OCIO::ROLE_COMPOSITING_LOG;
-            }
+        if ( !_proc || (_procKey != key) ) {
+            OCIOProcessorCache& cache = OCIOProcessorCache::instance();
+            _proc = cache.get(key);
+            if (!_proc) {
+                const char * src = 0;
+                const char * dst = 0;
+
+                if (mode_i == 0) {
+                    src = OCIO::ROLE_COMPOSITING_LOG;
+                    dst = OCIO::ROLE_SCENE_LINEAR;
+                } else {
+                    src = OCIO::ROLE_SCENE_LINEAR;
+                    dst = OCIO::ROLE_COMPOSITING_LOG;
+                }
 
-            _proc = _config->getProcessor(src, dst);
+                _proc = _config->getProcessor(src, dst);
+                cache.set(key, _proc);
+            }
+            _procKey = key;
         }
     } catch (const OCIO::Exception &e) {
         setPersistentMessage( Message::eMessageError, "", e.what() );
@@ -534,10 +604,11 @@ OCIOLogConvertPlugin::getProcessor(OfxTime time)
 void
 OCIOLogConvertPlugin::apply(double time,
                             const OfxRectI& renderWindow,
-                            float *pixelData,
+                            void *pixelData,
                             const OfxRectI& bounds,
                             PixelComponentEnum pixelComponents,
                             int pixelComponentCount,
+                            BitDepthEnum bitDepth,
                             int rowBytes)
 {
     // are we in the image bounds
@@ -551,9 +622,13 @@ OCIOLogConvertPlugin::apply(double time,
 
     OCIOProcessor processor(*this);
     // set the images
-    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
 
-    processor.setProcessor( getProcessor(time) );
+    OCIO::ConstProcessorRcPtr proc = getProcessor(time);
+    processor.setProcessor(proc);
+    // the shaper is built from the allocation of the source role
+    const char* src = (_mode->getValueAtTime(time) == 0) ? OCIO::ROLE_COMPOSITING_LOG : OCIO::ROLE_SCENE_LINEAR;
+    processor.setBakedLut( GenericOCIO::getFastCPULut(_fastCPU, time, _config, src, proc, &_bakedLut) );
 
     // set the render window
     processor.setRenderWindow(renderWindow);
@@ -662,7 +737,7 @@ OCIOLogConvertPlugin::renderGPU(const RenderArguments &args)
     BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
     PixelComponentEnum srcComponents = srcImg->getPixelComponents();
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -790,7 +865,7 @@ OCIOLogConvertPlugin::render(const RenderArguments &args)
     }
 
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -827,7 +902,7 @@ OCIOLogConvertPlugin::render(const RenderArguments &args)
     int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
     ImageMemory mem(memSize, this);
-    float *tmpPixelData = (float*)mem.lock();
+    void *tmpPixelData = mem.lock();
     bool premult;
     _premult->getValueAtTime(args.time, premult);
 
@@ -835,7 +910,7 @@ OCIOLogConvertPlugin::render(const RenderArguments &args)
     copyPixelData(premult, false, false, args.time, args.renderWindow, srcPixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, srcRowBytes, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     ///do the color-space conversion
-    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
+    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     // copy the color-converted window
     copyPixelData( false, premult, true, args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes, dstImg.get() );
@@ -944,6 +1019,9 @@ OCIOLogConvertPlugin::changedParam(const InstanceChangedArgs &args,
             }
         }
         sendMessage(Message::eMessageMessage, "", msg);
+    } else if ( (paramName == kOCIOParamFastCPUError) && (args.reason == eChangeUserEdit) ) {
+        const char* src = (_mode->getValueAtTime(args.time) == 0) ? OCIO::ROLE_COMPOSITING_LOG : OCIO::ROLE_SCENE_LINEAR;
+        GenericOCIO::showFastCPUError( this, _config, src, getProcessor(args.time) );
 #ifdef OFX_SUPPORTS_OPENGLRENDER
     } else if (paramName == kParamEnableGPU) {
         bool supportsGL = _enableGPU->getValueAtTime(args.time);
@@ -993,6 +1071,8 @@ OCIOLogConvertPluginFactory::describe(ImageEffectDescriptor &desc)
     desc.addSupportedContext(eContextPaint);
 
     // add supported pixel depths
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
     desc.setSupportsTiles(kSupportsTiles);
@@ -1117,6 +1197,8 @@ OCIOLogConvertPluginFactory::describeInContext(ImageEffectDescriptor &desc,
     }
 #endif
 
+    GenericOCIO::describeInContextFastCPU(desc, context, page);
+
     ofxsPremultDescribeParams(desc, page);
     ofxsMaskMixDescribeParams(desc, page);
 
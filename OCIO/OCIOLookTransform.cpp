@@ -279,6 +279,25 @@ private:
                        BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
+    template <class PIX, int maxValue>
+    void copyPixelDataForDepth(bool unpremult,
+                               bool premult,
+                               bool maskmix,
+                               double time,
+                               const OfxRectI &renderWindow,
+                               const void *srcPixelData,
+                               const OfxRectI& srcBounds,
+                               PixelComponentEnum srcPixelComponents,
+                               int srcPixelComponentCount,
+                               BitDepthEnum srcPixelDepth,
+                               int srcRowBytes,
+                               void *dstPixelData,
+                               const OfxRectI& dstBounds,
+                               PixelComponentEnum dstPixelComponents,
+                               int dstPixelComponentCount,
+                               BitDepthEnum dstBitDepth,
+                               int dstRowBytes);
+
     void setupAndCopy(PixelProcessorFilterBase & processor,
                       double time,
                       const OfxRectI &renderWindow,
@@ -295,7 +314,7 @@ private:
                       BitDepthEnum dstPixelDepth,
                       int dstRowBytes);
 
-    void apply(double time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    void apply(double time, const OfxRectI& renderWindow, void *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, BitDepthEnum bitDepth, int rowBytes);
 
     // do not need to delete these, the ImageEffect is managing them for us
     Clip *_dstClip;
@@ -312,15 +331,14 @@ private:
     BooleanParam* _maskApply;
     BooleanParam* _maskInvert;
     BooleanParam* _enableGPU;
+    BooleanParam* _fastCPU;
 
     auto_ptr<GenericOCIO> _ocio;
 
     GenericOCIO::Mutex _procMutex;
     OCIO::ConstProcessorRcPtr _proc;
-    string _procLook;
-    string _procInputSpace;
-    string _procOutputSpace;
-    int _procDirection;
+    string _procKey; // the OCIOProcessorCache key of _proc
+    OCIOBakedLutRef _bakedLut; // the baked version of _proc (see kOCIOParamFastCPU)
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     OCIOOpenGLContextData* _openGLContextData; // (OpenGL-only) - the single openGL context, in case the host does not support kNatronOfxImageEffectPropOpenGLContextData
@@ -343,8 +361,8 @@ OCIOLookTransformPlugin::OCIOLookTransformPlugin(OfxImageEffectHandle handle)
     , _maskApply(NULL)
     , _maskInvert(NULL)
     , _enableGPU(NULL)
+    , _fastCPU(NULL)
     , _ocio( new GenericOCIO(this) )
-    , _procDirection(-1)
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     , _openGLContextData(NULL)
 #endif
@@ -372,6 +390,8 @@ OCIOLookTransformPlugin::OCIOLookTransformPlugin(OfxImageEffectHandle handle)
     _maskApply = paramExists(kParamMaskApply) ? fetchBooleanParam(kParamMaskApply) : 0;
     _maskInvert = fetchBooleanParam(kParamMaskInvert);
     assert(_mix && _maskInvert);
+    _fastCPU = fetchBooleanParam(kOCIOParamFastCPU);
+    assert(_fastCPU);
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     _enableGPU = fetchBooleanParam(kParamEnableGPU);
@@ -475,65 +495,60 @@ OCIOLookTransformPlugin::setupAndCopy(PixelProcessorFilterBase & processor,
     processor.process();
 }
 
+template <class PIX, int maxValue>
 void
-OCIOLookTransformPlugin::copyPixelData(bool unpremult,
-                                       bool premult,
-                                       bool maskmix,
-                                       double time,
-                                       const OfxRectI& renderWindow,
-                                       const void *srcPixelData,
-                                       const OfxRectI& srcBounds,
-                                       PixelComponentEnum srcPixelComponents,
-                                       int srcPixelComponentCount,
-                                       BitDepthEnum srcPixelDepth,
-                                       int srcRowBytes,
-                                       void *dstPixelData,
-                                       const OfxRectI& dstBounds,
-                                       PixelComponentEnum dstPixelComponents,
-                                       int dstPixelComponentCount,
-                                       BitDepthEnum dstBitDepth,
-                                       int dstRowBytes)
+OCIOLookTransformPlugin::copyPixelDataForDepth(bool unpremult,
+                                               bool premult,
+                                               bool maskmix,
+                                               double time,
+                                               const OfxRectI& renderWindow,
+                                               const void *srcPixelData,
+                                               const OfxRectI& srcBounds,
+                                               PixelComponentEnum srcPixelComponents,
+                                               int srcPixelComponentCount,
+                                               BitDepthEnum srcPixelDepth,
+                                               int srcRowBytes,
+                                               void *dstPixelData,
+                                               const OfxRectI& dstBounds,
+                                               PixelComponentEnum dstPixelComponents,
+                                               int dstPixelComponentCount,
+                                               BitDepthEnum dstBitDepth,
+                                               int dstRowBytes)
 {
     assert(srcPixelData && dstPixelData);
-    // do the rendering
-    if ( (dstBitDepth != eBitDepthFloat) || ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) ) {
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
     if (!unpremult && !premult && !maskmix) {
         copyPixels(*this, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     } else if (unpremult && !premult && !maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierUnPremult<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierUnPremult<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierUnPremult<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierUnPremult<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && !premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierMaskMix<float, 4, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 4, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierMaskMix<float, 3, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 3, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierMaskMix<float, 1, 1, true> fred(*this);
+            PixelCopierMaskMix<PIX, 1, maxValue, true> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else if (!unpremult && premult && maskmix) {
         if (dstPixelComponents == ePixelComponentRGBA) {
-            PixelCopierPremultMaskMix<float, 4, 1, float, 4, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 4, maxValue, PIX, 4, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } else if (dstPixelComponents == ePixelComponentRGB) {
-            PixelCopierPremultMaskMix<float, 3, 1, float, 3, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 3, maxValue, PIX, 3, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         }  else if (dstPixelComponents == ePixelComponentAlpha) {
-            PixelCopierPremultMaskMix<float, 1, 1, float, 1, 1> fred(*this);
+            PixelCopierPremultMaskMix<PIX, 1, maxValue, PIX, 1, maxValue> fred(*this);
             setupAndCopy(fred, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
         } // switch
     } else {
@@ -541,6 +556,47 @@ OCIOLookTransformPlugin::copyPixelData(bool unpremult,
     }
 }
 
+void
+OCIOLookTransformPlugin::copyPixelData(bool unpremult,
+                                       bool premult,
+                                       bool maskmix,
+                                       double time,
+                                       const OfxRectI& renderWindow,
+                                       const void *srcPixelData,
+                                       const OfxRectI& srcBounds,
+                                       PixelComponentEnum srcPixelComponents,
+                                       int srcPixelComponentCount,
+                                       BitDepthEnum srcPixelDepth,
+                                       int srcRowBytes,
+                                       void *dstPixelData,
+                                       const OfxRectI& dstBounds,
+                                       PixelComponentEnum dstPixelComponents,
+                                       int dstPixelComponentCount,
+                                       BitDepthEnum dstBitDepth,
+                                       int dstRowBytes)
+{
+    assert(srcPixelData && dstPixelData);
+    // do the rendering
+    if ( (dstPixelComponents != ePixelComponentRGBA) && (dstPixelComponents != ePixelComponentRGB) && (dstPixelComponents != ePixelComponentAlpha) ) {
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+    switch (dstBitDepth) {
+    case eBitDepthUByte:
+        copyPixelDataForDepth<unsigned char, 255>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthUShort:
+        copyPixelDataForDepth<unsigned short, 65535>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    case eBitDepthFloat:
+        copyPixelDataForDepth<float, 1>(unpremult, premult, maskmix, time, renderWindow, srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcPixelDepth, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+    }
+}
+
 OCIO::ConstProcessorRcPtr
 OCIOLookTransformPlugin::getProcessor(OfxTime time,
                                       bool singleLook,
@@ -567,31 +623,39 @@ OCIOLookTransformPlugin::getProcessor(OfxTime time,
     string outputSpace;
     _ocio->getOutputColorspaceAtTime(time, outputSpace);
     try {
+        string description("Look");
+        OCIOProcessorCache::appendKey(&description, look);
+        OCIOProcessorCache::appendKey(&description, inputSpace);
+        OCIOProcessorCache::appendKey(&description, outputSpace);
+        OCIOProcessorCache::appendKey(&description, directioni);
+        const string key = OCIOProcessorCache::getKey(config, config->getCurrentContext(), description);
         GenericOCIO::AutoMutex guard(_procMutex);
-        if ( !_proc ||
-             ( _procLook != look) ||
-             ( _procInputSpace != inputSpace) ||
-             ( _procOutputSpace != outputSpace) ||
-             ( _procDirection != directioni) ) {
-            OCIO::TransformDirection direction = OCIO::TRANSFORM_DIR_UNKNOWN;
-            OCIO::LookTransformRcPtr transform = OCIO::LookTransform::Create();
-            transform->setLooks( look.c_str() );
-
-            if (directioni == 0) {
-                transform->setSrc( inputSpace.c_str() );
-                transform->setDst( outputSpace.c_str() );
-                direction = OCIO::TRANSFORM_DIR_FORWARD;
-            } else {
-                // The TRANSFORM_DIR_INVERSE applies an inverse for the end-to-end transform,
-                // which would otherwise do dst->inv look -> src.
-                // This is an unintuitive result for the artist (who would expect in, out to
-                // remain unchanged), so we account for that here by flipping src/dst
-
-                transform->setSrc( outputSpace.c_str() );
-                transform->setDst( inputSpace.c_str() );
-                direction = OCIO::TRANSFORM_DIR_INVERSE;
+        if ( !_proc || (_procKey != key) ) {
+            OCIOProcessorCache& cache = OCIOProcessorCache::instance();
+            _proc = cache.get(key);
+            if (!_proc) {
+                OCIO::TransformDirection direction = OCIO::TRANSFORM_DIR_UNKNOWN;
+                OCIO::LookTransformRcPtr transform = OCIO::LookTransform::Create();
+                transform->setLooks( look.c_str() );
+
+                if (directioni == 0) {
+                    transform->setSrc( inputSpace.c_str() );
+                    transform->setDst( outputSpace.c_str() );
+                    direction = OCIO::TRANSFORM_DIR_FORWARD;
+                } else {
+                    // The TRANSFORM_DIR_INVERSE applies an inverse for the end-to-end transform,
+                    // which would otherwise do dst->inv look -> src.
+                    // This is an unintuitive result for the artist (who would expect in, out to
+                    // remain unchanged), so we account for that here by flipping src/dst
+
+                    transform->setSrc( outputSpace.c_str() );
+                    transform->setDst( inputSpace.c_str() );
+                    direction = OCIO::TRANSFORM_DIR_INVERSE;
+                }
+                _proc = config->getProcessor(transform, direction);
+                cache.set(key, _proc);
             }
-            _proc = config->getProcessor(transform, direction);
+            _procKey = key;
         }
 
         return _proc;
@@ -606,10 +670,11 @@ OCIOLookTransformPlugin::getProcessor(OfxTime time,
 void
 OCIOLookTransformPlugin::apply(double time,
                                const OfxRectI& renderWindow,
-                               float *pixelData,
+                               void *pixelData,
                                const OfxRectI& bounds,
                                PixelComponentEnum pixelComponents,
                                int pixelComponentCount,
+                               BitDepthEnum bitDepth,
                                int rowBytes)
 {
     // are we in the image bounds
@@ -630,10 +695,14 @@ OCIOLookTransformPlugin::apply(double time,
         return; // isIdentity
     }
 
-    processor.setProcessor( getProcessor(time, singleLook, lookCombination) );
+    OCIO::ConstProcessorRcPtr proc = getProcessor(time, singleLook, lookCombination);
+    processor.setProcessor(proc);
+    string inputSpace;
+    _ocio->getInputColorspaceAtTime(time, inputSpace);
+    processor.setBakedLut( GenericOCIO::getFastCPULut(_fastCPU, time, _ocio->getConfig(), inputSpace, proc, &_bakedLut) );
 
     // set the images
-    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
 
 
     // set the render window
@@ -742,7 +811,7 @@ OCIOLookTransformPlugin::renderGPU(const RenderArguments &args)
     BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
     PixelComponentEnum srcComponents = srcImg->getPixelComponents();
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -877,7 +946,7 @@ OCIOLookTransformPlugin::render(const RenderArguments &args)
     }
 
     BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
-    if ( (dstBitDepth != eBitDepthFloat) || (dstBitDepth != srcBitDepth) ) {
+    if ( ( (dstBitDepth != eBitDepthFloat) && (dstBitDepth != eBitDepthUShort) && (dstBitDepth != eBitDepthUByte) ) || (dstBitDepth != srcBitDepth) ) {
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -914,7 +983,7 @@ OCIOLookTransformPlugin::render(const RenderArguments &args)
     int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
     size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
     ImageMemory mem(memSize, this);
-    float *tmpPixelData = (float*)mem.lock();
+    void *tmpPixelData = mem.lock();
     bool premult;
     _premult->getValueAtTime(args.time, premult);
 
@@ -922,7 +991,7 @@ OCIOLookTransformPlugin::render(const RenderArguments &args)
     copyPixelData(premult, false, false, args.time, args.renderWindow, srcPixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, srcRowBytes, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     ///do the color-space conversion
-    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
+    apply(args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     // copy the color-converted window and apply masking
     copyPixelData( false, premult, true, args.time, args.renderWindow, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes, dstImg.get() );
@@ -1004,6 +1073,13 @@ OCIOLookTransformPlugin::changedParam(const InstanceChangedArgs &args,
         _lookChoice->setEvaluateOnChange(singleLook);
         _lookCombination->setEnabled(!singleLook);
         _lookCombination->setEvaluateOnChange(!singleLook);
+    } else if ( (paramName == kOCIOParamFastCPUError) && (args.reason == eChangeUserEdit) ) {
+        bool singleLook = _singleLook->getValueAtTime(args.time);
+        string lookCombination;
+        _lookCombination->getValueAtTime(args.time, lookCombination);
+        string inputSpace;
+        _ocio->getInputColorspaceAtTime(args.time, inputSpace);
+        GenericOCIO::showFastCPUError( this, _ocio->getConfig(), inputSpace, getProcessor(args.time, singleLook, lookCombination) );
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     } else if (paramName == kParamEnableGPU) {
         bool supportsGL = _enableGPU->getValueAtTime(args.time);
@@ -1072,6 +1148,8 @@ OCIOLookTransformPluginFactory::describe(ImageEffectDescriptor &desc)
     desc.addSupportedContext(eContextPaint);
 
     // add supported pixel depths
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
     desc.setSupportsTiles(kSupportsTiles);
@@ -1214,6 +1292,8 @@ OCIOLookTransformPluginFactory::describeInContext(ImageEffectDescriptor &desc,
     }
 #endif
 
+    GenericOCIO::describeInContextFastCPU(desc, context, page);
+
     ofxsPremultDescribeParams(desc, page);
     ofxsMaskMixDescribeParams(desc, page);
 } // OCIOLookTransformPluginFactory::describeInContext
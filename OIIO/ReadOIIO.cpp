@@ -22,6 +22,8 @@
  */
 
 #include <iostream>
+#include <list>
+#include <map>
 #include <set>
 #include <sstream>
 #include <fstream>
@@ -49,10 +51,19 @@ GCC_DIAG_ON(unused-parameter)
 #include "GenericOCIO.h"
 #include "GenericReader.h"
 #include "IOUtility.h"
+#include "FileHandleCache.h"
+#include "MappedFile.h"
+
+#if OIIO_VERSION >= 20100
+GCC_DIAG_OFF(unused-parameter)
+#include <OpenImageIO/filesystem.h>
+GCC_DIAG_ON(unused-parameter)
+#endif
 
 #include <ofxsCoords.h>
 #include <ofxsMultiPlane.h>
 #include "ofxsMultiThread.h"
+#include "tinythread.h"
 #ifdef OFX_USE_MULTITHREAD_MUTEX
 namespace {
 typedef OFX::MultiThread::Mutex Mutex;
@@ -321,6 +332,84 @@ typedef vector< pair<string, LayersMap> > ViewsLayersMap;
 // <layer name, extended layer info>
 typedef vector<pair<string, LayerUnionData> > LayersUnionVect;
 
+/**
+ * @brief An ImageInput opened without the OIIO cache, and the specs of its subimages.
+ * It is kept open by the FileHandleCache between renders, and checked out by one thread at a time,
+ * since an ImageInput is not thread safe.
+ **/
+class OIIOFile
+    : public FileHandleCache::Handle
+{
+public:
+    OIIOFile()
+        : img(NULL)
+        , subimages()
+        , mappedFile()
+#if OIIO_VERSION >= 20100
+        , ioProxy(NULL)
+#endif
+    {
+    }
+
+    virtual ~OIIOFile()
+    {
+        if (img) {
+            img->close();
+            delete img;
+        }
+#if OIIO_VERSION >= 20100
+        // the ImageInput reads from the proxy until it is closed
+        delete ioProxy;
+#endif
+    }
+
+    // the scanline or tile buffers of the readers: count 32 scanlines (an EXR line block) or one row of tiles per subimage
+    virtual std::size_t getMemorySize() const OVERRIDE FINAL
+    {
+        std::size_t size = sizeof(OIIOFile);
+
+        for (std::size_t i = 0; i < subimages.size(); ++i) {
+            const ImageSpec& spec = subimages[i];
+            size += (std::size_t)spec.scanline_bytes() * std::max(spec.tile_height, 32);
+        }
+
+        return size;
+    }
+
+    /**
+     * @brief Get the spec of a MIP level of a subimage, which is read from the file only once.
+     * Returns false if the subimage has no such level.
+     **/
+    bool getLevelSpec(int subimage,
+                      int level,
+                      ImageSpec* spec)
+    {
+        const std::pair<int, int> key(subimage, level);
+        std::map<std::pair<int, int>, ImageSpec>::const_iterator found = levelSpecs.find(key);
+
+        if ( found == levelSpecs.end() ) {
+            ImageSpec levelSpec;
+            if ( !img->seek_subimage(subimage, level, levelSpec) ) {
+                levelSpec = ImageSpec(); // width is 0
+            }
+            found = levelSpecs.insert( std::make_pair(key, levelSpec) ).first;
+        }
+        *spec = found->second;
+
+        return spec->width > 0;
+    }
+
+    ImageInput* img;
+    vector<ImageSpec> subimages;
+    std::map<std::pair<int, int>, ImageSpec> levelSpecs; // the MIP level specs already read by getLevelSpec(), by (subimage, level)
+    MappedFile mappedFile; // if mappings are enabled, local files are read through a memory mapping, if the format supports it
+#if OIIO_VERSION >= 20100
+    Filesystem::IOProxy* ioProxy; // reads from mappedFile
+#endif
+};
+
+typedef FileHandleCache::Checkout<OIIOFile> OIIOFileCheckout;
+
 class ReadOIIOPlugin
     : public GenericReaderPlugin
 {
@@ -404,18 +493,82 @@ private:
         decodePlane(filename, time, view, isPlayback, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComps, rowBytes);
     }
 
-    virtual void decodePlane(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
-                             PixelComponentEnum pixelComponents, int pixelComponentCount, const string& rawComponents, int rowBytes) OVERRIDE FINAL;
+    virtual void decodePlane(const string& filename, OfxTime /*time*/, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                             PixelComponentEnum pixelComponents, int pixelComponentCount, const string& rawComponents, int rowBytes) OVERRIDE FINAL
+    {
+        decodePlaneLevel(filename, view, isPlayback, 0, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+    }
+
+    virtual void decodeFileMipmapLevel(const string& filename, OfxTime /*time*/, int view, bool isPlayback, unsigned int level, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                                       PixelComponentEnum pixelComponents, int pixelComponentCount, const string& rawComponents, int rowBytes) OVERRIDE FINAL
+    {
+        decodePlaneLevel(filename, view, isPlayback, (int)level, renderWindow, pixelData, bounds, pixelComponents, pixelComponentCount, rawComponents, rowBytes);
+    }
+
+    void decodePlaneLevel(const string& filename, int view, bool isPlayback, int miplevel, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                          PixelComponentEnum pixelComponents, int pixelComponentCount, const string& rawComponents, int rowBytes);
+
+    virtual unsigned int getFileMipmapLevel(const string& filename, OfxTime time, int view, unsigned int maxLevel, OfxRectI* bounds, int* tile_width, int* tile_height) OVERRIDE FINAL;
+
+    virtual void beginDecodePlanes(const string& filename, OfxTime time, int view, const std::list<PlaneToRender>& planes) OVERRIDE FINAL;
+    virtual void endDecodePlanes() OVERRIDE FINAL;
+
+    /**
+     * @brief The planes of a frame being rendered by one thread, between beginDecodePlanes() and endDecodePlanes().
+     * The file is opened once, and the channels of all the planes that are in the same subimage are read
+     * with a single read_scanlines()/read_tiles() call: decodePlane() then copies its channels from there.
+     **/
+    struct PlaneBatch
+    {
+        struct Pixels
+        {
+            int subImageIndex;
+            int miplevel;
+            int chbegin; // first OIIO channel read
+            int nChannels;
+            OfxRectI window;
+            vector<float> data; // flipped vertically, like the images passed to decodePlane()
+        };
+
+        string filename;
+        OfxTime time;
+        int view;
+        vector<pair<PixelComponentEnum, string> > planes;
+        bool opened;
+        bool useCache;
+        OIIOFileCheckout file; // empty if the OIIO cache is used
+        vector<ImageSpec> subimages;
+        std::list<Pixels> pixels;
+    };
+
+    PlaneBatch* getPlaneBatch(const string& filename, int view);
+
+    void decodePlaneFromBatch(PlaneBatch& batch, bool useCache, int miplevel, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds,
+                              PixelComponentEnum pixelComponents, const string& rawComponents, int rowBytes);
+
+    void getPlaneChannels(const string& filename, int view, PixelComponentEnum pixelComponents, const string& rawComponents, const vector<ImageSpec>& subimages, vector<int>& channels, int& numChannels, int& subImageIndex);
+
+    void readPixels(const string& filename, ImageInput* img, bool useCache, vector<ImageSpec>& subimages, int subImageIndex, int miplevel, const vector<int>& channels, int numChannels,
+                    const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, int rowBytes);
 
     void getOIIOChannelIndexesFromLayerName(const string& filename, int view, const string& layerName, PixelComponentEnum pixelComponents, const vector<ImageSpec>& subimages, vector<int>& channels, int& numChannels, int& subImageIndex);
 
-    void openFile(const string& filename, bool useCache, ImageInput** img, vector<ImageSpec>* subimages);
+    void openFile(const string& filename, bool useCache, OIIOFileCheckout* file, vector<ImageSpec>* subimages);
+
+    // open a file for the FileHandleCache, arg is the config
+    static FileHandleCache::Handle* createFile(const string& filename, void* arg);
+
+    // check out the file opened with the current config from the FileHandleCache, rather than opening it
+    // and parsing its header each time
+    bool checkoutFile(const string& filename, OIIOFileCheckout* file) const;
 
     virtual bool getFrameBounds(const string& filename, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, string *error,  int* tile_width, int* tile_height) OVERRIDE FINAL;
 
+    virtual bool getHeaderCacheKey(string* key) const OVERRIDE FINAL;
+
     string metadata(const string& filename);
 
-    void getSpecsFromImageInput(ImageInput* img, vector<ImageSpec>* subimages) const;
+    static void getSpecsFromImageInput(ImageInput* img, vector<ImageSpec>* subimages);
 
     void getSpecsFromCache(const string& filename, vector<ImageSpec>* subimages) const;
 
@@ -459,6 +612,8 @@ private:
     string _lastFileReadNoPlayback;
     Mutex _outputLayerMenuMutex;
     LayersUnionVect _outputLayerMenu;
+    Mutex _planeBatchesMutex;
+    std::map<tthread::thread::id, PlaneBatch*> _planeBatches; // the plane batch of each rendering thread
 };
 
 ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
@@ -481,6 +636,8 @@ ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
     , _lastFileReadNoPlayback()
     , _outputLayerMenuMutex()
     , _outputLayerMenu()
+    , _planeBatchesMutex()
+    , _planeBatches()
 {
 #ifdef OFX_READ_OIIO_USES_CACHE
     if (useOIIOCache) {
@@ -524,6 +681,12 @@ ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
 
 ReadOIIOPlugin::~ReadOIIOPlugin()
 {
+    // endDecodePlanes() should have been called by each render
+    assert( _planeBatches.empty() );
+    for (std::map<tthread::thread::id, PlaneBatch*>::iterator it = _planeBatches.begin(); it != _planeBatches.end(); ++it) {
+        delete it->second;
+    }
+    FileHandleCache::instance().purge(this);
     if (_cache) {
 #     ifdef OFX_READ_OIIO_SHARED_CACHE
         ImageCache::destroy(_cache); // don't teardown if it's a shared cache
@@ -536,6 +699,7 @@ ReadOIIOPlugin::~ReadOIIOPlugin()
 void
 ReadOIIOPlugin::clearAnyCache()
 {
+    FileHandleCache::instance().purge(this);
     if (_cache) {
         ///flush the OIIO cache
         _cache->invalidate_all(true);
@@ -610,6 +774,8 @@ ReadOIIOPlugin::changedParam(const InstanceChangedArgs &args,
         }
         sendMessage( Message::eMessageMessage, "", ss.str() );
     } else if ( _outputLayerString && (paramName == kParamChannelOutputLayer) ) {
+        // the decoded color plane comes from another layer
+        clearDecodedFrames();
         int index;
         _outputLayer->getValue(index);
         string optionName;
@@ -646,6 +812,9 @@ ReadOIIOPlugin::changedParam(const InstanceChangedArgs &args,
                (paramName == kParamRawExposure) ||
                (paramName == kParamRawDemosaic)) {
         // advanced parameters changed, invalidate the cache entries for the whole sequence
+        clearDecodedFrames();
+        // the open files were opened with the previous config
+        FileHandleCache::instance().purge(this);
         if (_cache) {
             OfxRangeD range;
             getTimeDomain(range);
@@ -1235,7 +1404,7 @@ ReadOIIOPlugin::buildOutputLayerMenu(const vector<ImageSpec>& subimages)
 
 void
 ReadOIIOPlugin::getSpecsFromImageInput(ImageInput* img,
-                                       vector<ImageSpec>* subimages) const
+                                       vector<ImageSpec>* subimages)
 {
     subimages->clear();
     int subImageIndex = 0;
@@ -1288,20 +1457,15 @@ ReadOIIOPlugin::getSpecs(const string &filename,
         gotSpec = true;
     }
     if (!gotSpec) {
-        // use the right config
-        ImageSpec config;
-        getConfig(&config);
-        
-        auto_ptr<ImageInput> img( ImageInput::open(filename, &config) );
-        if ( !img.get() ) {
+        OIIOFileCheckout file;
+        if ( !checkoutFile(filename, &file) ) {
             if (error) {
                 *error = "Could node open file " + filename;
             }
 
             return;
         }
-        getSpecsFromImageInput(img.get(), subimages);
-        img->close();
+        *subimages = file->subimages;
     }
     if ( subimages->empty() ) {
         if (error) {
@@ -1854,10 +2018,71 @@ ReadOIIOPlugin::getConfig(ImageSpec* config) const
     }
 }
 
+FileHandleCache::Handle*
+ReadOIIOPlugin::createFile(const string& filename,
+                           void* arg)
+{
+    const ImageSpec* config = (const ImageSpec*)arg;
+    auto_ptr<OIIOFile> file(new OIIOFile);
+
+#if OIIO_VERSION >= 20100
+    // The readers that support an IOProxy (OpenEXR, PNG, ...) can read local files from a memory mapping,
+    // which avoids a copy and a system call per chunk.
+    if ( file->mappedFile.open(filename) ) {
+        ImageInput::unique_ptr img = ImageInput::create(filename);
+        if ( img && img->supports("ioproxy") ) {
+            file->ioProxy = new Filesystem::IOMemReader( (void*)file->mappedFile.data(), file->mappedFile.size() );
+            ImageSpec proxyConfig;
+            if (config) {
+                proxyConfig = *config;
+            }
+            proxyConfig.attribute("oiio:ioproxy", TypeDesc::PTR, &file->ioProxy);
+            ImageSpec spec;
+            if ( img->open(filename, spec, proxyConfig) ) {
+                file->img = img.release();
+            }
+        }
+        if (!file->img) {
+            // read the file normally
+            img.reset();
+            delete file->ioProxy;
+            file->ioProxy = NULL;
+            file->mappedFile.close();
+        }
+    }
+#endif
+    if (!file->img) {
+#if OIIO_VERSION >= 20000
+        file->img = ImageInput::open(filename, config).release();
+#else
+        file->img = ImageInput::open(filename, config);
+#endif
+    }
+    if (!file->img) {
+        return NULL;
+    }
+    getSpecsFromImageInput(file->img, &file->subimages);
+
+    return file.release();
+}
+
+bool
+ReadOIIOPlugin::checkoutFile(const string& filename,
+                             OIIOFileCheckout* file) const
+{
+    // use the right config
+    ImageSpec config;
+
+    getConfig(&config);
+    file->reset( static_cast<OIIOFile*>( FileHandleCache::instance().checkout(this, filename, createFile, &config) ) );
+
+    return file->get() != NULL;
+}
+
 void
 ReadOIIOPlugin::openFile(const string& filename,
                          bool useCache,
-                         ImageInput** img,
+                         OIIOFileCheckout* file,
                          vector<ImageSpec>* subimages)
 {
     if (_cache && useCache) {
@@ -1866,18 +2091,13 @@ ReadOIIOPlugin::openFile(const string& filename,
         return;
     }
 
-    // use the right config
-    ImageSpec config;
-    getConfig(&config);
-
-    *img = ImageInput::open(filename, &config);
-    if ( !(*img) ) {
+    if ( !checkoutFile(filename, file) ) {
         setPersistentMessage(Message::eMessageError, "", string("Cannot open file ") + filename);
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
     }
-    getSpecsFromImageInput(*img, subimages);
+    *subimages = (*file)->subimages;
 }
 
 void
@@ -2037,17 +2257,17 @@ ReadOIIOPlugin::getOIIOChannelIndexesFromLayerName(const string& filename,
 } // ReadOIIOPlugin::getOIIOChannelIndexesFromLayerName
 
 void
-ReadOIIOPlugin::decodePlane(const string& filename,
-                            OfxTime /*time*/,
-                            int view,
-                            bool isPlayback,
-                            const OfxRectI& renderWindow,
-                            float *pixelData,
-                            const OfxRectI& bounds,
-                            PixelComponentEnum pixelComponents,
-                            int pixelComponentCount,
-                            const string& rawComponents,
-                            int rowBytes)
+ReadOIIOPlugin::decodePlaneLevel(const string& filename,
+                                 int view,
+                                 bool isPlayback,
+                                 int miplevel,
+                                 const OfxRectI& renderWindow,
+                                 float *pixelData,
+                                 const OfxRectI& bounds,
+                                 PixelComponentEnum pixelComponents,
+                                 int pixelComponentCount,
+                                 const string& rawComponents,
+                                 int rowBytes)
 {
     unused(pixelComponentCount);
 #if OIIO_VERSION >= 10605
@@ -2073,16 +2293,19 @@ ReadOIIOPlugin::decodePlane(const string& filename,
         return;
     }
 
+    PlaneBatch* batch = getPlaneBatch(filename, view);
+    if (batch) {
+        decodePlaneFromBatch(*batch, useCache, miplevel, renderWindow, pixelData, bounds, pixelComponents, rawComponents, rowBytes);
+
+        return;
+    }
+
     vector<int> channels;
     int numChannels = 0;
-    auto_ptr<ImageInput> img;
+    OIIOFileCheckout file;
     vector<ImageSpec> subimages;
 
-    ImageInput* rawImg = 0;
-    openFile(filename, useCache, &rawImg, &subimages);
-    if (rawImg) {
-        img.reset(rawImg);
-    }
+    openFile(filename, useCache, &file, &subimages);
 
     if ( subimages.empty() ) {
         setPersistentMessage(Message::eMessageError, "", string("Cannot open file ") + filename);
@@ -2092,6 +2315,24 @@ ReadOIIOPlugin::decodePlane(const string& filename,
     }
 
     int subImageIndex = 0;
+    getPlaneChannels(filename, view, pixelComponents, rawComponents, subimages, channels, numChannels, subImageIndex);
+
+    readPixels(filename, file.get() ? file->img : NULL, useCache, subimages, subImageIndex, miplevel, channels, numChannels, renderWindow, pixelData, bounds, rowBytes);
+} // ReadOIIOPlugin::decodePlaneLevel
+
+// get the OIIO channel indexes and the subimage for the given plane
+void
+ReadOIIOPlugin::getPlaneChannels(const string& filename,
+                                 int view,
+                                 PixelComponentEnum pixelComponents,
+                                 const string& rawComponents,
+                                 const vector<ImageSpec>& subimages,
+                                 vector<int>& channels,
+                                 int& numChannels,
+                                 int& subImageIndex)
+{
+    unused(rawComponents);
+    subImageIndex = 0;
     if (pixelComponents != ePixelComponentCustom) {
 #ifdef OFX_EXTENSIONS_NATRON
         assert(rawComponents == kOfxImageComponentAlpha ||
@@ -2194,22 +2435,55 @@ ReadOIIOPlugin::decodePlane(const string& filename,
         }
     }
 #endif
+} // ReadOIIOPlugin::getPlaneChannels
 
-
-    if ( img.get() && !img->seek_subimage(subImageIndex, 0, subimages[0]) ) {
+// read the given channels of a subimage into pixelData (the image is flipped vertically).
+// channels[i] < kXChannelFirst fills the channel i with the constant value channels[i].
+// If miplevel > 0, renderWindow and bounds are in the pixel coordinates of that MIP level (see getFileMipmapLevel()).
+void
+ReadOIIOPlugin::readPixels(const string& filename,
+                           ImageInput* img,
+                           bool useCache,
+                           vector<ImageSpec>& subimages,
+                           int subImageIndex,
+                           int miplevel,
+                           const vector<int>& channels,
+                           int numChannels,
+                           const OfxRectI& renderWindow,
+                           float *pixelData,
+                           const OfxRectI& bounds,
+                           int rowBytes)
+{
+    // do not overwrite subimages[0]: the specs may be reused to read other planes from the same file
+    ImageSpec seekSpec;
+    if ( img && !img->seek_subimage(subImageIndex, miplevel, seekSpec) ) {
         stringstream ss;
-        ss << "Cannot seek subimage " << subImageIndex << " in " << filename;
+        ss << "Cannot seek subimage " << subImageIndex << " MIP level " << miplevel << " in " << filename;
         setPersistentMessage( Message::eMessageError, "", ss.str() );
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
     }
+    if ( (miplevel > 0) && !img && !_cache->get_imagespec(ustring(filename), seekSpec, subImageIndex, miplevel) ) {
+        setPersistentMessage( Message::eMessageError, "", _cache->geterror() );
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+    if (miplevel > 0) {
+        // getFileMipmapLevel() only accepts MIP levels whose data window starts at 0,0:
+        // the display window of the level is its data window
+        seekSpec.full_x = seekSpec.x;
+        seekSpec.full_y = seekSpec.y;
+        seekSpec.full_width = seekSpec.width;
+        seekSpec.full_height = seekSpec.height;
+    }
 
     bool offsetNegativeDisplayWindow;
     _offsetNegativeDispWindow->getValue(offsetNegativeDisplayWindow);
 
     // Non const because ImageSpec::valid_tile_range is not const...
-    ImageSpec& spec = subimages[subImageIndex];
+    ImageSpec& spec = (miplevel > 0) ? seekSpec : subimages[subImageIndex];
 
     // Compute X offset as done in getFrameBounds
     int dataOffset = 0;
@@ -2355,7 +2629,7 @@ ReadOIIOPlugin::decodePlane(const string& filename,
             if (_cache && useCache) {
                 gotPixels = _cache->get_pixels(ustring(filename),
                                                subImageIndex, //subimage
-                                               0, //miplevel
+                                               miplevel, //miplevel
                                                xbegin, //x begin
                                                xend, //x end
                                                ybegin, //y begin
@@ -2528,11 +2802,188 @@ ReadOIIOPlugin::decodePlane(const string& filename,
             } // !useCache
         } // if (channels[i] < kXChannelFirst) {
     } // for (std::size_t i = 0; i < channels.size(); i+=incr) {
+} // ReadOIIOPlugin::readPixels
+
+void
+ReadOIIOPlugin::beginDecodePlanes(const string& filename,
+                                  OfxTime time,
+                                  int view,
+                                  const std::list<PlaneToRender>& planes)
+{
+    PlaneBatch* batch = new PlaneBatch;
+
+    batch->filename = filename;
+    batch->time = time;
+    batch->view = view;
+    for (std::list<PlaneToRender>::const_iterator it = planes.begin(); it != planes.end(); ++it) {
+        batch->planes.push_back( make_pair(it->comps, it->rawComps) );
+    }
+    batch->opened = false;
+    batch->useCache = false;
+
+    PlaneBatch* previous = NULL;
+    {
+        AutoMutex lock(_planeBatchesMutex);
+        PlaneBatch*& threadBatch = _planeBatches[tthread::this_thread::get_id()];
+        previous = threadBatch;
+        threadBatch = batch;
+    }
+    if (previous) {
+        // endDecodePlanes() was not called
+        delete previous;
+    }
+}
+
+void
+ReadOIIOPlugin::endDecodePlanes()
+{
+    PlaneBatch* batch = NULL;
+    {
+        AutoMutex lock(_planeBatchesMutex);
+        std::map<tthread::thread::id, PlaneBatch*>::iterator it = _planeBatches.find( tthread::this_thread::get_id() );
+        if ( it == _planeBatches.end() ) {
+            return;
+        }
+        batch = it->second;
+        _planeBatches.erase(it);
+    }
+    // the file is checked in
+    delete batch;
+}
+
+ReadOIIOPlugin::PlaneBatch*
+ReadOIIOPlugin::getPlaneBatch(const string& filename,
+                              int view)
+{
+    AutoMutex lock(_planeBatchesMutex);
+    std::map<tthread::thread::id, PlaneBatch*>::iterator it = _planeBatches.find( tthread::this_thread::get_id() );
+
+    if ( ( it == _planeBatches.end() ) || (it->second->filename != filename) || (it->second->view != view) ) {
+        return NULL;
+    }
+
+    return it->second;
+}
+
+void
+ReadOIIOPlugin::decodePlaneFromBatch(PlaneBatch& batch,
+                                     bool useCache,
+                                     int miplevel,
+                                     const OfxRectI& renderWindow,
+                                     float *pixelData,
+                                     const OfxRectI& bounds,
+                                     PixelComponentEnum pixelComponents,
+                                     const string& rawComponents,
+                                     int rowBytes)
+{
+    if (!batch.opened) {
+        openFile(batch.filename, useCache, &batch.file, &batch.subimages);
+        batch.useCache = useCache;
+        batch.opened = true;
+    }
+    if ( batch.subimages.empty() ) {
+        setPersistentMessage(Message::eMessageError, "", string("Cannot open file ") + batch.filename);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    vector<int> channels;
+    int numChannels = 0;
+    int subImageIndex = 0;
+    getPlaneChannels(batch.filename, batch.view, pixelComponents, rawComponents, batch.subimages, channels, numChannels, subImageIndex);
+
+    int chbegin = INT_MAX;
+    int chend = INT_MIN;
+    for (int i = 0; i < numChannels; ++i) {
+        if (channels[i] >= kXChannelFirst) {
+            chbegin = std::min(chbegin, channels[i] - kXChannelFirst);
+            chend = std::max(chend, channels[i] - kXChannelFirst + 1);
+        }
+    }
+
+    // look for the pixels of this subimage, if they were already read for another plane
+    const PlaneBatch::Pixels* pixels = NULL;
+    for (std::list<PlaneBatch::Pixels>::const_iterator it = batch.pixels.begin(); !pixels && it != batch.pixels.end(); ++it) {
+        if ( (it->subImageIndex == subImageIndex) && (it->miplevel == miplevel) &&
+             ( (chbegin >= chend) || ( (it->chbegin <= chbegin) && (chend <= it->chbegin + it->nChannels) ) ) &&
+             (it->window.x1 <= renderWindow.x1) && (renderWindow.x2 <= it->window.x2) &&
+             (it->window.y1 <= renderWindow.y1) && (renderWindow.y2 <= it->window.y2) ) {
+            pixels = &*it;
+        }
+    }
+
+    if (!pixels) {
+        // read the channels of all the planes of the batch that are in this subimage
+        int nOtherPlanes = 0;
+        for (vector<pair<PixelComponentEnum, string> >::const_iterator it = batch.planes.begin(); it != batch.planes.end(); ++it) {
+            if ( (it->first == pixelComponents) && (it->second == rawComponents) ) {
+                continue;
+            }
+            vector<int> planeChannels;
+            int planeNumChannels = 0;
+            int planeSubImageIndex = 0;
+            try {
+                getPlaneChannels(batch.filename, batch.view, it->first, it->second, batch.subimages, planeChannels, planeNumChannels, planeSubImageIndex);
+            } catch (...) {
+                // this plane will fail when it is decoded
+                continue;
+            }
+            if (planeSubImageIndex != subImageIndex) {
+                continue;
+            }
+            for (int i = 0; i < planeNumChannels; ++i) {
+                if (planeChannels[i] >= kXChannelFirst) {
+                    chbegin = std::min(chbegin, planeChannels[i] - kXChannelFirst);
+                    chend = std::max(chend, planeChannels[i] - kXChannelFirst + 1);
+                }
+            }
+            ++nOtherPlanes;
+        }
+
+        if ( (nOtherPlanes == 0) || (chbegin >= chend) ) {
+            // nothing to share, read this plane directly
+            readPixels(batch.filename, batch.file.get() ? batch.file->img : NULL, batch.useCache, batch.subimages, subImageIndex, miplevel, channels, numChannels, renderWindow, pixelData, bounds, rowBytes);
 
-    if (!useCache) {
-        img->close();
+            return;
+        }
+
+        // read the whole channel range at once: the file is decompressed only once for all the planes
+        batch.pixels.push_back( PlaneBatch::Pixels() );
+        PlaneBatch::Pixels& newPixels = batch.pixels.back();
+        newPixels.subImageIndex = subImageIndex;
+        newPixels.miplevel = miplevel;
+        newPixels.chbegin = chbegin;
+        newPixels.nChannels = chend - chbegin;
+        newPixels.window = renderWindow;
+        vector<int> batchChannels(newPixels.nChannels);
+        for (int i = 0; i < newPixels.nChannels; ++i) {
+            batchChannels[i] = chbegin + i + kXChannelFirst;
+        }
+        int batchRowBytes = (renderWindow.x2 - renderWindow.x1) * newPixels.nChannels * sizeof(float);
+        try {
+            newPixels.data.resize( (size_t)(renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1) * newPixels.nChannels );
+            readPixels(batch.filename, batch.file.get() ? batch.file->img : NULL, batch.useCache, batch.subimages, subImageIndex, miplevel, batchChannels, newPixels.nChannels,
+                       renderWindow, &newPixels.data.front(), renderWindow, batchRowBytes);
+        } catch (...) {
+            batch.pixels.pop_back();
+            throw;
+        }
+        pixels = &newPixels;
     }
-} // ReadOIIOPlugin::decodePlane
+
+    // copy the channels of this plane
+    const size_t srcRowSize = (size_t)(pixels->window.x2 - pixels->window.x1) * pixels->nChannels;
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        const float* srcPix = &pixels->data[(size_t)(y - pixels->window.y1) * srcRowSize + (size_t)(renderWindow.x1 - pixels->window.x1) * pixels->nChannels];
+        float* dstPix = (float*)( (char*)pixelData + (ptrdiff_t)(y - bounds.y1) * rowBytes ) + (ptrdiff_t)(renderWindow.x1 - bounds.x1) * numChannels;
+        for (int x = renderWindow.x1; x < renderWindow.x2; ++x, srcPix += pixels->nChannels, dstPix += numChannels) {
+            for (int i = 0; i < numChannels; ++i) {
+                dstPix[i] = (channels[i] < kXChannelFirst) ? float(channels[i]) : srcPix[channels[i] - kXChannelFirst - pixels->chbegin];
+            }
+        }
+    }
+} // ReadOIIOPlugin::decodePlaneFromBatch
 
 bool
 ReadOIIOPlugin::getFrameBounds(const string& filename,
@@ -2668,27 +3119,116 @@ ReadOIIOPlugin::getFrameBounds(const string& filename,
     return true;
 } // ReadOIIOPlugin::getFrameBounds
 
+bool
+ReadOIIOPlugin::getHeaderCacheKey(string* key) const
+{
+    // the specs depend on the reader config (e.g. the raw settings), and the bounds on the display window
+    // and edge pixels settings. The config is hashed (FNV-1a) to keep the key short.
+    ImageSpec config;
+
+    getConfig(&config);
+    const string xml = config.to_xml();
+    unsigned long long hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < xml.size(); ++i) {
+        hash = (hash ^ (unsigned char)xml[i]) * 1099511628211ULL;
+    }
+    stringstream ss;
+    ss << std::hex << hash << std::dec << '|' << _offsetNegativeDispWindow->getValue() << '|' << _edgePixels->getValue();
+    *key += ss.str();
+
+    return true;
+}
+
+// The MIP levels of a file can be decoded in place of the downscaled image only if they have exactly
+// the size of the image at the corresponding render scale, i.e. ceil(width/2^level) x ceil(height/2^level)
+// (OpenEXR files with the "round up" rounding mode, TIFF and OIIO-generated textures), and if the full-res image
+// has no data window/display window offset that would make the levels misaligned.
+unsigned int
+ReadOIIOPlugin::getFileMipmapLevel(const string& filename,
+                                   OfxTime /*time*/,
+                                   int /*view*/,
+                                   unsigned int maxLevel,
+                                   OfxRectI* bounds,
+                                   int* tile_width,
+                                   int* tile_height)
+{
+    assert(bounds && tile_width && tile_height);
+    int edgeMode_i;
+    _edgePixels->getValue(edgeMode_i);
+    if ( (maxLevel == 0) || ( (EdgePixelsEnum)edgeMode_i == eEdgePixelsBlack ) ) {
+        // black edge pixels are added around the image: the bounds of the levels do not match
+
+        return 0;
+    }
+
+    // without the OIIO cache, the file stays open in the FileHandleCache, which also keeps the level specs
+    vector<ImageSpec> specs;
+    OIIOFileCheckout file;
+    if (_cache) {
+        getSpecs(filename, &specs);
+    } else if ( checkoutFile(filename, &file) ) {
+        specs = file->subimages;
+    }
+    if ( specs.empty() ) {
+        return 0;
+    }
+    const int width = specs[0].width;
+    const int height = specs[0].height;
+    for (std::size_t i = 0; i < specs.size(); ++i) {
+        const ImageSpec& spec = specs[i];
+        if ( (spec.x != 0) || (spec.y != 0) || (spec.full_x != 0) || (spec.full_y != 0) ||
+             (spec.width != width) || (spec.height != height) || (spec.full_width != width) || (spec.full_height != height) ) {
+            return 0;
+        }
+    }
+
+    unsigned int level = maxLevel;
+    for (; level > 0; --level) {
+        const int levelWidth = (width + (1 << level) - 1) >> level;
+        const int levelHeight = (height + (1 << level) - 1) >> level;
+        bool levelOk = true;
+        ImageSpec levelSpec;
+        for (std::size_t i = 0; levelOk && i < specs.size(); ++i) {
+            ImageSpec spec;
+            if ( file.get() ) {
+                levelOk = file->getLevelSpec( (int)i, (int)level, &spec );
+            } else {
+                levelOk = _cache->get_imagespec( ustring(filename), spec, (int)i, (int)level );
+            }
+            levelOk = levelOk && (spec.x == 0) && (spec.y == 0) && (spec.width == levelWidth) && (spec.height == levelHeight) && !spec.deep;
+            if (i == 0) {
+                levelSpec = spec;
+            }
+        }
+        if (levelOk) {
+            bounds->x1 = 0;
+            bounds->y1 = 0;
+            bounds->x2 = levelWidth;
+            bounds->y2 = levelHeight;
+            *tile_width = levelSpec.tile_width;
+            *tile_height = levelSpec.tile_height;
+            break;
+        }
+    }
+
+    return level;
+} // ReadOIIOPlugin::getFileMipmapLevel
+
 string
 ReadOIIOPlugin::metadata(const string& filename)
 {
     stringstream ss;
 
-    auto_ptr<ImageInput> img;
-
+    vector<ImageSpec> subImages;
     if (!_cache) {
-        // use the right config
-        ImageSpec config;
-        getConfig(&config);
-        
-        img.reset( ImageInput::open(filename, &config) );
-        if ( !img.get() ) {
+        OIIOFileCheckout file;
+        if ( !checkoutFile(filename, &file) ) {
             setPersistentMessage(Message::eMessageError, "", string("ReadOIIO: cannot open file ") + filename);
             throwSuiteStatusException(kOfxStatFailed);
 
             return string();
         }
     }
-    vector<ImageSpec> subImages;
     getSpecs(filename, &subImages);
     if ( subImages.empty() ) {
         setPersistentMessage(Message::eMessageError, "", string("No information found in") + filename);
@@ -2772,10 +3312,6 @@ ReadOIIOPlugin::metadata(const string& filename)
             ss << std::endl;
         }
     }
-    if (!_cache) {
-        assert( img.get() );
-        img->close();
-    }
 
     return ss.str();
 } // ReadOIIOPlugin::metadata
@@ -2918,6 +3454,7 @@ void
 ReadOIIOPluginFactory::unload()
 {
     _extensions.clear();
+    GenericReaderUnload();
 
 #  ifdef OFX_READ_OIIO_SHARED_CACHE
     // get the shared image cache (may be shared with other plugins using OIIO)
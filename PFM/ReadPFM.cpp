@@ -22,12 +22,17 @@
  */
 
 #include <cstdio> // fopen, fread...
+#include <cstring> // memcpy
+#include <cctype> // isspace
 #include <algorithm>
 
 #include "GenericReader.h"
 #include "GenericOCIO.h"
+#include "FileHandleCache.h"
+#include "MappedFile.h"
 #include "ofxsFileOpen.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -37,7 +42,6 @@ namespace OCIO = OCIO_NAMESPACE;
 #endif
 
 using std::string;
-using std::stringstream;
 using std::vector;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -47,7 +51,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription "Read PFM (Portable Float Map) files."
 #define kPluginIdentifier "fr.inria.openfx.ReadPFM"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 #define kPluginEvaluation 92 // better than ReadOIIO
 
 #define kSupportsRGBA true
@@ -56,6 +60,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSupportsAlpha true
 #define kSupportsTiles false
 
+// maximum size of the header read from a file that is not memory-mapped (including comments)
+#define kPFMHeaderMaxSize 65536
+
 class ReadPFMPlugin
     : public GenericReaderPlugin
 {
@@ -68,6 +75,9 @@ public:
 private:
 
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
+    virtual bool isDecodeParamFree() const OVERRIDE FINAL { return true; }
+
+    virtual void clearAnyCache() OVERRIDE FINAL;
 
     virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, string *error, int* tile_width, int* tile_height) OVERRIDE FINAL;
@@ -139,6 +149,170 @@ invert_endianness(T *const buffer,
     }
 }
 
+namespace Pfm {
+// The header of a PFM file.
+struct Header
+{
+    Header()
+        : type(0)
+        , width(0)
+        , height(0)
+        , nComps(0)
+        , hasScale(false)
+        , scale(0.)
+        , dataOffset(0)
+    {
+    }
+
+    char type; // 'F' (color) or 'f' (grayscale)
+    int width;
+    int height;
+    int nComps;
+    bool hasScale;
+    double scale; // a positive scale means big-endian samples
+    std::size_t dataOffset; // position of the first sample in the file
+
+    // size of a row of samples in the file. Rows are stored from bottom to top, like OFX images.
+    std::size_t rowSize() const
+    {
+        return (std::size_t)width * nComps * sizeof(float);
+    }
+};
+
+// Get the next line of the header that is not a comment, after skipping whitespace, like
+// fscanf(" %1023[^\n]"). On return, *pos is the position of the end of the line.
+static bool
+nextHeaderLine(const char* data,
+               std::size_t size,
+               std::size_t* pos,
+               string* line)
+{
+    for (;;) {
+        while ( *pos < size && std::isspace( (unsigned char)data[*pos] ) ) {
+            ++*pos;
+        }
+        if (*pos >= size) {
+            return false;
+        }
+        const std::size_t start = *pos;
+        while (*pos < size && data[*pos] != '\n') {
+            ++*pos;
+        }
+        if (data[start] != '#') {
+            line->assign( data + start, std::min(*pos - start, (std::size_t)1023) );
+
+            return true;
+        }
+    }
+}
+
+// Parse the header at the beginning of data. Returns false and sets error if it is invalid.
+static bool
+parseHeader(const char* data,
+            std::size_t size,
+            const string& filename,
+            Header* header,
+            string* error)
+{
+    std::size_t pos = 0;
+    string line;
+
+    if ( !nextHeaderLine(data, size, &pos, &line) || (std::sscanf(line.c_str(), " P%c", &header->type) != 1) ) {
+        *error = string("PFM header not found in file \"") + filename + "\".";
+
+        return false;
+    }
+    if ( !nextHeaderLine(data, size, &pos, &line) || (std::sscanf(line.c_str(), " %d %d", &header->width, &header->height) != 2) ) {
+        *error = string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
+
+        return false;
+    }
+    if ( (header->width <= 0) || (header->height <= 0) || (0xffff < header->width) || (0xffff < header->height) ) {
+        *error = string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".";
+
+        return false;
+    }
+    header->hasScale = nextHeaderLine(data, size, &pos, &line) && std::sscanf(line.c_str(), "%lf", &header->scale) == 1;
+    if (!header->hasScale) {
+        header->scale = 0.;
+    }
+    // the samples start after the single newline that ends the scale line
+    header->dataOffset = std::min(pos + 1, size);
+    header->nComps = (header->type == 'F') ? 3 : 1;
+
+    return true;
+}
+
+// A PFM file with its parsed header. The file is only memory-mapped if mappings are enabled (see kMappedFileEnv):
+// it stays mapped while it is in the cache, and reading it after another process truncated it would raise SIGBUS.
+// By default, decode() reads the rows of the render window through the regular file API.
+// Mapped pages belong to the system file cache, so they are not counted in the memory budget.
+struct File
+    : public FileHandleCache::Handle
+{
+    File(const string& filename);
+
+    virtual std::size_t getMemorySize() const OVERRIDE FINAL
+    {
+        return sizeof(File);
+    }
+
+    // the mapping is read-only, so that all threads can copy rows from it at once
+    virtual bool isShareable() const OVERRIDE FINAL { return true; }
+
+    virtual bool isValid() const OVERRIDE FINAL { return error.empty(); }
+
+    MappedFile mapping;
+    Header header;
+    string error; // not empty if the file could not be opened or its header is invalid
+};
+
+File::File(const string& filename)
+    : mapping()
+    , header()
+    , error()
+{
+    if ( mapping.open(filename) ) {
+        parseHeader(mapping.data(), mapping.size(), filename, &header, &error);
+
+        return;
+    }
+
+    // mappings are disabled, or this is not a local file: read the header through the regular file API,
+    // decode() reads the rows the same way
+    std::FILE *const nfile = fopen_utf8(filename.c_str(), "rb");
+    if (!nfile) {
+        error = string("Cannot open file \"") + filename + "\".";
+
+        return;
+    }
+    vector<char> buffer(kPFMHeaderMaxSize);
+    const std::size_t numread = std::fread(&buffer.front(), 1, buffer.size(), nfile);
+    std::fclose(nfile);
+    parseHeader(&buffer.front(), numread, filename, &header, &error);
+}
+
+static FileHandleCache::Handle*
+createFile(const string& filename,
+           void* /*arg*/)
+{
+    return new File(filename);
+}
+
+// Check out the file from the FileHandleCache. The files are kept under the instance that opened them,
+// so that they are closed when that instance clears its caches or is destroyed.
+class FileCheckout
+    : public FileHandleCache::Checkout<File>
+{
+public:
+    FileCheckout(const void* owner,
+                 const string& filename)
+        : FileHandleCache::Checkout<File>(owner, filename, createFile, NULL)
+    {
+    }
+};
+} // namespace Pfm
+
 ReadPFMPlugin::ReadPFMPlugin(OfxImageEffectHandle handle,
                              const vector<string>& extensions)
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
@@ -147,11 +321,18 @@ ReadPFMPlugin::ReadPFMPlugin(OfxImageEffectHandle handle,
 
 ReadPFMPlugin::~ReadPFMPlugin()
 {
+    FileHandleCache::instance().purge(this);
+}
+
+void
+ReadPFMPlugin::clearAnyCache()
+{
+    FileHandleCache::instance().purge(this);
 }
 
 template <class PIX, int srcC, int dstC>
 static void
-copyLine(PIX *image,
+copyLine(const PIX *srcPix,
          int x1,
          int x2,
          int C,
@@ -159,7 +340,6 @@ copyLine(PIX *image,
 {
     assert(srcC == C);
 
-    const PIX *srcPix = image + x1 * C;
     dstPix += x1 * dstC;
 
     for (int x = x1; x < x2; ++x) {
@@ -189,6 +369,119 @@ copyLine(PIX *image,
     }
 }
 
+// Copy the pixels x1..x2 of a row of the file to dstPix (the beginning of the destination row).
+// The samples are read in place if they are aligned and in the native byte order, else they are
+// first copied to buffer.
+static void
+copyRow(const char* row,
+        bool is_inverted,
+        int x1,
+        int x2,
+        int C,
+        int dstC,
+        float* dstPix,
+        vector<float>& buffer)
+{
+    const char* src = row + (std::size_t)x1 * C * sizeof(float);
+    const std::size_t numsamples = (std::size_t)(x2 - x1) * C;
+    const float* srcPix = (const float*)src;
+
+    if ( is_inverted || ( ( (std::size_t)src % sizeof(float) ) != 0 ) ) {
+        buffer.resize(numsamples);
+        std::memcpy(&buffer.front(), src, numsamples * sizeof(float));
+        if (is_inverted) {
+            invert_endianness( &buffer.front(), (unsigned int)numsamples );
+        }
+        srcPix = &buffer.front();
+    }
+
+    if (C == 1) {
+        switch (dstC) {
+        case 1:
+            copyLine<float, 1, 1>(srcPix, x1, x2, C, dstPix);
+            break;
+        case 2:
+            copyLine<float, 1, 2>(srcPix, x1, x2, C, dstPix);
+            break;
+        case 3:
+            copyLine<float, 1, 3>(srcPix, x1, x2, C, dstPix);
+            break;
+        case 4:
+            copyLine<float, 1, 4>(srcPix, x1, x2, C, dstPix);
+            break;
+        default:
+            break;
+        }
+    } else if (C == 3) {
+        switch (dstC) {
+        case 1:
+            copyLine<float, 3, 1>(srcPix, x1, x2, C, dstPix);
+            break;
+        case 2:
+            copyLine<float, 3, 2>(srcPix, x1, x2, C, dstPix);
+            break;
+        case 3:
+            copyLine<float, 3, 3>(srcPix, x1, x2, C, dstPix);
+            break;
+        case 4:
+            copyLine<float, 3, 4>(srcPix, x1, x2, C, dstPix);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// Copies the rows of the render window from a memory-mapped file, each thread taking a band of rows.
+class PFMCopyProcessor
+    : public MultiThread::Processor
+{
+public:
+    PFMCopyProcessor(const Pfm::Header& header,
+                     const char* data,
+                     const OfxRectI& renderWindow,
+                     float *pixelData,
+                     const OfxRectI& bounds,
+                     int pixelComponentCount,
+                     int rowBytes)
+        : _header(header)
+        , _data(data)
+        , _renderWindow(renderWindow)
+        , _pixelData(pixelData)
+        , _bounds(bounds)
+        , _pixelComponentCount(pixelComponentCount)
+        , _rowBytes(rowBytes)
+        , _is_inverted( (header.scale > 0) != endianness() )
+    {
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int h = _renderWindow.y2 - _renderWindow.y1;
+        const int y1 = _renderWindow.y1 + (int)( (long long)h * threadID / nThreads );
+        const int y2 = _renderWindow.y1 + (int)( (long long)h * (threadID + 1) / nThreads );
+        const std::size_t rowSize = _header.rowSize();
+        vector<float> buffer;
+
+        for (int y = y1; y < y2; ++y) {
+            const char* row = _data + _header.dataOffset + (std::size_t)y * rowSize;
+            float* dstPix = (float*)( (char*)_pixelData + (std::size_t)(y - _bounds.y1) * _rowBytes );
+            copyRow(row, _is_inverted, _renderWindow.x1, _renderWindow.x2, _header.nComps, _pixelComponentCount, dstPix, buffer);
+        }
+    }
+
+    const Pfm::Header& _header;
+    const char* _data;
+    const OfxRectI _renderWindow;
+    float* _pixelData;
+    const OfxRectI _bounds;
+    const int _pixelComponentCount;
+    const int _rowBytes;
+    const bool _is_inverted;
+};
+
 void
 ReadPFMPlugin::decode(const string& filename,
                       OfxTime /*time*/,
@@ -202,133 +495,75 @@ ReadPFMPlugin::decode(const string& filename,
                       int rowBytes)
 {
     if ( (pixelComponents != ePixelComponentRGBA) && (pixelComponents != ePixelComponentRGB) && (pixelComponents != ePixelComponentAlpha) ) {
-        setPersistentMessage(Message::eMessageError, "", "PFM: can only read RGBA, RGB or Alpha components images");
+        setDecodeMessage(Message::eMessageError, "PFM: can only read RGBA, RGB or Alpha components images");
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
     }
 
-    // read PFM header
-    std::FILE *const nfile = fopen_utf8(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int C = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ( ( err = std::fscanf(nfile, "%1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("PFM header not found in file \"") + filename + "\".");
+    Pfm::FileCheckout file(this, filename);
+    if ( !file->error.empty() ) {
+        setDecodeMessage(Message::eMessageError, file->error);
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
     }
-    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " %d %d", &W, &H) != 2) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".");
-        throwSuiteStatusException(kOfxStatFailed);
+    const Pfm::Header& header = file->header;
 
-        return;
-    }
-    if ( (W <= 0) || (H <= 0) || (0xffff < W) || (0xffff < H) ) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".");
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-
-    clearPersistentMessage();
-    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, "%lf", &scale) != 1) {
-        setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
+    if ( !isPrefetching() ) {
+        clearPersistentMessage();
     }
-
-    {
-        int c = std::fgetc(nfile);
-        (void)c;
+    if (!header.hasScale) {
+        setDecodeMessage(Message::eMessageWarning, string("SCALE field is undefined in file \"") + filename + "\".");
     }
 
-    const bool is_inverted = (scale > 0) != endianness();
-    if (pfm_type == 'F') {
-        C = 3;
-    } else {
-        C = 1;
-    }
+    assert(0 <= renderWindow.x1 && renderWindow.x2 <= header.width &&
+           0 <= renderWindow.y1 && renderWindow.y2 <= header.height);
+    const std::size_t rowSize = header.rowSize();
 
-    std::size_t numpixels = W * C;
-    vector<float> image(numpixels);
-
-    assert(0 <= renderWindow.x1 && renderWindow.x2 <= W &&
-           0 <= renderWindow.y1 && renderWindow.y2 <= H);
-    const int x1 = renderWindow.x1;
-    const int x2 = renderWindow.x2;
-
-    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
-        std::size_t numread = std::fread(&image.front(), 4, numpixels, nfile);
-        if (numread < numpixels) {
-            std::fclose(nfile);
-            setPersistentMessage(Message::eMessageError, "", "could not read all the image samples needed");
+    if ( file->mapping.isOpen() ) {
+        // only the rows of the render window are read (and paged in), straight from the mapping
+        if ( file->mapping.size() < header.dataOffset + (std::size_t)renderWindow.y2 * rowSize ) {
+            setDecodeMessage(Message::eMessageError, "could not read all the image samples needed");
             throwSuiteStatusException(kOfxStatFailed);
 
             return;
         }
+        PFMCopyProcessor processor(header, file->mapping.data(), renderWindow, pixelData, bounds, pixelComponentCount, rowBytes);
+        processor.multiThread( isPrefetching() ? 1 : 0 );
 
-        if (is_inverted) {
-            invert_endianness(&image.front(), numpixels);
-        }
+        return;
+    }
 
-        // now copy to the dstImg
-        float* dstPix = (float*)( (char*)pixelData + (y - bounds.y1) * rowBytes );
-        if (C == 1) {
-            switch (pixelComponentCount) {
-            case 1:
-                copyLine<float, 1, 1>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 2:
-                copyLine<float, 1, 2>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 3:
-                copyLine<float, 1, 3>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 4:
-                copyLine<float, 1, 4>(&image.front(), x1, x2, C, dstPix);
-                break;
-            default:
-                break;
-            }
-        } else if (C == 3) {
-            switch (pixelComponentCount) {
-            case 1:
-                copyLine<float, 3, 1>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 2:
-                copyLine<float, 3, 2>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 3:
-                copyLine<float, 3, 3>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 4:
-                copyLine<float, 3, 4>(&image.front(), x1, x2, C, dstPix);
-                break;
-            default:
-                break;
-            }
+    std::FILE *const nfile = fopen_utf8(filename.c_str(), "rb");
+    if (!nfile) {
+        setDecodeMessage(Message::eMessageError, string("Cannot open file \"") + filename + "\".");
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+    // skip to the first row of the render window (a row is less than 1MB, so that each seek fits in a long)
+    bool ok = std::fseek(nfile, (long)header.dataOffset, SEEK_SET) == 0;
+    for (int y = 0; ok && y < renderWindow.y1; ++y) {
+        ok = std::fseek(nfile, (long)rowSize, SEEK_CUR) == 0;
+    }
+    const bool is_inverted = (header.scale > 0) != endianness();
+    vector<char> row(rowSize);
+    vector<float> buffer;
+    for (int y = renderWindow.y1; ok && y < renderWindow.y2; ++y) {
+        ok = std::fread(&row.front(), 1, rowSize, nfile) == rowSize;
+        if (ok) {
+            float* dstPix = (float*)( (char*)pixelData + (std::size_t)(y - bounds.y1) * rowBytes );
+            copyRow(&row.front(), is_inverted, renderWindow.x1, renderWindow.x2, header.nComps, pixelComponentCount, dstPix, buffer);
         }
     }
     std::fclose(nfile);
+    if (!ok) {
+        setDecodeMessage(Message::eMessageError, "could not read all the image samples needed");
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
 } // ReadPFMPlugin::decode
 
 bool
@@ -342,54 +577,25 @@ ReadPFMPlugin::getFrameBounds(const string& filename,
                               int* tile_height)
 {
     assert(bounds && par);
-    // read PFM header
-    std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ( ( err = std::fscanf(nfile, "%1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        if (error) {
-            *error = string("PFM header not found in file \"") + filename + "\".";
-        }
-
-        return false;
-    }
-    while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if ( ( err = std::sscanf(item, " %d %d", &W, &H) ) < 2 ) {
-        std::fclose(nfile);
+    // the header is parsed once, and kept with the file for decode()
+    Pfm::FileCheckout file(this, filename);
+    if ( !file->error.empty() ) {
         if (error) {
-            *error =  string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
+            *error = file->error;
         }
 
         return false;
     }
-    if (err == 2) {
-        clearPersistentMessage();
-        while ( ( err = std::fscanf(nfile, " %1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-            int c = std::fgetc(nfile);
-            (void)c;
-        }
-        if (std::sscanf(item, "%lf", &scale) != 1) {
-            setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
-        }
+    const Pfm::Header& header = file->header;
+    clearPersistentMessage();
+    if (!header.hasScale) {
+        setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
     }
-    std::fclose(nfile);
 
     bounds->x1 = 0;
-    bounds->x2 = W;
+    bounds->x2 = header.width;
     bounds->y1 = 0;
-    bounds->y2 = H;
+    bounds->y2 = header.height;
     *format = *bounds;
     *par = 1.;
     *tile_width = *tile_height = 0;
@@ -434,25 +640,12 @@ ReadPFMPlugin::guessParamsFromFilename(const string& /*newFile*/,
     if ( (st != kOfxStatOK) || filename.empty() ) {
         return false;
     }
-    stringstream ss;
-
-    // read PFM header
-    std::FILE *const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type = 0;
-    char item[1024] = { 0 };
-    int err = 0;
-    while ( ( err = std::fscanf(nfile, "%1023[^\n]", item) ) != EOF && (*item == '#' || !err) ) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-
-        //setPersistentMessage(Message::eMessageWarning, "", string("PFM header not found in file \"") + filename + "\".");
+    Pfm::FileCheckout file(this, filename);
+    if ( !file->error.empty() ) {
+        //setPersistentMessage(Message::eMessageWarning, "", file->error);
         return false;
     }
-    std::fclose(nfile);
+    const char pfm_type = file->header.type;
 
     // set the components of _outputClip
     *components = ePixelComponentNone;
@@ -478,7 +671,7 @@ ReadPFMPlugin::guessParamsFromFilename(const string& /*newFile*/,
     return true;
 } // ReadPFMPlugin::guessParamsFromFilename
 
-mDeclareReaderPluginFactory(ReadPFMPluginFactory, {}, false);
+mDeclareReaderPluginFactory(ReadPFMPluginFactory, { GenericReaderUnload(); }, false);
 void
 ReadPFMPluginFactory::load()
 {
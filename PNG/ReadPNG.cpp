@@ -84,6 +84,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSupportsAlpha false
 #define kSupportsTiles false
 
+// number of rows decoded before they are converted to the output image
+#define kReadPNGRowsPerChunk 64
+
 #define OFX_IO_LIBPNG_VERSION (PNG_LIBPNG_VER_MAJOR * 10000 + PNG_LIBPNG_VER_MINOR * 100 + PNG_LIBPNG_VER_RELEASE)
 
 // Try to deduce endianness
@@ -610,6 +613,7 @@ private:
 
     virtual void changedParam(const InstanceChangedArgs &args, const string &paramName) OVERRIDE FINAL;
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
+    virtual bool isDecodeParamFree() const OVERRIDE FINAL { return true; }
 
     virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, OfxRectI *bounds, OfxRectI *format, double *par, string *error, int* tile_width, int* tile_height) OVERRIDE FINAL;
@@ -634,6 +638,10 @@ private:
      * When reading an image sequence, this is called only for the first image when the user actually selects the new sequence.
      **/
     virtual bool guessParamsFromFilename(const string& filename, string *colorspace, PreMultiplicationEnum *filePremult, PixelComponentEnum *components, int *componentCount) OVERRIDE FINAL;
+
+    // guessParamsFromFilename() only depends on the file header and the OCIO config
+    virtual bool isGuessParamsCacheable() const OVERRIDE FINAL { return true; }
+
     static void openFile(const string& filename,
                          png_structp* png,
                          png_infop* info,
@@ -1056,7 +1064,12 @@ ReadPNGPlugin::changedParam(const InstanceChangedArgs &args,
         OfxStatus st = getFilenameAtTime(args.time, &filename);
         stringstream ss;
         if (st == kOfxStatOK) {
-            ss << metadata(filename);
+            string info;
+            if ( !getCachedMetadata(filename, &info) ) {
+                info = metadata(filename);
+                setCachedMetadata(filename, info);
+            }
+            ss << info;
         } else {
             ss << "Impossible to read image info:\nCould not get filename at time " << args.time << '.';
         }
@@ -1130,7 +1143,7 @@ ReadPNGPlugin::decode(const string& filename,
                       int rowBytes)
 {
     if ( (pixelComponents != ePixelComponentRGBA) && (pixelComponents != ePixelComponentRGB) && (pixelComponents != ePixelComponentXY) && (pixelComponents != ePixelComponentAlpha) ) {
-        setPersistentMessage(Message::eMessageError, "", "PNG: can only read RGBA, RGB or Alpha components images");
+        setDecodeMessage(Message::eMessageError, "PNG: can only read RGBA, RGB or Alpha components images");
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
@@ -1143,7 +1156,7 @@ ReadPNGPlugin::decode(const string& filename,
     try {
         openFile(filename, &png, &info, &file);
     } catch (const std::exception& e) {
-        setPersistentMessage( Message::eMessageError, "", e.what() );
+        setDecodeMessage( Message::eMessageError, e.what() );
         throwSuiteStatusException(kOfxStatFailed);
     }
 
@@ -1153,85 +1166,105 @@ ReadPNGPlugin::decode(const string& filename,
     int realbitdepth;
     int colorType;
     double par;
-    getPNGInfo(png, info, &x1, &y1, &width, &height, &par, &nChannels, &bitdepth, &realbitdepth, &colorType, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    int interlaceType = PNG_INTERLACE_NONE;
+    getPNGInfo(png, info, &x1, &y1, &width, &height, &par, &nChannels, &bitdepth, &realbitdepth, &colorType, 0, 0, &interlaceType, 0, 0, 0, 0, 0, 0, 0, 0);
 
     assert(renderWindow.x1 >= x1 && renderWindow.y1 >= y1 && renderWindow.x2 <= x1 + width && renderWindow.y2 <= y1 + height);
 
+    PixelComponentEnum srcComponents;
+    switch (nChannels) {
+    case 1:
+        srcComponents = ePixelComponentAlpha;
+        break;
+    case 2:
+        srcComponents = ePixelComponentXY;
+        break;
+    case 3:
+        srcComponents = ePixelComponentRGB;
+        break;
+    case 4:
+        srcComponents = ePixelComponentRGBA;
+        break;
+    default:
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+        setDecodeMessage(Message::eMessageError, "This plug-in only supports images with 1 to 4 channels");
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+
+    OfxRectI srcBounds;
+    srcBounds.x1 = x1;
+    srcBounds.y1 = y1;
+    srcBounds.x2 = x1 + width;
+    srcBounds.y2 = y1 + height;
+
     std::size_t pngRowBytes = nChannels * width;
     if (bitdepth == eBitDepthUShort) {
         pngRowBytes *= sizeof(unsigned short);
     }
 
-    RamBuffer scratchBuffer(pngRowBytes * height);
-    unsigned char* tmpData = scratchBuffer.getData();
-
+    // The PNG rows (counted from the top of the file) that are in the render window.
+    // Row r of the file is line bounds.y2 - 1 - (y1 + r) of pixelData (see convertDepthAndComponents).
+    const int rowBegin = std::max(0, bounds.y2 - y1 - renderWindow.y2);
+    const int rowEnd = std::min(height, bounds.y2 - y1 - renderWindow.y1);
+    // Interlaced images are only complete after the last pass: they are read at once.
+    // Other images are read row by row, and converted to pixelData by chunks.
+    const bool interlaced = (interlaceType != PNG_INTERLACE_NONE);
+    const int chunkRows = interlaced ? height : std::max( 1, std::min(kReadPNGRowsPerChunk, rowEnd - rowBegin) );
 
-    //if (interlace_type != 0) {
-    vector<unsigned char *> row_pointers(height);
-    for (int i = 0; i < height; ++i) {
-        row_pointers[i] = tmpData + i * pngRowBytes;
-    }
+    RamBuffer scratchBuffer(pngRowBytes * chunkRows);
+    unsigned char* tmpData = scratchBuffer.getData();
 
     // Must call this setjmp in every function that does PNG reads
     if ( setjmp ( png_jmpbuf (png) ) ) {
         png_destroy_read_struct(&png, &info, NULL);
         std::fclose(file);
-        setPersistentMessage(Message::eMessageError, "", "PNG library error");
+        setDecodeMessage(Message::eMessageError, "PNG library error");
         throwSuiteStatusException(kOfxStatErrFormat);
 
         return;
     }
-    png_read_image(png, &row_pointers[0]);
-    png_read_end(png, NULL);
-    /*
-       } else {
-        for (int y = 0; y < height; ++y) {
-            // Must call this setjmp in every function that does PNG reads
-            if (setjmp (png_jmpbuf (png))) {
-                png_destroy_read_struct(&png, &info, NULL);
-                std::fclose(file);
-                setPersistentMessage(Message::eMessageError, "", "PNG library error");
-                throwSuiteStatusException(kOfxStatErrFormat);
-
-                return;
+    if (interlaced) {
+        vector<unsigned char *> row_pointers(height);
+        for (int i = 0; i < height; ++i) {
+            row_pointers[i] = tmpData + i * pngRowBytes;
+        }
+        png_read_image(png, &row_pointers[0]);
+        png_read_end(png, NULL);
+        convertDepthAndComponents(tmpData, renderWindow, srcBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes);
+    } else {
+        // each row is filtered against the previous one: rows above the render window must be decoded, but are not converted
+        for (int y = 0; y < rowBegin; ++y) {
+            png_read_row(png, tmpData, NULL);
+        }
+        // abort() is a host suite call, which must not be made from the prefetch threads
+        const bool checkAbort = !isPrefetching();
+        int y = rowBegin;
+        while ( (y < rowEnd) && !(checkAbort && abort()) ) {
+            const int chunkBegin = y;
+            const int chunkEnd = std::min(chunkBegin + chunkRows, rowEnd);
+            for (; y < chunkEnd; ++y) {
+                png_read_row(png, tmpData + (y - chunkBegin) * pngRowBytes, NULL);
             }
-            png_read_row (png, (png_bytep)tmpData + y * pngRowBytes, NULL);
+            OfxRectI chunkBounds = srcBounds;
+            chunkBounds.y1 = y1 + chunkBegin;
+            chunkBounds.y2 = y1 + chunkEnd;
+            OfxRectI chunkWindow = renderWindow;
+            chunkWindow.y1 = std::max(renderWindow.y1, bounds.y2 - y1 - chunkEnd);
+            chunkWindow.y2 = std::min(renderWindow.y2, bounds.y2 - y1 - chunkBegin);
+            convertDepthAndComponents(tmpData, chunkWindow, chunkBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes);
         }
-       }
-     */
+        // the rows below the render window are not decoded
+        if (y == height) {
+            png_read_end(png, NULL);
+        }
+    }
 
     png_destroy_read_struct(&png, &info, NULL);
     std::fclose(file);
     file = NULL;
-
-    OfxRectI srcBounds;
-    srcBounds.x1 = x1;
-    srcBounds.y1 = y1;
-    srcBounds.x2 = x1 + width;
-    srcBounds.y2 = y1 + height;
-
-    PixelComponentEnum srcComponents;
-    switch (nChannels) {
-    case 1:
-        srcComponents = ePixelComponentAlpha;
-        break;
-    case 2:
-        srcComponents = ePixelComponentXY;
-        break;
-    case 3:
-        srcComponents = ePixelComponentRGB;
-        break;
-    case 4:
-        srcComponents = ePixelComponentRGBA;
-        break;
-    default:
-        setPersistentMessage(Message::eMessageError, "", "This plug-in only supports images with 1 to 4 channels");
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
-
-    convertDepthAndComponents(tmpData, renderWindow, srcBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes);
 } // ReadPNGPlugin::decode
 
 bool
@@ -1470,7 +1503,7 @@ ReadPNGPlugin::guessParamsFromFilename(const string& filename,
 } // ReadPNGPlugin::guessParamsFromFilename
 
 
-mDeclareReaderPluginFactory(ReadPNGPluginFactory, {}, false);
+mDeclareReaderPluginFactory(ReadPNGPluginFactory, { GenericReaderUnload(); }, false);
 void
 ReadPNGPluginFactory::load()
 {
@@ -23,6 +23,9 @@
 
 
 #include <cstdio> // fopen, fwrite...
+#include <cmath> // exp
+#include <cstdlib> // abs
+#include <cstring> // memset
 #include <vector>
 #include <algorithm>
 
@@ -103,6 +106,24 @@ enum PNGBitDepthEnum {
 #define kWritePNGParamDitherLabel "Dithering"
 #define kWritePNGParamDitherHint "When checked, conversion from float input buffers to 8-bit PNG will use a dithering algorithm to reduce quantization artifacts. This has no effect when writing to 16bit PNG"
 
+#define kWritePNGParamDitherType "ditherType"
+#define kWritePNGParamDitherTypeLabel "Dithering Type"
+#define kWritePNGParamDitherTypeHint "The dithering algorithm used when Dithering is checked."
+#define kWritePNGParamDitherTypeErrorDiffusion "Error Diffusion", "Diffuse the quantization error along each row, from a random position.", "errordiffusion"
+#define kWritePNGParamDitherTypeBlueNoise "Blue Noise", "Add a tiled blue-noise pattern before quantization. The noise is finer and more uniform, and does not depend on neighboring pixels.", "bluenoise"
+
+#define kWritePNGParamParallel "parallelCompression"
+#define kWritePNGParamParallelLabel "Parallel Compression"
+#define kWritePNGParamParallelHint "When checked, the rows of the image are filtered and compressed by several threads, which is much faster on large images. " \
+    "The image is compressed in independent bands, so the file may be slightly larger than when it is compressed by a single thread. " \
+    "The Compression and Compression Level parameters are used in both cases."
+
+// size in bytes of the filtered image data compressed by each task when Parallel Compression is checked
+#define kWritePNGDeflateBandSize (256 * 1024)
+
+// maximum size of the IDAT chunks written when Parallel Compression is checked
+#define kWritePNGIDATSize (1024 * 1024)
+
 #define kParamLibraryInfo "libraryInfo"
 #define kParamLibraryInfoLabel "libpng Info...", "Display information about the underlying library."
 
@@ -346,6 +367,606 @@ convertPseudoRandomHashToRange(unsigned int lastRandomHash,
     return ( (double)lastRandomHash / (double)0x100000000LL ) * (max - min)  + min;
 }
 
+enum PNGDitherTypeEnum
+{
+    ePNGDitherTypeErrorDiffusion = 0,
+    ePNGDitherTypeBlueNoise,
+};
+
+#define kBlueNoiseSize 64 // size of the blue-noise mask (a power of two)
+
+// add (sign = 1) or remove (sign = -1) a minority pixel of a blue-noise pattern, and update the energy
+static void
+toggleBlueNoisePixel(int p,
+                     float sign,
+                     const vector<float>& filter,
+                     vector<char>* pattern,
+                     vector<float>* energy)
+{
+    const int px = p % kBlueNoiseSize;
+    const int py = p / kBlueNoiseSize;
+
+    (*pattern)[p] = (sign > 0);
+    for (int y = 0; y < kBlueNoiseSize; ++y) {
+        const int fy = ( (y - py) & (kBlueNoiseSize - 1) ) * kBlueNoiseSize;
+        for (int x = 0; x < kBlueNoiseSize; ++x) {
+            (*energy)[y * kBlueNoiseSize + x] += sign * filter[fy + ( (x - px) & (kBlueNoiseSize - 1) )];
+        }
+    }
+}
+
+// the minority pixel with the highest energy (value = 1, the tightest cluster),
+// or the majority pixel with the lowest energy (value = 0, the largest void)
+static int
+findBlueNoisePixel(char value,
+                   const vector<char>& pattern,
+                   const vector<float>& energy)
+{
+    int best = -1;
+
+    for (int p = 0; p < (int)pattern.size(); ++p) {
+        if ( (pattern[p] == value) &&
+             ( (best < 0) || (value ? (energy[p] > energy[best]) : (energy[p] < energy[best]) ) ) ) {
+            best = p;
+        }
+    }
+
+    return best;
+}
+
+/// Generates a kBlueNoiseSize x kBlueNoiseSize blue-noise threshold mask with the void-and-cluster method
+/// (R. Ulichney, "The void-and-cluster method for dither array generation", 1993), with values in [0,255].
+static void
+generateBlueNoiseMask(vector<unsigned char>* mask)
+{
+    const int n = kBlueNoiseSize;
+    const int nPixels = n * n;
+    const double sigma = 1.5;
+    // toroidal gaussian filter, indexed by the (wrapped) offset
+    vector<float> filter(nPixels);
+
+    for (int dy = 0; dy < n; ++dy) {
+        for (int dx = 0; dx < n; ++dx) {
+            const int ox = std::min(dx, n - dx);
+            const int oy = std::min(dy, n - dy);
+            filter[dy * n + dx] = (float)std::exp( -(ox * ox + oy * oy) / (2. * sigma * sigma) );
+        }
+    }
+
+    vector<char> pattern(nPixels, 0);
+    vector<float> energy(nPixels, 0.f);
+
+    // initial binary pattern: 10% of pixels, placed with a fixed pseudo-random sequence, then relaxed by
+    // moving the tightest cluster to the largest void until it stops moving
+    const int nInitial = nPixels / 10;
+    unsigned int hash = 0x1234567;
+    for (int i = 0; i < nInitial; ++i) {
+        int p;
+        do {
+            hash = hashFunction(hash);
+            p = (int)(hash % (unsigned int)nPixels);
+        } while (pattern[p]);
+        toggleBlueNoisePixel(p, 1.f, filter, &pattern, &energy);
+    }
+    for (int i = 0; i < nPixels; ++i) {
+        const int cluster = findBlueNoisePixel(1, pattern, energy);
+        toggleBlueNoisePixel(cluster, -1.f, filter, &pattern, &energy);
+        const int voidPixel = findBlueNoisePixel(0, pattern, energy);
+        toggleBlueNoisePixel(voidPixel, 1.f, filter, &pattern, &energy);
+        if (voidPixel == cluster) {
+            break;
+        }
+    }
+
+    vector<int> rank(nPixels);
+    {
+        // rank the initial pixels by removing the tightest clusters first
+        vector<char> p = pattern;
+        vector<float> e = energy;
+        for (int r = nInitial - 1; r >= 0; --r) {
+            const int cluster = findBlueNoisePixel(1, p, e);
+            toggleBlueNoisePixel(cluster, -1.f, filter, &p, &e);
+            rank[cluster] = r;
+        }
+    }
+    // rank the other pixels by filling the largest voids first
+    for (int r = nInitial; r < nPixels; ++r) {
+        const int voidPixel = findBlueNoisePixel(0, pattern, energy);
+        toggleBlueNoisePixel(voidPixel, 1.f, filter, &pattern, &energy);
+        rank[voidPixel] = r;
+    }
+
+    mask->resize(nPixels);
+    for (int p = 0; p < nPixels; ++p) {
+        (*mask)[p] = (unsigned char)(rank[p] * 256 / nPixels);
+    }
+} // generateBlueNoiseMask
+
+static Mutex* gBlueNoiseMutex;
+static vector<unsigned char> gBlueNoiseMask;
+
+// the blue-noise mask, generated on first use
+static const unsigned char*
+getBlueNoiseMask()
+{
+    AutoMutex lock(*gBlueNoiseMutex);
+
+    if ( gBlueNoiseMask.empty() ) {
+        generateBlueNoiseMask(&gBlueNoiseMask);
+    }
+
+    return &gBlueNoiseMask[0];
+}
+
+// Converts the float image to the PNG bit depth, in parallel, optionally dithering the color channels of 8-bit images.
+// Rows are independent, so that the result does not depend on the number of threads.
+class PNGConvertProcessor
+    : public MultiThread::Processor
+{
+public:
+    PNGConvertProcessor(const float* src,
+                        int srcRowElements,
+                        int srcNComps,
+                        int srcNCompsStartIndex,
+                        int width,
+                        int height,
+                        unsigned char* dst,
+                        int dstNComps,
+                        PNGBitDepthEnum depth)
+        : _src(src)
+        , _srcRowElements(srcRowElements)
+        , _srcNComps(srcNComps)
+        , _srcNCompsStartIndex(srcNCompsStartIndex)
+        , _width(width)
+        , _height(height)
+        , _dst(dst)
+        , _dstNComps(dstNComps)
+        , _depth(depth)
+        , _lut(NULL)
+        , _ditherType(ePNGDitherTypeErrorDiffusion)
+        , _errorDiffusionStarts()
+        , _blueNoise(NULL)
+        , _blueNoiseX(0)
+        , _blueNoiseY(0)
+    {
+    }
+
+    /// Dither the color channels of an 8-bit image (which must have at least 3 components).
+    void setDither(const Color::Lut* lut,
+                   PNGDitherTypeEnum ditherType,
+                   OfxTime time,
+                   unsigned int seed)
+    {
+        assert(_depth == ePNGBitDepthUByte && _srcNComps >= 3 && _dstNComps >= 3);
+        _lut = lut;
+        _ditherType = ditherType;
+        unsigned int randHash = pseudoRandomHashSeed(time, seed);
+        if (ditherType == ePNGDitherTypeErrorDiffusion) {
+            // The random start of each row comes from the same hash sequence as before rows were
+            // processed in parallel: computing it first keeps the output identical.
+            _errorDiffusionStarts.resize(_height);
+            for (int y = 0; y < _height; ++y) {
+                randHash = generatePseudoRandomHash(randHash);
+                _errorDiffusionStarts[y] = convertPseudoRandomHashToRange(randHash, 0, _width);
+            }
+        } else {
+            // move the mask at each frame, so that the noise is not static
+            randHash = generatePseudoRandomHash(randHash);
+            _blueNoise = getBlueNoiseMask();
+            _blueNoiseX = randHash & (kBlueNoiseSize - 1);
+            _blueNoiseY = (randHash >> 8) & (kBlueNoiseSize - 1);
+        }
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int y1 = (int)( (long long)_height * threadID / nThreads );
+        const int y2 = (int)( (long long)_height * (threadID + 1) / nThreads );
+
+        if (!_lut) {
+            convertRows(y1, y2);
+        } else if (_srcNComps == 3) {
+            if (_dstNComps == 3) {
+                ditherRows<3, 3>(y1, y2);
+            } else {
+                ditherRows<3, 4>(y1, y2);
+            }
+        } else {
+            if (_dstNComps == 3) {
+                ditherRows<4, 3>(y1, y2);
+            } else {
+                ditherRows<4, 4>(y1, y2);
+            }
+        }
+    }
+
+private:
+    void convertRows(int y1,
+                     int y2)
+    {
+        const int nComps = std::min(_dstNComps, _srcNComps);
+
+        for (int y = y1; y < y2; ++y) {
+            const float* src_pixels = _src + (std::size_t)y * _srcRowElements + _srcNCompsStartIndex;
+            if (_depth == ePNGBitDepthUByte) {
+                unsigned char* dst_pixels = _dst + (std::size_t)y * _width * _dstNComps;
+                for (int x = 0; x < _width; ++x, src_pixels += _srcNComps, dst_pixels += _dstNComps) {
+                    for (int c = 0; c < nComps; ++c) {
+                        dst_pixels[c] = floatToInt<256>(src_pixels[c]);
+                    }
+                }
+            } else {
+                unsigned short* dstRow = reinterpret_cast<unsigned short*>(_dst) + (std::size_t)y * _width * _dstNComps;
+                unsigned short* dst_pixels = dstRow;
+                for (int x = 0; x < _width; ++x, src_pixels += _srcNComps, dst_pixels += _dstNComps) {
+                    for (int c = 0; c < nComps; ++c) {
+                        dst_pixels[c] = floatToInt<65536>(src_pixels[c]);
+                    }
+                }
+                // PNG is always big endian
+                if ( littleendian() ) {
+                    swap_endian (dstRow, _width * _dstNComps);
+                }
+            }
+        }
+    }
+
+    template <int srcNComps, int dstNComps>
+    void ditherRows(int y1,
+                    int y2)
+    {
+        // The color-space conversions of a row are looked up first, in a loop without dependencies between pixels,
+        // and then dithered.
+        vector<unsigned short> colors(_width * 3);
+
+        for (int y = y1; y < y2; ++y) {
+            const float* src_pixels = _src + (std::size_t)y * _srcRowElements + _srcNCompsStartIndex;
+            unsigned char* dst_pixels = _dst + (std::size_t)y * _width * dstNComps;
+            unsigned short* c = &colors[0];
+            for (int x = 0; x < _width; ++x, src_pixels += srcNComps, c += 3) {
+                c[0] = _lut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[0]);
+                c[1] = _lut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[1]);
+                c[2] = _lut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[2]);
+            }
+            if (_ditherType == ePNGDitherTypeErrorDiffusion) {
+                errorDiffusionRow<dstNComps>(&colors[0], _errorDiffusionStarts[y], dst_pixels);
+            } else {
+                blueNoiseRow<dstNComps>(&colors[0], y, dst_pixels);
+            }
+            if (dstNComps == 4) {
+                src_pixels = _src + (std::size_t)y * _srcRowElements + _srcNCompsStartIndex;
+                for (int x = 0; x < _width; ++x, src_pixels += srcNComps, dst_pixels += dstNComps) {
+                    dst_pixels[3] = (srcNComps == 4) ? floatToInt<256>(src_pixels[3]) : 255;
+                }
+            }
+        }
+    }
+
+    // error diffusion from a random start towards both ends of the row
+    template <int dstNComps>
+    void errorDiffusionRow(const unsigned short* colors,
+                           int start,
+                           unsigned char* dst_pixels) const
+    {
+        for (int backward = 0; backward < 2; ++backward) {
+            int index = backward ? start - 1 : start;
+            assert( backward == 1 || ( index >= 0 && index < _width ) );
+            unsigned error_r = 0x80;
+            unsigned error_g = 0x80;
+            unsigned error_b = 0x80;
+
+            while (index < _width && index >= 0) {
+                const unsigned short* c = colors + index * 3;
+                unsigned char* dst = dst_pixels + index * dstNComps;
+                error_r = (error_r & 0xff) + c[0];
+                error_g = (error_g & 0xff) + c[1];
+                error_b = (error_b & 0xff) + c[2];
+                assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
+
+                dst[0] = (unsigned char)(error_r >> 8);
+                dst[1] = (unsigned char)(error_g >> 8);
+                dst[2] = (unsigned char)(error_b >> 8);
+
+                if (backward) {
+                    --index;
+                } else {
+                    ++index;
+                }
+            }
+        }
+    }
+
+    // ordered dithering with the blue-noise mask: each pixel only depends on its position
+    template <int dstNComps>
+    void blueNoiseRow(const unsigned short* colors,
+                      int y,
+                      unsigned char* dst_pixels) const
+    {
+        const unsigned char* mask = _blueNoise + ( (y + _blueNoiseY) & (kBlueNoiseSize - 1) ) * kBlueNoiseSize;
+
+        for (int x = 0; x < _width; ++x, colors += 3, dst_pixels += dstNComps) {
+            // colors are at most 0xff00, so that the sum fits in 16 bits
+            const unsigned threshold = mask[(x + _blueNoiseX) & (kBlueNoiseSize - 1)];
+            dst_pixels[0] = (unsigned char)( (colors[0] + threshold) >> 8 );
+            dst_pixels[1] = (unsigned char)( (colors[1] + threshold) >> 8 );
+            dst_pixels[2] = (unsigned char)( (colors[2] + threshold) >> 8 );
+        }
+    }
+
+    const float* _src;
+    int _srcRowElements;
+    int _srcNComps;
+    int _srcNCompsStartIndex;
+    int _width;
+    int _height;
+    unsigned char* _dst;
+    int _dstNComps;
+    PNGBitDepthEnum _depth;
+    const Color::Lut* _lut;
+    PNGDitherTypeEnum _ditherType;
+    vector<int> _errorDiffusionStarts;
+    const unsigned char* _blueNoise;
+    int _blueNoiseX;
+    int _blueNoiseY;
+};
+
+// PNG filter types (PNG specification, section 9.2)
+enum PNGFilterTypeEnum
+{
+    ePNGFilterTypeNone = 0,
+    ePNGFilterTypeSub,
+    ePNGFilterTypeUp,
+    ePNGFilterTypeAverage,
+    ePNGFilterTypePaeth,
+};
+
+inline int
+paethPredictor(int a,
+               int b,
+               int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+
+    if ( (pa <= pb) && (pa <= pc) ) {
+        return a;
+    } else if (pb <= pc) {
+        return b;
+    }
+
+    return c;
+}
+
+// the cost of a filtered byte, seen as a signed value
+inline unsigned int
+filterCost(int v)
+{
+    const unsigned char u = (unsigned char)v;
+
+    return (u < 128) ? u : 256 - u;
+}
+
+/// Filters one PNG row into dst (the filter type byte, followed by rowBytes filtered bytes), choosing the
+/// filter that minimizes the sum of the absolute values of the filtered bytes, like libpng does by default.
+/// prev is the previous (unfiltered) row, or NULL for the first row.
+static void
+filterPNGRow(const unsigned char* row,
+             const unsigned char* prev,
+             std::size_t rowBytes,
+             int bpp,
+             unsigned char* dst)
+{
+    unsigned int cost[ePNGFilterTypePaeth + 1] = { 0, 0, 0, 0, 0 };
+
+    for (std::size_t i = 0; i < rowBytes; ++i) {
+        const int x = row[i];
+        const int a = (i >= (std::size_t)bpp) ? row[i - bpp] : 0;
+        const int b = prev ? prev[i] : 0;
+        const int c = ( prev && (i >= (std::size_t)bpp) ) ? prev[i - bpp] : 0;
+        cost[ePNGFilterTypeNone] += filterCost(x);
+        cost[ePNGFilterTypeSub] += filterCost(x - a);
+        cost[ePNGFilterTypeUp] += filterCost(x - b);
+        cost[ePNGFilterTypeAverage] += filterCost( x - ( (a + b) >> 1 ) );
+        cost[ePNGFilterTypePaeth] += filterCost( x - paethPredictor(a, b, c) );
+    }
+    int filter = ePNGFilterTypeNone;
+    for (int f = ePNGFilterTypeSub; f <= ePNGFilterTypePaeth; ++f) {
+        if (cost[f] < cost[filter]) {
+            filter = f;
+        }
+    }
+    dst[0] = (unsigned char)filter;
+    ++dst;
+    for (std::size_t i = 0; i < rowBytes; ++i) {
+        const int x = row[i];
+        const int a = (i >= (std::size_t)bpp) ? row[i - bpp] : 0;
+        const int b = prev ? prev[i] : 0;
+        const int c = ( prev && (i >= (std::size_t)bpp) ) ? prev[i - bpp] : 0;
+        int predictor = 0;
+        switch (filter) {
+        case ePNGFilterTypeSub:
+            predictor = a;
+            break;
+        case ePNGFilterTypeUp:
+            predictor = b;
+            break;
+        case ePNGFilterTypeAverage:
+            predictor = (a + b) >> 1;
+            break;
+        case ePNGFilterTypePaeth:
+            predictor = paethPredictor(a, b, c);
+            break;
+        default:
+            break;
+        }
+        dst[i] = (unsigned char)(x - predictor);
+    }
+} // filterPNGRow
+
+// Filters the rows of an image, in parallel.
+// The source rows are stored bottom-up (as in OFX images), the filtered rows are stored top-down (as in PNG files).
+class PNGRowFilterProcessor
+    : public MultiThread::Processor
+{
+public:
+    PNGRowFilterProcessor(const unsigned char* src,
+                          std::size_t rowBytes,
+                          int height,
+                          int bpp,
+                          unsigned char* dst)
+        : _src(src)
+        , _rowBytes(rowBytes)
+        , _height(height)
+        , _bpp(bpp)
+        , _dst(dst)
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int y1 = (int)( (long long)_height * threadID / nThreads );
+        const int y2 = (int)( (long long)_height * (threadID + 1) / nThreads );
+
+        for (int y = y1; y < y2; ++y) {
+            filterPNGRow( row(y), (y > 0) ? row(y - 1) : NULL, _rowBytes, _bpp, _dst + (std::size_t)y * (_rowBytes + 1) );
+        }
+    }
+
+private:
+    // the y-th row of the PNG image
+    const unsigned char* row(int y) const
+    {
+        return _src + (std::size_t)(_height - 1 - y) * _rowBytes;
+    }
+
+    const unsigned char* _src;
+    std::size_t _rowBytes;
+    int _height;
+    int _bpp;
+    unsigned char* _dst;
+};
+
+// Compresses bands of filtered PNG data into raw deflate streams, in parallel (as pigz does).
+// Each band is primed with the last 32K of the previous band, so that matches can cross band boundaries, and
+// ends on a byte boundary (Z_SYNC_FLUSH), so that the compressed bands can simply be concatenated.
+class PNGBandDeflateProcessor
+    : public MultiThread::Processor
+{
+public:
+    PNGBandDeflateProcessor(const unsigned char* data,
+                            std::size_t size,
+                            std::size_t bandSize,
+                            int level,
+                            int strategy)
+        : _data(data)
+        , _size(size)
+        , _bandSize(bandSize)
+        , _level(level)
+        , _strategy(strategy)
+        , _bands( (size + bandSize - 1) / bandSize )
+        , _adlers( _bands.size() )
+        , _ok( _bands.size(), 1 )
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        // bands have the same size: distribute them round-robin
+        for (std::size_t i = threadID; i < _bands.size(); i += nThreads) {
+            const std::size_t begin = i * _bandSize;
+            const std::size_t end = std::min(begin + _bandSize, _size);
+            const std::size_t dictSize = std::min(begin, (std::size_t)kPNGDeflateWindowSize);
+            _adlers[i] = adler32( 0L, Z_NULL, 0 );
+            _adlers[i] = adler32( _adlers[i], _data + begin, (uInt)(end - begin) );
+            _ok[i] = deflateBand(_data + begin - dictSize, dictSize, end - begin, end == _size, &_bands[i]);
+        }
+    }
+
+    bool ok() const
+    {
+        return std::find(_ok.begin(), _ok.end(), 0) == _ok.end();
+    }
+
+    std::size_t bandCount() const
+    {
+        return _bands.size();
+    }
+
+    const vector<unsigned char>& band(std::size_t i) const
+    {
+        return _bands[i];
+    }
+
+    /// The adler32 checksum of the whole data.
+    uLong adler() const
+    {
+        uLong adler = _adlers[0];
+
+        for (std::size_t i = 1; i < _adlers.size(); ++i) {
+            const std::size_t begin = i * _bandSize;
+            adler = adler32_combine( adler, _adlers[i], (z_off_t)(std::min(begin + _bandSize, _size) - begin) );
+        }
+
+        return adler;
+    }
+
+private:
+    enum { kPNGDeflateWindowSize = 32768 };
+
+    // compresses the size bytes at dict + dictSize, using the dictSize bytes before them as a dictionary
+    bool deflateBand(const unsigned char* dict,
+                     std::size_t dictSize,
+                     std::size_t size,
+                     bool last,
+                     vector<unsigned char>* out) const
+    {
+        z_stream stream;
+
+        std::memset( &stream, 0, sizeof(stream) );
+        // negative window bits: raw deflate data, without the zlib header and trailer
+        if (deflateInit2(&stream, _level, Z_DEFLATED, -MAX_WBITS, 8, _strategy) != Z_OK) {
+            return false;
+        }
+        if ( (dictSize > 0) && (deflateSetDictionary(&stream, (const Bytef*)dict, (uInt)dictSize) != Z_OK) ) {
+            deflateEnd(&stream);
+
+            return false;
+        }
+        // the sync flush marker takes 5 more bytes than deflateBound
+        out->resize( deflateBound(&stream, (uLong)size) + 16 );
+        stream.next_in = (Bytef*)(dict + dictSize);
+        stream.avail_in = (uInt)size;
+        const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+        int ret;
+        do {
+            if ( stream.total_out == out->size() ) {
+                out->resize(out->size() * 2);
+            }
+            stream.next_out = &(*out)[stream.total_out];
+            stream.avail_out = (uInt)(out->size() - stream.total_out);
+            ret = deflate(&stream, flush);
+        } while ( (ret == Z_OK || ret == Z_BUF_ERROR) && (stream.avail_out == 0) );
+        out->resize(stream.total_out);
+        deflateEnd(&stream);
+
+        return last ? (ret == Z_STREAM_END) : (ret == Z_OK && stream.avail_in == 0);
+    }
+
+    const unsigned char* _data;
+    std::size_t _size;
+    std::size_t _bandSize;
+    int _level;
+    int _strategy;
+    vector<vector<unsigned char> > _bands;
+    vector<uLong> _adlers;
+    vector<char> _ok;
+};
+
 class WritePNGPlugin
     : public GenericWriterPlugin
 {
@@ -391,32 +1012,12 @@ private:
                      const string& outputColorspace,
                      PNGBitDepthEnum bitdepth);
 
-    template <int srcNComps, int dstNComps>
-    void add_dither_for_components(OfxTime time,
-                                   unsigned int seed,
-                                   const float *src_pixels,
-                                   const OfxRectI& bounds,
-                                   unsigned char* dst_pixels,
-                                   int srcRowElements,
-                                   int dstRowElements,
-                                   int dstNCompsStartIndex);
-
-    void add_dither(OfxTime time,
-                    unsigned int seed,
-                    const float *src_pixels,
-                    const OfxRectI& bounds,
-                    unsigned char* dst_pixels,
-                    int srcRowElements,
-                    int dstRowElements,
-                    int dstNCompsStartIndex,
-                    int srcNComps,
-                    int dstNComps);
-
-
     ChoiceParam* _compression;
     IntParam* _compressionLevel;
     ChoiceParam* _bitdepth;
     BooleanParam* _ditherEnabled;
+    ChoiceParam* _ditherType;
+    BooleanParam* _parallel;
     const Color::Lut* _ditherLut;
 };
 
@@ -427,13 +1028,17 @@ WritePNGPlugin::WritePNGPlugin(OfxImageEffectHandle handle,
     , _compressionLevel(NULL)
     , _bitdepth(NULL)
     , _ditherEnabled(NULL)
+    , _ditherType(NULL)
+    , _parallel(NULL)
     , _ditherLut( gLutManager->linearLut() )
 {
     _compression = fetchChoiceParam(kWritePNGParamCompression);
     _compressionLevel = fetchIntParam(kWritePNGParamCompressionLevel);
     _bitdepth = fetchChoiceParam(kWritePNGParamBitDepth);
     _ditherEnabled = fetchBooleanParam(kWritePNGParamDither);
-    assert(_compression && _compressionLevel && _bitdepth && _ditherEnabled);
+    _ditherType = fetchChoiceParam(kWritePNGParamDitherType);
+    _parallel = fetchBooleanParam(kWritePNGParamParallel);
+    assert(_compression && _compressionLevel && _bitdepth && _ditherEnabled && _ditherType && _parallel);
 }
 
 WritePNGPlugin::~WritePNGPlugin()
@@ -601,92 +1206,6 @@ WritePNGPlugin::write_info (png_structp& sp,
     png_set_packing (sp);   // Pack 1, 2, 4 bit into bytes
 }
 
-template <int srcNComps, int dstNComps>
-void
-WritePNGPlugin::add_dither_for_components(OfxTime time,
-                                          unsigned int seed,
-                                          const float *src_pixels,
-                                          const OfxRectI& bounds,
-                                          unsigned char* dst_pixels,
-                                          int srcRowElements,
-                                          int dstRowElements,
-                                          int dstNCompsStartIndex)
-{
-    unsigned int randHash = pseudoRandomHashSeed(time, seed);
-
-
-    assert(srcNComps >= 3 && dstNComps >= 3);
-
-    int width = bounds.x2 - bounds.x1;
-
-    for (int y = bounds.y1; y < bounds.y2; ++y,
-         src_pixels += srcRowElements,
-         dst_pixels += dstRowElements) {
-        randHash = generatePseudoRandomHash(randHash);
-        int start = convertPseudoRandomHashToRange( randHash, 0, (bounds.x2 - bounds.x1) );
-
-        for (int backward = 0; backward < 2; ++backward) {
-            int index = backward ? start - 1 : start;
-            assert( backward == 1 || ( index >= 0 && index < width ) );
-            unsigned error_r = 0x80;
-            unsigned error_g = 0x80;
-            unsigned error_b = 0x80;
-
-            while (index < width && index >= 0) {
-                int src_col = index * srcNComps + dstNCompsStartIndex;
-                int dst_col = index * dstNComps;
-                error_r = (error_r & 0xff) + _ditherLut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[src_col]);
-                error_g = (error_g & 0xff) + _ditherLut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[src_col + 1]);
-                error_b = (error_b & 0xff) + _ditherLut->toColorSpaceUint8xxFromLinearFloatFast(src_pixels[src_col + 2]);
-                assert(error_r < 0x10000 && error_g < 0x10000 && error_b < 0x10000);
-
-
-                dst_pixels[dst_col] = (unsigned char)(error_r >> 8);
-                dst_pixels[dst_col + 1] = (unsigned char)(error_g >> 8);
-                dst_pixels[dst_col + 2] = (unsigned char)(error_b >> 8);
-
-                if (dstNComps == 4) {
-                    dst_pixels[dst_col + 3] = (srcNComps == 4) ? Color::floatToInt<256>(src_pixels[src_col + 3]) : 255;
-                }
-
-
-                if (backward) {
-                    --index;
-                } else {
-                    ++index;
-                }
-            }
-        }
-    }
-}
-
-void
-WritePNGPlugin::add_dither(OfxTime time,
-                           unsigned int seed,
-                           const float *src_pixels,
-                           const OfxRectI& bounds,
-                           unsigned char* dst_pixels,
-                           int srcRowElements,
-                           int dstRowElements,
-                           int dstNCompsStartIndex,
-                           int srcNComps,
-                           int dstNComps)
-{
-    if (srcNComps == 3) {
-        if (dstNComps == 3) {
-            add_dither_for_components<3, 3>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        } else if (dstNComps == 4) {
-            add_dither_for_components<3, 4>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        }
-    } else if (srcNComps == 4) {
-        if (dstNComps == 3) {
-            add_dither_for_components<4, 3>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        } else if (dstNComps == 4) {
-            add_dither_for_components<4, 4>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
-        }
-    }
-}
-
 void
 WritePNGPlugin::encode(const string& filename,
                        const OfxTime time,
@@ -715,6 +1234,8 @@ WritePNGPlugin::encode(const string& filename,
     } catch (const std::exception& e) {
         setPersistentMessage( Message::eMessageError, "", e.what() );
         throwSuiteStatusException(kOfxStatFailed);
+
+        return;
     }
 
 
@@ -728,24 +1249,26 @@ WritePNGPlugin::encode(const string& filename,
 
     int compression_i;
     _compression->getValue(compression_i);
+    int compressionStrategy;
     switch (compression_i) {
     case 1:
-        png_set_compression_strategy(png, Z_FILTERED);
+        compressionStrategy = Z_FILTERED;
         break;
     case 2:
-        png_set_compression_strategy(png, Z_HUFFMAN_ONLY);
+        compressionStrategy = Z_HUFFMAN_ONLY;
         break;
     case 3:
-        png_set_compression_strategy(png, Z_RLE);
+        compressionStrategy = Z_RLE;
         break;
     case 4:
-        png_set_compression_strategy(png, Z_FIXED);
+        compressionStrategy = Z_FIXED;
         break;
     case 0:
     default:
-        png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
+        compressionStrategy = Z_DEFAULT_STRATEGY;
         break;
     }
+    png_set_compression_strategy(png, compressionStrategy);
 
     PNGBitDepthEnum pngDepth = (PNGBitDepthEnum)_bitdepth->getValueAtTime(time);
     string ocioColorspace;
@@ -764,57 +1287,91 @@ WritePNGPlugin::encode(const string& filename,
     RamBuffer scratchBuffer(scratchBufBytes);
     int nComps = std::min(dstNComps, pixelDataNComps);
     const int srcRowElements = rowBytes / sizeof(float);
-    const size_t numPixels = (size_t)(bounds.x2 - bounds.x1) * (size_t)(bounds.y2 - bounds.y1);
 
     assert(srcRowElements == (bounds.x2 - bounds.x1) * pixelDataNComps);
-    assert(scratchBufBytes == numPixels * dstNComps * bitDepthSize);
-
-    const float* src_pixels = pixelData;
+    assert(scratchBufBytes == (size_t)(bounds.x2 - bounds.x1) * (size_t)(bounds.y2 - bounds.y1) * dstNComps * bitDepthSize);
+
+    PNGConvertProcessor converter(pixelData, srcRowElements, pixelDataNComps, dstNCompsStartIndex,
+                                  bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
+                                  scratchBuffer.getData(), dstNComps, pngDepth);
+    if ( (pngDepth == ePNGBitDepthUByte) && (nComps >= 3) && _ditherEnabled->getValue() ) {
+        const unsigned int ditherSeed = 2000;
+        converter.setDither( _ditherLut, (PNGDitherTypeEnum)_ditherType->getValue(), time, ditherSeed );
+    }
+    converter.multiThread();
+
+    const int height = bounds.y2 - bounds.y1;
+    const std::size_t filteredBytes = (std::size_t)height * (pngRowBytes + 1);
+    if ( _parallel->getValue() && (MultiThread::getNumCPUs() > 1) && (filteredBytes > kWritePNGDeflateBandSize) ) {
+        // Filter the rows and compress bands of rows in parallel, then write the zlib stream to IDAT chunks.
+        // The bands do not depend on the number of threads, so that the file does not either.
+        RamBuffer filteredBuffer(filteredBytes);
+        PNGRowFilterProcessor filterer(scratchBuffer.getData(), pngRowBytes, height, dstNComps * bitDepthSize, filteredBuffer.getData());
+        filterer.multiThread();
+
+        PNGBandDeflateProcessor deflater(filteredBuffer.getData(), filteredBytes, kWritePNGDeflateBandSize, compressionLevel, compressionStrategy);
+        deflater.multiThread();
+        if ( !deflater.ok() ) {
+            destroy_write_struct(png, info);
+            std::fclose(file);
+            setPersistentMessage(Message::eMessageError, "", "zlib compression error");
+            throwSuiteStatusException(kOfxStatFailed);
 
-    if (pngDepth == ePNGBitDepthUByte) {
-        bool ditherEnabled = _ditherEnabled->getValue();
+            return;
+        }
 
-        unsigned char* dstPixelData = scratchBuffer.getData();
-        unsigned char* dst_pixels = dstPixelData;
+        // zlib header (RFC 1950): deflate with a 32K window, the compression level, and the header check bits
+        const int flevel = (compressionLevel < 2) ? 0 : (compressionLevel < 6) ? 1 : (compressionLevel == 6) ? 2 : 3;
+        unsigned int header = (0x78 << 8) | (flevel << 6);
+        header += 31 - (header % 31);
+        const uLong adler = deflater.adler();
+
+        // the zlib stream: header, concatenated bands, adler32 checksum (big endian)
+        vector<unsigned char> idat;
+        idat.reserve(kWritePNGIDATSize);
+        idat.push_back( (unsigned char)(header >> 8) );
+        idat.push_back( (unsigned char)(header & 0xff) );
+        std::size_t i = 0;
+        std::size_t pos = 0;
+        if ( setjmp ( png_jmpbuf(png) ) ) {
+            destroy_write_struct(png, info);
+            std::fclose(file);
+            setPersistentMessage(Message::eMessageError, "", "PNG library error");
+            throwSuiteStatusException(kOfxStatFailed);
 
-        // no dither
-        if ( !ditherEnabled || (nComps < 3) ) {
-            for ( size_t i = 0; i < numPixels; ++i,
-                 dst_pixels += dstNComps,
-                 src_pixels += pixelDataNComps) {
-                assert(src_pixels == pixelData + i * pixelDataNComps);
-                assert(dst_pixels == dstPixelData + i * dstNComps);
-                for (int c = 0; c < nComps; ++c) {
-                    dst_pixels[c] = floatToInt<256>(src_pixels[dstNCompsStartIndex + c]);
+            return;
+        }
+        while ( i < deflater.bandCount() ) {
+            const vector<unsigned char>& band = deflater.band(i);
+            const std::size_t n = std::min(band.size() - pos, kWritePNGIDATSize - idat.size());
+            idat.insert(idat.end(), band.begin() + pos, band.begin() + pos + n);
+            pos += n;
+            if ( pos == band.size() ) {
+                ++i;
+                pos = 0;
+            }
+            if ( i == deflater.bandCount() ) {
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                    idat.push_back( (unsigned char)( (adler >> shift) & 0xff ) );
                 }
-
             }
-        } else {
-            assert(nComps >= 3);
-            const unsigned int ditherSeed = 2000;
-            add_dither(time, ditherSeed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex, pixelDataNComps, dstNComps);
-        }
-    } else {
-        assert(pngDepth == ePNGBitDepthUShort);
-
-        unsigned short* dstPixelData = reinterpret_cast<unsigned short*>( scratchBuffer.getData() );
-        unsigned short* dst_pixels = dstPixelData;
-
-        for ( size_t i = 0; i < numPixels; ++i,
-             dst_pixels += dstNComps,
-             src_pixels += pixelDataNComps) {
-            assert(src_pixels == pixelData + i * pixelDataNComps);
-            assert(dst_pixels == dstPixelData + i * dstNComps);
-            for (int c = 0; c < nComps; ++c) {
-                dst_pixels[c] = floatToInt<65536>(src_pixels[dstNCompsStartIndex + c]);
+            if ( ( idat.size() >= kWritePNGIDATSize) || ( i == deflater.bandCount() ) ) {
+                png_write_chunk( png, (png_bytep)"IDAT", (png_bytep)&idat[0], idat.size() );
+                idat.clear();
             }
         }
-        // PNG is always big endian
-        if ( littleendian() ) {
-            swap_endian ( dstPixelData, numPixels * dstNComps );
+        // libpng only lets png_write_end() finish the IDAT chunks it compressed itself ("No IDATs written into file"),
+        // so IEND is written directly: all the other chunks were written before IDAT by png_write_info().
+        png_write_chunk(png, (png_bytep)"IEND", NULL, 0);
+        destroy_write_struct(png, info);
+        // the last buffered bytes are written when the file is closed
+        if (std::fclose(file) != 0) {
+            setPersistentMessage(Message::eMessageError, "", string("Cannot write file ") + filename);
+            throwSuiteStatusException(kOfxStatFailed);
         }
-    }
 
+        return;
+    }
 
     // Y is top down in PNG, so invert it now
     for (int y = (bounds.y2 - bounds.y1 - 1); y >= 0; --y) {
@@ -823,6 +1380,8 @@ WritePNGPlugin::encode(const string& filename,
             std::fclose(file);
             setPersistentMessage(Message::eMessageError, "", "PNG library error");
             throwSuiteStatusException(kOfxStatFailed);
+
+            return;
         }
         png_write_row (png, (png_byte*)scratchBuffer.getData() + y * pngRowBytes);
     }
@@ -912,12 +1471,14 @@ WritePNGPluginFactory::load()
     _extensions.clear();
     _extensions.push_back("png");
     gLutManager = new Color::LutManager<Mutex>;
+    gBlueNoiseMutex = new Mutex;
 }
 
 void
 WritePNGPluginFactory::unload()
 {
     delete gLutManager;
+    delete gBlueNoiseMutex;
 }
 
 /** @brief The basic describe function, passed a plugin descriptor */
@@ -990,6 +1551,31 @@ WritePNGPluginFactory::describeInContext(ImageEffectDescriptor &desc,
         param->setLabel(kWritePNGParamDitherLabel);
         param->setHint(kWritePNGParamDitherHint);
         param->setDefault(true);
+        param->setLayoutHint(eLayoutHintNoNewLine);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kWritePNGParamDitherType);
+        param->setLabel(kWritePNGParamDitherTypeLabel);
+        param->setHint(kWritePNGParamDitherTypeHint);
+        assert(param->getNOptions() == ePNGDitherTypeErrorDiffusion);
+        param->appendOption(kWritePNGParamDitherTypeErrorDiffusion);
+        assert(param->getNOptions() == ePNGDitherTypeBlueNoise);
+        param->appendOption(kWritePNGParamDitherTypeBlueNoise);
+        param->setDefault(ePNGDitherTypeErrorDiffusion);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kWritePNGParamParallel);
+        param->setLabel(kWritePNGParamParallelLabel);
+        param->setHint(kWritePNGParamParallelHint);
+        param->setDefault(true);
         if (page) {
             page->addChild(*param);
         }